@@ -0,0 +1,900 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+/**
+ * @file
+ *
+ * The result cache of the client, see ICECC_CACHE_DIR.
+ *
+ * Results are kept by a hash of the preprocessed source, the flags for
+ * the remote compiler, the compiler and the environments.  Every entry
+ * is a directory with the object file, the split DWARF file if any and
+ * what the compiler printed.  It's written under a temporary name and
+ * renamed into place, so readers only ever see complete entries.
+ *
+ * The entries are spread over 16 buckets by the first digit of the key.
+ * Each bucket has a small statistics file, which is also the lock for
+ * changing the bucket.  When a bucket grows beyond its share of
+ * ICECC_CACHE_SIZE, the least recently used entries are removed.
+ *
+ * To skip the preprocessor as well, every job also gets a manifest,
+ * keyed by the compiler, the flags, the working directory and the
+ * source file name.  It lists the files the preprocessor read (from the
+ * line markers of its output) with their hashes, and which result key
+ * that state of them gave, along with the dependency file if -MD wanted
+ * one.  If all the files are still the same, the result is taken right
+ * away (the "direct mode").  Files that changed are only hashed again if
+ * their size or modification time differs.
+ **/
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "client.h"
+#include "fileio.h"
+#include "objectkey.h"
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+using namespace std;
+
+#define CACHE_BUCKETS 16
+// a full bucket is cleaned down to this part of its share
+#define CACHE_CLEAN_TO 0.8
+// unfinished entries older than this were left by a crashed client
+#define CACHE_STALE_TIME 3600
+// the number of states of the included files a manifest remembers
+#define MANIFEST_RESULTS 8
+
+struct CacheStats {
+    unsigned long long size;
+    unsigned long long entries;
+    unsigned long long hits;
+    unsigned long long misses;
+};
+
+struct CacheEntry {
+    time_t used;
+    string path;
+    off_t size;
+
+    bool operator<(const CacheEntry &other) const
+    {
+        return used < other.used;
+    }
+};
+
+static string cache_dir()
+{
+    const char *dir = getenv("ICECC_CACHE_DIR");
+    return dir ? dir : "";
+}
+
+// ICECC_CACHE_SIZE is in MiB
+static unsigned long long cache_limit()
+{
+    const char *size = getenv("ICECC_CACHE_SIZE");
+    unsigned long long mib = size ? strtoull(size, 0, 10) : 0;
+
+    if (!mib) {
+        mib = 1024;
+    }
+
+    return mib * 1024 * 1024;
+}
+
+static string bucket_of(const string &key)
+{
+    return cache_dir() + "/" + key.substr(0, 1);
+}
+
+static string dwo_file(const CompileJob &job)
+{
+    return job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
+}
+
+static bool make_bucket(const string &bucket)
+{
+    if ((mkdir(cache_dir().c_str(), 0777) && errno != EEXIST)
+            || (mkdir(bucket.c_str(), 0777) && errno != EEXIST)) {
+        log_perror("mkdir") << "\t" << bucket << endl;
+        return false;
+    }
+
+    return true;
+}
+
+static bool parse_stats(const char *text, CacheStats &stats)
+{
+    memset(&stats, 0, sizeof(stats));
+    return sscanf(text, "%llu %llu %llu %llu", &stats.size, &stats.entries, &stats.hits,
+                  &stats.misses) == 4;
+}
+
+/* Opens and locks the statistics of BUCKET and reads them into STATS.
+   Returns the descriptor, or -1 if that failed.  */
+static int lock_stats(const string &bucket, CacheStats &stats)
+{
+    if (!make_bucket(bucket)) {
+        return -1;
+    }
+
+    int fd = open((bucket + "/stats").c_str(), O_RDWR | O_CREAT, 0666);
+
+    if (fd < 0) {
+        log_perror("open cache statistics") << "\t" << bucket << endl;
+        return -1;
+    }
+
+    struct flock lock;
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 0;
+
+    while (fcntl(fd, F_SETLKW, &lock) < 0) {
+        if (errno != EINTR) {
+            log_perror("lock cache statistics") << "\t" << bucket << endl;
+            close_fd(fd);
+            return -1;
+        }
+    }
+
+    char buf[128];
+    ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+    buf[len > 0 ? len : 0] = 0;
+    parse_stats(buf, stats);
+    return fd;
+}
+
+// writes STATS and unlocks them
+static void unlock_stats(int fd, const CacheStats &stats)
+{
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "%llu %llu %llu %llu\n", stats.size, stats.entries,
+                       stats.hits, stats.misses);
+
+    if (pwrite(fd, buf, len, 0) != len || ftruncate(fd, len) < 0) {
+        log_perror("write cache statistics");
+    }
+
+    close_fd(fd);
+}
+
+static void count(const string &key, bool hit)
+{
+    CacheStats stats;
+    int fd = lock_stats(bucket_of(key), stats);
+
+    if (fd < 0) {
+        return;
+    }
+
+    if (hit) {
+        ++stats.hits;
+    } else {
+        ++stats.misses;
+    }
+
+    unlock_stats(fd, stats);
+}
+
+/* Copies FROM to TO, through a temporary file next to TO like
+   receive_file(), so TO is either the complete copy or unchanged.
+   Returns the size, or -1.  */
+static off_t copy_file(const string &from, const string &to)
+{
+    int in = open(from.c_str(), O_RDONLY);
+
+    if (in < 0) {
+        return -1;
+    }
+
+    string tmp = to + "_icetmp";
+    int out = open(tmp.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_LARGEFILE, 0666);
+
+    if (out < 0) {
+        log_perror("open") << "\t" << tmp << endl;
+        close_fd(in);
+        return -1;
+    }
+
+    off_t size = 0;
+    char buf[65536];
+
+    for (;;) {
+        ssize_t len = read(in, buf, sizeof(buf));
+
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (len < 0 || (len > 0 && write(out, buf, len) != len)) {
+            size = -1;
+        }
+
+        if (len <= 0 || size < 0) {
+            break;
+        }
+
+        size += len;
+    }
+
+    close_fd(in);
+
+    if (close(out) != 0 || size < 0 || rename(tmp.c_str(), to.c_str()) != 0) {
+        log_perror("copy") << "\t" << from << " to " << to << endl;
+        unlink(tmp.c_str());
+        return -1;
+    }
+
+    return size;
+}
+
+static off_t entry_size(const string &path)
+{
+    off_t size = 0;
+    DIR *dir = opendir(path.c_str());
+
+    if (!dir) {
+        return 0;
+    }
+
+    while (struct dirent *ent = readdir(dir)) {
+        struct stat st;
+
+        if (!lstat((path + "/" + ent->d_name).c_str(), &st) && S_ISREG(st.st_mode)) {
+            size += st.st_size;
+        }
+    }
+
+    closedir(dir);
+    return size;
+}
+
+/* Removes the least recently used entries of BUCKET until it's well
+   below its share of the limit, and counts STATS anew.  The bucket is
+   locked.  */
+static void clean_bucket(const string &bucket, CacheStats &stats)
+{
+    DIR *dir = opendir(bucket.c_str());
+
+    if (!dir) {
+        return;
+    }
+
+    vector<CacheEntry> entries;
+    time_t now = time(0);
+    unsigned long long size = 0;
+
+    while (struct dirent *ent = readdir(dir)) {
+        string name = ent->d_name;
+        string path = bucket + "/" + name;
+        struct stat st;
+
+        if (name[0] == '.' || lstat(path.c_str(), &st)) {
+            continue;
+        }
+
+        if (S_ISREG(st.st_mode) && name.size() > 9
+                && name.compare(name.size() - 9, 9, ".manifest") == 0) {
+            CacheEntry entry;
+            entry.used = st.st_mtime;
+            entry.path = path;
+            entry.size = st.st_size;
+            entries.push_back(entry);
+            size += entry.size;
+            continue;
+        }
+
+        if (!S_ISDIR(st.st_mode)) {
+            continue;
+        }
+
+        if (name.compare(0, 4, "tmp.") == 0) {
+            if (st.st_mtime + CACHE_STALE_TIME < now) {
+                remove_entry(AT_FDCWD, path);
+            }
+
+            continue;
+        }
+
+        CacheEntry entry;
+        entry.used = st.st_mtime;
+        entry.path = path;
+        entry.size = entry_size(path);
+        entries.push_back(entry);
+        size += entry.size;
+    }
+
+    closedir(dir);
+    sort(entries.begin(), entries.end());
+
+    unsigned long long wanted = cache_limit() / CACHE_BUCKETS * CACHE_CLEAN_TO;
+    size_t removed = 0;
+
+    for (; removed < entries.size() && size > wanted; ++removed) {
+        remove_entry(AT_FDCWD, entries[removed].path);
+        size -= entries[removed].size;
+    }
+
+    trace() << "cleaned cache bucket " << bucket << ", removed " << removed << " of "
+            << entries.size() << " entries" << endl;
+    stats.size = size;
+    stats.entries = entries.size() - removed;
+}
+
+bool cache_enabled()
+{
+    return !cache_dir().empty();
+}
+
+bool remote_cache_enabled()
+{
+    return getenv("ICECC_REMOTE_CACHE");
+}
+
+/* The environment of ENVS the compile servers for JOB use, the one for
+   its target platform.  Only they can check the key (see object_key()),
+   without one the key still works for the local cache.  */
+static string cache_environment(const CompileJob &job, const Environments &envs)
+{
+    string all;
+
+    for (Environments::const_iterator it = envs.begin(); it != envs.end(); ++it) {
+        if (it->first == job.targetPlatform()) {
+            return it->second;
+        }
+
+        all += it->first + " " + it->second + "\n";
+    }
+
+    return all;
+}
+
+string cache_key(const CompileJob &job, const Environments &envs, const string &source_hash)
+{
+    return source_hash.empty() ? string()
+           : object_key(job, cache_environment(job, envs), source_hash);
+}
+
+// puts the entry KEY where JOB wants the output, without counting it
+static bool fetch_entry(const string &key, const CompileJob &job, string &out, string &err)
+{
+    string entry = bucket_of(key) + "/" + key;
+    struct stat st;
+    bool hit = copy_file(entry + "/o", job.outputFile()) >= 0;
+
+    if (hit && job.dwarfFissionEnabled() && !stat((entry + "/dwo").c_str(), &st)) {
+        hit = copy_file(entry + "/dwo", dwo_file(job)) >= 0;
+    }
+
+    if (hit) {
+        read_text(AT_FDCWD, entry + "/out", out);
+        read_text(AT_FDCWD, entry + "/err", err);
+        // the time of the last use, for the cleaning
+        utimes(entry.c_str(), 0);
+    }
+
+    return hit;
+}
+
+bool cache_fetch(const string &key, const CompileJob &job, string &out, string &err)
+{
+    bool hit = fetch_entry(key, job, out, err);
+    trace() << "cache " << (hit ? "hit " : "miss ") << key << endl;
+    count(key, hit);
+    return hit;
+}
+
+void cache_store(const string &key, const CompileJob &job, const string &out, const string &err)
+{
+    string bucket = bucket_of(key);
+
+    if (!make_bucket(bucket)) {
+        return;
+    }
+
+    string tmp = bucket + "/tmp.XXXXXX";
+    vector<char> name(tmp.begin(), tmp.end());
+    name.push_back(0);
+
+    if (!mkdtemp(&name[0])) {
+        log_perror("mkdtemp") << "\t" << tmp << endl;
+        return;
+    }
+
+    tmp = &name[0];
+    struct stat st;
+    off_t size = copy_file(job.outputFile(), tmp + "/o");
+
+    if (size >= 0 && job.dwarfFissionEnabled() && !stat(dwo_file(job).c_str(), &st)) {
+        off_t dwo_size = copy_file(dwo_file(job), tmp + "/dwo");
+        size = dwo_size < 0 ? -1 : size + dwo_size;
+    }
+
+    if (size < 0 || !write_text(AT_FDCWD, tmp + "/out", out, O_CREAT | O_TRUNC, 0666)
+            || !write_text(AT_FDCWD, tmp + "/err", err, O_CREAT | O_TRUNC, 0666)) {
+        remove_entry(AT_FDCWD, tmp);
+        return;
+    }
+
+    size += out.size() + err.size();
+
+    // fails if another client was faster, which is just as good
+    if (rename(tmp.c_str(), (bucket + "/" + key).c_str()) < 0) {
+        remove_entry(AT_FDCWD, tmp);
+        return;
+    }
+
+    CacheStats stats;
+    int fd = lock_stats(bucket, stats);
+
+    if (fd < 0) {
+        return;
+    }
+
+    stats.size += size;
+    ++stats.entries;
+
+    if (stats.size > cache_limit() / CACHE_BUCKETS) {
+        clean_bucket(bucket, stats);
+    }
+
+    unlock_stats(fd, stats);
+}
+
+/* The key of the manifest of JOB, or an empty string if the direct mode
+   can't be used.  DEPFILE is set to the dependency file of -MD.  */
+static string manifest_key(const CompileJob &job, string &depfile)
+{
+    string compiler = find_compiler(job);
+    struct stat st;
+    char cwd[PATH_MAX];
+
+    // a new compiler has other headers and gives other results
+    if (compiler.empty() || stat(compiler.c_str(), &st) || !getcwd(cwd, sizeof(cwd))) {
+        return string();
+    }
+
+    const char *version = getenv("ICECC_VERSION");
+    string text = "icecc manifest 1\n" + compiler + " " + toString(st.st_size) + " "
+                  + toString(st.st_mtime) + "\n" + job.compilerName() + "\n"
+                  + job.targetPlatform() + "\n" + char('0' + job.language()) + "\n" + cwd + "\n"
+                  + job.inputFile() + "\n" + (version ? version : "") + "\n";
+
+    list<string> flags = job.allFlags();
+    depfile.clear();
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        // dependency files written behind our back can't be replayed
+        if (it->compare(0, 4, "-Wp,") == 0 && it->find("-M") != string::npos) {
+            return string();
+        }
+
+        if (*it == "-MF") {
+            list<string>::const_iterator next = it;
+
+            if (++next != flags.end()) {
+                depfile = *next;
+            }
+        } else if (it->compare(0, 3, "-MF") == 0) {
+            depfile = it->substr(3);
+        }
+
+        text += *it + "\n";
+    }
+
+    md5_state_t state;
+    md5_init(&state);
+    md5_append(&state, (const md5_byte_t *) text.data(), text.size());
+    return md5_hex(state);
+}
+
+static string manifest_file(const string &mkey)
+{
+    return bucket_of(mkey) + "/" + mkey + ".manifest";
+}
+
+/* The hash of the contents of PATH.  TIME_MACROS is set if it uses
+   __DATE__ and the like, which make the result depend on more.  */
+static bool hash_file(const string &path, string &hex, bool *time_macros)
+{
+    struct stat st;
+
+    if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    string text;
+    read_text(AT_FDCWD, path, text);
+
+    if (text.size() != size_t(st.st_size)) {
+        return false;
+    }
+
+    if (time_macros) {
+        *time_macros = text.find("__DATE__") != string::npos
+                       || text.find("__TIME__") != string::npos
+                       || text.find("__TIMESTAMP__") != string::npos;
+    }
+
+    hex = md5_hex(text);
+    return true;
+}
+
+/* The files the preprocessor read, from the line markers in its output
+   PREPROCESSED, like  # 1 "/usr/include/stdio.h" 1 3 4  */
+static bool included_files(const string &preprocessed, vector<string> &files)
+{
+    FILE *f = fopen(preprocessed.c_str(), "r");
+
+    if (!f) {
+        return false;
+    }
+
+    set<string> seen;
+    char *line = 0;
+    size_t size = 0;
+
+    while (getline(&line, &size, f) > 0) {
+        if (line[0] != '#') {
+            continue;
+        }
+
+        const char *p = line + 1;
+
+        if (!strncmp(p, "line", 4)) {
+            p += 4;
+        }
+
+        while (*p == ' ') {
+            ++p;
+        }
+
+        if (!isdigit(*p)) {
+            continue;
+        }
+
+        while (isdigit(*p)) {
+            ++p;
+        }
+
+        if (*p++ != ' ' || *p++ != '"') {
+            continue;
+        }
+
+        string name;
+
+        for (; *p && *p != '"'; ++p) {
+            if (*p == '\\' && p[1]) {
+                ++p;
+            }
+
+            name += *p;
+        }
+
+        // not <built-in> and <command-line>
+        if (*p == '"' && !name.empty() && name[0] != '<' && seen.insert(name).second) {
+            files.push_back(name);
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return !files.empty();
+}
+
+void parse_manifest(const string &text, vector<ManifestResult> &results)
+{
+    static const string magic = "icecc manifest 1\n";
+
+    if (text.compare(0, magic.size(), magic) != 0) {
+        return;
+    }
+
+    size_t pos = magic.size();
+
+    while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+        char key[33];
+        unsigned long count;
+        unsigned long dep_size;
+
+        if (eol == string::npos
+                || sscanf(text.c_str() + pos, "result %32s %lu %lu", key, &count, &dep_size) != 3) {
+            return;
+        }
+
+        ManifestResult result;
+        result.key = key;
+        pos = eol + 1;
+
+        for (; count > 0; --count) {
+            eol = text.find('\n', pos);
+
+            if (eol == string::npos) {
+                return;
+            }
+
+            result.files.append(text, pos, eol + 1 - pos);
+            pos = eol + 1;
+        }
+
+        if (pos + dep_size + 1 > text.size()) {
+            return;
+        }
+
+        result.depend = text.substr(pos, dep_size);
+        pos += dep_size + 1;
+        results.push_back(result);
+    }
+}
+
+string format_manifest(const vector<ManifestResult> &results)
+{
+    string text = "icecc manifest 1\n";
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const ManifestResult &r = results[i];
+        text += "result " + r.key + " " + toString(std::count(r.files.begin(), r.files.end(), '\n'))
+                + " " + toString(r.depend.size()) + "\n" + r.files + r.depend + "\n";
+    }
+
+    return text;
+}
+
+// whether the files of RESULT are as they were, HASHED caches what was hashed already
+static bool files_unchanged(const ManifestResult &result, map<string, string> &hashed)
+{
+    size_t pos = 0;
+
+    while (pos < result.files.size()) {
+        size_t eol = result.files.find('\n', pos);
+        string line = result.files.substr(pos, eol - pos);
+        pos = eol + 1;
+
+        char md5[33];
+        unsigned long long size;
+        long long mtime;
+        long long ctime;
+        int path_start = 0;
+
+        if (sscanf(line.c_str(), "%32s %llu %lld %lld %n", md5, &size, &mtime, &ctime,
+                   &path_start) != 4 || !path_start) {
+            return false;
+        }
+
+        string path = line.substr(path_start);
+        struct stat st;
+
+        if (stat(path.c_str(), &st) || (unsigned long long) st.st_size != size) {
+            return false;
+        }
+
+        // not touched since (0 in manifests written before the times were reliable)
+        if (mtime && st.st_mtime == mtime && st.st_ctime == ctime) {
+            continue;
+        }
+
+        map<string, string>::iterator it = hashed.find(path);
+
+        if (it == hashed.end()) {
+            string hex;
+
+            if (!hash_file(path, hex, 0)) {
+                return false;
+            }
+
+            it = hashed.insert(make_pair(path, hex)).first;
+        }
+
+        if (it->second != md5) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool cache_direct_fetch(const CompileJob &job, string &out, string &err)
+{
+    string depfile;
+    string mkey = manifest_key(job, depfile);
+
+    if (mkey.empty()) {
+        return false;
+    }
+
+    string text;
+    read_text(AT_FDCWD, manifest_file(mkey), text);
+
+    vector<ManifestResult> results;
+    parse_manifest(text, results);
+    map<string, string> hashed;
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (!files_unchanged(results[i], hashed)) {
+            continue;
+        }
+
+        if (!fetch_entry(results[i].key, job, out, err)
+                || (!depfile.empty()
+                    && !write_text(AT_FDCWD, depfile, results[i].depend, O_CREAT | O_TRUNC, 0666))) {
+            break;
+        }
+
+        trace() << "cache direct hit " << results[i].key << endl;
+        utimes(manifest_file(mkey).c_str(), 0);
+        count(results[i].key, true);
+        return true;
+    }
+
+    trace() << "cache direct miss " << mkey << endl;
+    return false;
+}
+
+void cache_record_manifest(const CompileJob &job, const string &preprocessed, const string &key,
+                           time_t cpp_start)
+{
+    string depfile;
+    string mkey = manifest_key(job, depfile);
+    vector<string> files;
+
+    if (mkey.empty() || !included_files(preprocessed, files)) {
+        return;
+    }
+
+    ManifestResult result;
+    result.key = key;
+
+    if (!depfile.empty()) {
+        struct stat st;
+
+        if (stat(depfile.c_str(), &st)) {
+            return;
+        }
+
+        read_text(AT_FDCWD, depfile, result.depend);
+    }
+
+    for (vector<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        struct stat st;
+        string hex;
+        bool time_macros = false;
+
+        if (stat(it->c_str(), &st) || !hash_file(*it, hex, &time_macros)) {
+            return;
+        }
+
+        if (time_macros) {
+            trace() << "no manifest, " << *it << " uses the time" << endl;
+            return;
+        }
+
+        /* Hashed now, but the preprocessor may have read it before a change.
+           Only what is older than its start is what it read, and then any
+           later change gives another ctime as well.  */
+        if (st.st_mtime >= cpp_start || st.st_ctime >= cpp_start) {
+            trace() << "no manifest, " << *it << " changed while preprocessing" << endl;
+            return;
+        }
+
+        result.files += hex + " " + toString(st.st_size) + " " + toString((long long) st.st_mtime)
+                        + " " + toString((long long) st.st_ctime) + " " + *it + "\n";
+    }
+
+    string bucket = bucket_of(mkey);
+    CacheStats stats;
+    int fd = lock_stats(bucket, stats);
+
+    if (fd < 0) {
+        return;
+    }
+
+    string file = manifest_file(mkey);
+    string text;
+    read_text(AT_FDCWD, file, text);
+
+    vector<ManifestResult> results;
+    parse_manifest(text, results);
+    vector<ManifestResult> kept(1, result);
+
+    for (size_t i = 0; i < results.size() && kept.size() < MANIFEST_RESULTS; ++i) {
+        if (results[i].key != key) {
+            kept.push_back(results[i]);
+        }
+    }
+
+    string new_text = format_manifest(kept);
+
+    if (write_text(AT_FDCWD, file + "_icetmp", new_text, O_CREAT | O_TRUNC, 0666)
+            && !rename((file + "_icetmp").c_str(), file.c_str())) {
+        stats.size += new_text.size() - text.size();
+
+        if (text.empty()) {
+            ++stats.entries;
+        }
+    } else {
+        unlink((file + "_icetmp").c_str());
+    }
+
+    unlock_stats(fd, stats);
+}
+
+int cache_show_stats()
+{
+    if (!cache_enabled()) {
+        fprintf(stderr, "ICECC_CACHE_DIR is not set\n");
+        return 1;
+    }
+
+    CacheStats total;
+    memset(&total, 0, sizeof(total));
+
+    for (int i = 0; i < CACHE_BUCKETS; ++i) {
+        char digit[2] = { "0123456789abcdef"[i], 0 };
+        string text;
+        CacheStats stats;
+        read_text(AT_FDCWD, cache_dir() + "/" + digit + "/stats", text);
+
+        if (parse_stats(text.c_str(), stats)) {
+            total.size += stats.size;
+            total.entries += stats.entries;
+            total.hits += stats.hits;
+            total.misses += stats.misses;
+        }
+    }
+
+    unsigned long long lookups = total.hits + total.misses;
+    printf("cache directory    %s\n", cache_dir().c_str());
+    printf("hits               %llu", total.hits);
+
+    if (lookups) {
+        printf(" (%.1f%%)", 100.0 * total.hits / lookups);
+    }
+
+    printf("\nmisses             %llu\n", total.misses);
+    printf("entries            %llu\n", total.entries);
+    printf("size               %.1f MiB of %.1f MiB\n", total.size / 1048576.0,
+           cache_limit() / 1048576.0);
+    return 0;
+}
@@ -31,6 +31,7 @@
 #include <sys/resource.h>
 
 #include <stdexcept>
+#include <vector>
 
 #include "exitcode.h"
 #include "logging.h"
@@ -48,7 +49,63 @@ extern bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun,
                          std::list<std::string> *extrafiles);
 
 /* In cpp.cpp.  */
-extern pid_t call_cpp(CompileJob &job, int fdwrite, int fdread = -1);
+extern bool dcc_is_preprocessed(const std::string &sfile);
+extern pid_t call_cpp(CompileJob &job, int fdwrite, int fdread = -1, int fderr = -1);
+
+/* The preprocessor, started into a temporary file as soon as a compile
+   server is asked for, so it runs while we wait for the daemon, the
+   scheduler and the compile server.  Its diagnostics are held back until wait(), so a job
+   that ends up being built locally doesn't print them twice.  */
+class EarlyCpp
+{
+public:
+    EarlyCpp();
+    ~EarlyCpp();   // discard()s
+
+    bool start(CompileJob &job);
+
+    bool started() const
+    {
+        return !m_file.empty();
+    }
+
+    // the output, complete once wait() returned 0
+    const std::string &file() const
+    {
+        return m_file;
+    }
+
+    // when it started, what it read must not have changed since
+    time_t started_at() const
+    {
+        return m_started;
+    }
+
+    // hangs up once it exited, to wait for that with poll()
+    int done_fd() const
+    {
+        return m_donefd;
+    }
+
+    // whether it exited already, without waiting for it
+    bool exited() const;
+
+    // the size of the output once wait() returned 0, else 0
+    uint32_t output_size() const;
+
+    // waits for it and returns its exit status
+    int wait();
+    // kills it if needed and removes the output
+    void discard();
+
+private:
+    pid_t m_pid;
+    int m_status;
+    int m_errfd;
+    int m_donefd;
+    time_t m_started;
+    std::string m_file;
+};
 
 /* In local.cpp.  */
 extern int build_local(CompileJob &job, MsgChannel *daemon, struct rusage *usage = 0);
@@ -58,9 +115,73 @@ extern bool compiler_only_rewrite_includes(const CompileJob &job);
 extern std::string compiler_path_lookup(const std::string &compiler);
 
 /* In remote.cpp - permill is the probability it will be compiled three times */
-extern int build_remote(CompileJob &job, MsgChannel *scheduler, const Environments &envs, int permill);
+extern int build_remote(CompileJob &job, MsgChannel *scheduler, const Environments &envs, int permill,
+                        EarlyCpp &cpp);
+// what the compiler printed, with colors if wanted
+extern void write_compiler_output(const CompileJob &job, const std::string &out,
+                                  const std::string &err);
 
 /* safeguard.cpp */
+/* cache.cpp */
+extern bool cache_enabled();
+// whether to ask the object caches of the compile servers
+extern bool remote_cache_enabled();
+// the key of JOB with SOURCE_HASH the md5 sum of the preprocessed source
+extern std::string cache_key(const CompileJob &job, const Environments &envs,
+                             const std::string &source_hash);
+// puts the result for KEY where JOB wants it, and what the compiler printed into OUT and ERR
+extern bool cache_fetch(const std::string &key, const CompileJob &job, std::string &out,
+                        std::string &err);
+extern void cache_store(const std::string &key, const CompileJob &job, const std::string &out,
+                        const std::string &err);
+// the result of JOB without preprocessing, if the files it includes didn't change
+extern bool cache_direct_fetch(const CompileJob &job, std::string &out, std::string &err);
+/* Remembers which files the preprocessor read for JOB, and that they gave
+   KEY.  Nothing is recorded if one of them changed since CPP_START, when
+   the preprocessor started, what it read could be older than the file.  */
+extern void cache_record_manifest(const CompileJob &job, const std::string &preprocessed,
+                                  const std::string &key, time_t cpp_start);
+extern int cache_show_stats();
+
+// one state of the included files in a manifest
+struct ManifestResult {
+    std::string key;
+    std::string files;    // "<md5> <size> <mtime> <ctime> <path>" lines
+    std::string depend;   // the dependency file
+};
+
+// what is left of a damaged manifest are the results before the damage
+extern void parse_manifest(const std::string &text, std::vector<ManifestResult> &results);
+extern std::string format_manifest(const std::vector<ManifestResult> &results);
+
+/* pump.cpp */
+// whether the server should preprocess JOB, see ICECC_PUMP
+extern bool pump_wanted(const CompileJob &job);
+// the files JOB includes, and what the server needs to preprocess it
+extern bool pump_scan(const CompileJob &job, PumpFilesMsg &files);
+// sends the contents of the files the server asked for with NEED
+extern void pump_send_contents(MsgChannel *cserver, const PumpFilesMsg &files,
+                               const PumpNeedMsg &need);
+// where the dependency output of JOB goes, empty if there is none
+extern std::string pump_dep_file(const CompileJob &job);
+
+/* envfiles.cpp */
+/* the files in the environment TARBALL, and the md5 sums of the contents
+   in there in order, false if the tarball can't be read like that */
+extern bool env_list_files(const std::string &tarball, EnvFilesMsg &files,
+                           std::vector<std::string> &contents);
+// sends the contents the server asked for with NEED
+extern void env_send_contents(MsgChannel *cserver, const std::string &tarball,
+                              const std::vector<std::string> &contents, const EnvNeedMsg &need);
+
+/* submit.cpp */
+// the local daemon, SOCKET is where it was found (empty for TCP)
+extern MsgChannel *connect_local_daemon(std::string &socket);
+// hands the job to the server of ICECC_SUBMIT_SOCKET, -1 if that didn't happen
+extern int submit_job(int argc, char **argv);
+// icecc --serve, runs every submitted job with RUN_JOB in a child
+extern int run_submission_server(const std::string &socket, int (*run_job)(int, char **));
+
 extern void dcc_increment_safeguard(void);
 extern int dcc_recursion_safeguard(void);
 
@@ -34,8 +34,15 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "client.h"
+#include "tempfile.h"
+#include "services/util.h"
 
 using namespace std;
 
@@ -68,7 +75,7 @@ bool dcc_is_preprocessed(const string &sfile)
  * allows us to overlap opening the TCP socket, which probably doesn't
  * use many cycles, with running the preprocessor.
  **/
-pid_t call_cpp(CompileJob &job, int fdwrite, int fdread)
+pid_t call_cpp(CompileJob &job, int fdwrite, int fdread, int fderr)
 {
     flush_debug();
     pid_t pid = fork();
@@ -176,8 +183,169 @@ pid_t call_cpp(CompileJob &job, int fdwrite, int fdread)
         close(fdwrite);
     }
 
+    if (fderr > -1) {
+        dup2(fderr, STDERR_FILENO);
+        close(fderr);
+    }
+
     dcc_increment_safeguard();
     execv(argv[0], argv);
     log_perror("execv failed");
     _exit(-1);
 }
+
+EarlyCpp::EarlyCpp()
+    : m_pid(-1)
+    , m_status(0)
+    , m_errfd(-1)
+    , m_donefd(-1)
+    , m_started(0)
+{
+}
+
+EarlyCpp::~EarlyCpp()
+{
+    discard();
+}
+
+bool EarlyCpp::start(CompileJob &job)
+{
+    char *tmp = 0;
+
+    if (dcc_make_tmpnam("icecc", ".ix", &tmp, 0) != 0) {
+        return false;
+    }
+
+    m_file = tmp;
+    free(tmp);
+
+    int fd = open(m_file.c_str(), O_WRONLY);
+    // what it says goes to the terminal only if its output gets used
+    char *errname = 0;
+
+    if (fd < 0 || dcc_make_tmpnam("icecc", ".err", &errname, 0) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        discard();
+        return false;
+    }
+
+    m_errfd = open(errname, O_RDWR);
+    unlink(errname);
+    free(errname);
+
+    /* The preprocessor inherits the write end of DONE, and so the read end
+       hangs up when the last of its processes exited.  */
+    int done[2];
+
+    if (m_errfd < 0 || pipe(done) < 0) {
+        close(fd);
+        discard();
+        return false;
+    }
+
+    m_donefd = done[0];
+
+    if (fcntl(m_donefd, F_SETFD, FD_CLOEXEC) < 0) {
+        log_perror("fcntl()");
+    }
+
+    /* When call_cpp returns normally (for the parent) it will have closed
+       the write fd.  */
+    m_started = time(0);
+    m_pid = call_cpp(job, fd, -1, m_errfd);
+    close(done[1]);
+
+    if (m_pid == -1) {
+        discard();
+        return false;
+    }
+
+    trace() << "preprocessing into " << m_file << " while asking for a server" << endl;
+    return true;
+}
+
+int EarlyCpp::wait()
+{
+    if (m_pid > 0) {
+        int status = 255;
+
+        while (waitpid(m_pid, &status, 0) < 0 && errno == EINTR) {}
+
+        m_status = shell_exit_status(status);
+        m_pid = 0;
+    }
+
+    // now the diagnostics belong to this compile
+    if (m_errfd >= 0) {
+        char buffer[4096];
+        ssize_t bytes;
+
+        lseek(m_errfd, 0, SEEK_SET);
+
+        while ((bytes = read(m_errfd, buffer, sizeof(buffer))) > 0) {
+            ignore_result(write(STDERR_FILENO, buffer, bytes));
+        }
+
+        close(m_errfd);
+        m_errfd = -1;
+    }
+
+    return m_status;
+}
+
+bool EarlyCpp::exited() const
+{
+    if (m_donefd < 0) {
+        return true;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = m_donefd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+uint32_t EarlyCpp::output_size() const
+{
+    struct stat st;
+
+    if (m_file.empty() || m_pid != 0 || m_status != 0 || stat(m_file.c_str(), &st)
+            || st.st_size >= 0xffffffff) {
+        return 0;
+    }
+
+    return st.st_size;
+}
+
+void EarlyCpp::discard()
+{
+    if (m_pid > 0) {
+        kill(m_pid, SIGTERM);
+
+        while (waitpid(m_pid, 0, 0) < 0 && errno == EINTR) {}
+    }
+
+    m_pid = -1;
+
+    if (m_errfd >= 0) {
+        close(m_errfd);
+        m_errfd = -1;
+    }
+
+    if (m_donefd >= 0) {
+        close(m_donefd);
+        m_donefd = -1;
+    }
+
+    if (!m_file.empty()) {
+        // may have been renamed to .caught already
+        if (unlink(m_file.c_str()) && errno != ENOENT) {
+            log_perror("unlink failed") << "\t" << m_file << endl;
+        }
+
+        m_file.clear();
+    }
+}
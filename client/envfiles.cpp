@@ -0,0 +1,637 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+/**
+ * @file
+ *
+ * Environment transfers to compile servers that keep the files of their
+ * environments in a store by md5 sum (IS_PROTOCOL_45).  The client reads
+ * its tarball and sends the list of the files in it with their sums, the
+ * server asks for the contents it doesn't have yet, and the client reads
+ * the tarball again to send just those.  Consecutive versions of a
+ * compiler, or the same one with a plugin more, then cost little more
+ * than the files that differ.
+ *
+ * The tarball is read with a small reader for the formats tar writes,
+ * through gzip or bzip2 like the server would.  Anything it doesn't
+ * understand makes the caller fall back to sending the whole tarball.
+ **/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <map>
+
+#include "chunksender.h"
+#include "client.h"
+#include "fileio.h"
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+using namespace std;
+
+// longer names and pax headers than this are not from any sane environment
+static const off_t MAX_HEADER_DATA = 1024 * 1024;
+
+struct TarEntry {
+    char type;          // '0' file, '1' hard link, '2' symlink, '5' directory
+    string path;
+    string link;        // what a link points to
+    off_t size;
+    mode_t mode;
+};
+
+/* Reads the entries of a tarball one after the other, with the
+   decompressor running as a child if it's compressed.  */
+class TarReader
+{
+public:
+    explicit TarReader(const string &tarball);
+    ~TarReader();
+
+    // false at the end, and on errors (failed() tells)
+    bool next(TarEntry &entry);
+
+    // the contents of the entry next() returned last, like read(2)
+    ssize_t read(unsigned char *buf, size_t len);
+
+    bool failed() const
+    {
+        return m_failed;
+    }
+
+    // waits for the decompressor, false if anything went wrong
+    bool finish();
+
+private:
+    bool read_full(void *buf, size_t len);
+    bool skip_rest();
+    bool read_data(off_t size, string &data);
+    bool fail();
+
+    int m_fd;
+    pid_t m_pid;
+    off_t m_left;       // of the contents of the current entry
+    off_t m_padding;    // after them, up to the next block
+    bool m_failed;
+};
+
+TarReader::TarReader(const string &tarball)
+    : m_fd(-1)
+    , m_pid(-1)
+    , m_left(0)
+    , m_padding(0)
+    , m_failed(false)
+{
+    int fd = open(tarball.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+    unsigned char magic[2];
+
+    if (fd < 0 || pread(fd, magic, 2, 0) != 2) {
+        if (fd >= 0) {
+            close_fd(fd);
+        }
+
+        m_failed = true;
+        return;
+    }
+
+    const char *decompress = 0;
+
+    if (magic[0] == 037 && magic[1] == 0213) {
+        decompress = "gzip";
+    } else if (magic[0] == 'B' && magic[1] == 'Z') {
+        decompress = "bzip2";
+    }
+
+    if (!decompress) {
+        m_fd = fd;
+        return;
+    }
+
+    int fds[2];
+
+    if (pipe(fds)) {
+        log_perror("pipe failed");
+        close_fd(fd);
+        m_failed = true;
+        return;
+    }
+
+    m_pid = fork();
+
+    if (m_pid == 0) {
+        close_fd(fds[0]);
+
+        if (dup2(fd, 0) < 0 || dup2(fds[1], 1) < 0) {
+            _exit(1);
+        }
+
+        signal(SIGPIPE, SIG_DFL);
+        execlp(decompress, decompress, "-dc", (char *) 0);
+        log_perror("execlp failed") << "\t" << decompress << endl;
+        _exit(1);
+    }
+
+    close_fd(fd);
+    close_fd(fds[1]);
+
+    if (m_pid < 0) {
+        log_perror("fork failed");
+        close_fd(fds[0]);
+        m_failed = true;
+        return;
+    }
+
+    m_fd = fds[0];
+}
+
+TarReader::~TarReader()
+{
+    finish();
+}
+
+bool TarReader::finish()
+{
+    if (m_fd >= 0) {
+        close_fd(m_fd);
+        m_fd = -1;
+    }
+
+    if (m_pid > 0) {
+        int status = 0;
+
+        while (waitpid(m_pid, &status, 0) < 0 && errno == EINTR) {}
+
+        m_pid = -1;
+
+        // the decompressor may only be cut short once the tarball ended
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGPIPE) {
+                m_failed = true;
+            }
+        }
+    }
+
+    return !m_failed;
+}
+
+bool TarReader::fail()
+{
+    m_failed = true;
+    return false;
+}
+
+bool TarReader::read_full(void *buf, size_t len)
+{
+    char *p = static_cast<char *>(buf);
+
+    while (len) {
+        ssize_t bytes = ::read(m_fd, p, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        p += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+bool TarReader::skip_rest()
+{
+    char buf[8192];
+    off_t left = m_left + m_padding;
+
+    while (left) {
+        size_t len = min(off_t(sizeof(buf)), left);
+
+        if (!read_full(buf, len)) {
+            return false;
+        }
+
+        left -= len;
+    }
+
+    m_left = m_padding = 0;
+    return true;
+}
+
+ssize_t TarReader::read(unsigned char *buf, size_t len)
+{
+    len = min(off_t(len), m_left);
+
+    if (!len) {
+        return 0;
+    }
+
+    ssize_t bytes;
+
+    while ((bytes = ::read(m_fd, buf, len)) < 0 && errno == EINTR) {}
+
+    if (bytes <= 0) {
+        m_failed = true;
+        return -1;
+    }
+
+    m_left -= bytes;
+    return bytes;
+}
+
+// the contents of a long name or pax header
+bool TarReader::read_data(off_t size, string &data)
+{
+    if (size > MAX_HEADER_DATA) {
+        return false;
+    }
+
+    data.resize(size);
+
+    if (size && !read_full(&data[0], size)) {
+        return false;
+    }
+
+    m_padding = (512 - size % 512) % 512;
+    return skip_rest();
+}
+
+// octal, or base-256 for big values
+static bool parse_number(const char *field, size_t len, off_t &value)
+{
+    value = 0;
+
+    if ((unsigned char) field[0] & 0x80) {
+        for (size_t i = 0; i < len; ++i) {
+            value = (value << 8) | (unsigned char)(i ? field[i] : field[i] & 0x7f);
+        }
+
+        return value >= 0;
+    }
+
+    size_t i = 0;
+
+    while (i < len && field[i] == ' ') {
+        ++i;
+    }
+
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = value * 8 + (field[i] - '0');
+    }
+
+    return i == len || field[i] == ' ' || field[i] == '\0';
+}
+
+static string field_string(const char *field, size_t len)
+{
+    return string(field, strnlen(field, len));
+}
+
+// relative, without a leading "./" or a trailing slash
+static string normalize_path(string path)
+{
+    while (path.compare(0, 2, "./") == 0 || path.compare(0, 1, "/") == 0) {
+        path.erase(0, path[0] == '/' ? 1 : 2);
+    }
+
+    while (!path.empty() && path[path.size() - 1] == '/') {
+        path.erase(path.size() - 1);
+    }
+
+    return path == "." ? string() : path;
+}
+
+// the "<length> <key>=<value>\n" records of a pax header
+static void parse_pax(const string &data, map<string, string> &values)
+{
+    size_t pos = 0;
+
+    while (pos < data.size()) {
+        size_t len = strtoul(data.c_str() + pos, 0, 10);
+        size_t space = data.find(' ', pos);
+
+        if (!len || space == string::npos || pos + len > data.size() || space >= pos + len) {
+            return;
+        }
+
+        string record = data.substr(space + 1, pos + len - space - 2);
+        size_t equal = record.find('=');
+
+        if (equal != string::npos) {
+            values[record.substr(0, equal)] = record.substr(equal + 1);
+        }
+
+        pos += len;
+    }
+}
+
+bool TarReader::next(TarEntry &entry)
+{
+    if (m_failed || m_fd < 0) {
+        return false;
+    }
+
+    string long_name;
+    string long_link;
+    map<string, string> pax;
+
+    for (;;) {
+        char header[512];
+
+        if (!skip_rest() || !read_full(header, sizeof(header))) {
+            return fail();
+        }
+
+        bool zero = true;
+
+        for (size_t i = 0; i < sizeof(header) && zero; ++i) {
+            zero = !header[i];
+        }
+
+        if (zero) {
+            return false;
+        }
+
+        off_t size;
+        off_t mode;
+
+        if (!parse_number(header + 124, 12, size) || !parse_number(header + 100, 8, mode)) {
+            return fail();
+        }
+
+        char type = header[156];
+
+        if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+            string data;
+
+            if (!read_data(size, data)) {
+                return fail();
+            }
+
+            if (type == 'L') {
+                long_name = field_string(data.c_str(), data.size());
+            } else if (type == 'K') {
+                long_link = field_string(data.c_str(), data.size());
+            } else if (type == 'x') {
+                parse_pax(data, pax);
+            }
+
+            continue;
+        }
+
+        entry.path = field_string(header, 100);
+
+        // the prefix field of POSIX tarballs, GNU ones have other things there
+        if (memcmp(header + 257, "ustar\0", 6) == 0 && header[345]) {
+            entry.path = field_string(header + 345, 155) + "/" + entry.path;
+        }
+
+        entry.link = field_string(header + 157, 100);
+
+        if (!long_name.empty()) {
+            entry.path = long_name;
+        }
+
+        if (!long_link.empty()) {
+            entry.link = long_link;
+        }
+
+        if (pax.count("path")) {
+            entry.path = pax["path"];
+        }
+
+        if (pax.count("linkpath")) {
+            entry.link = pax["linkpath"];
+        }
+
+        if (pax.count("size")) {
+            size = strtoll(pax["size"].c_str(), 0, 10);
+        }
+
+        entry.type = (type == '\0' || type == '7') ? '0' : type;
+        entry.path = normalize_path(entry.path);
+        entry.mode = mode & 07777;
+        entry.size = 0;
+
+        switch (entry.type) {
+        case '0':
+            entry.size = size;
+            m_left = size;
+            m_padding = (512 - size % 512) % 512;
+            break;
+        case '1':
+            entry.link = normalize_path(entry.link);
+            break;
+        case '2':
+        case '5':
+            break;
+        default:
+            // devices and fifos have no place in an environment
+            log_warning() << "unexpected entry in environment: " << entry.path << endl;
+            return fail();
+        }
+
+        if (entry.path.empty()) {
+            if (entry.type == '5') {
+                long_name.clear();
+                long_link.clear();
+                pax.clear();
+                continue;
+            }
+
+            return fail();
+        }
+
+        return true;
+    }
+}
+
+static string octal(mode_t mode)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%o", (unsigned int) mode);
+    return buf;
+}
+
+bool env_list_files(const string &tarball, EnvFilesMsg &files, vector<string> &contents)
+{
+    TarReader tar(tarball);
+    TarEntry entry;
+    // "<md5> <size> <mode>" of the files so far, for the hard links
+    map<string, string> by_path;
+    unsigned char buf[65536];
+
+    while (tar.next(entry)) {
+        if (entry.type == '0') {
+            md5_state_t state;
+            md5_init(&state);
+            ssize_t len;
+
+            while ((len = tar.read(buf, sizeof(buf))) > 0) {
+                md5_append(&state, buf, len);
+            }
+
+            if (len < 0) {
+                break;
+            }
+
+            string hash = md5_hex(state);
+            string file = hash + " " + toString(entry.size) + " " + octal(entry.mode);
+            files.files.push_back(file + " " + entry.path);
+            by_path[entry.path] = file;
+            contents.push_back(hash);
+        } else if (entry.type == '1') {
+            map<string, string>::const_iterator target = by_path.find(entry.link);
+
+            if (target == by_path.end()) {
+                log_warning() << "hard link to an unknown file in environment: "
+                              << entry.path << endl;
+                return false;
+            }
+
+            files.files.push_back(target->second + " " + entry.path);
+            by_path[entry.path] = target->second;
+        } else if (entry.type == '2') {
+            files.links.push_back(entry.path);
+            files.link_targets.push_back(entry.link);
+        } else if (!entry.path.empty()) {   // not the "./" of tar -C dir .
+            files.dirs.push_back(octal(entry.mode) + " " + entry.path);
+        }
+    }
+
+    if (!tar.finish()) {
+        log_warning() << "can't list the files of " << tarball << endl;
+        return false;
+    }
+
+    return !files.files.empty();
+}
+
+/* The contents of the files the server asked for, read from the tarball
+   again.  The server asks in the order of the list, so it's a single
+   pass.  */
+class EnvContentsSource : public ChunkSource
+{
+public:
+    EnvContentsSource(const string &tarball, const vector<string> &contents,
+                      const list<string> &hashes)
+        : m_tar(tarball)
+        , m_contents(contents)
+        , m_index(0)
+        , m_hashes(hashes)
+        , m_next(m_hashes.begin())
+        , m_in_file(false) {}
+
+    virtual ssize_t read(unsigned char *buf, size_t len);
+
+    bool complete() const
+    {
+        return m_next == m_hashes.end() && !m_in_file;
+    }
+
+private:
+    TarReader m_tar;
+    const vector<string> &m_contents;
+    size_t m_index;
+    const list<string> &m_hashes;
+    list<string>::const_iterator m_next;
+    bool m_in_file;
+};
+
+ssize_t EnvContentsSource::read(unsigned char *buf, size_t len)
+{
+    for (;;) {
+        if (m_in_file) {
+            ssize_t bytes = m_tar.read(buf, len);
+
+            if (bytes) {
+                return bytes;
+            }
+
+            m_in_file = false;
+        }
+
+        if (m_next == m_hashes.end()) {
+            return 0;
+        }
+
+        TarEntry entry;
+
+        do {
+            if (!m_tar.next(entry)) {
+                errno = EIO;
+                return -1;
+            }
+        } while (entry.type != '0');
+
+        if (m_index >= m_contents.size()) {
+            errno = EIO;
+            return -1;
+        }
+
+        if (m_contents[m_index++] == *m_next) {
+            ++m_next;
+            m_in_file = true;
+        }
+    }
+}
+
+void env_send_contents(MsgChannel *cserver, const string &tarball,
+                       const vector<string> &contents, const EnvNeedMsg &need)
+{
+    EnvContentsSource source(tarball, contents, need.hashes);
+    ChunkSender sender(cserver);
+    ChunkSender::Result result = sender.send(source);
+
+    if (result == ChunkSender::SEND_FAILED) {
+        throw client_error(15, "Error 15 - write to host failed");
+    }
+
+    if (result == ChunkSender::READ_FAILED || !source.complete()) {
+        throw client_error(5, "Error 5 - unable to read version file:\n\t" + tarball);
+    }
+
+    if (!cserver->send_msg(EndMsg())) {
+        log_error() << "write of environment failed" << endl;
+        throw client_error(8, "Error 8 - write environment to remote failed");
+    }
+
+    trace() << "sent " << need.hashes.size() << " of " << contents.size()
+            << " files of the environment, " << sender.uncompressed() << " bytes" << endl;
+}
@@ -60,6 +60,7 @@
 #include <sys/wait.h>
 
 #include "client.h"
+#include "compression.h"
 #include "platform.h"
 #include "util.h"
 
@@ -73,12 +74,19 @@ static void dcc_show_usage(void)
         "Usage:\n"
         "   icecc [compiler] [compile options] -o OBJECT -c SOURCE\n"
         "   icecc --build-native [compilertype] [file...]\n"
+        "   icecc --train-dictionary OUTPUT PREPROCESSED_FILE...\n"
+        "   icecc --cache-stats\n"
+        "   icecc --serve SOCKET\n"
         "   icecc --help\n"
         "\n"
         "Options:\n"
         "   --help                     explain usage and exit\n"
         "   --version                  show version and exit\n"
         "   --build-native             create icecc environment\n"
+        "   --train-dictionary         train a compression dictionary for an environment,\n"
+        "                              see icecc-create-env --compression-dictionary\n"
+        "   --cache-stats              show the statistics of the result cache\n"
+        "   --serve                    run the jobs submitted at SOCKET, see ICECC_SUBMIT_SOCKET\n"
         "Environment Variables:\n"
         "   ICECC                      If set to \"no\", just exec the real compiler.\n"
         "                              If set to \"disable\", just exec the real compiler, but without\n"
@@ -98,6 +106,15 @@ static void dcc_show_usage(void)
         "   ICECC_EXTRAFILES           additional files used in the compilation.\n"
         "   ICECC_COLOR_DIAGNOSTICS    set to 1 or 0 to override color diagnostics support.\n"
         "   ICECC_CARET_WORKAROUND     set to 1 or 0 to override gcc show caret workaround.\n"
+        "   ICECC_CACHE_DIR            if set, keep the results of remote jobs in this directory\n"
+        "                              and reuse them for the same preprocessed source.\n"
+        "   ICECC_CACHE_SIZE           the size of the result cache in MiB (default 1024).\n"
+        "   ICECC_REMOTE_CACHE         if set, prefer compile servers that have the result\n"
+        "                              cached already, which then skip the job.\n"
+        "   ICECC_PUMP                 if set, let the compile servers preprocess, sending them\n"
+        "                              the source and the headers it includes.\n"
+        "   ICECC_SUBMIT_SOCKET        if set, pass the job to the icecc --serve listening there\n"
+        "                              instead of running it in this process.\n"
         "\n");
 }
 
@@ -166,6 +183,90 @@ static string read_output(const char *command)
     return output.substr(0, output.length() - 1);
 }
 
+static bool same_mtime(const char *file, time_t mtime)
+{
+    struct stat st;
+
+    if (stat(file, &st)) {
+        return mtime == 0;
+    }
+
+    return st.st_mtime == mtime;
+}
+
+/* The native environment the daemon listening on SOCKET has for COMPILER
+   and EXTRAFILES, from the table it keeps next to the socket, or an empty
+   string if it has to be asked.  */
+static string cached_native_env(const string &socket, const string &compiler,
+                                const list<string> &extrafiles)
+{
+    string table = socket + ".native";
+    struct stat socket_st, table_st;
+
+    // only believe what the daemon wrote
+    if (socket.empty() || stat(socket.c_str(), &socket_st) || stat(table.c_str(), &table_st)
+            || table_st.st_uid != socket_st.st_uid || (table_st.st_mode & (S_IWGRP | S_IWOTH))) {
+        return string();
+    }
+
+    string key = compiler;
+
+    for (list<string>::const_iterator it = extrafiles.begin(); it != extrafiles.end(); ++it) {
+        key += ':' + *it;
+    }
+
+    FILE *f = fopen(table.c_str(), "r");
+
+    if (!f) {
+        return string();
+    }
+
+    char line[PATH_MAX + 64];
+    bool found = false;
+    bool valid = false;
+    string native;
+
+    while (!found && fgets(line, sizeof(line), f)) {
+        string text = line;
+
+        if (text.empty() || text[text.size() - 1] != '\n') {
+            break;
+        }
+
+        text.erase(text.size() - 1);
+
+        if (text.compare(0, 4, "key ") == 0) {
+            valid = text.substr(4) == key;
+        } else if (!valid) {
+            continue;
+        } else if (text.compare(0, 10, "compilers ") == 0) {
+            long long gcc, gpp, clang;
+
+            valid = sscanf(text.c_str() + 10, "%lld %lld %lld", &gcc, &gpp, &clang) == 3
+                    && same_mtime("/usr/bin/gcc", gcc) && same_mtime("/usr/bin/g++", gpp)
+                    && same_mtime("/usr/bin/clang", clang);
+        } else if (text.compare(0, 6, "extra ") == 0) {
+            long long mtime = atoll(text.c_str() + 6);
+            size_t space = text.find(' ', 6);
+            struct stat st;
+
+            valid = space != string::npos && !stat(text.c_str() + space + 1, &st)
+                    && st.st_mtime == mtime;
+        } else if (text.compare(0, 4, "env ") == 0) {
+            native = text.substr(4);
+            found = true;
+        }
+    }
+
+    fclose(f);
+
+    if (!found || ::access(native.c_str(), R_OK)) {
+        return string();
+    }
+
+    return native;
+}
+
 /*
  * @param args Are [clang,gcc] [extra files...]
  */
@@ -245,7 +346,7 @@ static int create_native(char **args)
 
 }
 
-int main(int argc, char **argv)
+static int setup_logging()
 {
     char *env = getenv("ICECC_DEBUG");
     int debug_level = Error;
@@ -267,7 +368,11 @@ int main(int argc, char **argv)
     }
 
     setup_debug(debug_level, logfile, "ICECC");
+    return debug_level;
+}
 
+static int compile_main(int argc, char **argv, int debug_level)
+{
     CompileJob job;
     bool icerun = false;
 
@@ -296,6 +401,20 @@ int main(int argc, char **argv)
                 return create_native(argv + 2);
             }
 
+            if (arg == "--train-dictionary") {
+                if (argc < 4) {
+                    dcc_show_usage();
+                    return 1;
+                }
+
+                list<string> files(argv + 3, argv + argc);
+                return train_dictionary(files, argv[2]) ? 0 : 1;
+            }
+
+            if (arg == "--cache-stats") {
+                return cache_show_stats();
+            }
+
             if (arg.size() > 0) {
                 job.setCompilerName(arg);
                 job.setCompilerPathname(arg);
@@ -390,34 +509,32 @@ int main(int argc, char **argv)
         }
     }
 
-    MsgChannel *local_daemon;
-    if (getenv("ICECC_TEST_SOCKET") == NULL) {
-        /* try several options to reach the local daemon - 3 sockets, one TCP */
-        local_daemon = Service::createChannel("/var/run/icecc/iceccd.socket");
+    /* Started by build_remote() once it asked for a compile server, the
+       rest of the talking happens meanwhile.  */
+    EarlyCpp cpp;
 
-        if (!local_daemon) {
-            local_daemon = Service::createChannel("/var/run/iceccd.socket");
-        }
+    if (!local && cache_enabled()) {
+        string out, err;
 
-        if (!local_daemon && getenv("HOME")) {
-            string path = getenv("HOME");
-            path += "/.iceccd.socket";
-            local_daemon = Service::createChannel(path);
+        // nothing the preprocessor read changed since the last time
+        if (cache_direct_fetch(job, out, err)) {
+            write_compiler_output(job, out, err);
+            return 0;
         }
+    }
 
-        if (!local_daemon) {
-            local_daemon = Service::createChannel("127.0.0.1", 10245, 0/*timeout*/);
-        }
-    } else {
-        local_daemon = Service::createChannel(getenv("ICECC_TEST_SOCKET"));
-        if (!local_daemon) {
-            log_error() << "test socket error" << endl;
-            return EXIT_TEST_SOCKET_ERROR;
-        }
+    // the unix domain socket the daemon was found at, if it was one
+    string daemon_socket;
+    MsgChannel *local_daemon = connect_local_daemon(daemon_socket);
+
+    if (!local_daemon && getenv("ICECC_TEST_SOCKET")) {
+        log_error() << "test socket error" << endl;
+        return EXIT_TEST_SOCKET_ERROR;
     }
 
     if (!local_daemon) {
         log_warning() << "no local daemon found" << endl;
+        cpp.discard();
         return build_local(job, 0);
     }
 
@@ -434,18 +551,24 @@ int main(int argc, char **argv)
             log_warning() << "Local daemon is too old to handle compiler plugins." << endl;
             local = true;
         } else {
-            if (!local_daemon->send_msg(GetNativeEnvMsg(compiler_is_clang(job)
-                                        ? "clang" : "gcc", extrafiles))) {
-                log_warning() << "failed to write get native environment" << endl;
-                goto do_local_error;
-            }
+            string compiler = compiler_is_clang(job) ? "clang" : "gcc";
+            string native = cached_native_env(daemon_socket, compiler, extrafiles);
+            Msg *umsg = 0;
 
-            // the timeout is high because it creates the native version
-            Msg *umsg = local_daemon->get_msg(4 * 60);
-            string native;
+            if (!native.empty()) {
+                trace() << "native environment from the daemon's table" << endl;
+            } else {
+                if (!local_daemon->send_msg(GetNativeEnvMsg(compiler, extrafiles))) {
+                    log_warning() << "failed to write get native environment" << endl;
+                    goto do_local_error;
+                }
+
+                // the timeout is high because it creates the native version
+                umsg = local_daemon->get_msg(4 * 60);
 
-            if (umsg && umsg->type == M_NATIVE_ENV) {
-                native = static_cast<UseNativeEnvMsg*>(umsg)->nativeVersion;
+                if (umsg && umsg->type == M_NATIVE_ENV) {
+                    native = static_cast<UseNativeEnvMsg*>(umsg)->nativeVersion;
+                }
             }
 
             if (native.empty() || ::access(native.c_str(), R_OK)) {
@@ -481,6 +604,8 @@ int main(int argc, char **argv)
         struct rusage ru;
         Msg *startme = 0L;
 
+        cpp.discard();
+
         /* Inform the daemon that we like to start a job.  */
         if (local_daemon->send_msg(JobLocalBeginMsg(0, get_absfilename(job.outputFile())))) {
             /* Now wait until the daemon gives us the start signal.  40 minutes
@@ -502,7 +627,7 @@ int main(int argc, char **argv)
             // check if it should be compiled three times
             const char *s = getenv("ICECC_REPEAT_RATE");
             int rate = s ? atoi(s) : 0;
-            ret = build_remote(job, local_daemon, envs, rate);
+            ret = build_remote(job, local_daemon, envs, rate, cpp);
 
             /* We have to tell the local daemon that everything is fine and
                that the remote daemon will send the scheduler our done msg.
@@ -510,6 +635,10 @@ int main(int argc, char **argv)
                and tell the scheduler - and that fail message may arrive earlier
                than the remote daemon's success msg. */
             if (ret == 0) {
+                if (cpp.output_size() && IS_PROTOCOL_50(local_daemon)) {
+                    local_daemon->send_msg(InputSizeMsg(cpp.output_size()));
+                }
+
                 local_daemon->send_msg(EndMsg());
             }
         } catch (remote_error& error) {
@@ -539,5 +668,34 @@ int main(int argc, char **argv)
 
 do_local_error:
     delete local_daemon;
+    cpp.discard();
     return build_local(job, 0);
 }
+
+// a job of the submission server, in its own child
+static int run_submitted(int argc, char **argv)
+{
+    return compile_main(argc, argv, setup_logging());
+}
+
+int main(int argc, char **argv)
+{
+    int debug_level = setup_logging();
+
+    if (argc > 1 && find_basename(argv[0]) == rs_program_name && !strcmp(argv[1], "--serve")) {
+        if (argc != 3) {
+            dcc_show_usage();
+            return 1;
+        }
+
+        return run_submission_server(argv[2], run_submitted);
+    }
+
+    int status = submit_job(argc, argv);
+
+    if (status >= 0) {
+        return status;
+    }
+
+    return compile_main(argc, argv, debug_level);
+}
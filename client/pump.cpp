@@ -0,0 +1,1041 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+/**
+ * @file
+ *
+ * Preprocessing on the compile server ("pump" mode), see ICECC_PUMP.
+ *
+ * Instead of the preprocessed source, the server gets the source and
+ * all the files it may include, and runs the preprocessor there.  The
+ * search path comes from what the compiler says with -v.  The includes
+ * are found by scanning for #include, #include_next, #import and
+ * __has_include, following every branch of the conditionals, which may
+ * give more files than needed but none less.  Computed includes
+ * (#include FOO) work if FOO is #defined to a "file" or <file>
+ * somewhere, otherwise the job is preprocessed here as before.
+ *
+ * What the scan found out about a file, and its md5 sum, is kept in a
+ * small cache next to the result cache or in the temporary directory,
+ * so every build reads each header once.  The server has a cache of the
+ * files by their md5 sum and only asks for the ones it doesn't have.
+ **/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "client.h"
+#include "fileio.h"
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+using namespace std;
+
+// more than that and it's no include scanning anymore
+#define PUMP_MAX_FILES 20000
+// the list of files has to fit into one message
+#define PUMP_MAX_LIST_SIZE (768 * 1024)
+
+/* A file the scan looked at.  The directives are a kind and the
+   operand: 'i' for #include, 'n' for #include_next (both followed by
+   '"' or '<' and the name), 'm' for a computed include (and the macro)
+   and 'd' for a #define that may name a file ("NAME "file"").  */
+struct ScannedFile {
+    off_t size;
+    string hash;
+    vector<string> directives;
+};
+
+/* A computed include, FILE includes what MACRO is defined to.  INDEX
+   is where in the search path FILE was found, -1 if not there.  */
+struct ComputedInclude {
+    string macro;
+    string file;
+    int index;
+};
+
+struct ScanState {
+    vector<string> chain;       // absolute, the quote directories first
+    size_t brackets;            // where the <...> search starts in CHAIN
+    map<string, bool> exists;
+    map<string, ScannedFile> files;
+    set<pair<string, int> > visited;
+    vector<pair<string, int> > queue;
+    vector<ComputedInclude> computed;
+    map<string, set<string> > defines;
+    string cache_dir;           // empty if there is none
+};
+
+// replaces FILE with TEXT, so readers never see half of it
+static void write_file(const string &file, const string &text)
+{
+    string tmp = file + "." + toString(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd < 0) {
+        return;
+    }
+
+    bool ok = write(fd, text.data(), text.size()) == ssize_t(text.size());
+    close(fd);
+
+    if (!ok || rename(tmp.c_str(), file.c_str())) {
+        unlink(tmp.c_str());
+    }
+}
+
+// PATH made absolute, without "." and ".." and double slashes
+static string normalize(const string &path, const string &cwd)
+{
+    string full = path[0] == '/' ? path : cwd + "/" + path;
+    vector<string> parts;
+    size_t start = 0;
+
+    while (start < full.size()) {
+        size_t end = full.find('/', start);
+
+        if (end == string::npos) {
+            end = full.size();
+        }
+
+        string part = full.substr(start, end - start);
+
+        if (part == "..") {
+            if (!parts.empty()) {
+                parts.pop_back();
+            }
+        } else if (!part.empty() && part != ".") {
+            parts.push_back(part);
+        }
+
+        start = end + 1;
+    }
+
+    string result;
+
+    for (vector<string>::const_iterator it = parts.begin(); it != parts.end(); ++it) {
+        result += "/" + *it;
+    }
+
+    return result.empty() ? "/" : result;
+}
+
+static string strip_slashes(string dir)
+{
+    while (dir.size() > 1 && dir[dir.size() - 1] == '/') {
+        dir.erase(dir.size() - 1);
+    }
+
+    return dir;
+}
+
+/* Where the results of the scan are kept, if there is a safe place.
+   The default one is in the temporary directory, which only counts if
+   it is ours.  */
+static string scan_cache_dir()
+{
+    const char *cache = getenv("ICECC_CACHE_DIR");
+    const char *tmp = getenv("TMPDIR");
+    string dir;
+
+    if (cache && *cache) {
+        dir = string(cache) + "/scan";
+    } else {
+        dir = string(tmp && *tmp ? tmp : "/tmp") + "/icecc-scan-" + toString(getuid());
+    }
+
+    if (mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+        return string();
+    }
+
+    struct stat st;
+
+    if (lstat(dir.c_str(), &st) || !S_ISDIR(st.st_mode) || st.st_uid != getuid()
+            || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        log_warning() << "not using " << dir << " for the include scan" << endl;
+        return string();
+    }
+
+    return dir;
+}
+
+static bool pump_enabled()
+{
+    return getenv("ICECC_PUMP");
+}
+
+// a precompiled header would be used instead of INCLUDE
+static bool has_pch(const string &include)
+{
+    return !access((include + ".gch").c_str(), R_OK) || !access((include + ".pch").c_str(), R_OK);
+}
+
+bool pump_wanted(const CompileJob &job)
+{
+    // the keys of the caches are made from the preprocessed source
+    if (!pump_enabled() || cache_enabled() || remote_cache_enabled()) {
+        return false;
+    }
+
+    if ((job.language() != CompileJob::Lang_C && job.language() != CompileJob::Lang_CXX
+            && job.language() != CompileJob::Lang_OBJC)
+            || dcc_is_preprocessed(job.inputFile()) || job.workingDirectory().empty()) {
+        return false;
+    }
+
+    list<string> flags = job.localFlags();
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        if (it->compare(0, 4, "-Wp,") == 0 || (*it)[0] == '@' || *it == "-I-") {
+            trace() << "argument " << *it << ", preprocessing locally" << endl;
+            return false;
+        }
+
+        if (*it == "-include" || *it == "-imacros") {
+            list<string>::const_iterator next = it;
+
+            if (++next != flags.end() && has_pch(*next)) {
+                trace() << "precompiled header " << *next << ", preprocessing locally" << endl;
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static const char *language_name(const CompileJob &job)
+{
+    switch (job.language()) {
+    case CompileJob::Lang_CXX:
+        return "c++";
+    case CompileJob::Lang_OBJC:
+        return "objective-c";
+    default:
+        return "c";
+    }
+}
+
+// flags with an argument that don't matter for the search path
+static bool skip_for_search_path(const string &flag, bool &with_argument)
+{
+    static const char *const with_arg[] = { "-MF", "-MT", "-MQ", "-D", "-U", "-include",
+                                            "-imacros" };
+    with_argument = false;
+
+    for (size_t i = 0; i < sizeof(with_arg) / sizeof(with_arg[0]); ++i) {
+        if (flag == with_arg[i]) {
+            with_argument = true;
+            return true;
+        }
+    }
+
+    return flag == "-MD" || flag == "-MMD" || flag == "-MP" || flag == "-MG" || flag == "-c"
+           || flag == "-S" || flag.compare(0, 3, "-MF") == 0 || flag.compare(0, 3, "-MT") == 0
+           || flag.compare(0, 3, "-MQ") == 0 || flag.compare(0, 2, "-D") == 0
+           || flag.compare(0, 2, "-U") == 0;
+}
+
+// what the compiler says about its search path with FLAGS
+static bool run_compiler_v(const string &compiler, const CompileJob &job,
+                           const list<string> &flags, string &output)
+{
+    int pipes[2];
+
+    if (pipe(pipes)) {
+        return false;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("failed to fork:");
+        close(pipes[0]);
+        close(pipes[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(pipes[0]);
+        int null_fd = open("/dev/null", O_RDWR);
+
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+
+        dup2(pipes[1], STDERR_FILENO);
+        close(pipes[1]);
+
+        char **argv = new char*[flags.size() + 7];
+        int i = 0;
+        argv[i++] = strdup(compiler.c_str());
+
+        for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+            argv[i++] = strdup(it->c_str());
+        }
+
+        argv[i++] = strdup("-x");
+        argv[i++] = strdup(language_name(job));
+        argv[i++] = strdup("-E");
+        argv[i++] = strdup("-v");
+        argv[i++] = strdup("/dev/null");
+        argv[i++] = 0;
+
+        dcc_increment_safeguard();
+        execv(argv[0], argv);
+        _exit(-1);
+    }
+
+    close(pipes[1]);
+    char buf[4096];
+    ssize_t len;
+    output.clear();
+
+    while ((len = read(pipes[0], buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        output.append(buf, len);
+    }
+
+    close(pipes[0]);
+    int status = 255;
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    return shell_exit_status(status) == 0;
+}
+
+/* The directories the compiler searches for JOB, as it names them:
+   those of -iquote, those of -I, and the rest, which are system
+   directories.  */
+static bool search_path(const CompileJob &job, const string &cache_dir,
+                        PumpFilesMsg &msg)
+{
+    string compiler = find_compiler(job);
+    struct stat st;
+
+    if (compiler.empty() || stat(compiler.c_str(), &st)) {
+        return false;
+    }
+
+    list<string> all = job.allFlags();
+    list<string> flags;
+    set<string> user_dirs;
+
+    for (list<string>::const_iterator it = all.begin(); it != all.end(); ++it) {
+        bool with_argument;
+        list<string>::const_iterator next = it;
+        ++next;
+
+        if (*it == "-I" && next != all.end()) {
+            user_dirs.insert(strip_slashes(*next));
+        } else if (it->compare(0, 2, "-I") == 0 && it->size() > 2) {
+            user_dirs.insert(strip_slashes(it->substr(2)));
+        }
+
+        if (skip_for_search_path(*it, with_argument)) {
+            if (with_argument && next != all.end()) {
+                ++it;
+            }
+
+            continue;
+        }
+
+        flags.push_back(*it);
+    }
+
+    // nonexistent directories are left out, so relative ones depend on where we are
+    string key = "icecc search path 1\n" + compiler + " " + toString(st.st_size) + " "
+                 + toString(st.st_mtime) + "\n" + language_name(job) + "\n"
+                 + job.workingDirectory() + "\n";
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        key += *it + "\n";
+    }
+
+    string file = cache_dir.empty() ? string() : cache_dir + "/dirs-" + md5_hex(key);
+    string text;
+
+    if (file.empty() || !read_text(AT_FDCWD, file, text) || text.compare(0, key.size(), key) != 0) {
+        string output;
+
+        if (!run_compiler_v(compiler, job, flags, output)) {
+            trace() << "the compiler didn't tell its search path" << endl;
+            return false;
+        }
+
+        text = key;
+        char section = 0;
+        size_t pos = 0;
+        bool user = true;
+
+        while (pos < output.size()) {
+            size_t eol = output.find('\n', pos);
+
+            if (eol == string::npos) {
+                eol = output.size();
+            }
+
+            string line = output.substr(pos, eol - pos);
+            pos = eol + 1;
+
+            if (line.compare(0, 17, "#include \"...\" se") == 0) {
+                section = 'q';
+            } else if (line.compare(0, 17, "#include <...> se") == 0) {
+                section = 'u';
+            } else if (line.compare(0, 20, "End of search list.") == 0) {
+                section = 0;
+            } else if (section && line.size() > 1 && line[0] == ' ') {
+                string dir = strip_slashes(line.substr(1));
+
+                if (dir.find(" (framework directory)") != string::npos) {
+                    return false;
+                }
+
+                // -I comes first, everything after is a system directory
+                if (section == 'u' && (!user || !user_dirs.count(dir))) {
+                    user = false;
+                    text += "s " + dir + "\n";
+                } else {
+                    text += string(1, section) + " " + dir + "\n";
+                }
+            }
+        }
+
+        if (!file.empty()) {
+            write_file(file, text);
+        }
+    }
+
+    size_t pos = key.size();
+
+    while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+
+        if (eol == string::npos || eol < pos + 2) {
+            return false;
+        }
+
+        string dir = text.substr(pos + 2, eol - pos - 2);
+
+        switch (text[pos]) {
+        case 'q':
+            msg.quote_dirs.push_back(dir);
+            break;
+        case 'u':
+            msg.user_dirs.push_back(dir);
+            break;
+        case 's':
+            msg.system_dirs.push_back(dir);
+            break;
+        default:
+            return false;
+        }
+
+        pos = eol + 1;
+    }
+
+    return !msg.system_dirs.empty();
+}
+
+static bool is_identifier(char c)
+{
+    return isalnum((unsigned char) c) || c == '_';
+}
+
+static size_t skip_blanks(const string &text, size_t pos, size_t end)
+{
+    while (pos < end && (text[pos] == ' ' || text[pos] == '\t')) {
+        ++pos;
+    }
+
+    return pos;
+}
+
+// a "name" or <name> at POS, as the delimiter and the name
+static string file_operand(const string &text, size_t pos, size_t end)
+{
+    if (pos >= end || (text[pos] != '"' && text[pos] != '<')) {
+        return string();
+    }
+
+    size_t close = text.find(text[pos] == '"' ? '"' : '>', pos + 1);
+
+    if (close == string::npos || close >= end || close == pos + 1) {
+        return string();
+    }
+
+    return text.substr(pos, close - pos);
+}
+
+static void scan_text(const string &text, vector<string> &directives)
+{
+    set<string> seen;
+    size_t pos = 0;
+
+    while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+
+        if (eol == string::npos) {
+            eol = text.size();
+        }
+
+        size_t p = skip_blanks(text, pos, eol);
+        pos = eol + 1;
+
+        if (p >= eol || text[p] != '#') {
+            continue;
+        }
+
+        p = skip_blanks(text, p + 1, eol);
+        size_t word = p;
+
+        while (p < eol && is_identifier(text[p])) {
+            ++p;
+        }
+
+        string directive = text.substr(word, p - word);
+        p = skip_blanks(text, p, eol);
+        string entry;
+
+        if (directive == "include" || directive == "import" || directive == "include_next") {
+            string operand = file_operand(text, p, eol);
+
+            if (!operand.empty()) {
+                entry = (directive == "include_next" ? "n" : "i") + operand;
+            } else if (p < eol && is_identifier(text[p])) {
+                size_t name = p;
+
+                while (p < eol && is_identifier(text[p])) {
+                    ++p;
+                }
+
+                entry = "m" + text.substr(name, p - name);
+            }
+        } else if (directive == "define") {
+            size_t name = p;
+
+            while (p < eol && is_identifier(text[p])) {
+                ++p;
+            }
+
+            // only object-like macros, "#define FOO(x)" has no blank
+            if (p > name && p < eol && (text[p] == ' ' || text[p] == '\t')) {
+                string operand = file_operand(text, skip_blanks(text, p, eol), eol);
+
+                if (!operand.empty()) {
+                    entry = "d" + text.substr(name, p - name) + " " + operand;
+                }
+            }
+        }
+
+        if (!entry.empty() && seen.insert(entry).second) {
+            directives.push_back(entry);
+        }
+    }
+
+    // the answer has to be the same on the server
+    for (size_t at = text.find("__has_include"); at != string::npos;
+            at = text.find("__has_include", at + 13)) {
+        size_t eol = text.find('\n', at);
+        size_t p = at + 13;
+        char kind = 'i';
+
+        if (eol == string::npos) {
+            eol = text.size();
+        }
+
+        if (text.compare(p, 5, "_next") == 0) {
+            kind = 'n';
+            p += 5;
+        }
+
+        p = skip_blanks(text, p, eol);
+
+        if (p >= eol || text[p] != '(') {
+            continue;
+        }
+
+        string operand = file_operand(text, skip_blanks(text, p + 1, eol), eol);
+        string entry = kind + operand;
+
+        if (!operand.empty() && seen.insert(entry).second) {
+            directives.push_back(entry);
+        }
+    }
+}
+
+static bool parse_cache_entry(const string &text, const struct stat &st, ScannedFile &file)
+{
+    size_t eol = text.find('\n');
+    size_t eol2 = eol == string::npos ? eol : text.find('\n', eol + 1);
+
+    if (eol2 == string::npos || text.compare(0, eol + 1, "icecc scan 1\n") != 0) {
+        return false;
+    }
+
+    long long size, mtime, ctime;
+    char hash[33];
+
+    if (sscanf(text.c_str() + eol + 1, "%lld %lld %lld %32s", &size, &mtime, &ctime, hash) != 4
+            || size != st.st_size || mtime != st.st_mtime || ctime != st.st_ctime) {
+        return false;
+    }
+
+    file.size = size;
+    file.hash = hash;
+    size_t pos = eol2 + 1;
+
+    while (pos < text.size()) {
+        eol = text.find('\n', pos);
+
+        if (eol == string::npos) {
+            return false;
+        }
+
+        file.directives.push_back(text.substr(pos, eol - pos));
+        pos = eol + 1;
+    }
+
+    return true;
+}
+
+/* Reads what PATH includes and its hash, from the cache if it didn't
+   change since.  */
+static bool scan_file(const string &path, const string &cache_dir, ScannedFile &file)
+{
+    struct stat st;
+
+    if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    string entry = cache_dir.empty() ? string() : cache_dir + "/" + md5_hex(path);
+    string text;
+
+    if (!entry.empty() && read_text(AT_FDCWD, entry, text) && parse_cache_entry(text, st, file)) {
+        return true;
+    }
+
+    if (!read_text(AT_FDCWD, path, text) || text.size() != size_t(st.st_size)) {
+        return false;
+    }
+
+    file.size = text.size();
+    file.hash = md5_hex(text);
+    file.directives.clear();
+    scan_text(text, file.directives);
+
+    // a file changed within the same second may change again unnoticed
+    if (!entry.empty() && st.st_mtime < time(0) - 1) {
+        string cached = "icecc scan 1\n" + toString(st.st_size) + " " + toString(st.st_mtime)
+                        + " " + toString(st.st_ctime) + " " + file.hash + "\n";
+
+        for (vector<string>::const_iterator it = file.directives.begin();
+                it != file.directives.end(); ++it) {
+            cached += *it + "\n";
+        }
+
+        write_file(entry, cached);
+    }
+
+    return true;
+}
+
+static bool file_exists(ScanState &state, const string &path)
+{
+    map<string, bool>::iterator it = state.exists.find(path);
+
+    if (it != state.exists.end()) {
+        return it->second;
+    }
+
+    struct stat st;
+    bool exists = !stat(path.c_str(), &st) && S_ISREG(st.st_mode);
+    state.exists[path] = exists;
+    return exists;
+}
+
+static void add_file(ScanState &state, const string &path, int index)
+{
+    if (state.visited.insert(make_pair(path, index)).second) {
+        state.queue.push_back(make_pair(path, index));
+    }
+}
+
+static string dir_of(const string &path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash ? path.substr(0, slash) : "/";
+}
+
+/* Finds what FILE (found at INDEX of the search path) includes with
+   OPERAND, the delimiter and the name.  */
+static void resolve(ScanState &state, const string &file, int index, char kind,
+                    const string &operand)
+{
+    char delim = operand[0];
+    string name = operand.substr(1);
+
+    if (name[0] == '/') {
+        if (file_exists(state, normalize(name, "/"))) {
+            add_file(state, normalize(name, "/"), -1);
+        }
+
+        return;
+    }
+
+    if (kind == 'i' && delim == '"') {
+        string candidate = normalize(name, dir_of(file));
+
+        if (file_exists(state, candidate)) {
+            add_file(state, candidate, -1);
+            return;
+        }
+    }
+
+    size_t start = delim == '<' ? state.brackets : 0;
+    // not knowing where the current one was found, all of them might be meant
+    bool all = false;
+
+    if (kind == 'n') {
+        if (index >= 0) {
+            start = index + 1;
+        } else {
+            all = true;
+        }
+    }
+
+    for (size_t i = start; i < state.chain.size(); ++i) {
+        string candidate = normalize(name, state.chain[i]);
+
+        if (file_exists(state, candidate)) {
+            add_file(state, candidate, i);
+
+            if (!all) {
+                return;
+            }
+        }
+    }
+}
+
+bool pump_scan(const CompileJob &job, PumpFilesMsg &msg)
+{
+    log_block b("include scan");
+    ScanState state;
+    const string cwd = job.workingDirectory();
+    state.cache_dir = scan_cache_dir();
+
+    if (!search_path(job, state.cache_dir, msg)) {
+        return false;
+    }
+
+    for (list<string>::const_iterator it = msg.quote_dirs.begin(); it != msg.quote_dirs.end(); ++it) {
+        state.chain.push_back(normalize(*it, cwd));
+    }
+
+    state.brackets = state.chain.size();
+
+    for (list<string>::const_iterator it = msg.user_dirs.begin(); it != msg.user_dirs.end(); ++it) {
+        state.chain.push_back(normalize(*it, cwd));
+    }
+
+    for (list<string>::const_iterator it = msg.system_dirs.begin(); it != msg.system_dirs.end(); ++it) {
+        state.chain.push_back(normalize(*it, cwd));
+    }
+
+    string source = normalize(job.inputFile(), cwd);
+
+    if (!file_exists(state, source)) {
+        return false;
+    }
+
+    add_file(state, source, -1);
+
+    list<string> flags = job.localFlags();
+    bool deps = false;
+    bool target = false;
+
+    // what the server needs of them, without the search path which it gets apart
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        static const char *const dir_flags[] = { "-I", "-iquote", "-isystem", "-idirafter",
+                                                 "-iprefix", "-iwithprefix", "-iwithprefixbefore",
+                                                 "-isysroot", "-imultilib", "-cxx-isystem",
+                                                 "-c-isystem", "-MF", "-L", "-l" };
+        bool skip = false;
+
+        for (size_t i = 0; i < sizeof(dir_flags) / sizeof(dir_flags[0]); ++i) {
+            if (*it == dir_flags[i]) {
+                skip = true;
+                ++it;
+                break;
+            }
+        }
+
+        if (it == flags.end()) {
+            break;
+        }
+
+        if (skip || *it == "-nostdinc" || *it == "-nostdinc++"
+                || (it->size() > 2 && (it->compare(0, 2, "-I") == 0 || it->compare(0, 2, "-L") == 0
+                                       || it->compare(0, 2, "-l") == 0
+                                       || it->compare(0, 3, "-MF") == 0))) {
+            continue;
+        }
+
+        msg.cpp_flags.push_back(*it);
+        deps = deps || *it == "-MD" || *it == "-MMD";
+        target = target || it->compare(0, 3, "-MT") == 0 || it->compare(0, 3, "-MQ") == 0;
+
+        if (*it == "-include" || *it == "-imacros") {
+            if (++it == flags.end()) {
+                break;
+            }
+
+            msg.cpp_flags.push_back(*it);
+
+            // the working directory first, then the quote search path
+            string candidate = normalize(*it, cwd);
+
+            if (file_exists(state, candidate)) {
+                add_file(state, candidate, -1);
+            } else {
+                resolve(state, source, -1, 'i', "<" + *it);
+            }
+        } else if (*it == "-D" || it->compare(0, 2, "-D") == 0) {
+            string define = *it == "-D" ? string() : it->substr(2);
+
+            if (define.empty() && ++it != flags.end()) {
+                msg.cpp_flags.push_back(*it);
+                define = *it;
+            }
+
+            size_t equal = define.find('=');
+
+            if (equal != string::npos && equal + 1 < define.size()
+                    && (define[equal + 1] == '"' || define[equal + 1] == '<')) {
+                state.defines[define.substr(0, equal)].insert(define.substr(equal + 1, define.size() - equal - 2));
+            }
+
+            if (it == flags.end()) {
+                break;
+            }
+        }
+    }
+
+    // the target would be the name of the temporary file there
+    if (deps && !target) {
+        msg.cpp_flags.push_back("-MQ");
+        msg.cpp_flags.push_back(job.outputFile());
+    }
+
+    for (;;) {
+        while (!state.queue.empty()) {
+            pair<string, int> next = state.queue.back();
+            state.queue.pop_back();
+
+            if (!state.files.count(next.first)) {
+                if (state.files.size() >= PUMP_MAX_FILES
+                        || !scan_file(next.first, state.cache_dir, state.files[next.first])) {
+                    trace() << "include scan failed at " << next.first << endl;
+                    return false;
+                }
+            }
+
+            const vector<string> &directives = state.files[next.first].directives;
+
+            for (vector<string>::const_iterator it = directives.begin(); it != directives.end(); ++it) {
+                if ((*it)[0] == 'i' || (*it)[0] == 'n') {
+                    resolve(state, next.first, next.second, (*it)[0], it->substr(1));
+                } else if ((*it)[0] == 'm') {
+                    ComputedInclude c;
+                    c.macro = it->substr(1);
+                    c.file = next.first;
+                    c.index = next.second;
+                    state.computed.push_back(c);
+                } else if ((*it)[0] == 'd') {
+                    size_t space = it->find(' ');
+
+                    if (space != string::npos) {
+                        state.defines[it->substr(1, space - 1)].insert(it->substr(space + 1));
+                    }
+                }
+            }
+        }
+
+        // all the files a computed include may mean, until nothing new comes up
+        for (vector<ComputedInclude>::const_iterator it = state.computed.begin();
+                it != state.computed.end(); ++it) {
+            map<string, set<string> >::const_iterator values = state.defines.find(it->macro);
+
+            if (values == state.defines.end()) {
+                trace() << "include scan can't tell what " << it->macro << " in " << it->file
+                        << " is" << endl;
+                return false;
+            }
+
+            for (set<string>::const_iterator v = values->second.begin(); v != values->second.end(); ++v) {
+                resolve(state, it->file, it->index, 'i', *v);
+            }
+        }
+
+        if (state.queue.empty()) {
+            break;
+        }
+    }
+
+    size_t list_size = 0;
+
+    for (map<string, ScannedFile>::const_iterator it = state.files.begin(); it != state.files.end(); ++it) {
+        msg.files.push_back(it->second.hash + " " + toString(it->second.size) + " " + it->first);
+        list_size += msg.files.back().size() + 4;
+    }
+
+    if (list_size > PUMP_MAX_LIST_SIZE) {
+        trace() << "too many files for the include scan" << endl;
+        return false;
+    }
+
+    trace() << "include scan: " << msg.files.size() << " files" << endl;
+    return true;
+}
+
+string pump_dep_file(const CompileJob &job)
+{
+    list<string> flags = job.localFlags();
+    bool deps = false;
+    string file;
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        if (*it == "-MD" || *it == "-MMD") {
+            deps = true;
+        } else if (*it == "-MF") {
+            list<string>::const_iterator next = it;
+
+            if (++next != flags.end()) {
+                file = *next;
+            }
+        } else if (it->compare(0, 3, "-MF") == 0) {
+            file = it->substr(3);
+        }
+    }
+
+    return deps ? file : string();
+}
+
+void pump_send_contents(MsgChannel *cserver, const PumpFilesMsg &files, const PumpNeedMsg &need)
+{
+    map<string, pair<string, off_t> > by_hash;
+
+    for (list<string>::const_iterator it = files.files.begin(); it != files.files.end(); ++it) {
+        size_t space = it->find(' ');
+        size_t space2 = it->find(' ', space + 1);
+        by_hash[it->substr(0, space)] = make_pair(it->substr(space2 + 1),
+                                                  off_t(atoll(it->c_str() + space + 1)));
+    }
+
+    unsigned char buffer[100000];
+    size_t offset = 0;
+    size_t sent = 0;
+
+    for (list<string>::const_iterator it = need.hashes.begin(); it != need.hashes.end(); ++it) {
+        map<string, pair<string, off_t> >::const_iterator file = by_hash.find(*it);
+
+        if (file == by_hash.end()) {
+            throw client_error(14, "Error 14 - the server asked for an unknown file");
+        }
+
+        int fd = open(file->second.first.c_str(), O_RDONLY | O_LARGEFILE);
+        off_t left = file->second.second;
+
+        if (fd < 0) {
+            throw remote_error(103, "Error 103 - " + file->second.first + " is gone, building locally");
+        }
+
+        while (left) {
+            ssize_t bytes = read(fd, buffer + offset, min(off_t(sizeof(buffer) - offset), left));
+
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (bytes <= 0) {
+                close(fd);
+                throw remote_error(103, "Error 103 - " + file->second.first
+                                   + " changed, building locally");
+            }
+
+            offset += bytes;
+            left -= bytes;
+
+            if (offset == sizeof(buffer)) {
+                if (!cserver->send_msg(FileChunkMsg(buffer, offset))) {
+                    close(fd);
+                    throw client_error(15, "Error 15 - write to host failed");
+                }
+
+                sent += offset;
+                offset = 0;
+            }
+        }
+
+        close(fd);
+    }
+
+    if (offset && !cserver->send_msg(FileChunkMsg(buffer, offset))) {
+        throw client_error(15, "Error 15 - write to host failed");
+    }
+
+    if (!cserver->send_msg(EndMsg())) {
+        throw client_error(12, "Error 12 - failed to send file to remote");
+    }
+
+    trace() << "sent " << need.hashes.size() << " of " << files.files.size() << " files, "
+            << sent + offset << " bytes" << endl;
+}
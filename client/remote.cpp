@@ -34,7 +34,12 @@
 #include <sys/uio.h>
 #endif
 
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <limits.h>
 #include <assert.h>
@@ -48,8 +53,11 @@
 #include <vector>
 
 #include <comm.h>
+#include "chunksender.h"
+#include "compression.h"
 #include "client.h"
 #include "tempfile.h"
+#include "fileio.h"
 #include "md5.h"
 #include "util.h"
 #include "services/util.h"
@@ -247,63 +255,123 @@ static void check_for_failure(Msg *msg, MsgChannel *cserver)
     }
 }
 
-static void write_server_cpp(int cpp_fd, MsgChannel *cserver)
+/* The file the preprocessor is still writing into, its end is only
+   reached once it exited.  Reading waits for it to write more where
+   inotify tells that, elsewhere for it to exit.  */
+class GrowingFileSource : public ChunkSource
 {
-    unsigned char buffer[100000]; // some random but huge number
-    off_t offset = 0;
-    size_t uncompressed = 0;
-    size_t compressed = 0;
+public:
+    GrowingFileSource(int fd, EarlyCpp *cpp)
+        : m_fd(fd)
+        , m_cpp(cpp)
+        , m_growing(cpp != 0)
+        , m_watch(-1)
+    {
+#ifdef HAVE_SYS_INOTIFY_H
+        // before the first read, so nothing written after that is missed
+        if (m_growing) {
+            m_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+            if (m_watch >= 0 && inotify_add_watch(m_watch, cpp->file().c_str(), IN_MODIFY) < 0) {
+                close(m_watch);
+                m_watch = -1;
+            }
+        }
+#endif
+    }
 
-    do {
-        ssize_t bytes;
+    ~GrowingFileSource()
+    {
+        if (m_watch >= 0) {
+            close(m_watch);
+        }
+    }
 
-        do {
-            bytes = read(cpp_fd, buffer + offset, sizeof(buffer) - offset);
+    virtual ssize_t read(unsigned char *buf, size_t len)
+    {
+        for (;;) {
+            ssize_t bytes = ::read(m_fd, buf, len);
 
             if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
                 continue;
             }
 
-            if (bytes < 0) {
-                log_perror("reading from cpp_fd");
-                close(cpp_fd);
-                throw client_error(16, "Error 16 - error reading local cpp file");
+            // caught up with the preprocessor, read once more after it exited
+            if (!bytes && m_growing) {
+                m_growing = wait_for_more();
+                continue;
             }
 
-            break;
-        } while (1);
+            return bytes;
+        }
+    }
 
-        offset += bytes;
+private:
+    // false once the preprocessor exited
+    bool wait_for_more()
+    {
+        struct pollfd fds[2];
+        fds[0].fd = m_cpp->done_fd();
+        fds[0].events = POLLIN;
+        fds[1].fd = m_watch;
+        fds[1].events = POLLIN;
+
+        if (fds[0].fd < 0) {   // waited for already
+            return false;
+        }
 
-        if (!bytes || offset == sizeof(buffer)) {
-            if (offset) {
-                FileChunkMsg fcmsg(buffer, offset);
+        while (poll(fds, m_watch >= 0 ? 2 : 1, -1) < 0) {
+            if (errno != EINTR) {
+                return false;
+            }
+        }
 
-                if (!cserver->send_msg(fcmsg)) {
-                    Msg *m = cserver->get_msg(2);
-                    check_for_failure(m, cserver);
+        if (fds[0].revents) {
+            return false;
+        }
 
-                    log_error() << "write of source chunk to host "
-                                << cserver->name.c_str() << endl;
-                    log_perror("failed ");
-                    close(cpp_fd);
-                    throw client_error(15, "Error 15 - write to host failed");
-                }
+        // the events only say that there is more
+        char events[4096];
 
-                uncompressed += fcmsg.len;
-                compressed += fcmsg.compressed;
-                offset = 0;
-            }
+        while (::read(m_watch, events, sizeof(events)) > 0) {}
 
-            if (!bytes) {
-                break;
-            }
-        }
-    } while (1);
+        return true;
+    }
+
+    int m_fd;
+    EarlyCpp *m_cpp;
+    bool m_growing;
+    int m_watch;                // inotify on the file, or -1
+};
 
-    if (compressed)
-        trace() << "sent " << compressed << " bytes (" << (compressed * 100 / uncompressed) <<
-                "%)" << endl;
+/* Sends what's in CPP_FD.  If CPP is given, it is still writing into
+   that file, and its end is only reached once it exited.  */
+static void write_server_cpp(int cpp_fd, MsgChannel *cserver, EarlyCpp *cpp = 0)
+{
+    GrowingFileSource source(cpp_fd, cpp);
+    ChunkSender sender(cserver);
+    ChunkSender::Result result = sender.send(source);
+
+    if (result == ChunkSender::READ_FAILED) {
+        log_perror("reading from cpp_fd");
+        close(cpp_fd);
+        throw client_error(16, "Error 16 - error reading local cpp file");
+    }
+
+    if (result == ChunkSender::SEND_FAILED) {
+        Msg *m = cserver->get_msg(2);
+        check_for_failure(m, cserver);
+
+        log_error() << "write of source chunk to host "
+                    << cserver->name.c_str() << endl;
+        log_perror("failed ");
+        close(cpp_fd);
+        throw client_error(15, "Error 15 - write to host failed");
+    }
+
+    if (sender.compressed())
+        trace() << "sent " << sender.compressed() << " bytes ("
+                << (sender.compressed() * 100 / sender.uncompressed()) << "%)" << endl;
 
     if ((-1 == close(cpp_fd)) && (errno != EBADF)){
         log_perror("close failed");
@@ -371,9 +439,52 @@ static void receive_file(const string& output_file, MsgChannel* cserver)
     }
 }
 
+void write_compiler_output(const CompileJob &job, const string &out, const string &err)
+{
+    ignore_result(write(STDOUT_FILENO, out.c_str(), out.size()));
+
+    if (colorify_wanted(job)) {
+        colorify_output(err);
+    } else {
+        ignore_result(write(STDERR_FILENO, err.c_str(), err.size()));
+    }
+}
+
+/* Asks the server to get the environment of JOB from PEERS, other daemons
+   that have it.  Returns false if none of them had it, the tarball has to
+   be sent then.  */
+static bool fetch_env_from_peers(MsgChannel *cserver, const CompileJob &job,
+                                 const list<string> &peers)
+{
+    log_block b("Fetch Environment");
+    EnvFetchMsg msg(job.targetPlatform(), job.environmentVersion(), peers);
+
+    if (!cserver->send_msg(msg)) {
+        throw client_error(6, "Error 6 - send environment to remove failed");
+    }
+
+    // it takes as long as installing it does
+    Msg *done = cserver->get_msg(10 * 60);
+
+    if (!done || done->type != M_ENV_FETCH_DONE) {
+        delete done;
+        throw client_error(6, "Error 6 - send environment to remove failed");
+    }
+
+    bool ok = static_cast<EnvFetchDoneMsg *>(done)->ok;
+    delete done;
+    trace() << "environment " << (ok ? "fetched" : "not fetched") << " from "
+            << peers.size() << " peers" << endl;
+    return ok;
+}
+
+/* Builds JOB on the host given by USECS.  A successful result is put
+   into the result cache under CACHE_KEY, if that's not empty.  With PUMP
+   the server preprocesses, if it can and the include scan works out.  */
 static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
                             const string &environment, const string &version_file,
-                            const char *preproc_file, bool output)
+                            const char *preproc_file, EarlyCpp *cpp, bool output,
+                            const string &cache_key = string(), bool pump = false)
 {
     string hostname = usecs->hostname;
     unsigned int port = usecs->port;
@@ -392,7 +503,22 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
     MsgChannel *cserver = 0;
 
     try {
-        cserver = Service::createChannel(hostname, port, 10);
+        if (usecs->pooled_fd >= 0 && usecs->pooled_stream) {
+            // a stream of the local daemon's connection to that host
+            trace() << "using multiplexed stream to " << hostname << endl;
+            cserver = Service::createChannel(usecs->pooled_fd, hostname, port);
+            usecs->pooled_fd = -1;
+        } else if (usecs->pooled_fd >= 0) {
+            // the local daemon passed along a connection that is set up already
+            trace() << "using pooled connection to " << hostname << endl;
+            cserver = Service::adoptChannel(usecs->pooled_fd, usecs->pooled_protocol,
+                                            usecs->pooled_codecs);
+            usecs->pooled_fd = -1;
+        }
+
+        if (!cserver) {
+            cserver = Service::createChannel(hostname, port, 10);
+        }
 
         if (!cserver) {
             log_error() << "no server found behind given hostname " << hostname << ":"
@@ -410,23 +536,58 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
                 throw client_error(4, "Error 4 - unable to stat version file");
             }
 
-            EnvTransferMsg msg(job.targetPlatform(), job.environmentVersion());
+            // the server gets it from other daemons if it can, not over our link
+            bool fetched = !usecs->env_peers.empty() && IS_PROTOCOL_46(cserver)
+                           && fetch_env_from_peers(cserver, job, usecs->env_peers);
 
-            if (!cserver->send_msg(msg)) {
-                throw client_error(6, "Error 6 - send environment to remove failed");
-            }
+            if (!fetched) {
+                EnvTransferMsg msg(job.targetPlatform(), job.environmentVersion());
+                // servers with a store of environment files only get what they lack
+                EnvFilesMsg env_files;
+                vector<string> env_contents;
+                bool by_files = IS_PROTOCOL_45(cserver)
+                                && env_list_files(version_file, env_files, env_contents);
 
-            int env_fd = open(version_file.c_str(), O_RDONLY);
+                if (!cserver->send_msg(msg)) {
+                    throw client_error(6, "Error 6 - send environment to remove failed");
+                }
 
-            if (env_fd < 0) {
-                throw client_error(5, "Error 5 - unable to open version file:\n\t" + version_file);
-            }
+                if (by_files) {
+                    if (!cserver->send_msg(env_files)) {
+                        throw client_error(6, "Error 6 - send environment to remove failed");
+                    }
+
+                    Msg *need = cserver->get_msg(60);
+
+                    if (!need || need->type != M_ENV_NEED) {
+                        delete need;
+                        throw client_error(6, "Error 6 - send environment to remove failed");
+                    }
+
+                    try {
+                        env_send_contents(cserver, version_file, env_contents,
+                                          *static_cast<EnvNeedMsg *>(need));
+                    } catch (...) {
+                        delete need;
+                        throw;
+                    }
+
+                    delete need;
+                } else {
+                    int env_fd = open(version_file.c_str(), O_RDONLY);
+
+                    if (env_fd < 0) {
+                        throw client_error(5, "Error 5 - unable to open version file:\n\t"
+                                           + version_file);
+                    }
 
-            write_server_cpp(env_fd, cserver);
+                    write_server_cpp(env_fd, cserver);
 
-            if (!cserver->send_msg(EndMsg())) {
-                log_error() << "write of environment failed" << endl;
-                throw client_error(8, "Error 8 - write environment to remote failed");
+                    if (!cserver->send_msg(EndMsg())) {
+                        log_error() << "write of environment failed" << endl;
+                        throw client_error(8, "Error 8 - write environment to remote failed");
+                    }
+                }
             }
 
             if (IS_PROTOCOL_31(cserver)) {
@@ -467,6 +628,23 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             throw client_error(26, "Error 26 - environment on " + hostname + " cannot be verified");
         }
 
+        PumpFilesMsg pump_files;
+
+        // with a source hash it is preprocessed here already
+        if (pump && job.sourceHash().empty() && IS_PROTOCOL_43(cserver)
+                && pump_scan(job, pump_files)) {
+            job.setPreprocessRemotely(true);
+        }
+
+        // sent along in the CompileFileMsg, the remote answers with its own
+        if (cserver->set_compression_dictionary(version_file + COMPRESSION_DICTIONARY_SUFFIX)) {
+            trace() << "compression dictionary for " << version_file << " has id "
+                    << cserver->compression_dictionary_id() << endl;
+        }
+
+        // while cpp still writes the input, its time is cpp's and not the link's
+        job.setInputFromCpp(!job.preprocessRemotely()
+                            && (cpp ? !cpp->exited() : !preproc_file));
         CompileFileMsg compile_file(&job);
         {
             log_block b("send compile_file");
@@ -477,7 +655,73 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             }
         }
 
-        if (!preproc_file) {
+        bool cached = false;
+
+        if ((!job.sourceHash().empty() && IS_PROTOCOL_48(cserver))
+                || (cserver->compression_dictionary_id() && IS_PROTOCOL_49(cserver))) {
+            Msg *answer = cserver->get_msg(60);
+
+            check_for_failure(answer, cserver);
+
+            if (!answer || answer->type != M_CACHE_ANSWER) {
+                delete answer;
+                throw client_error(14, "Error 14 - error reading message from remote");
+            }
+
+            cached = static_cast<CacheAnswerMsg *>(answer)->hit;
+            delete answer;
+
+            if (cserver->compression_dictionary_id() == cserver->remote_dictionary_id()) {
+                trace() << "using compression dictionary for " << version_file << endl;
+            }
+        }
+
+        if (cached) {
+            trace() << "the result is in the object cache of " << hostname << endl;
+        } else if (job.preprocessRemotely()) {
+            log_block b("send pump files");
+
+            if (!cserver->send_msg(pump_files)) {
+                throw client_error(9, "Error 9 - error sending file to remote");
+            }
+
+            Msg *need = cserver->get_msg(60);
+
+            check_for_failure(need, cserver);
+
+            if (!need || need->type != M_PUMP_NEED) {
+                delete need;
+                throw client_error(14, "Error 14 - error reading message from remote");
+            }
+
+            try {
+                pump_send_contents(cserver, pump_files, *static_cast<PumpNeedMsg *>(need));
+            } catch (...) {
+                delete need;
+                throw;
+            }
+
+            delete need;
+        } else if (cpp) {
+            int cpp_fd = open(cpp->file().c_str(), O_RDONLY);
+
+            if (cpp_fd < 0) {
+                throw client_error(11, "Error 11 - unable to open preprocessed file");
+            }
+
+            {
+                log_block cpp_block("write_server_cpp following cpp");
+                write_server_cpp(cpp_fd, cserver, cpp);
+            }
+
+            status = cpp->wait();
+
+            if (status != 0) {   // failure
+                delete cserver;
+                cserver = 0;
+                return status;
+            }
+        } else if (!preproc_file) {
             int sockets[2];
 
             if (pipe(sockets)) {
@@ -522,7 +766,7 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             write_server_cpp(cpp_fd, cserver);
         }
 
-        if (!cserver->send_msg(EndMsg())) {
+        if (!cached && !job.preprocessRemotely() && !cserver->send_msg(EndMsg())) {
             log_info() << "write of end failed" << endl;
             throw client_error(12, "Error 12 - failed to send file to remote");
         }
@@ -556,6 +800,13 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             throw remote_error(101, "Error 101 - the server ran out of memory, recompiling locally");
         }
 
+        // the include scan may have missed something, the real preprocessor tells
+        if (status && job.preprocessRemotely()) {
+            delete crmsg;
+            log_info() << "preprocessing on the server failed, recompiling locally" << endl;
+            throw remote_error(104, "Error 104 - preprocessing on the server failed, recompiling locally");
+        }
+
         if (output) {
             if ((!crmsg->out.empty() || !crmsg->err.empty()) && output_needs_workaround(job)) {
                 delete crmsg;
@@ -563,13 +814,7 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
                 throw remote_error(102, "Error 102 - command needs stdout/stderr workaround, recompiling locally");
             }
 
-            ignore_result(write(STDOUT_FILENO, crmsg->out.c_str(), crmsg->out.size()));
-
-            if (colorify_wanted(job)) {
-                colorify_output(crmsg->err);
-            } else {
-                ignore_result(write(STDERR_FILENO, crmsg->err.c_str(), crmsg->err.size()));
-            }
+            write_compiler_output(job, crmsg->out, crmsg->err);
 
             if (status && (crmsg->err.length() || crmsg->out.length())) {
                 log_error() << "Compiled on " << hostname << endl;
@@ -577,6 +822,8 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         }
 
         bool have_dwo_file = crmsg->have_dwo_file;
+        string out = crmsg->out;
+        string err = crmsg->err;
         delete crmsg;
 
         assert(!job.outputFile().empty());
@@ -587,6 +834,14 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
                 string dwo_output = job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
                 receive_file(dwo_output, cserver);
             }
+
+            if (job.preprocessRemotely() && !pump_dep_file(job).empty()) {
+                receive_file(pump_dep_file(job), cserver);
+            }
+
+            if (!cache_key.empty()) {
+                cache_store(cache_key, job, out, err);
+            }
         }
 
     } catch (...) {
@@ -605,6 +860,7 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         throw;
     }
 
+    trace() << "compression: " << cserver->compression_stats() << endl;
     delete cserver;
     return status;
 }
@@ -652,7 +908,7 @@ md5_for_file(const string & file)
 
 static bool
 maybe_build_local(MsgChannel *local_daemon, UseCSMsg *usecs, CompileJob &job,
-                  int &ret)
+                  int &ret, EarlyCpp *cpp = 0)
 {
     remote_daemon = usecs->hostname;
 
@@ -662,6 +918,12 @@ maybe_build_local(MsgChannel *local_daemon, UseCSMsg *usecs, CompileJob &job,
         if (getenv("ICECC_TEST_REMOTEBUILD") && usecs->port != 0 )
             return false;
         trace() << "building myself, but telling localhost\n";
+
+        // the compiler preprocesses itself
+        if (cpp) {
+            cpp->discard();
+        }
+
         int job_id = usecs->job_id;
         job.setJobID(job_id);
         job.setEnvironmentVersion("__client");
@@ -727,7 +989,8 @@ static int minimalRemoteVersion( const CompileJob& job)
     return version;
 }
 
-int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &_envs, int permill)
+int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &_envs, int permill,
+                 EarlyCpp &cpp)
 {
     srand(time(0) + getpid());
 
@@ -759,6 +1022,40 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
     const char *preferred_host = getenv("ICECC_PREFERRED_HOST");
 
     if (torepeat == 1) {
+        string key;
+
+        if (cache_enabled() || remote_cache_enabled()) {
+            /* The key needs the preprocessed source, and with a hit nobody
+               else has to be asked.  */
+            if (!cpp.started() && !cpp.start(job)) {
+                throw client_error(10, "Error 10 - (unable to fork process?)");
+            }
+
+            int status = cpp.wait();
+
+            if (status) {   // failure
+                return status;
+            }
+
+            string source_hash = md5_file(cpp.file());
+            key = cache_key(job, envs, source_hash);
+            string out, err;
+
+            if (!key.empty() && cache_enabled()) {
+                cache_record_manifest(job, cpp.file(), key, cpp.started_at());
+            }
+
+            if (!key.empty() && cache_enabled() && cache_fetch(key, job, out, err)) {
+                write_compiler_output(job, out, err);
+                return 0;
+            }
+
+            if (remote_cache_enabled() && !key.empty()) {
+                job.setCacheKey(key);
+                job.setSourceHash(source_hash);
+            }
+        }
+
         string fake_filename;
         list<string> args = job.remoteFlags();
 
@@ -778,45 +1075,66 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                        job.targetPlatform(), job.argumentFlags(),
                        preferred_host ? preferred_host : string(),
                        minimalRemoteVersion(job));
+        getcs.cache_key = job.cacheKey();
+
+        /* Small jobs may be cheaper to compile right here, see JobCosts.
+           The preprocessed size says more than the source's, but mostly
+           cpp is still running, the daemon is told once it's known.  */
+        struct stat st;
+
+        if (!stat(job.inputFile().c_str(), &st) && st.st_size < 0xffffffff) {
+            getcs.input_size = st.st_size;
+        }
+
+        getcs.preprocessed_size = cpp.output_size();
 
         if (!local_daemon->send_msg(getcs)) {
             log_warning() << "asked for CS" << endl;
             throw client_error(24, "Error 24 - asked for CS");
         }
 
+        /* Preprocess while the daemon and the scheduler answer.  If it's not
+           possible, the preprocessor runs once the server is known, as
+           before.  The server preprocesses if the include scan works out.  */
+        if (!cpp.started() && !pump_wanted(job)) {
+            cpp.start(job);
+        }
+
         UseCSMsg *usecs = get_server(local_daemon);
         int ret;
 
-        if (!maybe_build_local(local_daemon, usecs, job, ret))
-            ret = build_remote_int(job, usecs, local_daemon,
-                                   version_map[usecs->host_platform],
-                                   versionfile_map[usecs->host_platform],
-                                   0, true);
+        if (!maybe_build_local(local_daemon, usecs, job, ret, &cpp)) {
+            if (key.empty()) {
+                ret = build_remote_int(job, usecs, local_daemon,
+                                       version_map[usecs->host_platform],
+                                       versionfile_map[usecs->host_platform],
+                                       0, cpp.started() ? &cpp : 0, true, string(),
+                                       !cpp.started() && pump_wanted(job));
+            } else {
+                ret = build_remote_int(job, usecs, local_daemon,
+                                       version_map[usecs->host_platform],
+                                       versionfile_map[usecs->host_platform],
+                                       cpp.file().c_str(), 0, true,
+                                       cache_enabled() ? key : string());
+            }
+        }
 
         delete usecs;
         return ret;
     } else {
-        char *preproc = 0;
-        dcc_make_tmpnam("icecc", ".ix", &preproc, 0);
-        const CharBufferDeleter preproc_holder(preproc);
-        int cpp_fd = open(preproc, O_WRONLY);
-        /* When call_cpp returns normally (for the parent) it will have closed
-           the write fd, i.e. cpp_fd.  */
-        pid_t cpp_pid = call_cpp(job, cpp_fd);
-
-        if (cpp_pid == -1) {
-            ::unlink(preproc);
+        // all the servers get the same complete file
+        if (!cpp.started() && !cpp.start(job)) {
             throw client_error(10, "Error 10 - (unable to fork process?)");
         }
 
-        int status = 255;
-        waitpid(cpp_pid, &status, 0);
+        int status = cpp.wait();
 
-        if (shell_exit_status(status)) {   // failure
-            ::unlink(preproc);
-            return shell_exit_status(status);
+        if (status) {   // failure
+            return status;
         }
 
+        const char *preproc = cpp.file().c_str();
+
         char rand_seed[400]; // "designed to be oversized" (Levi's)
         sprintf(rand_seed, "-frandom-seed=%d", rand());
         job.appendFlag(rand_seed, Arg_Remote);
@@ -881,7 +1199,7 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                                   jobs[i], umsgs[i], local_daemon,
                                   version_map[umsgs[i]->host_platform],
                                   versionfile_map[umsgs[i]->host_platform],
-                                  preproc, i == 0);
+                                  preproc, 0, i == 0);
                 } catch (std::exception& error) {
                     log_info() << "build_remote_int failed and has thrown " << error.what() << endl;
                     kill(getpid(), SIGTERM);
@@ -996,10 +1314,6 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
 
         delete umsgs[0];
 
-        if (-1 == ::unlink(preproc)){
-            log_perror("unlink failed") << "\t" << preproc << endl;
-        }
-
         int ret = exit_codes[0];
 
         delete [] umsgs;
@@ -0,0 +1,692 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+/**
+ * @file
+ *
+ * The submission server, see icecc --serve.
+ *
+ * Build systems start icecc for every compile.  With ICECC_SUBMIT_SOCKET
+ * set, icecc only passes its arguments, working directory, environment
+ * umask and standard file descriptors to a server that keeps running, and
+ * waits for the exit code.  The server forks a worker per job, which runs the
+ * job like icecc would, but with what the server set up already: the
+ * local daemon is found once, every worker gets a connection to it that
+ * did the protocol setup while nothing was waiting for it, and the
+ * platform is only determined once.
+ **/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <map>
+#include <vector>
+
+#include "client.h"
+#include "fileio.h"
+#include "platform.h"
+#include "util.h"
+
+using namespace std;
+
+extern char **environ;
+
+// what starts every request, followed by the length of the rest
+#define SUBMIT_MAGIC 0x49435343
+// how long a stub may take to send its request
+#define REQUEST_TIMEOUT 5
+
+// the connection a worker of the submission server got from it
+static MsgChannel *submitted_daemon = 0;
+static string submitted_socket;
+
+MsgChannel *connect_local_daemon(string &socket)
+{
+    MsgChannel *channel = submitted_daemon;
+    submitted_daemon = 0;
+
+    // unless the job wants a different daemon than the server found
+    if (channel && (!getenv("ICECC_TEST_SOCKET") || submitted_socket == getenv("ICECC_TEST_SOCKET"))) {
+        socket = submitted_socket;
+        return channel;
+    }
+
+    delete channel;
+
+    if (getenv("ICECC_TEST_SOCKET")) {
+        socket = getenv("ICECC_TEST_SOCKET");
+        return Service::createChannel(socket);
+    }
+
+    /* try several options to reach the local daemon - 3 sockets, one TCP */
+    socket = "/var/run/icecc/iceccd.socket";
+    channel = Service::createChannel(socket);
+
+    if (!channel) {
+        socket = "/var/run/iceccd.socket";
+        channel = Service::createChannel(socket);
+    }
+
+    if (!channel && getenv("HOME")) {
+        socket = getenv("HOME");
+        socket += "/.iceccd.socket";
+        channel = Service::createChannel(socket);
+    }
+
+    if (!channel) {
+        socket.clear();
+        channel = Service::createChannel("127.0.0.1", 10245, 0/*timeout*/);
+    }
+
+    return channel;
+}
+
+int submit_job(int argc, char **argv)
+{
+    const char *path = getenv("ICECC_SUBMIT_SOCKET");
+
+    // what the server runs must not come back to it
+    if (!path || !*path || dcc_recursion_safeguard() > 0) {
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+
+    string cwd = get_cwd();
+    string payload = toString(argc);
+    payload += '\0';
+
+    for (int i = 0; i < argc; ++i) {
+        payload += argv[i];
+        payload += '\0';
+    }
+
+    payload += cwd;
+    payload += '\0';
+    mode_t mask = umask(0);
+    umask(mask);
+    payload += toString(mask);
+    payload += '\0';
+
+    for (char **env = environ; *env; ++env) {
+        payload += *env;
+        payload += '\0';
+    }
+
+    uint32_t header[2] = { htonl(SUBMIT_MAGIC), htonl(payload.size()) };
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov;
+    struct msghdr msg;
+
+    memset(control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent;
+
+    while ((sent = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR) {}
+
+    if (sent != sizeof(header) || !write_full(fd, payload.data(), payload.size())) {
+        close(fd);
+        return -1;
+    }
+
+    uint32_t status;
+
+    // a server that went away mid-job leaves it to us
+    if (!read_full(fd, &status, sizeof(status))) {
+        log_warning() << "submission server at " << path << " failed, building here" << endl;
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return ntohl(status);
+}
+
+static int signal_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t submission_quit = 0;
+
+static void submission_signalled(int whichsig)
+{
+    int saved_errno = errno;
+
+    if (whichsig != SIGCHLD) {
+        submission_quit = 1;
+    }
+
+    if (write(signal_pipe[1], "c", 1) < 0) {
+        // the pipe is full, which wakes the server up just as well
+    }
+
+    errno = saved_errno;
+}
+
+// a request of a stub, read as it comes in
+struct PendingRequest {
+    time_t since;
+    int fds[3];
+    bool have_header;
+    string payload;
+    size_t got;
+};
+
+/* Reads what is there of the request on FD, without blocking.  Returns 1
+   once REQ is complete, 0 if more is to come and -1 if it is broken.  */
+static int read_request(int fd, PendingRequest &req)
+{
+    if (!req.have_header) {
+        uint32_t header[2];
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        struct iovec iov;
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = header;
+        iov.iov_len = sizeof(header);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t bytes;
+
+        while ((bytes = recvmsg(fd, &msg, MSG_DONTWAIT)) < 0 && errno == EINTR) {}
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+
+        struct cmsghdr *cmsg = bytes > 0 ? CMSG_FIRSTHDR(&msg) : 0;
+
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+                || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+            return -1;
+        }
+
+        memcpy(req.fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+        // the stub sends the header in one go
+        if (bytes != sizeof(header) || ntohl(header[0]) != SUBMIT_MAGIC
+                || ntohl(header[1]) > 16 * 1024 * 1024) {
+            return -1;
+        }
+
+        req.have_header = true;
+        req.payload.assign(ntohl(header[1]), '\0');
+        req.got = 0;
+    }
+
+    while (req.got < req.payload.size()) {
+        ssize_t bytes = recv(fd, &req.payload[req.got], req.payload.size() - req.got,
+                             MSG_DONTWAIT);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+
+        if (bytes <= 0) {
+            return -1;
+        }
+
+        req.got += bytes;
+    }
+
+    return 1;
+}
+
+static bool parse_request(const string &payload, vector<string> &args, string &cwd,
+                          mode_t &mask, vector<string> &env)
+{
+    vector<string> fields;
+    size_t pos = 0;
+
+    while (pos < payload.size()) {
+        size_t end = payload.find('\0', pos);
+
+        if (end == string::npos) {
+            return false;
+        }
+
+        fields.push_back(payload.substr(pos, end - pos));
+        pos = end + 1;
+    }
+
+    size_t argc = fields.empty() ? 0 : atoi(fields[0].c_str());
+
+    if (argc < 1 || fields.size() < argc + 3) {
+        return false;
+    }
+
+    args.assign(fields.begin() + 1, fields.begin() + 1 + argc);
+    cwd = fields[argc + 1];
+    mask = atoi(fields[argc + 2].c_str()) & 0777;
+    env.assign(fields.begin() + argc + 3, fields.end());
+    return true;
+}
+
+static void close_fds(int fds[3])
+{
+    for (int i = 0; i < 3; ++i) {
+        if ((-1 == close(fds[i])) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+    }
+}
+
+struct SubmittedJob {
+    int fd;                   // the connection of the stub
+    struct timeval start;
+    string output;            // for the log
+};
+
+static string job_label(const vector<string> &args)
+{
+    for (size_t i = 0; i + 1 < args.size(); ++i) {
+        if (args[i] == "-o") {
+            return args[i + 1];
+        }
+    }
+
+    return args.back();
+}
+
+// runs the job in the child, never returns
+static void run_worker(int fds[3], vector<string> &args, const string &cwd, mode_t mask,
+                       vector<string> &env, int (*run_job)(int, char **))
+{
+    for (int i = 0; i < 3; ++i) {
+        if (dup2(fds[i], i) < 0) {
+            _exit(EXIT_DISTCC_FAILED);
+        }
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        if (fds[i] > 2) {
+            close(fds[i]);
+        }
+    }
+
+    if (chdir(cwd.c_str())) {
+        fprintf(stderr, "icecc: can't change to %s: %s\n", cwd.c_str(), strerror(errno));
+        _exit(EXIT_DISTCC_FAILED);
+    }
+
+    umask(mask);
+    char **envp = new char*[env.size() + 1];
+
+    for (size_t i = 0; i < env.size(); ++i) {
+        envp[i] = strdup(env[i].c_str());
+    }
+
+    envp[env.size()] = 0;
+    environ = envp;
+
+    char **argv = new char*[args.size() + 1];
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        argv[i] = strdup(args[i].c_str());
+    }
+
+    argv[args.size()] = 0;
+    exit(run_job(args.size(), argv));
+}
+
+int run_submission_server(const string &path, int (*run_job)(int, char **))
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof(addr.sun_path)) {
+        log_error() << "socket path too long: " << path << endl;
+        return 1;
+    }
+
+    strcpy(addr.sun_path, path.c_str());
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listen_fd < 0 || pipe(signal_pipe)) {
+        log_perror("socket()");
+        return 1;
+    }
+
+    unlink(path.c_str());
+    // the jobs run as us, nobody else may submit them
+    mode_t old_umask = umask(0077);
+
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(listen_fd, 128)) {
+        log_perror("bind()") << "\t" << path << endl;
+        umask(old_umask);
+        return 1;
+    }
+
+    umask(old_umask);
+    set_cloexec_flag(listen_fd, 1);
+    set_cloexec_flag(signal_pipe[0], 1);
+    set_cloexec_flag(signal_pipe[1], 1);
+    fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK);
+    signal(SIGCHLD, submission_signalled);
+    signal(SIGTERM, submission_signalled);
+    signal(SIGINT, submission_signalled);
+    dcc_ignore_sigpipe(1);
+
+    // the same in every job, and not cheap to find out
+    determine_platform();
+    log_info() << "accepting jobs at " << path << endl;
+
+    map<pid_t, SubmittedJob> jobs;
+    map<int, PendingRequest> requests;   // by the connection of the stub
+    MsgChannel *spare = 0;
+    string daemon_socket;
+    unsigned long done = 0;
+    double total_msec = 0;
+
+    while (!submission_quit) {
+        int status;
+        pid_t pid;
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            map<pid_t, SubmittedJob>::iterator it = jobs.find(pid);
+
+            if (it == jobs.end()) {
+                continue;
+            }
+
+            struct timeval now;
+            gettimeofday(&now, 0);
+            double msec = (now.tv_sec - it->second.start.tv_sec) * 1000.0
+                          + (now.tv_usec - it->second.start.tv_usec) / 1000.0;
+            int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            ++done;
+            total_msec += msec;
+            log_info() << "job " << it->second.output << " exited with " << code << " after "
+                       << msec << " ms (" << done << " jobs, " << total_msec / done
+                       << " ms on average)" << endl;
+
+            if (it->second.fd >= 0) {
+                uint32_t reply = htonl(code);
+
+                if (!write_full(it->second.fd, &reply, sizeof(reply))) {
+                    log_warning() << "the submitter of " << it->second.output << " is gone" << endl;
+                }
+
+                close(it->second.fd);
+            }
+
+            jobs.erase(it);
+        }
+
+        // the next job gets a connection that is set up already
+        if (spare && spare->at_eof()) {
+            delete spare;
+            spare = 0;
+        }
+
+        if (!spare) {
+            spare = connect_local_daemon(daemon_socket);
+        }
+
+        vector<struct pollfd> pfds;
+        struct pollfd pfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        pfd.fd = listen_fd;
+        pfds.push_back(pfd);
+        pfd.fd = signal_pipe[0];
+        pfds.push_back(pfd);
+
+        if (spare) {
+            pfd.fd = spare->fd;
+            pfds.push_back(pfd);
+        }
+
+        // a submitter that went away (interrupted) takes its job along
+        for (map<pid_t, SubmittedJob>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+            if (it->second.fd >= 0) {
+                pfd.fd = it->second.fd;
+                pfds.push_back(pfd);
+            }
+        }
+
+        for (map<int, PendingRequest>::const_iterator it = requests.begin(); it != requests.end();
+                ++it) {
+            pfd.fd = it->first;
+            pfds.push_back(pfd);
+        }
+
+        if (poll(&pfds[0], pfds.size(), spare && requests.empty() ? -1 : 1000) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_perror("poll()");
+            break;
+        }
+
+        char buf[64];
+
+        while (read(signal_pipe[0], buf, sizeof(buf)) > 0) {}
+
+        vector<int> readable;   // requests with something new
+
+        for (size_t i = 2; i < pfds.size(); ++i) {
+            if (!pfds[i].revents) {
+                continue;
+            }
+
+            if (requests.count(pfds[i].fd)) {
+                readable.push_back(pfds[i].fd);
+                continue;
+            }
+
+            if (spare && pfds[i].fd == spare->fd) {
+                // the daemon isn't supposed to say anything yet, so it went away
+                delete spare;
+                spare = 0;
+                continue;
+            }
+
+            for (map<pid_t, SubmittedJob>::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+                if (it->second.fd == pfds[i].fd) {
+                    log_info() << "the submitter of " << it->second.output << " is gone" << endl;
+                    kill(it->first, SIGTERM);
+                    close(it->second.fd);
+                    it->second.fd = -1;
+                    break;
+                }
+            }
+        }
+
+        if (pfds[0].revents) {
+            int fd = accept(listen_fd, 0, 0);
+
+#ifdef SO_PEERCRED
+            struct ucred cred;
+            socklen_t cred_len = sizeof(cred);
+
+            if (fd >= 0 && (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len)
+                            || cred.uid != getuid())) {
+                log_warning() << "refusing a job of another user" << endl;
+                close(fd);
+                fd = -1;
+            }
+#endif
+
+            // a stub sends everything at once, it is probably there already
+            if (fd >= 0) {
+                PendingRequest &req = requests[fd];
+                req.since = time(0);
+                req.fds[0] = req.fds[1] = req.fds[2] = -1;
+                req.have_header = false;
+                req.got = 0;
+                readable.push_back(fd);
+            }
+        }
+
+        time_t now = time(0);
+
+        for (map<int, PendingRequest>::iterator it = requests.begin(); it != requests.end();
+                ++it) {
+            if (now - it->second.since >= REQUEST_TIMEOUT) {
+                readable.push_back(it->first);
+            }
+        }
+
+        for (vector<int>::const_iterator r = readable.begin(); r != readable.end(); ++r) {
+            int fd = *r;
+            map<int, PendingRequest>::iterator it = requests.find(fd);
+
+            // a timed out one that was readable as well
+            if (it == requests.end()) {
+                continue;
+            }
+
+            int ret = read_request(fd, it->second);
+
+            if (!ret && now - it->second.since < REQUEST_TIMEOUT) {
+                continue;
+            }
+
+            PendingRequest req = it->second;
+            requests.erase(it);
+            vector<string> args, env;
+            string cwd;
+            mode_t mask = 0;
+
+            if (ret <= 0 || !parse_request(req.payload, args, cwd, mask, env)) {
+                log_warning() << "broken job submission" << endl;
+                close_fds(req.fds);
+                close(fd);
+                continue;
+            }
+
+            SubmittedJob job;
+            job.fd = fd;
+            job.output = job_label(args);
+            gettimeofday(&job.start, 0);
+            flush_debug();
+
+            pid = fork();
+
+            if (pid < 0) {
+                log_perror("fork()");
+                close_fds(req.fds);
+                close(fd);
+                continue;
+            }
+
+            if (pid == 0) {
+                signal(SIGCHLD, SIG_DFL);
+                signal(SIGTERM, SIG_DFL);
+                signal(SIGINT, SIG_DFL);
+                close(listen_fd);
+                close(signal_pipe[0]);
+                close(signal_pipe[1]);
+                close(fd);
+
+                for (map<pid_t, SubmittedJob>::const_iterator it = jobs.begin(); it != jobs.end();
+                        ++it) {
+                    if (it->second.fd >= 0) {
+                        close(it->second.fd);
+                    }
+                }
+
+                for (map<int, PendingRequest>::iterator it = requests.begin();
+                        it != requests.end(); ++it) {
+                    close_fds(it->second.fds);
+                    close(it->first);
+                }
+
+                submitted_daemon = spare;
+                submitted_socket = daemon_socket;
+                run_worker(req.fds, args, cwd, mask, env, run_job);
+            }
+
+            close_fds(req.fds);
+            jobs[pid] = job;
+            // the worker has it now
+            delete spare;
+            spare = 0;
+        }
+    }
+
+    // the running jobs go with us, their submitters build them themselves
+    for (map<pid_t, SubmittedJob>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        kill(it->first, SIGTERM);
+    }
+
+    delete spare;
+    close(listen_fd);
+    unlink(path.c_str());
+    return submission_quit ? 0 : 1;
+}
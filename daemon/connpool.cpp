@@ -0,0 +1,470 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "connpool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "logging.h"
+#include "mux.h"
+#include "reactor.h"
+
+using namespace std;
+
+// idle connections older than this are closed, the other side may have given up
+static const time_t IDLE_TIMEOUT = 30;
+// the number of recent uses of a host halves every this many seconds
+static const time_t DEMAND_PERIOD = 10;
+// wait this long before trying a host again that could not be reached
+static const time_t RETRY_DELAY = 30;
+static const unsigned int MAX_IDLE_PER_HOST = 8;
+static const unsigned int MAX_CONNECTORS = 4;
+// an unused multiplexed connection is kept that much longer than the idle ones
+static const time_t MUX_IDLE_TIMEOUT = 2 * IDLE_TIMEOUT;
+
+/* The child side of start_connector(): connect, switch to multiplexing
+   if the other side can, and pass the channel's descriptor with the
+   negotiated protocol, codecs and the window of the other side (or 0 for
+   a plain connection) to SOCK.  */
+static void connect_and_pass(int sock, const string &host, unsigned int port)
+{
+    uint32_t result[3] = { 0, 0, 0 };
+    MsgChannel *c = Service::createChannel(host, port, 10);
+
+    if (c && IS_PROTOCOL_39(c)) {
+        Msg *reply = 0;
+
+        if (c->send_msg(MuxStartMsg(MUX_WINDOW))) {
+            reply = c->get_msg(10);
+        }
+
+        if (reply && reply->type == M_MUX_START) {
+            result[2] = static_cast<MuxStartMsg *>(reply)->window;
+        } else {
+            c = 0;
+        }
+    }
+
+    if (c) {
+        result[0] = c->protocol;
+        result[1] = c->remote_codecs;
+    }
+
+    struct iovec iov;
+    iov.iov_base = result;
+    iov.iov_len = sizeof(result);
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (c) {
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &c->fd, sizeof(int));
+    }
+
+    while (sendmsg(sock, &mh, 0) < 0 && errno == EINTR) {}
+
+    // no destructors, the parent's objects are not ours
+    _exit(c ? 0 : 1);
+}
+
+ConnectionPool::ConnectionPool(Reactor &reactor)
+    : m_reactor(reactor)
+{
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    while (!m_idle_fds.empty()) {
+        drop_idle(m_idle_fds.begin()->first);
+    }
+
+    for (map<Key, Host>::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it) {
+        delete it->second.mux;
+    }
+
+    // the connectors exit on their own when they can't pass their result
+    while (!m_connectors.empty()) {
+        close_fd(m_connectors.begin()->first);
+        m_connectors.erase(m_connectors.begin());
+    }
+}
+
+void ConnectionPool::decay(Host &host, time_t now)
+{
+    time_t periods = (now - host.decayed) / DEMAND_PERIOD;
+
+    if (periods > 0) {
+        host.recent = periods >= 32 ? 0 : host.recent >> periods;
+        host.decayed += periods * DEMAND_PERIOD;
+    }
+}
+
+unsigned int ConnectionPool::wanted(const Host &host, time_t now) const
+{
+    if (now - host.last_use >= IDLE_TIMEOUT || now < host.retry_after || host.mux) {
+        return 0;
+    }
+
+    // the first connection tells whether the host can multiplex
+    if (!host.plain) {
+        return 1;
+    }
+
+    // one spare connection for every few jobs recently sent there
+    unsigned int count = 1 + host.recent / 4;
+    return count > MAX_IDLE_PER_HOST ? MAX_IDLE_PER_HOST : count;
+}
+
+void ConnectionPool::note_use(const string &host, unsigned int port, time_t now)
+{
+    Host &h = m_hosts[Key(host, port)];
+
+    if (!h.decayed) {
+        h.decayed = now;
+    }
+
+    decay(h, now);
+    h.recent++;
+    h.last_use = now;
+}
+
+bool ConnectionPool::take(const string &host, unsigned int port, bool stream_ok, int &fd,
+                          int &protocol, uint32_t &codecs, bool &stream)
+{
+    map<Key, Host>::iterator it = m_hosts.find(Key(host, port));
+
+    if (it == m_hosts.end()) {
+        return false;
+    }
+
+    MuxConnection *mux = it->second.mux;
+
+    if (mux && stream_ok && (fd = mux->open_stream()) >= 0) {
+        stream = true;
+        return true;
+    }
+
+    list<Connection> &idle = it->second.idle;
+
+    while (!idle.empty()) {
+        Connection conn = idle.back();   // the freshest
+        idle.pop_back();
+        m_idle_fds.erase(conn.fd);
+        m_reactor.remove(conn.fd);
+
+        /* EOF may be waiting in the socket since the last wait, and
+           the server doesn't talk before it got something from us.  */
+        char c;
+        ssize_t ret = recv(conn.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            fd = conn.fd;
+            protocol = conn.protocol;
+            codecs = conn.codecs;
+            stream = false;
+            return true;
+        }
+
+        close_fd(conn.fd);
+    }
+
+    return false;
+}
+
+bool ConnectionPool::handle_input(int fd, time_t now)
+{
+    if (m_connectors.find(fd) != m_connectors.end()) {
+        connector_done(fd, now);
+        return true;
+    }
+
+    if (m_idle_fds.find(fd) != m_idle_fds.end()) {
+        // closed by the server (or it talks out of turn), useless either way
+        trace() << "pooled connection " << fd << " went away" << endl;
+        drop_idle(fd);
+        return true;
+    }
+
+    MuxDescriptors::const_iterator it = m_mux_fds.find(fd);
+
+    if (it == m_mux_fds.end()) {
+        return false;
+    }
+
+    MuxConnection *mux = it->second;
+    vector<int> accepted;   // the other side can't open streams
+    mux->handle_readable(fd, accepted);
+    drop_dead_mux(mux);
+    return true;
+}
+
+bool ConnectionPool::handle_output(int fd)
+{
+    MuxDescriptors::const_iterator it = m_mux_fds.find(fd);
+
+    if (it == m_mux_fds.end()) {
+        return false;
+    }
+
+    MuxConnection *mux = it->second;
+    mux->handle_writable(fd);
+    drop_dead_mux(mux);
+    return true;
+}
+
+void ConnectionPool::drop_dead_mux(MuxConnection *mux)
+{
+    if (mux->alive()) {
+        return;
+    }
+
+    for (map<Key, Host>::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it) {
+        if (it->second.mux == mux) {
+            it->second.mux = 0;
+        }
+    }
+
+    delete mux;
+}
+
+void ConnectionPool::maintain(time_t now)
+{
+    for (map<Key, Host>::iterator it = m_hosts.begin(); it != m_hosts.end();) {
+        Host &h = it->second;
+
+        while (!h.idle.empty() && now - h.idle.front().since >= IDLE_TIMEOUT) {
+            drop_idle(h.idle.front().fd);
+        }
+
+        if (h.mux && !h.mux->stream_count() && now - h.mux->last_active() >= MUX_IDLE_TIMEOUT
+                && now - h.last_use >= MUX_IDLE_TIMEOUT) {
+            trace() << "closing unused " << h.mux->dump() << endl;
+            delete h.mux;
+            h.mux = 0;
+        }
+
+        decay(h, now);
+        unsigned int count = wanted(h, now);
+
+        while (h.idle.size() + h.connecting < count && m_connectors.size() < MAX_CONNECTORS) {
+            if (!start_connector(it->first)) {   // try again the next time
+                break;
+            }
+        }
+
+        if (h.idle.empty() && !h.connecting && !h.mux && now - h.last_use >= IDLE_TIMEOUT) {
+            m_hosts.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool ConnectionPool::start_connector(const Key &key)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        log_perror("socketpair()");
+        return false;
+    }
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        log_perror("fork()");
+        close_fd(sv[0]);
+        close_fd(sv[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(sv[0]);
+        connect_and_pass(sv[1], key.first, key.second);
+    }
+
+    close_fd(sv[1]);
+
+    if (fcntl(sv[0], F_SETFD, FD_CLOEXEC) < 0) {
+        log_perror("fcntl()");
+    }
+
+    m_reactor.add(sv[0], false);
+    Connector &connector = m_connectors[sv[0]];
+    connector.key = key;
+    connector.pid = pid;
+    m_hosts[key].connecting++;
+    trace() << "connecting to " << key.first << ":" << key.second << " for the pool" << endl;
+    return true;
+}
+
+void ConnectionPool::connector_done(int sock, time_t now)
+{
+    Connector connector = m_connectors[sock];
+    m_connectors.erase(sock);
+
+    uint32_t result[3] = { 0, 0, 0 };
+    struct iovec iov;
+    iov.iov_base = result;
+    iov.iov_len = sizeof(result);
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    int fd = -1;
+    ssize_t ret;
+
+    while ((ret = recvmsg(sock, &mh, MSG_DONTWAIT)) < 0 && errno == EINTR) {}
+
+    if (ret > 0) {
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+                memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+            }
+        }
+    }
+
+    m_reactor.remove(sock);
+    close_fd(sock);
+
+    // it exits right after writing; the main loop may have reaped it already
+    while (waitpid(connector.pid, 0, 0) < 0 && errno == EINTR) {}
+
+    Host &h = m_hosts[connector.key];
+    h.connecting--;
+
+    if (fd < 0 || ret != (ssize_t) sizeof(result) || !result[0]) {
+        if (fd >= 0) {
+            close_fd(fd);
+        }
+
+        trace() << "could not connect to " << connector.key.first << ":"
+                << connector.key.second << " for the pool" << endl;
+        h.retry_after = now + RETRY_DELAY;
+        return;
+    }
+
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        log_perror("fcntl()");
+    }
+
+    if (result[2]) {
+        if (h.mux) {   // raced with another connector
+            close_fd(fd);
+        } else {
+            h.mux = new MuxConnection(m_reactor, m_mux_fds, fd, true, result[2]);
+            trace() << "multiplexing jobs to " << connector.key.first << ":"
+                    << connector.key.second << endl;
+        }
+
+        return;
+    }
+
+    // an older server, it gets a connection per job
+    h.plain = true;
+
+    Connection conn;
+    conn.fd = fd;
+    conn.protocol = result[0];
+    conn.codecs = result[1];
+    conn.since = now;
+    h.idle.push_back(conn);
+    m_idle_fds[fd] = connector.key;
+    m_reactor.add(fd, false);
+}
+
+void ConnectionPool::drop_idle(int fd)
+{
+    map<int, Key>::iterator it = m_idle_fds.find(fd);
+
+    if (it == m_idle_fds.end()) {
+        return;
+    }
+
+    list<Connection> &idle = m_hosts[it->second].idle;
+
+    for (list<Connection>::iterator c = idle.begin(); c != idle.end(); ++c) {
+        if (c->fd == fd) {
+            idle.erase(c);
+            break;
+        }
+    }
+
+    m_idle_fds.erase(it);
+    m_reactor.remove(fd);
+    close_fd(fd);
+}
+
+void ConnectionPool::close_fd(int fd)
+{
+    if ((-1 == close(fd)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+}
+
+string ConnectionPool::dump() const
+{
+    string result;
+
+    for (map<Key, Host>::const_iterator it = m_hosts.begin(); it != m_hosts.end(); ++it) {
+        result += "  Pool " + it->first.first + ":" + toString(it->first.second) + ": "
+                  + toString(it->second.idle.size()) + " idle, "
+                  + toString(it->second.connecting) + " connecting, "
+                  + toString(it->second.recent) + " recent uses\n";
+
+        if (it->second.mux) {
+            result += "    " + it->second.mux->dump() + "\n";
+        }
+    }
+
+    return result;
+}
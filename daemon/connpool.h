@@ -0,0 +1,124 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_CONNPOOL_H
+#define ICECREAM_CONNPOOL_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <time.h>
+
+#include <comm.h>
+
+#include "mux.h"
+
+class Reactor;
+
+/* Connections to the compile servers our clients were sent to recently,
+   with the protocol setup already done.  The daemon hands them to its
+   local clients along with M_USE_CS, so they skip connect and handshake.
+   Servers that can multiplex (IS_PROTOCOL_39) get just one connection,
+   and the clients get a stream of it each (see MuxConnection).
+
+   New connections are made by short-lived children, so a slow or dead
+   host never blocks the daemon; they pass the connection back over a
+   socketpair.  Idle connections are watched for EOF and dropped after
+   a while, how many are kept per host follows the recent demand.  */
+class ConnectionPool
+{
+public:
+    explicit ConnectionPool(Reactor &reactor);
+    ~ConnectionPool();
+
+    // a job of a local client was sent to HOST:PORT
+    void note_use(const std::string &host, unsigned int port, time_t now);
+
+    /* Gives away an idle connection to HOST:PORT, or if STREAM_OK a new
+       stream of a multiplexed one (STREAM is set then, the protocol setup
+       is still to do).  The caller owns FD then.  Returns false if there
+       is nothing ready.  */
+    bool take(const std::string &host, unsigned int port, bool stream_ok, int &fd,
+              int &protocol, uint32_t &codecs, bool &stream);
+
+    // return true if FD belongs to the pool, it is handled then
+    bool handle_input(int fd, time_t now);
+    bool handle_output(int fd);
+
+    // drops old connections and starts new ones where they will be needed
+    void maintain(time_t now);
+
+    std::string dump() const;
+
+private:
+    typedef std::pair<std::string, unsigned int> Key;
+
+    struct Connection {
+        int fd;
+        int protocol;
+        uint32_t codecs;
+        time_t since;
+    };
+
+    struct Host {
+        Host()
+            : recent(0)
+            , decayed(0)
+            , last_use(0)
+            , retry_after(0)
+            , connecting(0)
+            , plain(false)
+            , mux(0) {}
+
+        std::list<Connection> idle;   // oldest first
+        unsigned int recent;          // uses, halved every DEMAND_PERIOD
+        time_t decayed;
+        time_t last_use;
+        time_t retry_after;           // connecting failed, don't hammer it
+        unsigned int connecting;
+        bool plain;                   // the server can't multiplex
+        MuxConnection *mux;
+    };
+
+    struct Connector {
+        Key key;
+        pid_t pid;
+    };
+
+    void decay(Host &host, time_t now);
+    unsigned int wanted(const Host &host, time_t now) const;
+    bool start_connector(const Key &key);
+    void connector_done(int sock, time_t now);
+    void drop_idle(int fd);
+    void drop_dead_mux(MuxConnection *mux);
+    void close_fd(int fd);
+
+    Reactor &m_reactor;
+    std::map<Key, Host> m_hosts;
+    std::map<int, Key> m_idle_fds;
+    std::map<int, Connector> m_connectors;   // by our end of the socketpair
+    MuxDescriptors m_mux_fds;
+};
+
+#endif
@@ -28,20 +28,35 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
 #ifdef HAVE_SIGNAL_H
 #include <signal.h>
 #endif
 
+#include "chunksender.h"
 #include "comm.h"
 #include "exitcode.h"
+#include "fileio.h"
+#include "md5.h"
 #include "util.h"
 
 using namespace std;
 
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
 #if 0
 static string read_fromFILE(FILE *f)
 {
@@ -111,6 +126,10 @@ size_t sumup_dir(const string &dir)
 
         if (S_ISDIR(st.st_mode)) {
             res += sumup_dir(tdir + ent->d_name);
+        } else if (S_ISREG(st.st_mode) && st.st_nlink > 1) {
+            // shared with other environments through the store, see
+            // gc_env_store(), each of them counts its part
+            res += st.st_size / (st.st_nlink - 1);
         } else if (S_ISREG(st.st_mode)) {
             res += st.st_size;
         }
@@ -175,43 +194,245 @@ static bool cleanup_directory(const string &directory)
         return false;
     }
 
+    bool ok = true;
+
     while (dirent *f = readdir(dir)) {
         if (strcmp(f->d_name, ".") == 0 || strcmp(f->d_name, "..") == 0) {
             continue;
         }
 
-        string fullpath = directory + '/' + f->d_name;
+        ok = remove_entry(dirfd(dir), f->d_name) >= 0 && ok;
+    }
+
+    closedir(dir);
+    return ok;
+}
+
+static uint64_t checksum_add(uint64_t sum, const string &data)
+{
+    // FNV-1a, with a terminating byte no name has
+    for (string::size_type i = 0; i <= data.size(); ++i) {
+        sum ^= i < data.size() ? (unsigned char) data[i] : 0xff;
+        sum *= 1099511628211ULL;
+    }
+
+    return sum;
+}
+
+static bool checksum_dir(const string &dir, const string &prefix, uint64_t &sum)
+{
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        return false;
+    }
+
+    vector<string> names;
+
+    for (struct dirent *ent = readdir(d); ent; ent = readdir(d)) {
+        string name = ent->d_name;
+
+        // the jobs use tmp
+        if (name != "." && name != ".." && !(prefix.empty() && name == "tmp")) {
+            names.push_back(name);
+        }
+    }
+
+    closedir(d);
+    sort(names.begin(), names.end());
+
+    for (vector<string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+        string file = dir + "/" + *it;
         struct stat st;
 
-        if (lstat(fullpath.c_str(), &st)) {
-            perror("stat");
+        if (lstat(file.c_str(), &st)) {
             return false;
         }
 
-        if (S_ISDIR(st.st_mode)) {
-            if (!cleanup_directory(fullpath) || rmdir(fullpath.c_str()) != 0) {
+        ostringstream entry;
+        entry << prefix << *it << " " << (st.st_mode & 0177777);
+
+        if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(file.c_str(), target, sizeof(target));
+
+            if (len < 0) {
                 return false;
             }
-        } else {
-            if (unlink(fullpath.c_str()) != 0) {
-                return false;
+
+            entry << " " << string(target, len);
+        } else if (!S_ISDIR(st.st_mode)) {
+            entry << " " << st.st_size << " " << st.st_mtime;
+        }
+
+        sum = checksum_add(sum, entry.str());
+
+        if (S_ISDIR(st.st_mode) && !checksum_dir(file, prefix + *it + "/", sum)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+string environment_checksum(const string &basedir, const string &env)
+{
+    uint64_t sum = 14695981039346656037ULL;
+
+    if (!checksum_dir(basedir + "/target=" + env, string(), sum)) {
+        return string();
+    }
+
+    char buf[20];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) sum);
+    return buf;
+}
+
+static const char env_manifest_header[] = "icecc envs 1";
+
+bool write_env_manifest(const string &basedir, const InstalledEnvs &envs)
+{
+    string file = basedir + "/manifest";
+    string tmp = file + ".tmp";
+    ofstream out(tmp.c_str());
+
+    out << env_manifest_header << "\n";
+
+    for (InstalledEnvs::const_iterator it = envs.begin(); it != envs.end(); ++it) {
+        out << it->second.checksum << " " << it->second.size << " " << it->second.last_use
+            << " " << it->first << "\n";
+    }
+
+    out.close();
+
+    if (!out || rename(tmp.c_str(), file.c_str())) {
+        log_perror("writing the environment manifest failed") << "\t" << file << endl;
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// the environments of the manifest that are still intact
+static InstalledEnvs read_env_manifest(const string &basedir, uid_t user_uid)
+{
+    InstalledEnvs envs;
+    string file = basedir + "/manifest";
+    struct stat st;
+
+    // the users of the environments can write to BASEDIR, but not this
+    if (lstat(file.c_str(), &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+        return envs;
+    }
+
+    ifstream in(file.c_str());
+    string line;
+
+    if (!getline(in, line) || line != env_manifest_header) {
+        log_warning() << "ignoring unknown environment manifest " << file << endl;
+        return envs;
+    }
+
+    while (getline(in, line)) {
+        istringstream fields(line);
+        InstalledEnv env;
+        string name;
+
+        if (!(fields >> env.checksum >> env.size >> env.last_use >> name)
+                || name.find("..") != string::npos || name.find('/') == string::npos) {
+            continue;
+        }
+
+        string dir = basedir + "/target=" + name;
+
+        if (lstat(dir.c_str(), &st) || !S_ISDIR(st.st_mode) || st.st_uid != user_uid
+                || access((dir + "/usr/bin/as").c_str(), X_OK)
+                || environment_checksum(basedir, name) != env.checksum) {
+            log_warning() << "discarding damaged environment " << name << endl;
+            continue;
+        }
+
+        envs[name] = env;
+    }
+
+    return envs;
+}
+
+/* Removes everything in BASEDIR but the environments in KEPT, of which
+   only the leftovers of jobs in tmp go.  */
+static bool cleanup_envs_dir(const string &basedir, const InstalledEnvs &kept)
+{
+    DIR *dir = opendir(basedir.c_str());
+
+    if (!dir) {
+        return false;
+    }
+
+    bool ok = true;
+
+    while (struct dirent *ent = readdir(dir)) {
+        string name = ent->d_name;
+
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        string path = basedir + "/" + name;
+
+        if (name == "store") {
+            continue;
+        }
+
+        if (name.compare(0, 7, "target=") != 0) {
+            ok = remove_entry(AT_FDCWD, path) >= 0 && ok;
+            continue;
+        }
+
+        DIR *target_dir = opendir(path.c_str());
+
+        if (!target_dir) {
+            ok = remove_entry(AT_FDCWD, path) >= 0 && ok;
+            continue;
+        }
+
+        while (struct dirent *env_ent = readdir(target_dir)) {
+            string env = env_ent->d_name;
+
+            if (env == "." || env == "..") {
+                continue;
+            }
+
+            if (kept.count(name.substr(7) + "/" + env)) {
+                cleanup_directory(path + "/" + env + "/tmp");
+            } else {
+                ok = remove_entry(AT_FDCWD, path + "/" + env) >= 0 && ok;
             }
         }
+
+        closedir(target_dir);
     }
 
     closedir(dir);
-    return true;
+    return ok;
 }
 
-bool cleanup_cache(const string &basedir, uid_t user_uid, gid_t user_gid)
+bool cleanup_cache(const string &basedir, uid_t user_uid, gid_t user_gid, InstalledEnvs &kept)
 {
     flush_debug();
+    kept = read_env_manifest(basedir, user_uid);
 
-    if (access(basedir.c_str(), R_OK) == 0 && !cleanup_directory(basedir)) {
+    if (access(basedir.c_str(), R_OK) == 0 && !cleanup_envs_dir(basedir, kept)) {
         log_error() << "failed to clean up envs dir" << endl;
         return false;
     }
 
+    if (!kept.empty()) {
+        log_info() << "kept " << kept.size() << " installed environments" << endl;
+    }
+
+    gc_env_store(basedir);
+
     if (mkdir(basedir.c_str(), 0755) && errno != EEXIST) {
         if (errno == EPERM) {
             log_error() << "permission denied on mkdir " << basedir << endl;
@@ -467,143 +688,626 @@ size_t finish_create_env(int pipe, const string &basedir, string &native_environ
 }
 
 
-pid_t start_install_environment(const std::string &basename, const std::string &target,
-                                const std::string &name, MsgChannel *c,
-                                int &pipe_to_stdin, FileChunkMsg *&fmsg,
-                                uid_t user_uid, gid_t user_gid, int extract_priority)
+/* The environment store, BASEDIR/store.  Environments sent as a list of
+   files (M_ENV_FILES) are hard link trees into it: every content is in
+   there once, named by its md5 sum and whether it is executable, owned
+   by the daemon and read-only, so no job can change what the other
+   environments see.  Contents no environment links to anymore are
+   removed by gc_env_store().  */
+struct StoreFile {
+    string hash;
+    off_t size;
+    mode_t mode;
+    string path;
+};
+
+struct StoreList {
+    vector<StoreFile> files;
+    vector<string> dirs;
+    vector<pair<string, string> > links;    // the path, and where it points to
+};
+
+static string store_dir(const string &basedir)
 {
-    if (!name.size()) {
-        log_error() << "illegal name for environment " << name << endl;
-        return 0;
+    return basedir + "/store";
+}
+
+static string blob_name(const string &hash, bool executable)
+{
+    return hash + (executable ? "-555" : "-444");
+}
+
+static bool valid_store_hash(const string &hash)
+{
+    if (hash.size() != 32) {
+        return false;
     }
 
-    for (string::size_type i = 0; i < name.size(); ++i) {
-        if (isascii(name[i]) && !isspace(name[i]) && name[i] != '/' && isprint(name[i])) {
-            continue;
+    for (size_t i = 0; i < hash.size(); ++i) {
+        if (!isdigit(hash[i]) && (hash[i] < 'a' || hash[i] > 'f')) {
+            return false;
         }
+    }
 
-        log_error() << "illegal char '" << name[i] << "' - rejecting environment " << name << endl;
-        return 0;
+    return true;
+}
+
+/* Relative and without "." or ".." anywhere, so it stays inside the
+   environment.  Nothing may take the place of the tmp directory the
+   daemon creates itself.  */
+static bool valid_store_path(const string &path)
+{
+    if (path.empty() || path == "tmp") {
+        return false;
     }
 
-    string dirname = basename + "/target=" + target;
-    Msg *msg = c->get_msg(30);
+    size_t start = 0;
 
-    if (!msg || msg->type != M_FILE_CHUNK) {
-        trace() << "Expected first file chunk\n";
-        return 0;
+    while (start <= path.size()) {
+        size_t end = path.find('/', start);
+
+        if (end == string::npos) {
+            end = path.size();
+        }
+
+        string part = path.substr(start, end - start);
+
+        if (part.empty() || part == "." || part == "..") {
+            return false;
+        }
+
+        start = end + 1;
     }
 
-    fmsg = dynamic_cast<FileChunkMsg*>(msg);
-    enum { BZip2, Gzip, None} compression = None;
+    return true;
+}
 
-    if (fmsg->len > 2) {
-        if (fmsg->buffer[0] == 037 && fmsg->buffer[1] == 0213) {
-            compression = Gzip;
-        } else if (fmsg->buffer[0] == 'B' && fmsg->buffer[1] == 'Z') {
-            compression = BZip2;
+static bool parse_store_list(const EnvFilesMsg &msg, StoreList &list)
+{
+    for (std::list<string>::const_iterator it = msg.files.begin(); it != msg.files.end(); ++it) {
+        StoreFile file;
+        size_t space = it->find(' ');
+        size_t space2 = space == string::npos ? space : it->find(' ', space + 1);
+        size_t space3 = space2 == string::npos ? space2 : it->find(' ', space2 + 1);
+
+        if (space3 == string::npos) {
+            return false;
+        }
+
+        file.hash = it->substr(0, space);
+        file.size = strtoll(it->c_str() + space + 1, 0, 10);
+        file.mode = strtoul(it->c_str() + space2 + 1, 0, 8);
+        file.path = it->substr(space3 + 1);
+
+        if (!valid_store_hash(file.hash) || file.size < 0 || !valid_store_path(file.path)) {
+            return false;
         }
+
+        list.files.push_back(file);
     }
 
-    if (mkdir(dirname.c_str(), 0770) && errno != EEXIST) {
-        log_perror("mkdir target") << "\t" << dirname << endl;
-        return 0;
+    for (std::list<string>::const_iterator it = msg.dirs.begin(); it != msg.dirs.end(); ++it) {
+        size_t space = it->find(' ');
+
+        if (space == string::npos || !valid_store_path(it->substr(space + 1))) {
+            return false;
+        }
+
+        list.dirs.push_back(it->substr(space + 1));
     }
 
-    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
-        log_perror("chown,chmod target") << "\t" << dirname << endl;
-        return 0;
+    if (msg.links.size() != msg.link_targets.size()) {
+        return false;
     }
 
-    dirname = dirname + "/" + name;
+    std::list<string>::const_iterator target = msg.link_targets.begin();
 
-    if (mkdir(dirname.c_str(), 0770)) {
-        log_perror("mkdir name") << "\t" << dirname << endl;
-        return 0;
+    for (std::list<string>::const_iterator it = msg.links.begin(); it != msg.links.end();
+            ++it, ++target) {
+        if (!valid_store_path(*it) || target->empty()) {
+            return false;
+        }
+
+        list.links.push_back(make_pair(*it, *target));
     }
 
-    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
-        log_perror("chown,chmod name") << "\t" << dirname << endl;
-        return 0;
+    return !list.files.empty();
+}
+
+static bool in_store(const string &store, const StoreFile &file)
+{
+    struct stat st;
+
+    for (int executable = 0; executable < 2; ++executable) {
+        if (!lstat((store + "/" + blob_name(file.hash, executable)).c_str(), &st)
+                && S_ISREG(st.st_mode) && st.st_size == file.size) {
+            return true;
+        }
     }
 
-    int fds[2];
+    return false;
+}
 
-    if (pipe(fds) == -1) {
-        log_perror("pipe failed");
-        return 0;
+static bool copy_file(const string &from, const string &to, mode_t mode)
+{
+    int in = open(from.c_str(), O_RDONLY | O_LARGEFILE);
+
+    if (in < 0) {
+        return false;
     }
 
-    flush_debug();
-    pid_t pid = fork();
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, mode);
 
-    if (pid == -1) {
-        log_perror("fork - trying to run tar");
-        return 0;
+    if (out < 0) {
+        close_fd(in);
+        return false;
     }
-    if (pid) {
-        trace() << "pid " << pid << endl;
 
-        if ((-1 == close(fds[0])) && (errno != EBADF)){
-            log_perror("close failed");
+    char buf[65536];
+    ssize_t len;
+    bool ok = true;
+
+    while (ok && (len = read(in, buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            ok = errno == EINTR;
+            continue;
         }
-        pipe_to_stdin = fds[1];
 
-        return pid;
+        ok = write_full(out, buf, len);
     }
 
-    // else
-#ifndef HAVE_LIBCAP_NG
+    close_fd(in);
+    close_fd(out);
+    return ok;
+}
 
-    if (setgroups(0, NULL) < 0) {
-        log_perror("setgroups fails");
-        _exit(143);
-    }
+/* Reads the contents of FILE from IN into the store, checking they are
+   what the md5 sum says.  */
+static bool receive_blob(int in, const string &store, const string &tmp, const StoreFile &file)
+{
+    unlink(tmp.c_str());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0600);
 
-    if (setgid(user_gid) < 0) {
-        log_perror("setgid fails");
-        _exit(143);
+    if (fd < 0) {
+        log_perror("open in the environment store failed") << "\t" << tmp << endl;
+        return false;
     }
 
-    if (!geteuid() && setuid(user_uid) < 0) {
-        log_perror("setuid fails");
-        _exit(142);
-    }
+    md5_state_t state;
+    md5_init(&state);
+    char buf[65536];
+    off_t left = file.size;
+    bool ok = true;
 
-#endif
+    while (ok && left) {
+        ssize_t len = read(in, buf, min(off_t(sizeof(buf)), left));
 
-    // reset SIGPIPE and SIGCHILD handler so that tar
-    // isn't confused when gzip/bzip2 aborts
-    signal(SIGCHLD, SIG_DFL);
-    signal(SIGPIPE, SIG_DFL);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
 
-    if ((-1 == close(0)) && (errno != EBADF)){
-        log_perror("close failed");
+        if (len <= 0) {
+            log_error() << "the contents of the environment ended early" << endl;
+            ok = false;
+            break;
+        }
+
+        md5_append(&state, (const md5_byte_t *) buf, len);
+        ok = write_full(fd, buf, len);
+        left -= len;
     }
 
-    if ((-1 == close(fds[1])) && (errno != EBADF)){
-        log_perror("close failed");
+    if (ok && md5_hex(state) != file.hash) {
+        log_error() << "contents don't match their md5 sum " << file.hash << endl;
+        ok = false;
     }
 
-    if (-1 == dup2(fds[0], 0)){
-        log_perror("dup2 failed");
+    bool executable = file.mode & 0111;
+    ok = ok && !fchmod(fd, executable ? 0555 : 0444);
+    close_fd(fd);
+    ok = ok && !rename(tmp.c_str(), (store + "/" + blob_name(file.hash, executable)).c_str());
+
+    if (!ok) {
+        unlink(tmp.c_str());
     }
 
-    int niceval = nice(extract_priority);
-    if (-1 == niceval){
-        log_warning() << "failed to set nice value: " << strerror(errno) << endl;
+    return ok;
+}
+
+// creates the directory PATH below ROOT and what is missing above it
+static bool make_dirs(const string &root, const string &path, set<string> &made)
+{
+    if (path.empty() || made.count(path)) {
+        return true;
     }
 
-    char **argv;
-    argv = new char*[6];
-    argv[0] = strdup(TAR);
-    argv[1] = strdup("-C");
-    argv[2] = strdup(dirname.c_str());
+    size_t slash = path.find_last_of('/');
 
-    if (compression == BZip2) {
-        argv[3] = strdup("-xjf");
-    } else if (compression == Gzip) {
-        argv[3] = strdup("-xzf");
+    if (slash != string::npos && !make_dirs(root, path.substr(0, slash), made)) {
+        return false;
+    }
+
+    string dir = root + "/" + path;
+    struct stat st;
+
+    if (mkdir(dir.c_str(), 0755) && (errno != EEXIST || lstat(dir.c_str(), &st)
+                                      || !S_ISDIR(st.st_mode))) {
+        log_perror("mkdir in environment failed") << "\t" << dir << endl;
+        return false;
+    }
+
+    made.insert(path);
+    return true;
+}
+
+static string parent_of(const string &path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == string::npos ? string() : path.substr(0, slash);
+}
+
+// links FILE from the store into ROOT, or copies it if that's not possible
+static bool place_blob(const string &store, const string &tmp, const string &root,
+                       const StoreFile &file)
+{
+    bool executable = file.mode & 0111;
+    string blob = store + "/" + blob_name(file.hash, executable);
+    struct stat st;
+
+    // so far only there with the other mode
+    if (lstat(blob.c_str(), &st)
+            && (!copy_file(store + "/" + blob_name(file.hash, !executable), tmp,
+                           executable ? 0555 : 0444)
+                || rename(tmp.c_str(), blob.c_str()))) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    string path = root + "/" + file.path;
+
+    if (!link(blob.c_str(), path.c_str())) {
+        return true;
+    }
+
+    // like tar, a later entry of the same name wins
+    if (errno == EEXIST) {
+        if (unlink(path.c_str())) {
+            return false;
+        }
+
+        if (!link(blob.c_str(), path.c_str())) {
+            return true;
+        }
+    }
+
+    // too many links, or no links on that file system
+    return copy_file(blob, path, executable ? 0555 : 0444);
+}
+
+/* What the child does for an environment sent as a list of files: it
+   takes the contents the server asked for from IN, and then builds the
+   tree in ROOT.  All directories are made here before any symlink, so
+   nothing can lead outside of ROOT, and ROOT is only the user's once
+   the tree is complete.  */
+static int install_from_store(int in, const string &basedir, const string &root,
+                              const StoreList &list, const std::list<string> &need,
+                              uid_t user_uid, gid_t user_gid)
+{
+    string store = store_dir(basedir);
+    string tmp = store + "/tmp." + toString(getpid());
+    map<string, const StoreFile *> first;
+
+    for (vector<StoreFile>::const_iterator it = list.files.begin(); it != list.files.end(); ++it) {
+        first.insert(make_pair(it->hash, &*it));
+    }
+
+    for (std::list<string>::const_iterator it = need.begin(); it != need.end(); ++it) {
+        if (!receive_blob(in, store, tmp, *first[*it])) {
+            return 1;
+        }
+    }
+
+    char c;
+    ssize_t extra;
+
+    while ((extra = read(in, &c, 1)) < 0 && errno == EINTR) {}
+
+    if (extra != 0) {
+        log_error() << "more contents than the environment has files" << endl;
+        return 1;
+    }
+
+    set<string> made;
+
+    for (vector<string>::const_iterator it = list.dirs.begin(); it != list.dirs.end(); ++it) {
+        if (!make_dirs(root, *it, made)) {
+            return 1;
+        }
+    }
+
+    for (vector<StoreFile>::const_iterator it = list.files.begin(); it != list.files.end(); ++it) {
+        if (!make_dirs(root, parent_of(it->path), made) || !place_blob(store, tmp, root, *it)) {
+            log_perror("placing a file of the environment failed") << "\t" << it->path << endl;
+            return 1;
+        }
+    }
+
+    for (vector<pair<string, string> >::const_iterator it = list.links.begin();
+            it != list.links.end(); ++it) {
+        string path = root + "/" + it->first;
+
+        if (!make_dirs(root, parent_of(it->first), made)
+                || (symlink(it->second.c_str(), path.c_str())
+                    && (errno != EEXIST || unlink(path.c_str())
+                        || symlink(it->second.c_str(), path.c_str())))) {
+            log_perror("symlink in environment failed") << "\t" << path << endl;
+            return 1;
+        }
+
+        ignore_result(lchown(path.c_str(), user_uid, user_gid));
+    }
+
+    // the directories are the user's like with tar, the files stay the store's
+    for (set<string>::const_iterator it = made.begin(); it != made.end(); ++it) {
+        ignore_result(chown((root + "/" + *it).c_str(), user_uid, user_gid));
+    }
+
+    if (chown(root.c_str(), user_uid, user_gid) || chmod(root.c_str(), 0770)) {
+        log_perror("chown,chmod name") << "\t" << root << endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+static bool make_target_dir(const string &dirname, uid_t user_uid, gid_t user_gid)
+{
+    if (mkdir(dirname.c_str(), 0770) && errno != EEXIST) {
+        log_perror("mkdir target") << "\t" << dirname << endl;
+        return false;
+    }
+
+    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
+        log_perror("chown,chmod target") << "\t" << dirname << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/* Answers the list of files with what the store lacks and starts the
+   child that receives that and builds the environment.  */
+static pid_t start_install_from_store(const string &basename, const string &dirname,
+                                      MsgChannel *c, const EnvFilesMsg &msg,
+                                      int &pipe_to_stdin, uid_t user_uid, gid_t user_gid,
+                                      int extract_priority)
+{
+    StoreList list;
+
+    if (!parse_store_list(msg, list)) {
+        log_error() << "invalid list of environment files" << endl;
+        return 0;
+    }
+
+    string store = store_dir(basename);
+
+    if (mkdir(store.c_str(), 0755) && errno != EEXIST) {
+        log_perror("mkdir of the environment store failed") << "\t" << store << endl;
+        return 0;
+    }
+
+    EnvNeedMsg need;
+    set<string> seen;
+    off_t all_bytes = 0;
+    off_t need_bytes = 0;
+
+    for (vector<StoreFile>::const_iterator it = list.files.begin(); it != list.files.end(); ++it) {
+        if (!seen.insert(it->hash).second) {
+            continue;
+        }
+
+        all_bytes += it->size;
+
+        if (!in_store(store, *it)) {
+            need.hashes.push_back(it->hash);
+            need_bytes += it->size;
+        }
+    }
+
+    // the user only gets it once it's complete
+    if (!make_target_dir(parent_of(dirname), user_uid, user_gid)
+            || mkdir(dirname.c_str(), 0700)) {
+        log_perror("mkdir name") << "\t" << dirname << endl;
+        return 0;
+    }
+
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        log_perror("pipe failed");
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("fork - trying to install environment");
+        close_fd(fds[0]);
+        close_fd(fds[1]);
+        return 0;
+    }
+
+    if (pid == 0) {
+        close_fd(fds[1]);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+
+        if (-1 == nice(extract_priority)) {
+            log_warning() << "failed to set nice value: " << strerror(errno) << endl;
+        }
+
+        _exit(install_from_store(fds[0], basename, dirname, list, need.hashes,
+                                 user_uid, user_gid));
+    }
+
+    close_fd(fds[0]);
+    pipe_to_stdin = fds[1];
+    trace() << "environment " << dirname << " has " << seen.size() << " different files, "
+            << need.hashes.size() << " not in the store yet (" << need_bytes << " of "
+            << all_bytes << " bytes)" << endl;
+
+    // if this fails, so does the transfer, and the child with it
+    if (!c->send_msg(need)) {
+        log_info() << "write of needed environment files failed" << endl;
+    }
+
+    return pid;
+}
+
+pid_t start_install_environment(const std::string &basename, const std::string &target,
+                                const std::string &name, MsgChannel *c, Msg *msg,
+                                int &pipe_to_stdin, uid_t user_uid, gid_t user_gid,
+                                int extract_priority)
+{
+    if (!name.size()) {
+        log_error() << "illegal name for environment " << name << endl;
+        return 0;
+    }
+
+    for (string::size_type i = 0; i < name.size(); ++i) {
+        if (isascii(name[i]) && !isspace(name[i]) && name[i] != '/' && isprint(name[i])) {
+            continue;
+        }
+
+        log_error() << "illegal char '" << name[i] << "' - rejecting environment " << name << endl;
+        return 0;
+    }
+
+    string dirname = basename + "/target=" + target;
+
+    if (msg->type == M_ENV_FILES) {
+        pid_t pid = start_install_from_store(basename, dirname + "/" + name, c,
+                                             *static_cast<EnvFilesMsg *>(msg), pipe_to_stdin,
+                                             user_uid, user_gid, extract_priority);
+
+        // the client waits for M_ENV_NEED otherwise
+        if (!pid) {
+            c->send_msg(EndMsg());
+        }
+
+        return pid;
+    }
+
+    if (msg->type != M_FILE_CHUNK) {
+        trace() << "Expected first file chunk\n";
+        return 0;
+    }
+
+    FileChunkMsg *fmsg = static_cast<FileChunkMsg*>(msg);
+    enum { BZip2, Gzip, None} compression = None;
+
+    if (fmsg->len > 2) {
+        if (fmsg->buffer[0] == 037 && fmsg->buffer[1] == 0213) {
+            compression = Gzip;
+        } else if (fmsg->buffer[0] == 'B' && fmsg->buffer[1] == 'Z') {
+            compression = BZip2;
+        }
+    }
+
+    if (!make_target_dir(dirname, user_uid, user_gid)) {
+        return 0;
+    }
+
+    dirname = dirname + "/" + name;
+
+    if (mkdir(dirname.c_str(), 0770)) {
+        log_perror("mkdir name") << "\t" << dirname << endl;
+        return 0;
+    }
+
+    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
+        log_perror("chown,chmod name") << "\t" << dirname << endl;
+        return 0;
+    }
+
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        log_perror("pipe failed");
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("fork - trying to run tar");
+        return 0;
+    }
+    if (pid) {
+        trace() << "pid " << pid << endl;
+
+        if ((-1 == close(fds[0])) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+        pipe_to_stdin = fds[1];
+
+        return pid;
+    }
+
+    // else
+#ifndef HAVE_LIBCAP_NG
+
+    if (setgroups(0, NULL) < 0) {
+        log_perror("setgroups fails");
+        _exit(143);
+    }
+
+    if (setgid(user_gid) < 0) {
+        log_perror("setgid fails");
+        _exit(143);
+    }
+
+    if (!geteuid() && setuid(user_uid) < 0) {
+        log_perror("setuid fails");
+        _exit(142);
+    }
+
+#endif
+
+    // reset SIGPIPE and SIGCHILD handler so that tar
+    // isn't confused when gzip/bzip2 aborts
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+
+    if ((-1 == close(0)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+
+    if ((-1 == close(fds[1])) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+
+    if (-1 == dup2(fds[0], 0)){
+        log_perror("dup2 failed");
+    }
+
+    int niceval = nice(extract_priority);
+    if (-1 == niceval){
+        log_warning() << "failed to set nice value: " << strerror(errno) << endl;
+    }
+
+    char **argv;
+    argv = new char*[6];
+    argv[0] = strdup(TAR);
+    argv[1] = strdup("-C");
+    argv[2] = strdup(dirname.c_str());
+
+    if (compression == BZip2) {
+        argv[3] = strdup("-xjf");
+    } else if (compression == Gzip) {
+        argv[3] = strdup("-xzf");
     } else if (compression == None) {
         argv[3] = strdup("-xf");
     }
@@ -643,46 +1347,438 @@ size_t finalize_install_environment(const std::string &basename, const std::stri
     return sumup_dir(dirname);
 }
 
-size_t remove_environment(const string &basename, const string &env)
+pid_t remove_environment(const string &basename, const string &env)
 {
+    static unsigned int removals = 0;
     string dirname = basename + "/target=" + env;
+    // in the base directory, so it's a rename on the same file system
+    string removed = basename + "/removed." + toString(getpid()) + "." + toString(++removals);
 
-    size_t res = sumup_dir(dirname);
+    if (rename(dirname.c_str(), removed.c_str())) {
+        if (errno != ENOENT) {
+            log_perror("rename failed") << "\t" << dirname << endl;
+            remove_entry(AT_FDCWD, dirname);
+        }
+
+        return 0;
+    }
 
     flush_debug();
     pid_t pid = fork();
 
     if (pid == -1) {
         log_perror("failed to fork");
+        remove_entry(AT_FDCWD, removed);
         return 0;
     }
 
     if (pid) {
-        int status = 0;
+        return pid;
+    }
 
-        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    // leftovers are removed with the next start, see cleanup_envs_dir()
+    _exit(remove_entry(AT_FDCWD, removed) >= 0 ? 0 : 1);
+}
+
+void gc_env_store(const string &basedir)
+{
+    string store = store_dir(basedir);
+    DIR *dir = opendir(store.c_str());
 
-        if (WIFEXITED(status)) {
-            return res;
+    if (!dir) {
+        return;
+    }
+
+    size_t removed = 0;
+
+    while (struct dirent *ent = readdir(dir)) {
+        string path = store + "/" + ent->d_name;
+        struct stat st;
+
+        if (ent->d_name[0] == '.' || lstat(path.c_str(), &st)) {
+            continue;
         }
 
-        // something went wrong. assume no disk space was free'd.
+        // no environment links to it anymore, or left over by a crashed child
+        if (!S_ISREG(st.st_mode) || st.st_nlink == 1 || !strncmp(ent->d_name, "tmp.", 4)) {
+            if (remove_entry(AT_FDCWD, path) >= 0) {
+                ++removed;
+            }
+        }
+    }
+
+    closedir(dir);
+
+    if (removed) {
+        trace() << "removed " << removed << " files from the environment store" << endl;
+    }
+}
+
+// the md5 sums of the files in the store, by inode
+typedef map<pair<dev_t, ino_t>, string> StoreHashes;
+
+static StoreHashes read_store_hashes(const string &store)
+{
+    StoreHashes hashes;
+    DIR *dir = opendir(store.c_str());
+
+    if (!dir) {
+        return hashes;
+    }
+
+    while (struct dirent *ent = readdir(dir)) {
+        string name = ent->d_name;
+        struct stat st;
+
+        if (name.size() == 36 && valid_store_hash(name.substr(0, 32))
+                && !lstat((store + "/" + name).c_str(), &st) && S_ISREG(st.st_mode)) {
+            hashes[make_pair(st.st_dev, st.st_ino)] = name.substr(0, 32);
+        }
+    }
+
+    closedir(dir);
+    return hashes;
+}
+
+/* Lists what is below PATH in the environment ROOT like a client does
+   (see EnvFilesMsg), with a file to read for each md5 sum in CONTENTS.
+   Files that came from the store have their sum in the name there.  */
+static bool list_env_dir(const string &root, const string &path, const StoreHashes &hashes,
+                         EnvFilesMsg &msg, map<string, string> &contents)
+{
+    DIR *dir = opendir((path.empty() ? root : root + "/" + path).c_str());
+
+    if (!dir) {
+        return false;
+    }
+
+    bool ok = true;
+
+    while (ok) {
+        struct dirent *ent = readdir(dir);
+
+        if (!ent) {
+            break;
+        }
+
+        string name = ent->d_name;
+
+        // the daemon's tmp directory is not part of it
+        if (name == "." || name == ".." || (path.empty() && name == "tmp")) {
+            continue;
+        }
+
+        string rel = path.empty() ? name : path + "/" + name;
+        string full = root + "/" + rel;
+        struct stat st;
+
+        if (lstat(full.c_str(), &st)) {
+            ok = false;
+            break;
+        }
+
+        char mode[16];
+        sprintf(mode, "%o", (unsigned int)(st.st_mode & 07777));
+
+        if (S_ISDIR(st.st_mode)) {
+            msg.dirs.push_back(string(mode) + " " + rel);
+            ok = list_env_dir(root, rel, hashes, msg, contents);
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(full.c_str(), target, sizeof(target));
+
+            if (len <= 0) {
+                ok = false;
+                break;
+            }
+
+            msg.links.push_back(rel);
+            msg.link_targets.push_back(string(target, len));
+        } else if (S_ISREG(st.st_mode)) {
+            StoreHashes::const_iterator it = hashes.find(make_pair(st.st_dev, st.st_ino));
+            string hash = it != hashes.end() ? it->second : md5_file(full);
+
+            if (hash.empty()) {
+                ok = false;
+                break;
+            }
+
+            msg.files.push_back(hash + " " + toString(st.st_size) + " " + mode + " " + rel);
+            contents.insert(make_pair(hash, full));
+        } else {
+            log_error() << "can't send " << full << " of an environment" << endl;
+            ok = false;
+        }
+    }
+
+    closedir(dir);
+    return ok;
+}
+
+// the contents of the files at PATHS, one after the other
+class EnvFilesSource : public ChunkSource
+{
+public:
+    explicit EnvFilesSource(const vector<string> &paths)
+        : m_paths(paths)
+        , m_next(0)
+        , m_fd(-1) {}
+
+    virtual ~EnvFilesSource()
+    {
+        if (m_fd >= 0) {
+            close_fd(m_fd);
+        }
+    }
+
+    virtual ssize_t read(unsigned char *buf, size_t len)
+    {
+        for (;;) {
+            if (m_fd < 0) {
+                if (m_next == m_paths.size()) {
+                    return 0;
+                }
+
+                m_fd = open(m_paths[m_next++].c_str(), O_RDONLY | O_LARGEFILE);
+
+                if (m_fd < 0) {
+                    return -1;
+                }
+            }
+
+            ssize_t bytes = ::read(m_fd, buf, len);
+
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (bytes != 0) {
+                return bytes;
+            }
+
+            close_fd(m_fd);
+            m_fd = -1;
+        }
+    }
+
+private:
+    vector<string> m_paths;
+    size_t m_next;
+    int m_fd;
+};
+
+bool send_environment(MsgChannel *c, const string &basedir, const string &env)
+{
+    EnvFilesMsg files;
+    map<string, string> contents;
+
+    if (!list_env_dir(basedir + "/target=" + env, string(),
+                      read_store_hashes(store_dir(basedir)), files, contents)
+            || files.files.empty()) {
+        log_error() << "can't list the files of environment " << env << endl;
+        c->send_msg(EndMsg());
+        return false;
+    }
+
+    if (!c->send_msg(files)) {
+        return false;
+    }
+
+    Msg *msg = c->get_msg(60);
+
+    if (!msg || msg->type != M_ENV_NEED) {
+        delete msg;
+        return false;
+    }
+
+    const list<string> &hashes = static_cast<EnvNeedMsg *>(msg)->hashes;
+    vector<string> paths;
+
+    for (list<string>::const_iterator it = hashes.begin(); it != hashes.end(); ++it) {
+        map<string, string>::const_iterator file = contents.find(*it);
+
+        if (file == contents.end()) {
+            log_error() << "asked for " << *it << ", which environment " << env
+                        << " doesn't have" << endl;
+            delete msg;
+            return false;
+        }
+
+        paths.push_back(file->second);
+    }
+
+    delete msg;
+
+    EnvFilesSource source(paths);
+    ChunkSender sender(c);
+
+    if (sender.send(source) != ChunkSender::SENT || !c->send_msg(EndMsg())) {
+        log_info() << "sending environment " << env << " failed" << endl;
+        return false;
+    }
+
+    trace() << "sent " << paths.size() << " of " << contents.size() << " files of environment "
+            << env << ", " << sender.uncompressed() << " bytes" << endl;
+    return true;
+}
+
+// how much of the files in MSG the store still lacks, -1 if MSG is invalid
+static off_t store_lacks(const string &basedir, const EnvFilesMsg &msg)
+{
+    StoreList list;
+
+    if (!parse_store_list(msg, list)) {
+        return -1;
+    }
+
+    string store = store_dir(basedir);
+    set<string> seen;
+    off_t need_bytes = 0;
+
+    for (vector<StoreFile>::const_iterator it = list.files.begin(); it != list.files.end(); ++it) {
+        if (seen.insert(it->hash).second && !in_store(store, *it)) {
+            need_bytes += it->size;
+        }
+    }
+
+    return need_bytes;
+}
+
+/* Gets the environment TARGET/NAME from the daemon PEER ("host:port")
+   like from a client that sends a list of files, and installs it, unless
+   it needs more than MAX_BYTES (if not 0).  Returns its size, 0 if that
+   didn't work out.  */
+static size_t fetch_from_peer(const string &peer, const string &basedir, const string &target,
+                              const string &name, uid_t user_uid, gid_t user_gid,
+                              int extract_priority, size_t max_bytes)
+{
+    size_t colon = peer.rfind(':');
+
+    if (colon == string::npos) {
         return 0;
     }
 
-    // else
+    MsgChannel *c = Service::createChannel(peer.substr(0, colon),
+                                           atoi(peer.c_str() + colon + 1), 10);
 
-    char **argv;
-    argv = new char*[5];
-    argv[0] = strdup("/bin/rm");
-    argv[1] = strdup("-rf");
-    argv[2] = strdup("--");
-    argv[3] = strdup(dirname.c_str());
-    argv[4] = NULL;
+    if (!c) {
+        log_info() << "could not connect to " << peer << " for environment " << name << endl;
+        return 0;
+    }
 
-    execv(argv[0], argv);
-    log_perror("execv failed");
-    _exit(-1);
+    Msg *msg = 0;
+
+    if (IS_PROTOCOL_46(c) && c->send_msg(GetEnvMsg(target, name))) {
+        msg = c->get_msg(60);
+    }
+
+    if (!msg || msg->type != M_ENV_FILES) {
+        log_info() << peer << " didn't send environment " << name << endl;
+        delete msg;
+        delete c;
+        return 0;
+    }
+
+    if (max_bytes) {
+        off_t need_bytes = store_lacks(basedir, *static_cast<EnvFilesMsg *>(msg));
+
+        if (need_bytes < 0 || size_t(need_bytes) > max_bytes) {
+            log_info() << "environment " << name << " needs " << (need_bytes >> 20)
+                       << " MB, more than the " << (max_bytes >> 20) << " MB left" << endl;
+            delete msg;
+            delete c;
+            return 0;
+        }
+    }
+
+    int pipe_to_stdin = -1;
+    pid_t pid = start_install_environment(basedir, target, name, c, msg, pipe_to_stdin,
+                                          user_uid, user_gid, extract_priority);
+    delete msg;
+
+    if (pid <= 0) {
+        delete c;
+        return 0;
+    }
+
+    while ((msg = c->get_msg(60)) && msg->type == M_FILE_CHUNK) {
+        FileChunkMsg *chunk = static_cast<FileChunkMsg *>(msg);
+        bool written = write_full(pipe_to_stdin, chunk->buffer, chunk->len);
+        delete msg;
+        msg = 0;
+
+        if (!written) {
+            log_perror("write to transfer env pipe failed");
+            break;
+        }
+    }
+
+    bool complete = msg && msg->type == M_END;
+    delete msg;
+    delete c;
+    close_fd(pipe_to_stdin);
+
+    string env = target + "/" + name;
+    size_t installed_size = finalize_install_environment(basedir, env, pid, user_uid, user_gid);
+
+    if (installed_size && !complete) {
+        remove_environment(basedir, env);
+        installed_size = 0;
+    }
+
+    trace() << (installed_size ? "fetched" : "failed to fetch") << " environment " << env
+            << " from " << peer << endl;
+    return installed_size;
+}
+
+int start_fetch_environment(const string &basedir, const string &target, const string &name,
+                            const list<string> &peers, uid_t user_uid, gid_t user_gid,
+                            int extract_priority, size_t max_bytes)
+{
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        log_perror("pipe failed");
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("fork - trying to fetch environment");
+        close_fd(fds[0]);
+        close_fd(fds[1]);
+        return 0;
+    }
+
+    if (pid) {
+        close_fd(fds[1]);
+        return fds[0];
+    }
+
+    close_fd(fds[0]);
+    size_t installed_size = 0;
+
+    for (list<string>::const_iterator it = peers.begin();
+            it != peers.end() && !installed_size; ++it) {
+        installed_size = fetch_from_peer(*it, basedir, target, name, user_uid, user_gid,
+                                         extract_priority, max_bytes);
+    }
+
+    write_full(fds[1], &installed_size, sizeof(installed_size));
+    _exit(installed_size ? 0 : 1);
+}
+
+size_t finish_fetch_environment(int pipe)
+{
+    size_t installed_size = 0;
+    ssize_t len;
+
+    while ((len = read(pipe, &installed_size, sizeof(installed_size))) < 0 && errno == EINTR) {}
+
+    close_fd(pipe);
+    return len == sizeof(installed_size) ? installed_size : 0;
 }
 
 size_t remove_native_environment(const string &env)
@@ -25,11 +25,30 @@
 
 #include <comm.h>
 #include <list>
+#include <map>
 #include <string>
+#include <time.h>
 #include <unistd.h>
 
 class MsgChannel;
-extern bool cleanup_cache(const std::string &basedir, uid_t user_uid, gid_t user_gid);
+
+/* An environment installed in BASEDIR/target=<target>/<name>, listed in
+   BASEDIR/manifest so it survives restarts.  The checksum covers the
+   names, sizes and times of all its files, which is enough to notice
+   damage without reading all of them.  */
+struct InstalledEnv {
+    size_t size;
+    time_t last_use;
+    std::string checksum;
+};
+typedef std::map<std::string, InstalledEnv> InstalledEnvs;   // by <target>/<name>
+
+/* Removes everything in BASEDIR but the environments of the manifest
+   that are still intact, which are returned in KEPT.  */
+extern bool cleanup_cache(const std::string &basedir, uid_t user_uid, gid_t user_gid,
+                          InstalledEnvs &kept);
+extern std::string environment_checksum(const std::string &basedir, const std::string &env);
+extern bool write_env_manifest(const std::string &basedir, const InstalledEnvs &envs);
 extern int start_create_env(const std::string &basedir,
                             uid_t user_uid, gid_t user_gid,
                             const std::string &compiler, const std::list<std::string> &extrafiles);
@@ -37,15 +56,39 @@ extern size_t finish_create_env(int pipe, const std::string &basedir, std::strin
 Environments available_environmnents(const std::string &basename);
 extern void save_compiler_timestamps(time_t &gcc_bin_timestamp, time_t &gpp_bin_timestamp, time_t &clang_bin_timestamp);
 bool compilers_uptodate(time_t gcc_bin_timestamp, time_t gpp_bin_timestamp, time_t clang_bin_timestamp);
+/* Starts installing an environment, with MSG the first message of the
+   transfer.  A tarball is extracted by tar, MSG is its first chunk then.
+   For a list of files (M_ENV_FILES), the contents are taken from the
+   store.  The caller relays what follows to PIPE_TO_CHILD.  */
 extern pid_t start_install_environment(const std::string &basename,
                                        const std::string &target,
                                        const std::string &name,
-                                       MsgChannel *c, int& pipe_to_child,
-                                       FileChunkMsg*& fmsg,
+                                       MsgChannel *c, Msg *msg, int &pipe_to_child,
                                        uid_t user_uid, gid_t user_gid, int extract_priority);
 extern size_t finalize_install_environment(const std::string &basename, const std::string &target,
         pid_t pid, uid_t user_uid, gid_t user_gid);
-extern size_t remove_environment(const std::string &basedir, const std::string &env);
+/* Moves the environment ENV out of the way, so all that takes is a
+   rename, and starts a child that removes its files.  Returns the pid of
+   that, or 0 if the environment is gone already.  */
+extern pid_t remove_environment(const std::string &basedir, const std::string &env);
+// the size of the files in DIR, with the ones from the store in parts
+extern size_t sumup_dir(const std::string &dir);
+/* Removes what no environment uses anymore from the store of environment
+   files.  Not while environments are installed, they may be about to use
+   what is there.  */
+extern void gc_env_store(const std::string &basedir);
+/* Another daemon asked for the installed environment ENV (M_GET_ENV):
+   sends the list of its files and then the contents it lacks.  */
+extern bool send_environment(MsgChannel *c, const std::string &basedir, const std::string &env);
+/* Starts a child that fetches TARGET/NAME from the first of PEERS that
+   has it, if that takes at most MAX_BYTES more (0 for any).  Returns a
+   pipe to pass to finish_fetch_environment() once it is readable, or 0.  */
+extern int start_fetch_environment(const std::string &basedir, const std::string &target,
+                                   const std::string &name, const std::list<std::string> &peers,
+                                   uid_t user_uid, gid_t user_gid, int extract_priority,
+                                   size_t max_bytes);
+// the size of the fetched environment, 0 if none of the peers had it
+extern size_t finish_fetch_environment(int pipe);
 extern size_t remove_native_environment(const std::string &env);
 extern void chdir_to_environment(MsgChannel *c, const std::string &dirname, uid_t user_uid, gid_t user_gid);
 extern bool verify_env(MsgChannel *c, const std::string &basedir, const std::string &target,
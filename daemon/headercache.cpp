@@ -0,0 +1,598 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+
+#include "config.h"
+#include "headercache.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <comm.h>
+
+#include "exitcode.h"
+#include "fileio.h"
+#include "file_util.h"
+#include "logging.h"
+#include "workit.h"
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+using namespace std;
+
+// how often the daemon looks through all of the cache
+static const time_t SCAN_INTERVAL = 300;
+// what is left of unfinished files of crashed children after this long
+static const time_t STALE_TMP_AGE = 3600;
+// files used again are only marked as such if they weren't for this long
+static const time_t TOUCH_INTERVAL = 60;
+
+HeaderCache::HeaderCache()
+    : m_limit(0)
+    , m_size(0)
+    , m_files(0)
+    , m_next_scan(0)
+{
+}
+
+bool HeaderCache::setup(const string &dir, size_t limit, uid_t uid, gid_t gid)
+{
+    m_dir = dir;
+    m_limit = limit;
+
+    if (!limit) {
+        return true;
+    }
+
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+        log_perror("mkdir of the header cache failed") << "\t" << dir << endl;
+        m_limit = 0;
+        return false;
+    }
+
+    // the children add the files after they dropped their privileges
+    if (chown(dir.c_str(), uid, gid)) {
+        log_perror("chown of the header cache failed") << "\t" << dir << endl;
+        m_limit = 0;
+        return false;
+    }
+
+    return true;
+}
+
+struct CachedHeader {
+    time_t used;
+    off_t size;
+    string name;
+
+    bool operator<(const CachedHeader &other) const
+    {
+        return used < other.used;
+    }
+};
+
+void HeaderCache::scan(time_t now)
+{
+    int dir_fd = header_cache_open(m_dir);
+
+    if (dir_fd < 0) {
+        return;
+    }
+
+    DIR *dir = fdopendir(dup(dir_fd));
+
+    if (!dir) {
+        log_perror("opendir of the header cache failed") << "\t" << m_dir << endl;
+        close_fd(dir_fd);
+        return;
+    }
+
+    vector<CachedHeader> files;
+    size_t size = 0;
+
+    for (struct dirent *ent = readdir(dir); ent; ent = readdir(dir)) {
+        string name = ent->d_name;
+        struct stat st;
+
+        if (name[0] == '.' || fstatat(dir_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW)
+                || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if (name.compare(0, 4, "tmp.") == 0) {
+            if (st.st_mtime + STALE_TMP_AGE < now) {
+                unlinkat(dir_fd, name.c_str(), 0);
+            }
+
+            continue;
+        }
+
+        CachedHeader h;
+        h.used = st.st_mtime;
+        h.size = st.st_size;
+        h.name = name;
+        files.push_back(h);
+        size += st.st_size;
+    }
+
+    closedir(dir);
+
+    size_t removed = 0;
+
+    if (size > m_limit) {
+        // the oldest go until there's some room again
+        sort(files.begin(), files.end());
+
+        while (removed < files.size() && size > m_limit / 10 * 8) {
+            if (unlinkat(dir_fd, files[removed].name.c_str(), 0) && errno != ENOENT) {
+                log_perror("removing from the header cache failed") << "\t"
+                        << files[removed].name << endl;
+            }
+
+            size -= files[removed].size;
+            ++removed;
+        }
+
+        trace() << "header cache: removed " << removed << " of " << files.size()
+                << " files" << endl;
+    }
+
+    close_fd(dir_fd);
+    m_size = size;
+    m_files = files.size() - removed;
+}
+
+void HeaderCache::maintain(time_t now)
+{
+    if (!enabled() || now < m_next_scan) {
+        return;
+    }
+
+    m_next_scan = now + SCAN_INTERVAL;
+    scan(now);
+}
+
+string HeaderCache::dump() const
+{
+    if (!enabled()) {
+        return string();
+    }
+
+    return "  Header cache: " + toString(m_files) + " files, " + toString(m_size)
+           + " bytes (limit " + toString(m_limit) + ")\n";
+}
+
+int header_cache_open(const string &dir)
+{
+    if (dir.empty()) {
+        return -1;
+    }
+
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0) {
+        log_perror("open of the header cache failed") << "\t" << dir << endl;
+    }
+
+    return fd;
+}
+
+struct PumpFile {
+    string hash;
+    off_t size;
+    string path;
+};
+
+static bool valid_hash(const string &hash)
+{
+    if (hash.size() != 32) {
+        return false;
+    }
+
+    for (size_t i = 0; i < hash.size(); ++i) {
+        if (!isxdigit(hash[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// absolute and without "." or ".." anywhere, so it stays below the job's root
+static bool valid_path(const string &path)
+{
+    if (path.empty() || path[0] != '/') {
+        return false;
+    }
+
+    size_t start = 1;
+
+    while (start <= path.size()) {
+        size_t end = path.find('/', start);
+
+        if (end == string::npos) {
+            end = path.size();
+        }
+
+        string part = path.substr(start, end - start);
+
+        if (part.empty() || part == "." || part == "..") {
+            return false;
+        }
+
+        start = end + 1;
+    }
+
+    return true;
+}
+
+static bool parse_files(const list<string> &entries, vector<PumpFile> &files)
+{
+    for (list<string>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        PumpFile f;
+        size_t space = it->find(' ');
+        size_t space2 = space == string::npos ? space : it->find(' ', space + 1);
+
+        if (space2 == string::npos) {
+            return false;
+        }
+
+        f.hash = it->substr(0, space);
+        f.size = strtoll(it->c_str() + space + 1, 0, 10);
+        f.path = it->substr(space2 + 1);
+
+        if (!valid_hash(f.hash) || f.size < 0 || !valid_path(f.path)) {
+            return false;
+        }
+
+        files.push_back(f);
+    }
+
+    return !files.empty();
+}
+
+/* Makes TMP the file HASH, if its contents really have that md5 sum, as
+   STATE got them, and SIZE.  Otherwise the client is broken or lying,
+   and what it sent must not get into the cache.  */
+static void finish_file(int dir_fd, int fd, const string &tmp, const string &hash, off_t size,
+                        md5_state_t &state)
+{
+    struct stat st;
+    bool ok = !fstat(fd, &st) && st.st_size == size && md5_hex(state) == hash;
+    fchmod(fd, 0444);
+    close_fd(fd);
+
+    if (!ok) {
+        log_error() << "header contents don't match " << hash << endl;
+        unlinkat(dir_fd, tmp.c_str(), 0);
+        throw myexception(EXIT_PROTOCOL_ERROR);
+    }
+
+    if (renameat(dir_fd, tmp.c_str(), dir_fd, hash.c_str())) {
+        log_perror("rename in the header cache failed") << "\t" << hash << endl;
+        throw myexception(EXIT_IO_ERROR);
+    }
+}
+
+/* Opens TMP for the next of HASHES that has contents, or returns -1 if
+   there is none.  The empty ones before it are complete right away.  */
+static int next_file(int dir_fd, const string &tmp, const list<string> &hashes,
+                     list<string>::const_iterator &next, map<string, off_t> &sizes,
+                     off_t &left, md5_state_t &state)
+{
+    while (next != hashes.end()) {
+        unlinkat(dir_fd, tmp.c_str(), 0);
+        int fd = openat(dir_fd, tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0644);
+
+        if (fd < 0) {
+            log_perror("open in the header cache failed") << "\t" << tmp << endl;
+            throw myexception(EXIT_IO_ERROR);
+        }
+
+        left = sizes[*next];
+        md5_init(&state);
+
+        if (left) {
+            return fd;
+        }
+
+        finish_file(dir_fd, fd, tmp, *next, 0, state);
+        ++next;
+    }
+
+    return -1;
+}
+
+/* Takes the contents of HASHES in that order from the client and adds
+   them to DIR_FD.  */
+static void receive_contents(int dir_fd, MsgChannel *client, const list<string> &hashes,
+                             map<string, off_t> &sizes, unsigned int job_stat[])
+{
+    string tmp = "tmp." + toString(getpid());
+    list<string>::const_iterator next = hashes.begin();
+    off_t left = 0;
+    struct timeval starttv;
+    gettimeofday(&starttv, 0);
+    md5_state_t state;
+    int fd = next_file(dir_fd, tmp, hashes, next, sizes, left, state);
+
+    for (;;) {
+        Msg *msg = client->get_msg(60);
+
+        if (msg && msg->type == M_END && fd < 0) {
+            delete msg;
+            break;
+        }
+
+        try {
+            if (!msg || msg->type != M_FILE_CHUNK) {
+                log_error() << "protocol error while reading the headers" << endl;
+                throw myexception(EXIT_PROTOCOL_ERROR);
+            }
+
+            FileChunkMsg *fcmsg = static_cast<FileChunkMsg *>(msg);
+            job_stat[JobStatistics::in_uncompressed] += fcmsg->len;
+            job_stat[JobStatistics::in_compressed] += fcmsg->compressed;
+            const unsigned char *data = fcmsg->buffer;
+            size_t len = fcmsg->len;
+
+            while (len) {
+                if (fd < 0) {
+                    log_error() << "more headers than asked for" << endl;
+                    throw myexception(EXIT_PROTOCOL_ERROR);
+                }
+
+                size_t part = min(off_t(len), left);
+
+                if (!write_full(fd, data, part)) {
+                    log_perror("write into the header cache failed");
+                    throw myexception(EXIT_IO_ERROR);
+                }
+
+                md5_append(&state, data, part);
+                data += part;
+                len -= part;
+                left -= part;
+
+                if (!left) {
+                    int done = fd;
+                    fd = -1;
+                    finish_file(dir_fd, done, tmp, *next, sizes[*next], state);
+                    ++next;
+                    fd = next_file(dir_fd, tmp, hashes, next, sizes, left, state);
+                }
+            }
+        } catch (...) {
+            delete msg;
+
+            if (fd >= 0) {
+                close_fd(fd);
+                unlinkat(dir_fd, tmp.c_str(), 0);
+            }
+
+            throw;
+        }
+
+        delete msg;
+    }
+
+    struct timeval endtv;
+    gettimeofday(&endtv, 0);
+    job_stat[JobStatistics::in_msec] = (endtv.tv_sec - starttv.tv_sec) * 1000
+                                       + (endtv.tv_usec - starttv.tv_usec) / 1000;
+}
+
+// links NAME of DIR_FD to PATH, or copies it if that's not possible
+static bool place_file(int dir_fd, const string &name, const string &path)
+{
+    if (!linkat(dir_fd, name.c_str(), AT_FDCWD, path.c_str(), 0) || errno == EEXIST) {
+        return true;
+    }
+
+    int in = openat(dir_fd, name.c_str(), O_RDONLY | O_LARGEFILE);
+
+    if (in < 0) {
+        return false;
+    }
+
+    int out = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0444);
+
+    if (out < 0) {
+        close_fd(in);
+        return false;
+    }
+
+    char buf[65536];
+    ssize_t len;
+    bool ok = true;
+
+    while (ok && (len = read(in, buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+
+        ok = write(out, buf, len) == len;
+    }
+
+    close_fd(in);
+    close_fd(out);
+    return ok;
+}
+
+static string in_root(const string &root, const string &path)
+{
+    return (!path.empty() && path[0] == '/') ? root + path : path;
+}
+
+bool header_cache_receive(int dir_fd, MsgChannel *client, CompileJob &job, const string &root,
+                          const string &dep_file, unsigned int job_stat[])
+{
+    Msg *msg = client->get_msg(60);
+
+    if (!msg || msg->type != M_PUMP_FILES) {
+        log_error() << "protocol error while reading the files of the job" << endl;
+        delete msg;
+        throw myexception(EXIT_PROTOCOL_ERROR);
+    }
+
+    PumpFilesMsg *fmsg = static_cast<PumpFilesMsg *>(msg);
+    vector<PumpFile> files;
+    bool own_dir = dir_fd < 0;
+
+    try {
+        if (!parse_files(fmsg->files, files)) {
+            log_error() << "invalid list of files for the job" << endl;
+            throw myexception(EXIT_PROTOCOL_ERROR);
+        }
+
+        // without a cache they are only kept for this job
+        if (own_dir) {
+            string dir = root + "/.icecc-headers";
+
+            if (mkdir(dir.c_str(), 0700) || (dir_fd = header_cache_open(dir)) < 0) {
+                log_perror("mkdir failed") << "\t" << dir << endl;
+                throw myexception(EXIT_IO_ERROR);
+            }
+        }
+
+        PumpNeedMsg need;
+        map<string, off_t> sizes;
+        time_t now = time(0);
+
+        for (vector<PumpFile>::const_iterator it = files.begin(); it != files.end(); ++it) {
+            if (sizes.count(it->hash)) {
+                continue;
+            }
+
+            sizes[it->hash] = it->size;
+            struct stat st;
+
+            if (fstatat(dir_fd, it->hash.c_str(), &st, 0) || st.st_size != it->size) {
+                need.hashes.push_back(it->hash);
+            } else if (st.st_mtime + TOUCH_INTERVAL < now) {
+                // the time of the last use, for the eviction
+                utimensat(dir_fd, it->hash.c_str(), 0, 0);
+            }
+        }
+
+        trace() << "job " << job.jobID() << " has " << files.size() << " files, "
+                << need.hashes.size() << " of them are new" << endl;
+
+        if (!client->send_msg(need)) {
+            log_info() << "write of needed headers failed" << endl;
+            throw myexception(EXIT_DISTCC_FAILED);
+        }
+
+        receive_contents(dir_fd, client, need.hashes, sizes, job_stat);
+
+        for (vector<PumpFile>::const_iterator it = files.begin(); it != files.end(); ++it) {
+            string path = root + it->path;
+
+            if (!mkpath(path.substr(0, path.find_last_of('/')))
+                    || !place_file(dir_fd, it->hash, path)) {
+                log_perror("placing a file of the job failed") << "\t" << path << endl;
+                throw myexception(EXIT_IO_ERROR);
+            }
+        }
+    } catch (...) {
+        if (own_dir && dir_fd >= 0) {
+            close_fd(dir_fd);
+        }
+
+        delete msg;
+        throw;
+    }
+
+    if (own_dir) {
+        close_fd(dir_fd);
+    }
+
+    // the compiler searches the same directories, but below ROOT
+    job.appendFlag("-nostdinc", Arg_Local);
+
+    for (list<string>::const_iterator it = fmsg->quote_dirs.begin();
+            it != fmsg->quote_dirs.end(); ++it) {
+        job.appendFlag("-iquote", Arg_Local);
+        job.appendFlag(in_root(root, *it), Arg_Local);
+    }
+
+    for (list<string>::const_iterator it = fmsg->user_dirs.begin();
+            it != fmsg->user_dirs.end(); ++it) {
+        job.appendFlag("-I", Arg_Local);
+        job.appendFlag(in_root(root, *it), Arg_Local);
+    }
+
+    for (list<string>::const_iterator it = fmsg->system_dirs.begin();
+            it != fmsg->system_dirs.end(); ++it) {
+        job.appendFlag("-isystem", Arg_Local);
+        job.appendFlag(in_root(root, *it), Arg_Local);
+    }
+
+    bool deps = false;
+
+    for (list<string>::const_iterator it = fmsg->cpp_flags.begin();
+            it != fmsg->cpp_flags.end(); ++it) {
+        if (*it == "-MF") {
+            // it's ours to choose
+            if (++it == fmsg->cpp_flags.end()) {
+                break;
+            }
+
+            continue;
+        }
+
+        job.appendFlag(*it, Arg_Local);
+
+        if (*it == "-MD" || *it == "-MMD") {
+            deps = true;
+        } else if (*it == "-include" || *it == "-imacros") {
+            if (++it == fmsg->cpp_flags.end()) {
+                break;
+            }
+
+            job.appendFlag(in_root(root, *it), Arg_Local);
+        }
+    }
+
+    if (deps) {
+        job.appendFlag("-MF", Arg_Local);
+        job.appendFlag(dep_file, Arg_Local);
+    }
+
+    job.setInputFile(in_root(root, job.inputFile()));
+    delete msg;
+    return deps;
+}
@@ -0,0 +1,83 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_HEADERCACHE_H
+#define ICECREAM_HEADERCACHE_H
+
+#include <string>
+#include <sys/types.h>
+#include <time.h>
+
+class CompileJob;
+class MsgChannel;
+
+/* The files of jobs that are preprocessed here (M_PUMP_FILES), by their
+   md5 sum, so a client sends every header only once.  The children
+   started by handle_connection() add to it and link the files into the
+   directory of their job, the daemon only keeps the size in bounds.  */
+class HeaderCache
+{
+public:
+    HeaderCache();
+
+    // LIMIT 0 disables the cache, the children run as UID:GID
+    bool setup(const std::string &dir, size_t limit, uid_t uid, gid_t gid);
+
+    bool enabled() const
+    {
+        return m_limit > 0;
+    }
+
+    // empty if disabled
+    std::string dir() const
+    {
+        return enabled() ? m_dir : std::string();
+    }
+
+    // evicts the least recently used files once in a while
+    void maintain(time_t now);
+
+    std::string dump() const;
+
+private:
+    void scan(time_t now);
+
+    std::string m_dir;
+    size_t m_limit;
+    size_t m_size;
+    size_t m_files;
+    time_t m_next_scan;
+};
+
+/* The children's side, DIR_FD is the cache directory (opened before the
+   chroot), or -1 to keep the files of this job only.  Reads the
+   M_PUMP_FILES of JOB, asks for the contents that are missing, and lays
+   all of it out under ROOT as on the client.  The flags to preprocess
+   with that are added to JOB.  Returns true if the compiler also writes
+   the dependencies, into DEP_FILE then.  */
+extern int header_cache_open(const std::string &dir);
+extern bool header_cache_receive(int dir_fd, MsgChannel *client, CompileJob &job,
+                                 const std::string &root, const std::string &dep_file,
+                                 unsigned int job_stat[]);
+
+#endif
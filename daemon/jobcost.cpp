@@ -0,0 +1,233 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+#include "jobcost.h"
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "job.h"
+
+using namespace std;
+
+// the weight of older samples decays by this with every new one
+static const double FIT_DECAY = 0.97;
+// the (weighted) number of samples a fit needs to be trusted
+static const double MIN_SAMPLES = 4;
+// the number of files with their own times
+static const size_t MAX_HISTORY = 20000;
+// without local times, one in this many of the smaller jobs is compiled here
+static const unsigned int EXPLORE_EVERY = 16;
+
+static const char *const kind_names[] = { "plain", "-g", "-O", "-g -O" };
+
+void JobCosts::Fit::add(double x, double y)
+{
+    n = n * FIT_DECAY + 1;
+    sx = sx * FIT_DECAY + x;
+    sy = sy * FIT_DECAY + y;
+    sxx = sxx * FIT_DECAY + x * x;
+    sxy = sxy * FIT_DECAY + x * y;
+}
+
+bool JobCosts::Fit::line(double &intercept, double &slope) const
+{
+    if (n < MIN_SAMPLES) {
+        return false;
+    }
+
+    double mx = sx / n;
+    double my = sy / n;
+    double var = sxx / n - mx * mx;
+
+    slope = 0;
+
+    // all the same size, or bigger files faster, which is noise
+    if (var > 1) {
+        slope = max(0.0, (sxy / n - mx * my) / var);
+    }
+
+    intercept = my - slope * mx;
+    return true;
+}
+
+bool JobCosts::Fit::predict(double x, double &y) const
+{
+    double intercept, slope;
+
+    if (!line(intercept, slope)) {
+        return false;
+    }
+
+    y = max(0.0, intercept + slope * x);
+    return true;
+}
+
+JobCosts::JobCosts()
+    : m_explore(0)
+    , m_decided_local(0)
+    , m_decided_remote(0)
+{
+}
+
+int JobCosts::kind(unsigned int arg_flags)
+{
+    int k = 0;
+
+    if (arg_flags & (CompileJob::Flag_g | CompileJob::Flag_g3)) {
+        k |= 1;
+    }
+
+    if (arg_flags & (CompileJob::Flag_O | CompileJob::Flag_O2 | CompileJob::Flag_Ol2)) {
+        k |= 2;
+    }
+
+    return k;
+}
+
+bool JobCosts::prefer_local(const string &file, unsigned int arg_flags, uint32_t size,
+                            string &reason)
+{
+    if (!size) {
+        reason = "no size";
+        return false;
+    }
+
+    int k = kind(arg_flags);
+    map<string, History>::const_iterator h = m_history.find(file);
+    bool known_local = h != m_history.end() && h->second.local_msec;
+    bool known_remote = h != m_history.end() && h->second.remote_msec;
+    double local_msec = known_local ? h->second.local_msec : 0;
+    double remote_msec = known_remote ? h->second.remote_msec : 0;
+    bool have_local = known_local || m_fits[1][k].predict(size, local_msec);
+    bool have_remote = known_remote || m_fits[0][k].predict(size, remote_msec);
+
+    ostringstream os;
+    os << kind_names[k] << ", " << size << " bytes";
+
+    if (!have_remote) {
+        reason = os.str() + ", no remote times yet";
+        return false;
+    }
+
+    os << ", remote " << int(remote_msec) << " ms" << (known_remote ? " (this file)" : "");
+
+    if (!have_local) {
+        const Fit &remote = m_fits[0][k];
+
+        // not twice the size of the average remote job
+        if (size * remote.n <= 2 * remote.sx && ++m_explore % EXPLORE_EVERY == 0) {
+            reason = os.str() + ", trying locally to learn";
+            ++m_decided_local;
+            return true;
+        }
+
+        reason = os.str() + ", no local times yet";
+        return false;
+    }
+
+    os << ", local " << int(local_msec) << " ms" << (known_local ? " (this file)" : "");
+    reason = os.str();
+
+    if (local_msec < remote_msec) {
+        ++m_decided_local;
+        return true;
+    }
+
+    ++m_decided_remote;
+    return false;
+}
+
+void JobCosts::record(const string &file, unsigned int arg_flags, uint32_t size,
+                      bool preprocessed, bool local, unsigned int msec, time_t now)
+{
+    if (!size) {
+        return;
+    }
+
+    m_fits[local ? 1 : 0][kind(arg_flags)].add(size, msec);
+
+    History &h = m_history[file];
+    unsigned int &last = local ? h.local_msec : h.remote_msec;
+    // a bit of smoothing, the same job doesn't always take the same time
+    last = last ? (last + msec) / 2 : max(msec, 1U);
+    h.last_use = now;
+
+    if (preprocessed) {
+        h.size = size;
+    }
+
+    if (m_history.size() > MAX_HISTORY) {
+        expire();
+    }
+}
+
+uint32_t JobCosts::preprocessed_size(const string &file) const
+{
+    map<string, History>::const_iterator h = m_history.find(file);
+    return h == m_history.end() ? 0 : h->second.size;
+}
+
+// forgets the older half of the files
+void JobCosts::expire()
+{
+    vector<time_t> uses;
+    uses.reserve(m_history.size());
+
+    for (map<string, History>::const_iterator it = m_history.begin(); it != m_history.end(); ++it) {
+        uses.push_back(it->second.last_use);
+    }
+
+    nth_element(uses.begin(), uses.begin() + uses.size() / 2, uses.end());
+    time_t median = uses[uses.size() / 2];
+
+    for (map<string, History>::iterator it = m_history.begin(); it != m_history.end();) {
+        if (it->second.last_use <= median) {
+            m_history.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+string JobCosts::dump() const
+{
+    ostringstream os;
+    os << "  Job costs: " << m_decided_local << " jobs kept here, " << m_decided_remote
+       << " sent away, " << m_history.size() << " files known\n";
+
+    for (int k = 0; k < 4; ++k) {
+        for (int local = 1; local >= 0; --local) {
+            double intercept, slope;
+
+            if (m_fits[local][k].line(intercept, slope)) {
+                os << "    " << kind_names[k] << (local ? " local: " : " remote: ")
+                   << int(intercept) << " ms + " << slope * 1024 << " ms/KiB\n";
+            }
+        }
+    }
+
+    return os.str();
+}
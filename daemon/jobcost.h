@@ -0,0 +1,101 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_JOBCOST_H
+#define ICECREAM_JOBCOST_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <time.h>
+
+/* What the compile jobs of our clients cost, to compile the small ones
+   right here instead of paying the round trip to a compile server.
+
+   For both ways there is a linear fit of the time over the size of the
+   preprocessed source per kind of job (with or without -g and -O), fed
+   with the jobs our clients compiled themselves and with the time from
+   asking for a compile server until the end of remote jobs.  Files seen
+   before use their own last times instead.  Jobs of a kind that hardly
+   ever ran locally are compiled here once in a while, to learn about
+   them.
+
+   The client usually knows the preprocessed size only after asking, so
+   the one of the last time is used for a file.  For files never seen
+   that is the size of the source file, which says less about the cost
+   but is better than nothing.  */
+class JobCosts
+{
+public:
+    JobCosts();
+
+    /* Whether the job of FILE (GetCSMsg::filename, which has the flags)
+       should be compiled locally.  REASON says why, for the log.  */
+    bool prefer_local(const std::string &file, unsigned int arg_flags, uint32_t size,
+                      std::string &reason);
+
+    /* A job took MSEC, compiled locally or by a compile server.  If
+       PREPROCESSED, SIZE is the preprocessed size and kept for FILE.  */
+    void record(const std::string &file, unsigned int arg_flags, uint32_t size,
+                bool preprocessed, bool local, unsigned int msec, time_t now);
+
+    // the preprocessed size of FILE the last time, 0 if unknown
+    uint32_t preprocessed_size(const std::string &file) const;
+
+    std::string dump() const;
+
+private:
+    // least squares with exponentially decaying weights
+    struct Fit {
+        Fit()
+            : n(0), sx(0), sy(0), sxx(0), sxy(0) {}
+
+        void add(double x, double y);
+        // y = INTERCEPT + SLOPE * x, false while there are too few samples
+        bool line(double &intercept, double &slope) const;
+        bool predict(double x, double &y) const;
+
+        double n, sx, sy, sxx, sxy;
+    };
+
+    struct History {
+        History()
+            : local_msec(0), remote_msec(0), size(0), last_use(0) {}
+
+        unsigned int local_msec;    // 0 if unknown
+        unsigned int remote_msec;
+        uint32_t size;              // preprocessed, 0 if unknown
+        time_t last_use;
+    };
+
+    static int kind(unsigned int arg_flags);
+    void expire();
+
+    Fit m_fits[2][4];       // by remote or local, then kind()
+    std::map<std::string, History> m_history;
+    unsigned int m_explore;
+    unsigned int m_decided_local;
+    unsigned int m_decided_remote;
+};
+
+#endif
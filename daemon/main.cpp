@@ -85,11 +85,14 @@
 #endif
 
 #include <deque>
+#include <list>
 #include <map>
 #include <algorithm>
 #include <set>
 #include <fstream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "ncpus.h"
 #include "exitcode.h"
@@ -100,10 +103,18 @@
 #include "load.h"
 #include "environment.h"
 #include "platform.h"
+#include "reactor.h"
+#include "connpool.h"
+#include "mux.h"
+#include "headercache.h"
+#include "objcache.h"
+#include "jobcost.h"
 #include "util.h"
 
 static std::string pidFilePath;
 static volatile sig_atomic_t exit_main_loop = 0;
+// how often the last use of the environments is written to their manifest
+static const time_t ENV_MANIFEST_INTERVAL = 300;
 
 #ifndef __attribute_warn_unused_result__
 #define __attribute_warn_unused_result__
@@ -128,11 +139,12 @@ public:
      * CLIENTWORK: Client is busy working and we reserve the spot (job_id is set if it's a scheduler job)
      * WAITFORCHILD: Client is waiting for the compile job to finish.
      * WAITCREATEENV: We're waiting for icecc-create-env to finish.
+     * WAITFETCHENV: We're getting the environment from other daemons for the client.
      */
     enum Status { UNKNOWN, GOTNATIVE, PENDING_USE_CS, JOBDONE, LINKJOB, TOINSTALL, TOCOMPILE,
                   WAITFORCS, WAITCOMPILE, CLIENTWORK, WAITFORCHILD, WAITCREATEENV,
-                  LASTSTATE = WAITCREATEENV
-                } status;
+                  WAITFETCHENV, LASTSTATE = WAITFETCHENV
+                } status; // only change it with Clients::set_status()
     Client() {
         job_id = 0;
         channel = 0;
@@ -142,6 +154,13 @@ public:
         status = UNKNOWN;
         pipe_to_child = -1;
         child_pid = -1;
+        prev_in_status = 0;
+        next_in_status = 0;
+        cost_flags = 0;
+        cost_size = 0;
+        cost_preprocessed = false;
+        cost_start.tv_sec = cost_start.tv_usec = 0;
+        cost_local = false;
     }
 
     static string status_str(Status status) {
@@ -170,6 +189,8 @@ public:
             return "waitforchild";
         case WAITCREATEENV:
             return "waitcreateenv";
+        case WAITFETCHENV:
+            return "waitfetchenv";
         }
 
         assert(false);
@@ -201,6 +222,20 @@ public:
     int pipe_to_child; // pipe to child process, only valid if WAITFORCHILD or TOINSTALL
     pid_t child_pid;
     string pending_create_env; // only for WAITCREATEENV
+    string pending_fetch_env; // only for WAITFETCHENV
+    // where the environment of TOINSTALL goes, it starts with the next message
+    string env_target;
+    string env_name;
+    // the job of M_GET_CS, for JobCosts (cost_size is 0 if there is none)
+    string cost_file;
+    unsigned int cost_flags;
+    uint32_t cost_size;
+    bool cost_preprocessed; // cost_size is the preprocessed size of this time
+    struct timeval cost_start;
+    bool cost_local; // we told the client to compile it itself
+    // the queue of the current status in Clients, don't touch
+    Client *prev_in_status;
+    Client *next_in_status;
 
     string dump() const {
         string ret = status_str(status) + " " + channel->dump();
@@ -214,6 +249,8 @@ public:
             return ret + " CID: " + toString(client_id) + " PID: " + toString(child_pid) + " PFD: " + toString(pipe_to_child);
         case WAITCREATEENV:
             return ret + " " + toString(client_id) + " " + pending_create_env;
+        case WAITFETCHENV:
+            return ret + " " + toString(client_id) + " " + pending_fetch_env;
         default:
 
             if (job_id) {
@@ -233,21 +270,100 @@ public:
     }
 };
 
+/* All clients, by channel.  Besides the map they are indexed by client id,
+   by the descriptors the daemon polls for them and by the pid of their
+   child, and they are queued in FIFO order per status, so none of the
+   lookups needs to walk all clients.  */
 class Clients : public map<MsgChannel*, Client*>
 {
 public:
     Clients() {
         active_processes = 0;
+        reactor = 0;
+
+        for (int i = 0; i <= Client::LASTSTATE; ++i) {
+            queue_head[i] = queue_tail[i] = 0;
+            queue_size[i] = 0;
+        }
     }
     unsigned int active_processes;
+    // gets the channels and child pipes of the clients, if set
+    Reactor *reactor;
+    // clients with messages already read from their channel
+    list<int> pending;
 
-    Client *find_by_client_id(int id) const {
-        for (const_iterator it = begin(); it != end(); ++it)
-            if (it->second->client_id == id) {
-                return it->second;
+    void add(Client *client) {
+        (*this)[client->channel] = client;
+        by_id[client->client_id] = client;
+        link(client);
+        watch(client, client->channel->fd, true);
+    }
+
+    bool remove(Client *client) {
+        if (!erase(client->channel)) {
+            return false;
+        }
+
+        unlink(client);
+        by_id.erase(client->client_id);
+        unwatch(client->channel->fd);
+
+        if (client->child_pid > 0) {
+            by_pid.erase(client->child_pid);
+        }
+
+        if (client->status == Client::WAITFORCHILD) {
+            unwatch(client->pipe_to_child);
+        }
+
+        return true;
+    }
+
+    /* Moves CLIENT to the end of the queue of STATUS.  The daemon doesn't
+       read the channel while the child compiles, so it's not polled then.  */
+    void set_status(Client *client, Client::Status status) {
+        bool was_busy = busy(client->status);
+        unlink(client);
+        client->status = status;
+        link(client);
+
+        if (reactor && was_busy != busy(status)) {
+            reactor->set_interest(client->channel->fd, !busy(status));
+
+            // the reactor only knows about what is still in the socket
+            if (!busy(status) && client->channel->has_msg()) {
+                pending.push_back(client->channel->fd);
             }
+        }
+    }
 
-        return 0;
+    // the compile child of a WAITFORCHILD client reports back on PIPE
+    void set_child(Client *client, pid_t pid, int pipe) {
+        set_child_pid(client, pid);
+        client->pipe_to_child = pipe;
+        watch(client, pipe, false);
+    }
+
+    void set_child_pid(Client *client, pid_t pid) {
+        if (client->child_pid > 0) {
+            by_pid.erase(client->child_pid);
+        }
+
+        client->child_pid = pid;
+
+        if (pid > 0) {
+            by_pid[pid] = client;
+        }
+    }
+
+    // stop polling the pipe, before it gets closed
+    void unwatch_child(Client *client) {
+        unwatch(client->pipe_to_child);
+    }
+
+    Client *find_by_client_id(int id) const {
+        unordered_map<int, Client *>::const_iterator it = by_id.find(id);
+        return it == by_id.end() ? 0 : it->second;
     }
 
     Client *find_by_channel(MsgChannel *c) const {
@@ -260,13 +376,15 @@ public:
         return it->second;
     }
 
-    Client *find_by_pid(pid_t pid) const {
-        for (const_iterator it = begin(); it != end(); ++it)
-            if (it->second->child_pid == pid) {
-                return it->second;
-            }
+    // the client owning FD, either its channel or the pipe to its child
+    Client *find_by_fd(int fd) const {
+        unordered_map<int, Client *>::const_iterator it = by_fd.find(fd);
+        return it == by_fd.end() ? 0 : it->second;
+    }
 
-        return 0;
+    Client *find_by_pid(pid_t pid) const {
+        unordered_map<pid_t, Client *>::const_iterator it = by_pid.find(pid);
+        return it == by_pid.end() ? 0 : it->second;
     }
 
     Client *first() {
@@ -281,16 +399,8 @@ public:
     }
 
     string dump_status(Client::Status s) const {
-        int count = 0;
-
-        for (const_iterator it = begin(); it != end(); ++it) {
-            if (it->second->status == s) {
-                count++;
-            }
-        }
-
-        if (count) {
-            return toString(count) + " " + Client::status_str(s) + ", ";
+        if (queue_size[s]) {
+            return toString(queue_size[s]) + " " + Client::status_str(s) + ", ";
         }
 
         return string();
@@ -306,20 +416,79 @@ public:
 
         return s;
     }
+
+    // the client that is longest in status S, walk on with next_in_status
     Client *get_earliest_client(Client::Status s) const {
-        // TODO: possibly speed this up in adding some sorted lists
-        Client *client = 0;
-        int min_client_id = 0;
-
-        for (const_iterator it = begin(); it != end(); ++it) {
-            if (it->second->status == s && (!min_client_id || min_client_id > it->second->client_id)) {
-                client = it->second;
-                min_client_id = client->client_id;
-            }
+        return queue_head[s];
+    }
+
+private:
+    static bool busy(Client::Status status) {
+        return status == Client::TOCOMPILE || status == Client::WAITFORCHILD;
+    }
+
+    void link(Client *client) {
+        Client::Status s = client->status;
+        client->prev_in_status = queue_tail[s];
+        client->next_in_status = 0;
+
+        if (queue_tail[s]) {
+            queue_tail[s]->next_in_status = client;
+        } else {
+            queue_head[s] = client;
+        }
+
+        queue_tail[s] = client;
+        queue_size[s]++;
+    }
+
+    void unlink(Client *client) {
+        Client::Status s = client->status;
+
+        if (client->prev_in_status) {
+            client->prev_in_status->next_in_status = client->next_in_status;
+        } else {
+            queue_head[s] = client->next_in_status;
+        }
+
+        if (client->next_in_status) {
+            client->next_in_status->prev_in_status = client->prev_in_status;
+        } else {
+            queue_tail[s] = client->prev_in_status;
+        }
+
+        client->prev_in_status = client->next_in_status = 0;
+        queue_size[s]--;
+    }
+
+    void watch(Client *client, int fd, bool edge_triggered) {
+        if (fd < 0) {
+            return;
         }
 
-        return client;
+        by_fd[fd] = client;
+
+        if (reactor) {
+            reactor->add(fd, edge_triggered);
+        }
     }
+
+    void unwatch(int fd) {
+        if (fd < 0 || !by_fd.erase(fd)) {
+            return;
+        }
+
+        if (reactor) {
+            reactor->remove(fd);
+        }
+    }
+
+    Client *queue_head[Client::LASTSTATE + 1];
+    Client *queue_tail[Client::LASTSTATE + 1];
+    unsigned int queue_size[Client::LASTSTATE + 1];
+    unordered_map<int, Client *> by_id;
+    unordered_map<int, Client *> by_fd;
+    unordered_map<pid_t, Client *> by_pid;
 };
 
 static int set_new_pgrp(void)
@@ -412,7 +581,9 @@ void usage(const char *reason = 0)
     }
 
     cerr << "usage: iceccd [-n <netname>] [-m <max_processes>] [--no-remote] [-w] [-d|--daemonize] [-l logfile] [-s <schedulerhost[:port]>]"
-        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [-N <node_name>]" << endl;
+        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [--object-cache <MB>]"
+        " [--header-cache <MB>]"
+        " [-N <node_name>]" << endl;
     exit(1);
 }
 
@@ -421,6 +592,8 @@ int mem_limit = 100;
 unsigned int max_kids = 0;
 
 size_t cache_size_limit = 100 * 1024 * 1024;
+size_t object_cache_limit = 256 * 1024 * 1024;
+size_t header_cache_limit = 256 * 1024 * 1024;
 
 struct NativeEnvironment {
     string name; // the hash
@@ -434,13 +607,40 @@ struct NativeEnvironment {
 };
 
 struct Daemon {
+    Reactor reactor;
+    // warm connections to the compile servers, handed out with M_USE_CS
+    ConnectionPool pool;
+    // connections from other daemons carrying the streams of their jobs
+    list<MuxConnection *> muxes;
+    MuxDescriptors mux_fds;
+    // jobs the scheduler placed ahead for our clients, with when they expire
+    list<pair<time_t, CSLeaseMsg *> > leases;
+    // results of earlier jobs, for clients sending the same job again
+    ObjectCache objects;
+    // headers of the jobs preprocessed here, so clients send them only once
+    HeaderCache headers;
+    // what the jobs of our clients cost here and remotely
+    JobCosts job_costs;
     Clients clients;
     map<string, time_t> envs_last_use;
+    // the environments installed in envbasedir, as written to its manifest
+    InstalledEnvs installed_envs;
+    time_t env_manifest_saved;
+    // an environment was removed, what it had in the store may be unused now
+    bool env_store_gc_pending;
+    // the children removing the files of environments, see remove_environment()
+    set<pid_t> env_removals;
+    // environments other daemons send us, with the pipe of the child getting them
+    map<string, int> env_fetches;
+    // the one of them the scheduler wants installed ahead of demand
+    string preinstall_env;
     // Map of native environments, the basic one(s) containing just the compiler
     // and possibly more containing additional files (such as compiler plugins).
     // The key is the compiler name and a concatenated list of the additional files
     // (or just the compiler name for the basic ones).
     map<string, NativeEnvironment> native_environments;
+    // where local clients look up the native environments, next to the socket
+    string native_table;
     string envbasedir;
     uid_t user_uid;
     gid_t user_gid;
@@ -452,7 +652,7 @@ struct Daemon {
     bool noremote;
     bool custom_nodename;
     size_t cache_size;
-    map<int, MsgChannel *> fd2chan;
+    unsigned int env_space;   // MB, as last reported to the scheduler
     int new_client_id;
     string remote_name;
     string extra_remote_name;
@@ -472,7 +672,8 @@ struct Daemon {
     int max_scheduler_ping;
     unsigned int current_kids;
 
-    Daemon() {
+    Daemon()
+        : pool(reactor) {
         warn_icecc_user_errno = 0;
         if (getuid() == 0) {
             struct passwd *pw = getpwnam("icecc");
@@ -496,6 +697,7 @@ struct Daemon {
         new_client_id = 0;
         next_scheduler_connect = 0;
         cache_size = 0;
+        env_space = 0;
         noremote = false;
         custom_nodename = false;
         icecream_load = 0;
@@ -509,27 +711,53 @@ struct Daemon {
         max_scheduler_pong = MAX_SCHEDULER_PONG;
         max_scheduler_ping = MAX_SCHEDULER_PING;
         current_kids = 0;
+        env_manifest_saved = 0;
+        env_store_gc_pending = false;
+        clients.reactor = &reactor;
     }
 
     ~Daemon() {
         delete discover;
+
+        for (list<MuxConnection *>::iterator it = muxes.begin(); it != muxes.end(); ++it) {
+            delete *it;
+        }
+
+        drop_leases();
     }
 
     bool reannounce_environments() __attribute_warn_unused_result__;
     int answer_client_requests();
     bool handle_transfer_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
+    bool start_transfer_env(Client *client, Msg *msg);
     bool handle_transfer_env_done(Client *client);
+    bool env_install_done(const string &env, size_t installed_size);
+    bool handle_fetch_env(Client *client, EnvFetchMsg *msg) __attribute_warn_unused_result__;
+    bool finish_fetch_env(Client *client, bool ok);
+    bool fetch_env_finished(string env);
+    int scheduler_fetch_env(EnvFetchMsg *msg);
+    bool handle_get_env(Client *client, GetEnvMsg *msg);
     bool handle_get_native_env(Client *client, GetNativeEnvMsg *msg) __attribute_warn_unused_result__;
     bool finish_get_native_env(Client *client, string env_key);
     void handle_old_request();
     bool handle_compile_file(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_activity(Client *client) __attribute_warn_unused_result__;
+    void handle_client_input(Client *client);
     bool handle_file_chunk_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
     void handle_end(Client *client, int exitcode);
     int scheduler_get_internals() __attribute_warn_unused_result__;
     void clear_children();
+    void reap_env_removals();
     int scheduler_use_cs(UseCSMsg *msg) __attribute_warn_unused_result__;
     bool handle_get_cs(Client *client, Msg *msg) __attribute_warn_unused_result__;
+    int scheduler_cs_lease(CSLeaseMsg *msg);
+    bool use_lease(GetCSMsg *msg) __attribute_warn_unused_result__;
+    bool keep_local(Client *client, GetCSMsg *msg);
+    bool handle_input_size(Client *client, InputSizeMsg *msg) __attribute_warn_unused_result__;
+    void return_leases(time_t now);
+    void drop_leases();
+    bool handle_mux_start(Client *client, MuxStartMsg *msg) __attribute_warn_unused_result__;
+    bool handle_mux_input(int fd, bool writable);
     bool handle_local_job(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_job_done(Client *cl, JobDoneMsg *m) __attribute_warn_unused_result__;
     bool handle_compile_done(Client *client) __attribute_warn_unused_result__;
@@ -545,7 +773,10 @@ struct Daemon {
     bool reconnect();
     int working_loop();
     bool setup_listen_fds();
+    void save_native_table();
     void check_cache_size(const string &new_env);
+    size_t env_room() const;
+    void save_env_manifest();
     bool create_env_finished(string env_key);
 };
 
@@ -595,6 +826,7 @@ bool Daemon::setup_listen_fds()
         }
 
         fcntl(tcp_listen_fd, F_SETFD, FD_CLOEXEC);
+        reactor.add(tcp_listen_fd, false);
     }
 
     if ((unix_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
@@ -676,10 +908,66 @@ bool Daemon::setup_listen_fds()
     }
 
     fcntl(unix_listen_fd, F_SETFD, FD_CLOEXEC);
+    reactor.add(unix_listen_fd, false);
+
+    native_table = string(myaddr.sun_path) + ".native";
+    save_native_table();
 
     return true;
 }
 
+/* Writes the native environments that are ready to NATIVE_TABLE, so the
+   clients find them without asking with GetNativeEnvMsg.  Along with
+   every one go the timestamps it was built for, which the clients
+   check like handle_get_native_env() does.  */
+void Daemon::save_native_table()
+{
+    if (native_table.empty()) {
+        return;
+    }
+
+    string text = "icecc native 1\n";
+
+    for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
+            it != native_environments.end(); ++it) {
+        const NativeEnvironment &env = it->second;
+
+        if (env.name.empty() || env.create_env_pipe) {
+            continue;
+        }
+
+        text += "key " + it->first + "\n";
+        text += "compilers " + toString(env.gcc_bin_timestamp) + " "
+                + toString(env.gpp_bin_timestamp) + " " + toString(env.clang_bin_timestamp) + "\n";
+
+        for (map<string, time_t>::const_iterator it2 = env.extrafilestimes.begin();
+                it2 != env.extrafilestimes.end(); ++it2) {
+            text += "extra " + toString(it2->second) + " " + it2->first + "\n";
+        }
+
+        text += "env " + env.name + "\n";
+    }
+
+    string tmp = native_table + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        log_perror("open()") << "\t" << tmp << endl;
+        return;
+    }
+
+    bool ok = !fchmod(fd, 0644) && write(fd, text.data(), text.size()) == ssize_t(text.size());
+
+    if ((-1 == close(fd)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+
+    if (!ok || rename(tmp.c_str(), native_table.c_str())) {
+        log_perror("failed to write") << "\t" << native_table << endl;
+        unlink(tmp.c_str());
+    }
+}
+
 void Daemon::determine_system()
 {
     struct utsname uname_buf;
@@ -746,6 +1034,8 @@ void Daemon::close_scheduler()
         return;
     }
 
+    drop_leases();
+    preinstall_env.clear();
     delete scheduler;
     scheduler = 0;
     delete discover;
@@ -828,10 +1118,21 @@ bool Daemon::maybe_stats(bool send_ping)
         // Matz got in the urine that not all CPUs are always feed
         mem_limit = std::max(int(msg.freeMem / std::min(std::max(max_kids, 1U), 4U)), int(100U));
 
-        if (abs(int(msg.load) - current_load) >= 100 || send_ping) {
+        if (IS_PROTOCOL_42(scheduler)) {
+            msg.object_filter = objects.filter_update(now.tv_sec);
+        }
+
+        if (IS_PROTOCOL_47(scheduler)) {
+            msg.env_space = env_room() >> 20;
+        }
+
+        if (abs(int(msg.load) - current_load) >= 100 || send_ping || !msg.object_filter.empty()
+                || msg.env_space != env_space) {
             if (!send_scheduler(msg)) {
                 return false;
             }
+
+            env_space = msg.env_space;
         }
 
         icecream_load = 0;
@@ -848,10 +1149,6 @@ string Daemon::dump_internals() const
     result += "Node Name: " + nodename + "\n";
     result += "  Remote name: " + remote_name + " [" + extra_remote_name + "]\n";
 
-    for (map<int, MsgChannel *>::const_iterator it = fd2chan.begin(); it != fd2chan.end(); ++it)  {
-        result += "  fd2chan[" + toString(it->first) + "] = " + it->second->dump() + "\n";
-    }
-
     for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it)  {
         result += "  client " + toString(it->second->client_id) + ": " + it->second->dump() + "\n";
     }
@@ -877,7 +1174,23 @@ string Daemon::dump_internals() const
         result += "  envs_last_use[" + it->first  + "] = " + toString(it->second) + "\n";
     }
 
+    for (map<string, int>::const_iterator it = env_fetches.begin(); it != env_fetches.end(); ++it) {
+        result += "  fetching " + it->first + "\n";
+    }
+
     result += "  Current kids: " + toString(current_kids) + " (max: " + toString(max_kids) + ")\n";
+    result += pool.dump();
+    result += objects.dump();
+    result += job_costs.dump();
+    result += headers.dump();
+
+    if (!leases.empty()) {
+        result += "  Leases: " + toString(leases.size()) + "\n";
+    }
+
+    for (list<MuxConnection *>::const_iterator it = muxes.begin(); it != muxes.end(); ++it) {
+        result += "  " + (*it)->dump() + "\n";
+    }
 
     if (scheduler) {
         result += "  Scheduler protocol: " + toString(scheduler->protocol) + "\n";
@@ -923,17 +1236,40 @@ int Daemon::scheduler_use_cs(UseCSMsg *msg)
     if ((msg->hostname == remote_name || msg->hostname == extra_remote_name) && int(msg->port) == daemon_port) {
         c->usecsmsg = new UseCSMsg(msg->host_platform, "127.0.0.1", daemon_port, msg->job_id, true, 1,
                                    msg->matched_job_id);
-        c->status = Client::PENDING_USE_CS;
+        clients.set_status(c, Client::PENDING_USE_CS);
     } else {
         c->usecsmsg = new UseCSMsg(msg->host_platform, msg->hostname, msg->port,
                                    msg->job_id, true, 1, msg->matched_job_id);
+        pool.note_use(msg->hostname, msg->port, time(0));
+
+        int pooled_fd = -1;
+        int pooled_protocol = 0;
+        uint32_t pooled_codecs = 0;
+        bool pooled_stream = false;
+
+        if (IS_PROTOCOL_38(c->channel) && c->channel->can_pass_fds()
+                && pool.take(msg->hostname, msg->port, IS_PROTOCOL_39(c->channel), pooled_fd,
+                             pooled_protocol, pooled_codecs, pooled_stream)) {
+            trace() << "passing pooled " << (pooled_stream ? "stream" : "connection") << " to "
+                    << msg->hostname << " to client " << c->client_id << endl;
+            msg->pooled_protocol = pooled_protocol;
+            msg->pooled_codecs = pooled_codecs;
+            msg->pooled_stream = pooled_stream;
+        }
+
+        bool sent = pooled_fd >= 0 ? c->channel->send_msg_with_fd(*msg, pooled_fd)
+                    : c->channel->send_msg(*msg);
+
+        if (pooled_fd >= 0 && (-1 == close(pooled_fd)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
 
-        if (!c->channel->send_msg(*msg)) {
+        if (!sent) {
             handle_end(c, 143);
             return 0;
         }
 
-        c->status = Client::WAITCOMPILE;
+        clients.set_status(c, Client::WAITCOMPILE);
     }
 
     c->job_id = msg->job_id;
@@ -951,37 +1287,48 @@ bool Daemon::handle_transfer_env(Client *client, Msg *_msg)
     assert(client->pipe_to_child < 0);
 
     EnvTransferMsg *emsg = static_cast<EnvTransferMsg *>(_msg);
-    string target = emsg->target;
+    client->env_target = emsg->target;
 
-    if (target.empty()) {
-        target =  machine_name;
+    if (client->env_target.empty()) {
+        client->env_target = machine_name;
     }
 
+    client->env_name = emsg->name;
+    clients.set_status(client, Client::TOINSTALL);
+    client->outfile = emsg->target + "/" + emsg->name;
+
+    /* Waiting for the first message here would block everything else, and
+       for good if the client is on a stream of a connection this daemon
+       relays itself (MuxConnection).  */
+    return true;
+}
+
+/* The first message of an environment transfer came in, a chunk of the
+   tarball or the list of its files.  Takes MSG.  */
+bool Daemon::start_transfer_env(Client *client, Msg *msg)
+{
     int sock_to_stdin = -1;
-    FileChunkMsg *fmsg = 0;
 
-    pid_t pid = start_install_environment(envbasedir, target, emsg->name, client->channel,
-                                          sock_to_stdin, fmsg, user_uid, user_gid, nice_level);
+    pid_t pid = start_install_environment(envbasedir, client->env_target, client->env_name,
+                                          client->channel, msg, sock_to_stdin, user_uid,
+                                          user_gid, nice_level);
 
-    client->status = Client::TOINSTALL;
-    client->outfile = emsg->target + "/" + emsg->name;
     current_kids++;
 
     if (pid > 0) {
         log_error() << "got pid " << pid << endl;
         client->pipe_to_child = sock_to_stdin;
-        client->child_pid = pid;
+        clients.set_child_pid(client, pid);
 
-        if (!handle_file_chunk_env(client, fmsg)) {
-            pid = 0;
+        // on failure, it deleted MSG and ended the client
+        if (msg->type == M_FILE_CHUNK && !handle_file_chunk_env(client, msg)) {
+            return false;
         }
-    }
-
-    if (pid <= 0) {
+    } else {
         handle_transfer_env_done(client);
     }
 
-    delete fmsg;
+    delete msg;
     return pid > 0;
 }
 
@@ -1001,23 +1348,34 @@ bool Daemon::handle_transfer_env_done(Client *client)
         client->pipe_to_child = -1;
     }
 
-    client->status = Client::UNKNOWN;
+    clients.set_status(client, Client::UNKNOWN);
     string current = client->outfile;
     client->outfile.clear();
-    client->child_pid = -1;
+    clients.set_child_pid(client, -1);
     assert(current_kids > 0);
     current_kids--;
 
+    return env_install_done(current, installed_size);
+}
+
+// ENV was installed, with INSTALLED_SIZE, or that failed if it's 0
+bool Daemon::env_install_done(const string &env, size_t installed_size)
+{
     log_error() << "installed_size: " << installed_size << endl;
 
     if (installed_size) {
         cache_size += installed_size;
-        envs_last_use[current] = time(NULL);
-        log_error() << "installed " << current << " size: " << installed_size
+        envs_last_use[env] = time(NULL);
+        log_error() << "installed " << env << " size: " << installed_size
                     << " all: " << cache_size << endl;
+
+        InstalledEnv &installed = installed_envs[env];
+        installed.size = installed_size;
+        installed.checksum = environment_checksum(envbasedir, env);
+        save_env_manifest();
     }
 
-    check_cache_size(current);
+    check_cache_size(env);
 
     bool r = reannounce_environments(); // do that before the file compiles
 
@@ -1029,6 +1387,22 @@ bool Daemon::handle_transfer_env_done(Client *client)
     return r;
 }
 
+// what more environments may take, in the cache limit and on the disk
+size_t Daemon::env_room() const
+{
+    size_t room = cache_size < cache_size_limit ? cache_size_limit - cache_size : 0;
+
+#ifdef HAVE_SYS_VFS_H
+    struct statfs buf;
+
+    if (!statfs(envbasedir.c_str(), &buf)) {
+        room = min(room, size_t(buf.f_bavail) * buf.f_bsize);
+    }
+
+#endif
+    return room;
+}
+
 void Daemon::check_cache_size(const string &new_env)
 {
     time_t now = time(NULL);
@@ -1094,21 +1468,71 @@ void Daemon::check_cache_size(const string &new_env)
             break;
         }
 
-        size_t removed;
+        size_t removed = 0;
 
         if (!oldest_native_env_key.empty()) {
             removed = remove_native_environment(oldest);
             native_environments.erase(oldest_native_env_key);
             trace() << "removing " << oldest << " " << oldest_time << " " << removed << endl;
         } else {
-            removed = remove_environment(envbasedir, oldest);
-            trace() << "removing " << envbasedir << "/" << oldest << " " << oldest_time
-                    << " " << removed << endl;
+            // what it counted for when it was installed
+            InstalledEnvs::const_iterator installed = installed_envs.find(oldest);
+
+            if (installed != installed_envs.end()) {
+                removed = installed->second.size;
+            }
+
+            pid_t pid = remove_environment(envbasedir, oldest);
+
+            if (pid > 0) {
+                env_removals.insert(pid);
+            }
+
+            env_store_gc_pending = true;
+            trace() << "removing " << envbasedir << "/" << oldest << " " << oldest_time << endl;
         }
 
-        cache_size -= min(removed, cache_size);
         envs_last_use.erase(oldest);
+        cache_size -= min(cache_size, removed);
+
+        if (!oldest_native_env_key.empty()) {
+            save_native_table();
+        } else if (installed_envs.erase(oldest)) {
+            save_env_manifest();
+        }
+    }
+
+    if (!env_store_gc_pending) {
+        return;
+    }
+
+    // they may be about to link what would be removed
+    if (!env_fetches.empty()) {
+        return;
+    }
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it)  {
+        if (it->second->status == Client::TOINSTALL) {
+            return;
+        }
+    }
+
+    gc_env_store(envbasedir);
+    env_store_gc_pending = false;
+}
+
+/* Writes the manifest of the installed environments, with when they were
+   used last.  That changes with every job, so it's also written once in
+   a while, see ENV_MANIFEST_INTERVAL.  */
+void Daemon::save_env_manifest()
+{
+    for (InstalledEnvs::iterator it = installed_envs.begin(); it != installed_envs.end(); ++it) {
+        map<string, time_t>::const_iterator last_use = envs_last_use.find(it->first);
+        it->second.last_use = last_use != envs_last_use.end() ? last_use->second : 0;
     }
+
+    write_env_manifest(envbasedir, installed_envs);
+    env_manifest_saved = time(0);
 }
 
 bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
@@ -1143,19 +1567,21 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
             cache_size -= remove_native_environment(env.name);
             envs_last_use.erase(env.name);
             if (env.create_env_pipe) {
+                reactor.remove(env.create_env_pipe);
                 if ((-1 == close(env.create_env_pipe)) && (errno != EBADF)){
                     log_perror("close failed");
                 }
                 // TODO kill the still running icecc-create-env process?
             }
             native_environments.erase(env_key);   // invalidates 'env'
+            save_native_table();
         }
     }
 
     trace() << "get_native_env " << native_environments[env_key].name
             << " (" << env_key << ")" << endl;
 
-    client->status = Client::WAITCREATEENV;
+    clients.set_status(client, Client::WAITCREATEENV);
     client->pending_create_env = env_key;
 
     if (native_environments[env_key].name.length()) { // already available
@@ -1166,6 +1592,8 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
             env.extrafilestimes = extrafilestimes;
             trace() << "start_create_env " << env_key << endl;
             env.create_env_pipe = start_create_env(envbasedir, user_uid, user_gid, msg->compiler, msg->extrafiles);
+            if (env.create_env_pipe)
+                reactor.add(env.create_env_pipe, false);
         } else {
             trace() << "waiting for already running create_env " << env_key << endl;
         }
@@ -1185,7 +1613,7 @@ bool Daemon::finish_get_native_env(Client *client, string env_key)
     }
 
     envs_last_use[native_environments[env_key].name] = time(NULL);
-    client->status = Client::GOTNATIVE;
+    clients.set_status(client, Client::GOTNATIVE);
     client->pending_create_env.clear();
     return true;
 }
@@ -1197,6 +1625,7 @@ bool Daemon::create_env_finished(string env_key)
 
     trace() << "create_env_finished " << env_key << endl;
     assert(env.create_env_pipe);
+    reactor.remove(env.create_env_pipe);
     size_t installed_size = finish_create_env(env.create_env_pipe, envbasedir, env.name);
     env.create_env_pipe = 0;
 
@@ -1204,11 +1633,15 @@ bool Daemon::create_env_finished(string env_key)
     cache_size += installed_size;
     trace() << "cache_size = " << cache_size << endl;
 
+    Client *client, *next;
+
     if (!installed_size) {
-        for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it)  {
-            if (it->second->pending_create_env == env_key) {
-                it->second->channel->send_msg(EndMsg());
-                handle_end(it->second, 121);
+        for (client = clients.get_earliest_client(Client::WAITCREATEENV); client; client = next) {
+            next = client->next_in_status;
+
+            if (client->pending_create_env == env_key) {
+                client->channel->send_msg(EndMsg());
+                handle_end(client, 121);
             }
         }
         return false;
@@ -1217,21 +1650,175 @@ bool Daemon::create_env_finished(string env_key)
     save_compiler_timestamps(env.gcc_bin_timestamp, env.gpp_bin_timestamp, env.clang_bin_timestamp);
     envs_last_use[env.name] = time(NULL);
     check_cache_size(env.name);
+    save_native_table();
+
+    for (client = clients.get_earliest_client(Client::WAITCREATEENV); client; client = next) {
+        next = client->next_in_status;
+
+        if (client->pending_create_env == env_key)
+            finish_get_native_env(client, env_key);
+    }
+    return true;
+}
+
+/* The client lacks the environment here, but other daemons have it.  A
+   child gets it from them, and the client waits for that along with any
+   other that needs it meanwhile.  */
+bool Daemon::handle_fetch_env(Client *client, EnvFetchMsg *msg)
+{
+    string target = msg->target.empty() ? machine_name : msg->target;
+    string env = target + "/" + msg->name;
+
+    clients.set_status(client, Client::WAITFETCHENV);
+    client->pending_fetch_env = env;
+
+    if (installed_envs.count(env)) {   // another client was faster
+        return finish_fetch_env(client, true);
+    }
+
+    if (env_fetches.count(env)) {
+        trace() << "waiting for already running fetch of " << env << endl;
+        return true;
+    }
+
+    int pipe = start_fetch_environment(envbasedir, target, msg->name, msg->peers, user_uid,
+                                       user_gid, nice_level, 0);
+
+    if (!pipe) {
+        return finish_fetch_env(client, false);
+    }
+
+    trace() << "fetching " << env << " from " << msg->peers.size() << " peers" << endl;
+    env_fetches[env] = pipe;
+    reactor.add(pipe, false);
+    return true;
+}
+
+bool Daemon::finish_fetch_env(Client *client, bool ok)
+{
+    assert(client->status == Client::WAITFETCHENV);
+    clients.set_status(client, Client::UNKNOWN);
+    client->pending_fetch_env.clear();
 
-    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
-        if (it->second->pending_create_env == env_key)
-            finish_get_native_env(it->second, env_key);
+    // if not, the client sends it itself
+    if (!client->channel->send_msg(EnvFetchDoneMsg(ok))) {
+        handle_end(client, 138);
+        return false;
     }
+
     return true;
 }
 
+bool Daemon::fetch_env_finished(string env)
+{
+    map<string, int>::iterator it = env_fetches.find(env);
+    assert(it != env_fetches.end());
+    reactor.remove(it->second);
+    size_t installed_size = finish_fetch_environment(it->second);
+    env_fetches.erase(it);
+
+    trace() << "fetch_env_finished " << env << " " << installed_size << endl;
+    bool r = !installed_size || env_install_done(env, installed_size);
+
+    if (env == preinstall_env) {
+        preinstall_env.clear();
+
+        if (!send_scheduler(EnvFetchDoneMsg(installed_size != 0))) {
+            r = false;
+        }
+    }
+
+    Client *client, *next;
+
+    for (client = clients.get_earliest_client(Client::WAITFETCHENV); client; client = next) {
+        next = client->next_in_status;
+
+        if (client->pending_fetch_env == env) {
+            finish_fetch_env(client, installed_size != 0);
+        }
+    }
+
+    return r;
+}
+
+/* The scheduler wants us to have an environment the next jobs will need,
+   and names the daemons to get it from.  That happens like for a client
+   (see handle_fetch_env()), but only with what room is left, it's not
+   worth pushing out the environments in use.  */
+int Daemon::scheduler_fetch_env(EnvFetchMsg *msg)
+{
+    string target = msg->target.empty() ? machine_name : msg->target;
+    string env = target + "/" + msg->name;
+
+    if (installed_envs.count(env)) {
+        return send_scheduler(EnvFetchDoneMsg(true)) ? 0 : 1;
+    }
+
+    if (!preinstall_env.empty()) {
+        log_error() << "asked to pre-install " << env << " while at " << preinstall_env << endl;
+        return send_scheduler(EnvFetchDoneMsg(false)) ? 0 : 1;
+    }
+
+    if (!env_fetches.count(env)) {
+        size_t room = env_room();
+        int pipe = room ? start_fetch_environment(envbasedir, target, msg->name, msg->peers,
+                                                  user_uid, user_gid, nice_level, room) : 0;
+
+        if (!pipe) {
+            return send_scheduler(EnvFetchDoneMsg(false)) ? 0 : 1;
+        }
+
+        env_fetches[env] = pipe;
+        reactor.add(pipe, false);
+    }
+
+    log_info() << "pre-installing " << env << " from " << msg->peers.size() << " peers" << endl;
+    preinstall_env = env;
+    return 0;
+}
+
+/* Another daemon fetches an environment of ours.  A child sends it, the
+   client is done here then.  */
+bool Daemon::handle_get_env(Client *client, GetEnvMsg *msg)
+{
+    string env = msg->target + "/" + msg->name;
+
+    if (!installed_envs.count(env)) {
+        trace() << "asked for environment " << env << ", which we don't have" << endl;
+        client->channel->send_msg(EndMsg());
+        handle_end(client, 124);
+        return false;
+    }
+
+    // so it's not removed while it's sent, it's wanted after all
+    envs_last_use[env] = time(NULL);
+    trace() << "sending environment " << env << " to " << client->channel->name << endl;
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("fork - trying to send environment");
+        client->channel->send_msg(EndMsg());
+    } else if (pid == 0) {
+        if (-1 == nice(nice_level)) {
+            log_warning() << "failed to set nice value: " << strerror(errno) << endl;
+        }
+
+        _exit(send_environment(client->channel, envbasedir, env) ? 0 : 1);
+    }
+
+    handle_end(client, 119);
+    return false;
+}
+
 bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
 {
     if (cl->status == Client::CLIENTWORK) {
         clients.active_processes--;
     }
 
-    cl->status = Client::JOBDONE;
+    clients.set_status(cl, Client::JOBDONE);
     JobDoneMsg *msg = static_cast<JobDoneMsg *>(m);
     trace() << "handle_job_done " << msg->job_id << " " << msg->exitcode << endl;
 
@@ -1242,6 +1829,18 @@ bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
 
     assert(msg->job_id == cl->job_id);
     cl->job_id = 0; // the scheduler doesn't have it anymore
+
+    if (!m->is_from_server() && cl->cost_size && !msg->exitcode) {
+        trace() << "cost of " << cl->cost_file << ": compiled here in " << msg->real_msec
+                << " ms" << endl;
+        job_costs.record(cl->cost_file, cl->cost_flags, cl->cost_size, cl->cost_preprocessed,
+                         true, msg->real_msec, time(0));
+    }
+
+    if (cl->cost_local) {
+        return send_scheduler(JobLocalDoneMsg(cl->client_id));
+    }
+
     return send_scheduler(*msg);
 }
 
@@ -1258,7 +1857,7 @@ void Daemon::handle_old_request()
                 log_warning() << "can't send start message to client" << endl;
                 handle_end(client, 112);
             } else {
-                client->status = Client::CLIENTWORK;
+                clients.set_status(client, Client::CLIENTWORK);
                 clients.active_processes++;
                 trace() << "pushed local job " << client->client_id << endl;
 
@@ -1276,7 +1875,7 @@ void Daemon::handle_old_request()
             trace() << "pending " << client->dump() << endl;
 
             if (client->channel->send_msg(*client->usecsmsg)) {
-                client->status = Client::CLIENTWORK;
+                clients.set_status(client, Client::CLIENTWORK);
                 /* we make sure we reserve a spot and the rest is done if the
                  * client contacts as back with a Compile request */
                 clients.active_processes++;
@@ -1305,14 +1904,14 @@ void Daemon::handle_old_request()
 
             string envforjob = job->targetPlatform() + "/" + job->environmentVersion();
             envs_last_use[envforjob] = time(NULL);
-            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid);
+            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid,
+                                    objects.dir(), headers.dir());
             trace() << "handle connection returned " << pid << endl;
 
             if (pid > 0) {
                 current_kids++;
-                client->status = Client::WAITFORCHILD;
-                client->pipe_to_child = sock;
-                client->child_pid = pid;
+                clients.set_status(client, Client::WAITFORCHILD);
+                clients.set_child(client, pid, sock);
 
                 if (!send_scheduler(JobBeginMsg(job->jobID()))) {
                     log_info() << "failed sending scheduler about " << job->jobID() << endl;
@@ -1339,7 +1938,7 @@ bool Daemon::handle_compile_done(Client *client)
     assert(current_kids > 0);
     current_kids--;
 
-    unsigned int job_stat[8];
+    unsigned int job_stat[JobStatistics::num_job_stats];
     int end_status = 151;
 
     if (read(client->pipe_to_child, job_stat, sizeof(job_stat)) == sizeof(job_stat)) {
@@ -1351,9 +1950,19 @@ bool Daemon::handle_compile_done(Client *client)
         msg->user_msec = job_stat[JobStatistics::user_msec];
         msg->sys_msec = job_stat[JobStatistics::sys_msec];
         msg->pfaults = job_stat[JobStatistics::sys_pfaults];
+        msg->transfer_msec = job_stat[JobStatistics::in_msec];
+        msg->rtt_usec = job_stat[JobStatistics::rtt_usec];
         end_status = job_stat[JobStatistics::exit_code];
+
+        if (job_stat[JobStatistics::from_cache]) {
+            msg->flags |= JobDoneMsg::FROM_CACHE;
+            objects.note_hit();
+        } else if (job_stat[JobStatistics::to_cache]) {
+            objects.note_stored(client->job->cacheKey());
+        }
     }
 
+    clients.unwatch_child(client);
     close(client->pipe_to_child);
     client->pipe_to_child = -1;
     string envforjob = client->job->targetPlatform() + "/" + client->job->environmentVersion();
@@ -1375,6 +1984,15 @@ bool Daemon::handle_compile_file(Client *client, Msg *msg)
     if (client->status == Client::CLIENTWORK) {
         assert(job->environmentVersion() == "__client");
 
+        if (client->cost_local) {
+            if (!send_scheduler(JobLocalBeginMsg(client->client_id, job->outputFile()))) {
+                trace() << "can't reach scheduler to tell him about local job "
+                        << client->client_id << endl;
+            }
+
+            return true;
+        }
+
         if (!send_scheduler(JobBeginMsg(job->jobID()))) {
             trace() << "can't reach scheduler to tell him about compile file job "
                     << job->jobID() << endl;
@@ -1383,7 +2001,7 @@ bool Daemon::handle_compile_file(Client *client, Msg *msg)
 
         // no scheduler is not an error case!
     } else {
-        client->status = Client::TOCOMPILE;
+        clients.set_status(client, Client::TOCOMPILE);
     }
 
     return true;
@@ -1424,8 +2042,6 @@ void Daemon::handle_end(Client *client, int exitcode)
     trace() << "handle_end " << client->dump() << endl;
     trace() << dump_internals() << endl;
 #endif
-    fd2chan.erase(client->channel->fd);
-
     if (client->status == Client::TOINSTALL && client->pipe_to_child >= 0) {
         close(client->pipe_to_child);
         client->pipe_to_child = -1;
@@ -1439,11 +2055,22 @@ void Daemon::handle_end(Client *client, int exitcode)
     if (client->status == Client::WAITCOMPILE && exitcode == 119) {
         /* the client sent us a real good bye, so forget about the scheduler */
         client->job_id = 0;
+
+        if (client->cost_size) {
+            struct timeval now;
+            gettimeofday(&now, 0);
+            unsigned int msec = (now.tv_sec - client->cost_start.tv_sec) * 1000
+                                + (now.tv_usec - client->cost_start.tv_usec) / 1000;
+            trace() << "cost of " << client->cost_file << ": compiled remotely in " << msec
+                    << " ms" << endl;
+            job_costs.record(client->cost_file, client->cost_flags, client->cost_size,
+                             client->cost_preprocessed, false, msec, now.tv_sec);
+        }
     }
 
     /* Delete from the clients map before send_scheduler, which causes a
        double deletion. */
-    if (!clients.erase(client->channel)) {
+    if (!clients.remove(client)) {
         log_error() << "client can't be erased: " << client->channel << endl;
         flush_debug();
         log_error() << dump_internals() << endl;
@@ -1477,6 +2104,7 @@ void Daemon::handle_end(Client *client, int exitcode)
             case Client::LINKJOB:
             case Client::TOINSTALL:
             case Client::WAITCREATEENV:
+            case Client::WAITFETCHENV:
                 assert(false);   // should not have a job_id
                 break;
             case Client::WAITCOMPILE:
@@ -1518,39 +2146,215 @@ void Daemon::clear_children()
 
         while ((child = waitpid(-1, &status, 0)) < 0 && errno == EINTR) {}
 
+        if (child < 0) {
+            break;
+        }
+
+        // not one of the kids, see reap_env_removals()
+        if (env_removals.erase(child)) {
+            env_store_gc_pending = true;
+            continue;
+        }
+
         current_kids--;
     }
 
-    // they should be all in clients too
-    assert(fd2chan.empty());
-
-    fd2chan.clear();
     new_client_id = 0;
     trace() << "cleared children\n";
 }
 
+/* The processes removing evicted environments run in the background,
+   they don't count as kids.  */
+void Daemon::reap_env_removals()
+{
+    bool finished = false;
+
+    for (set<pid_t>::iterator it = env_removals.begin(); it != env_removals.end();) {
+        int status;
+        pid_t child;
+
+        while ((child = waitpid(*it, &status, WNOHANG)) < 0 && errno == EINTR) {}
+
+        if (child == 0) {
+            ++it;
+            continue;
+        }
+
+        // done, or reaped as a zombie already
+        env_removals.erase(it++);
+        finished = true;
+    }
+
+    // the store still had the files of the removed environments until now
+    if (finished) {
+        env_store_gc_pending = true;
+        check_cache_size(string());
+    }
+}
+
 bool Daemon::handle_get_cs(Client *client, Msg *msg)
 {
     GetCSMsg *umsg = dynamic_cast<GetCSMsg *>(msg);
     assert(client);
-    client->status = Client::WAITFORCS;
+    clients.set_status(client, Client::WAITFORCS);
     umsg->client_id = client->client_id;
     trace() << "handle_get_cs " << umsg->client_id << endl;
 
+    // clients that found a native environment in the table don't say so otherwise
+    for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
+            it != native_environments.end(); ++it) {
+        string version = it->second.name.substr(it->second.name.rfind('/') + 1);
+        version = version.substr(0, version.find('.'));
+
+        for (Environments::const_iterator it2 = umsg->versions.begin();
+                it2 != umsg->versions.end(); ++it2) {
+            if (!version.empty() && it2->second == version) {
+                envs_last_use[it->second.name] = time(NULL);
+            }
+        }
+    }
+
     if (!scheduler) {
         /* now the thing is this: if there is no scheduler
            there is no point in trying to ask him. So we just
            redefine this as local job */
         client->usecsmsg = new UseCSMsg(umsg->target, "127.0.0.1", daemon_port,
                                         umsg->client_id, true, 1, 0);
-        client->status = Client::PENDING_USE_CS;
+        clients.set_status(client, Client::PENDING_USE_CS);
         client->job_id = umsg->client_id;
         return true;
     }
 
+    client->cost_file = umsg->filename;
+    client->cost_flags = umsg->arg_flags;
+    /* The cost goes by the preprocessed size, from the client if its cpp
+       is done already, else from the last time of the file.  The size of
+       the source file is only the fallback for files never seen.
+       Results from a cache say nothing about the cost.  */
+    client->cost_size = 0;
+    client->cost_preprocessed = umsg->preprocessed_size != 0;
+    if (umsg->count == 1 && umsg->cache_key.empty()) {
+        client->cost_size = umsg->preprocessed_size;
+        if (!client->cost_size) {
+            client->cost_size = job_costs.preprocessed_size(umsg->filename);
+        }
+        if (!client->cost_size) {
+            client->cost_size = umsg->input_size;
+        }
+    }
+    gettimeofday(&client->cost_start, 0);
+
+    if (keep_local(client, umsg) || use_lease(umsg)) {
+        return true;
+    }
+
     return send_scheduler(*umsg);
 }
 
+// the client's cpp is done, what it produced is the better size for the cost
+bool Daemon::handle_input_size(Client *client, InputSizeMsg *msg)
+{
+    if (client->cost_size && msg->size) {
+        client->cost_size = msg->size;
+        client->cost_preprocessed = true;
+    }
+
+    return true;
+}
+
+/* Lets the client compile the job of MSG itself if that is cheaper than
+   the round trip to a compile server, and there is a free slot for it.
+   The scheduler hears of it as a local job.  */
+bool Daemon::keep_local(Client *client, GetCSMsg *msg)
+{
+    if (!client->cost_size || !msg->preferred_host.empty() || msg->target != machine_name
+            || current_kids + clients.active_processes >= std::max((unsigned int)1, max_kids)) {
+        return false;
+    }
+
+    string reason;
+    bool local = job_costs.prefer_local(msg->filename, msg->arg_flags, client->cost_size, reason);
+    trace() << "cost of " << msg->filename << ": " << reason
+            << (local ? ", compiling it here" : "") << endl;
+
+    if (!local) {
+        return false;
+    }
+
+    // port 0, so even test builds compile it themselves
+    client->usecsmsg = new UseCSMsg(msg->target, "127.0.0.1", 0, 0, true, 1, 0);
+    client->cost_local = true;
+    clients.set_status(client, Client::PENDING_USE_CS);
+    return true;
+}
+
+int Daemon::scheduler_cs_lease(CSLeaseMsg *msg)
+{
+    trace() << "got lease " << msg->job_id << " on " << msg->hostname << " for "
+            << msg->lifetime << "s" << endl;
+    leases.push_back(make_pair(time(0) + msg->lifetime, new CSLeaseMsg(*msg)));
+    return 0;
+}
+
+/* Answers MSG with a job the scheduler already placed, if there is one
+   that fits.  Returns false if MSG still has to go to the scheduler.  */
+bool Daemon::use_lease(GetCSMsg *msg)
+{
+    if (msg->count != 1 || !msg->preferred_host.empty()) {
+        return false;
+    }
+
+    time_t now = time(0);
+
+    for (list<pair<time_t, CSLeaseMsg *> >::iterator it = leases.begin(); it != leases.end(); ++it) {
+        CSLeaseMsg *lease = it->second;
+
+        if (it->first <= now || msg->minimal_host_version > int(lease->host_version)
+                || find(msg->versions.begin(), msg->versions.end(),
+                        make_pair(lease->host_platform, lease->version)) == msg->versions.end()) {
+            continue;
+        }
+
+        leases.erase(it);
+        trace() << "using lease " << lease->job_id << " for client " << msg->client_id << endl;
+
+        UseCSMsg usecs(lease->host_platform, lease->hostname, lease->port, lease->job_id,
+                       lease->got_env, msg->client_id, 0);
+        bool ok = send_scheduler(UseLeaseMsg(lease->job_id, msg->client_id, msg->filename))
+                  && !scheduler_use_cs(&usecs);
+        delete lease;
+        return ok;
+    }
+
+    return false;
+}
+
+// gives the leases back that our clients didn't need in time
+void Daemon::return_leases(time_t now)
+{
+    while (!leases.empty() && leases.front().first <= now) {
+        CSLeaseMsg *lease = leases.front().second;
+        leases.pop_front();
+        trace() << "returning lease " << lease->job_id << endl;
+
+        if (!send_scheduler(ReturnLeaseMsg(lease->job_id))) {
+            delete lease;
+            return;
+        }
+
+        delete lease;
+    }
+}
+
+void Daemon::drop_leases()
+{
+    for (list<pair<time_t, CSLeaseMsg *> >::iterator it = leases.begin(); it != leases.end(); ++it) {
+        delete it->second;
+    }
+
+    leases.clear();
+}
+
 int Daemon::handle_cs_conf(ConfCSMsg *msg)
 {
     max_scheduler_pong = msg->max_scheduler_pong;
@@ -1560,7 +2364,7 @@ int Daemon::handle_cs_conf(ConfCSMsg *msg)
 
 bool Daemon::handle_local_job(Client *client, Msg *msg)
 {
-    client->status = Client::LINKJOB;
+    clients.set_status(client, Client::LINKJOB);
     client->outfile = dynamic_cast<JobLocalBeginMsg *>(msg)->outfile;
     return true;
 }
@@ -1631,6 +2435,8 @@ bool Daemon::handle_activity(Client *client)
 
     if (client->status == Client::TOINSTALL && client->pipe_to_child >= 0) {
         ret = handle_file_chunk_env(client, msg);
+    } else if (client->status == Client::TOINSTALL && client->child_pid <= 0) {
+        return start_transfer_env(client, msg);
     }
 
     if (ret) {
@@ -1648,9 +2454,18 @@ bool Daemon::handle_activity(Client *client)
     case M_TRANFER_ENV:
         ret = handle_transfer_env(client, msg);
         break;
+    case M_ENV_FETCH:
+        ret = handle_fetch_env(client, static_cast<EnvFetchMsg *>(msg));
+        break;
+    case M_GET_ENV:
+        ret = handle_get_env(client, static_cast<GetEnvMsg *>(msg));
+        break;
     case M_GET_CS:
         ret = handle_get_cs(client, msg);
         break;
+    case M_INPUT_SIZE:
+        ret = handle_input_size(client, static_cast<InputSizeMsg *>(msg));
+        break;
     case M_END:
         handle_end(client, 119);
         ret = false;
@@ -1667,6 +2482,9 @@ bool Daemon::handle_activity(Client *client)
     case M_BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(client, msg);
         break;
+    case M_MUX_START:
+        ret = handle_mux_start(client, static_cast<MuxStartMsg *>(msg));
+        break;
     default:
         log_error() << "not compile: " << (char)msg->type << "protocol error on client "
                     << client->dump() << endl;
@@ -1679,119 +2497,201 @@ bool Daemon::handle_activity(Client *client)
     return ret;
 }
 
-int Daemon::answer_client_requests()
+bool Daemon::handle_mux_start(Client *client, MuxStartMsg *msg)
 {
-#ifdef ICECC_DEBUG
+    MsgChannel *c = client->channel;
 
-    if (clients.size() + current_kids) {
-        log_info() << dump_internals() << endl;
+    if (!IS_PROTOCOL_39(c) || c->can_pass_fds() || client->status != Client::UNKNOWN) {
+        log_error() << "unexpected mux start from " << client->dump() << endl;
+        handle_end(client, 120);
+        return false;
     }
 
-    log_info() << "clients " << clients.dump_per_status() << " " << current_kids
-               << " (" << max_kids << ")" << endl;
+    if (!c->send_msg(MuxStartMsg(MUX_WINDOW))) {
+        handle_end(client, 121);
+        return false;
+    }
 
-#endif
+    /* The other side sends frames only after our answer, so the channel
+       didn't read any of them.  */
+    int fd = dup(c->fd);
 
-    /* reap zombis */
-    int status;
+    if (fd < 0) {
+        log_perror("dup()");
+        handle_end(client, 121);
+        return false;
+    }
+
+    trace() << "multiplexing jobs from " << c->name << endl;
+    muxes.push_back(new MuxConnection(reactor, mux_fds, fd, false, msg->window));
+    handle_end(client, 123);
+    return false;
+}
 
-    while (waitpid(-1, &status, WNOHANG) < 0 && errno == EINTR) {}
+/* Passes FD to the multiplexed connection it belongs to, returns false
+   if there is none.  Streams opened by the other side become clients,
+   like accepted connections.  */
+bool Daemon::handle_mux_input(int fd, bool writable)
+{
+    MuxDescriptors::const_iterator it = mux_fds.find(fd);
 
-    handle_old_request();
+    if (it == mux_fds.end()) {
+        return false;
+    }
 
-    /* collect the stats after the children exited icecream_load */
-    if (scheduler) {
-        maybe_stats();
+    MuxConnection *mux = it->second;
+    vector<int> accepted;
+
+    if (writable) {
+        mux->handle_writable(fd);
+    } else {
+        mux->handle_readable(fd, accepted);
     }
 
-    fd_set listen_set;
-    struct timeval tv;
+    for (vector<int>::const_iterator a = accepted.begin(); a != accepted.end(); ++a) {
+        /* The setup can't be waited for here, it comes in through
+           this very loop.  */
+        MsgChannel *c = Service::createChannel(*a, mux->peer_addr(), mux->peer_addr_len(),
+                                               false);
 
-    FD_ZERO(&listen_set);
-    int max_fd = 0;
+        if (!c) {
+            continue;
+        }
 
-    if (tcp_listen_fd != -1) {
-        FD_SET(tcp_listen_fd, &listen_set);
-        max_fd = tcp_listen_fd;
-    }
+        trace() << "accepted stream " << c->fd << " " << c->name << endl;
+
+        Client *client = new Client;
+        client->client_id = ++new_client_id;
+        client->channel = c;
+        clients.add(client);
 
-    FD_SET(unix_listen_fd, &listen_set);
+        handle_client_input(client);
+    }
 
-    if (unix_listen_fd > max_fd) { // very likely
-        max_fd = unix_listen_fd;
+    if (!mux->alive()) {
+        muxes.remove(mux);
+        delete mux;
     }
 
-    for (map<int, MsgChannel *>::const_iterator it = fd2chan.begin();
-            it != fd2chan.end();) {
-        int i = it->first;
-        MsgChannel *c = it->second;
-        ++it;
-        /* don't select on a fd that we're currently not interested in.
-           Avoids that we wake up on an event we're not handling anyway */
-        Client *client = clients.find_by_channel(c);
-        assert(client);
-        int current_status = client->status;
-        bool ignore_channel = current_status == Client::TOCOMPILE
-                              || current_status == Client::WAITFORCHILD;
+    return true;
+}
 
-        if (!ignore_channel && (!c->has_msg() || handle_activity(client))) {
-            if (i > max_fd) {
-                max_fd = i;
-            }
+/* Handles the messages of CLIENT until its socket would block, the
+   reactor reports the channel again only for new input.  Stops when a
+   compile job takes over the channel.  */
+void Daemon::handle_client_input(Client *client)
+{
+    MsgChannel *c = client->channel;
 
-            FD_SET(i, &listen_set);
+    for (;;) {
+        if (client->status == Client::TOCOMPILE
+                || client->status == Client::WAITFORCHILD) {
+            return;
         }
 
-        if (current_status == Client::WAITFORCHILD
-                && client->pipe_to_child != -1) {
-            if (client->pipe_to_child > max_fd) {
-                max_fd = client->pipe_to_child;
+        bool ok = c->read_a_bit();
+
+        if (!ok || c->has_msg()) {
+            if (!handle_activity(client)) {
+                return;
             }
 
-            FD_SET(client->pipe_to_child, &listen_set);
+            continue;
         }
+
+        if (c->input_drained()) {
+            return;
+        }
+    }
+}
+
+int Daemon::answer_client_requests()
+{
+#ifdef ICECC_DEBUG
+
+    if (clients.size() + current_kids) {
+        log_info() << dump_internals() << endl;
+    }
+
+    log_info() << "clients " << clients.dump_per_status() << " " << current_kids
+               << " (" << max_kids << ")" << endl;
+
+#endif
+
+    /* reap zombis */
+    int status;
+
+    pid_t child;
+
+    while ((child = waitpid(-1, &status, WNOHANG)) < 0 && errno == EINTR) {}
+
+    reap_env_removals();
+
+    handle_old_request();
+    pool.maintain(time(0));
+    return_leases(time(0));
+    objects.maintain(time(0));
+    headers.maintain(time(0));
+
+    if (time(0) - env_manifest_saved >= ENV_MANIFEST_INTERVAL) {
+        save_env_manifest();
     }
 
+    /* collect the stats after the children exited icecream_load */
     if (scheduler) {
-        FD_SET(scheduler->fd, &listen_set);
+        maybe_stats();
+    }
 
-        if (max_fd < scheduler->fd) {
-            max_fd = scheduler->fd;
-        }
+    /* The scheduler connection comes and goes between the passes, it's
+       watched only while waiting (so it's never closed while registered).  */
+    int sched_fd = -1;
+
+    if (scheduler) {
+        sched_fd = scheduler->fd;
     } else if (discover && discover->listen_fd() >= 0) {
-        /* We don't explicitely check for discover->get_fd() being in
-        the selected set below.  If it's set, we simply will return
+        /* We don't explicitely check for discover->get_fd() being ready
+        below.  If it's set, we simply will return
         and our call will make sure we try to get the scheduler.  */
-        FD_SET(discover->listen_fd(), &listen_set);
-
-        if (max_fd < discover->listen_fd()) {
-            max_fd = discover->listen_fd();
-        }
+        sched_fd = discover->listen_fd();
     }
 
-    for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
-            it != native_environments.end(); ++it) {
-        if (it->second.create_env_pipe) {
-            FD_SET(it->second.create_env_pipe, &listen_set);
-            if (max_fd < it->second.create_env_pipe)
-                max_fd = it->second.create_env_pipe;
-        }
+    if (sched_fd >= 0) {
+        reactor.add(sched_fd, false);
     }
 
-    tv.tv_sec = max_scheduler_pong;
-    tv.tv_usec = 0;
+    vector<int> ready;
+    vector<int> writable;
+    int ret = reactor.wait(clients.pending.empty() ? max_scheduler_pong * 1000 : 0, ready,
+                           writable);
 
-    int ret = select(max_fd + 1, &listen_set, NULL, NULL, &tv);
+    if (sched_fd >= 0) {
+        reactor.remove(sched_fd);
+    }
 
     if (ret < 0 && errno != EINTR) {
-        log_perror("select");
+        log_perror("wait");
         return 5;
     }
 
-    if (ret > 0) {
-        bool had_scheduler = scheduler;
+    /* Messages read while the channel wasn't polled, they don't make
+       the socket readable again.  */
+    while (!clients.pending.empty()) {
+        ready.push_back(clients.pending.front());
+        clients.pending.pop_front();
+    }
+
+    for (vector<int>::const_iterator it = writable.begin(); it != writable.end(); ++it) {
+        if (!pool.handle_output(*it) && !handle_mux_input(*it, true)) {
+            log_error() << "unexpected writable descriptor " << *it << endl;
+        }
+    }
+
+    bool had_scheduler = scheduler;
 
-        if (scheduler && FD_ISSET(scheduler->fd, &listen_set)) {
+    for (vector<int>::const_iterator it = ready.begin(); it != ready.end(); ++it) {
+        int fd = *it;
+
+        if (scheduler && fd == scheduler->fd) {
             while (!scheduler->read_a_bit() || scheduler->has_msg()) {
                 Msg *msg = scheduler->get_msg();
 
@@ -1815,12 +2715,18 @@ int Daemon::answer_client_requests()
                 case M_USE_CS:
                     ret = scheduler_use_cs(static_cast<UseCSMsg *>(msg));
                     break;
+                case M_CS_LEASE:
+                    ret = scheduler_cs_lease(static_cast<CSLeaseMsg *>(msg));
+                    break;
                 case M_GET_INTERNALS:
                     ret = scheduler_get_internals();
                     break;
                 case M_CS_CONF:
                     ret = handle_cs_conf(static_cast<ConfCSMsg *>(msg));
                     break;
+                case M_ENV_FETCH:
+                    ret = scheduler_fetch_env(static_cast<EnvFetchMsg *>(msg));
+                    break;
                 default:
                     log_error() << "unknown scheduler type " << (char)msg->type << endl;
                     ret = 1;
@@ -1832,22 +2738,10 @@ int Daemon::answer_client_requests()
                     return ret;
                 }
             }
-        }
-
-        int listen_fd = -1;
-
-        if (tcp_listen_fd != -1 && FD_ISSET(tcp_listen_fd, &listen_set)) {
-            listen_fd = tcp_listen_fd;
-        }
-
-        if (FD_ISSET(unix_listen_fd, &listen_set)) {
-            listen_fd = unix_listen_fd;
-        }
-
-        if (listen_fd != -1) {
+        } else if (fd == tcp_listen_fd || fd == unix_listen_fd) {
             struct sockaddr cli_addr;
             socklen_t cli_len = sizeof cli_addr;
-            int acc_fd = accept(listen_fd, &cli_addr, &cli_len);
+            int acc_fd = accept(fd, &cli_addr, &cli_len);
 
             if (acc_fd < 0) {
                 log_perror("accept error");
@@ -1861,7 +2755,7 @@ int Daemon::answer_client_requests()
             MsgChannel *c = Service::createChannel(acc_fd, &cli_addr, cli_len);
 
             if (!c) {
-                return 0;
+                continue;
             }
 
             trace() << "accepted " << c->fd << " " << c->name << endl;
@@ -1869,76 +2763,48 @@ int Daemon::answer_client_requests()
             Client *client = new Client;
             client->client_id = ++new_client_id;
             client->channel = c;
-            clients[c] = client;
+            clients.add(client);
 
-            fd2chan[c->fd] = c;
-
-            while (!c->read_a_bit() || c->has_msg()) {
-                if (!handle_activity(client)) {
-                    break;
-                }
+            handle_client_input(client);
+        } else if (pool.handle_input(fd, time(0)) || handle_mux_input(fd, false)) {
+            continue;
+        } else if (Client *client = clients.find_by_fd(fd)) {
+            if (fd == client->pipe_to_child) {
+                assert(client->status == Client::WAITFORCHILD);
 
-                if (client->status == Client::TOCOMPILE
-                        || client->status == Client::WAITFORCHILD) {
-                    break;
+                if (!handle_compile_done(client)) {
+                    return 1;
                 }
+            } else {
+                handle_client_input(client);
             }
         } else {
-            for (map<int, MsgChannel *>::const_iterator it = fd2chan.begin();
-                    max_fd && it != fd2chan.end();)  {
-                int i = it->first;
-                MsgChannel *c = it->second;
-                Client *client = clients.find_by_channel(c);
-                assert(client);
-                ++it;
-
-                if (client->status == Client::WAITFORCHILD
-                        && client->pipe_to_child >= 0
-                        && FD_ISSET(client->pipe_to_child, &listen_set)) {
-                    max_fd--;
-
-                    if (!handle_compile_done(client)) {
+            for (map<string, int>::iterator it = env_fetches.begin(); it != env_fetches.end(); ++it) {
+                if (it->second == fd) {
+                    if (!fetch_env_finished(it->first)) {
                         return 1;
                     }
-                }
-
-                if (FD_ISSET(i, &listen_set)) {
-                    assert(client->status != Client::TOCOMPILE);
-
-                    while (!c->read_a_bit() || c->has_msg()) {
-                        if (!handle_activity(client)) {
-                            break;
-                        }
-
-                        if (client->status == Client::TOCOMPILE
-                                || client->status == Client::WAITFORCHILD) {
-                            break;
-                        }
-                    }
 
-                    max_fd--;
+                    break;
                 }
             }
 
             for (map<string, NativeEnvironment>::iterator it = native_environments.begin();
-                 it != native_environments.end(); ) {
-                if (it->second.create_env_pipe && FD_ISSET(it->second.create_env_pipe, &listen_set)) {
-                    if(!create_env_finished(it->first))
-                    {
-                        native_environments.erase(it++);
-                        continue;
+                 it != native_environments.end(); ++it) {
+                if (it->second.create_env_pipe == fd) {
+                    if (!create_env_finished(it->first)) {
+                        native_environments.erase(it);
                     }
+
+                    break;
                 }
-                ++it;
             }
-
-        }
-
-        if (had_scheduler && !scheduler) {
-            clear_children();
-            return 2;
         }
+    }
 
+    if (had_scheduler && !scheduler) {
+        clear_children();
+        return 2;
     }
 
     return 0;
@@ -1987,6 +2853,8 @@ bool Daemon::reconnect()
     gettimeofday(&last_stat, 0);
     icecream_load = 0;
 
+    objects.filter_lost();
+
     LoginMsg lmsg(daemon_port, determine_nodename(), machine_name);
     lmsg.envs = available_environmnents(envbasedir);
     lmsg.max_kids = max_kids;
@@ -2009,6 +2877,7 @@ int Daemon::working_loop()
         if (exit_main_loop) {
             close_scheduler();
             clear_children();
+            save_env_manifest();
             break;
         }
     }
@@ -2046,6 +2915,8 @@ int main(int argc, char **argv)
             { "env-basedir", 1, NULL, 'b' },
             { "user-uid", 1, NULL, 'u'},
             { "cache-limit", 1, NULL, 0},
+            { "object-cache", 1, NULL, 0},
+            { "header-cache", 1, NULL, 0},
             { "no-remote", 0, NULL, 0},
             { "port", 1, NULL, 'p'},
             { "extra-name", 1, NULL, 0},
@@ -2090,6 +2961,28 @@ int main(int argc, char **argv)
                 } else {
                     usage("Error: --cache-limit requires argument");
                 }
+            } else if (optname == "object-cache") {
+                if (optarg && *optarg) {
+                    errno = 0;
+                    int mb = atoi(optarg);
+
+                    if (!errno) {
+                        object_cache_limit = size_t(mb) * 1024 * 1024;
+                    }
+                } else {
+                    usage("Error: --object-cache requires argument");
+                }
+            } else if (optname == "header-cache") {
+                if (optarg && *optarg) {
+                    errno = 0;
+                    int mb = atoi(optarg);
+
+                    if (!errno) {
+                        header_cache_limit = size_t(mb) * 1024 * 1024;
+                    }
+                } else {
+                    usage("Error: --header-cache requires argument");
+                }
             } else if (optname == "no-remote") {
                 d.noremote = true;
             } else if (optname == "extra-name") {
@@ -2326,10 +3219,23 @@ int main(int argc, char **argv)
     pidFile << dcc_master_pid << endl;
     pidFile.close();
 
-    if (!cleanup_cache(d.envbasedir, d.user_uid, d.user_gid)) {
+    if (!cleanup_cache(d.envbasedir, d.user_uid, d.user_gid, d.installed_envs)) {
         return 1;
     }
 
+    // the environments of before the restart, so the scheduler knows them right away
+    for (InstalledEnvs::const_iterator it = d.installed_envs.begin();
+            it != d.installed_envs.end(); ++it) {
+        d.envs_last_use[it->first] = it->second.last_use;
+        d.cache_size += it->second.size;
+    }
+
+    d.check_cache_size(string());
+    d.save_env_manifest();
+
+    d.objects.setup(d.envbasedir + "/objects", object_cache_limit, d.user_uid, d.user_gid);
+    d.headers.setup(d.envbasedir + "/headers", header_cache_limit, d.user_uid, d.user_gid);
+
     list<string> nl = get_netnames(200, d.scheduler_port);
     trace() << "Netnames:" << endl;
 
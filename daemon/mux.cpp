@@ -0,0 +1,482 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "mux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "fileio.h"
+#include "logging.h"
+#include "reactor.h"
+
+using namespace std;
+
+// the largest FRAME_DATA frame
+static const size_t MAX_FRAME = 64 * 1024;
+static const size_t HEADER_SIZE = 3 * sizeof(uint32_t);
+// stop reading the streams while this much output waits for the connection
+static const size_t MAX_QUEUED = 1024 * 1024;
+
+MuxConnection::MuxConnection(Reactor &reactor, MuxDescriptors &descriptors, int fd,
+                             bool initiator, uint32_t peer_window)
+    : m_reactor(reactor)
+    , m_descriptors(descriptors)
+    , m_fd(fd)
+    , m_initiator(initiator)
+    , m_peer_window(peer_window ? peer_window : MUX_WINDOW)
+    , m_last_id(0)
+    , m_throttled(false)
+    , m_last_active(time(0))
+    , m_out_ofs(0)
+{
+    m_peer_len = sizeof(m_peer);
+
+    if (getpeername(fd, (struct sockaddr *) &m_peer, &m_peer_len) < 0) {
+        log_perror("getpeername()");
+        m_peer_len = 0;
+    }
+
+    char buf[NI_MAXHOST] = "";
+
+    if (m_peer_len) {
+        getnameinfo((struct sockaddr *) &m_peer, m_peer_len, buf, sizeof(buf), NULL, 0,
+                    NI_NUMERICHOST);
+    }
+
+    m_name = buf;
+
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+        log_perror("MuxConnection fcntl()");
+    }
+
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        log_perror("MuxConnection fcntl() 2");
+    }
+
+    // the frames are batched already, small ones are acknowledgements
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+
+    m_reactor.add(fd, false);
+    m_descriptors[fd] = this;
+}
+
+MuxConnection::~MuxConnection()
+{
+    fail();
+}
+
+void MuxConnection::fail()
+{
+    // the jobs see EOF on their ends
+    for (map<uint32_t, Stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it) {
+        m_descriptors.erase(it->second->fd);
+        m_reactor.remove(it->second->fd);
+        close_fd(it->second->fd);
+        delete it->second;
+    }
+
+    m_streams.clear();
+    m_by_fd.clear();
+
+    if (m_fd >= 0) {
+        m_descriptors.erase(m_fd);
+        m_reactor.remove(m_fd);
+        close_fd(m_fd);
+        m_fd = -1;
+    }
+}
+
+MuxConnection::Stream *MuxConnection::new_stream(uint32_t id, int &job_fd)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        log_perror("socketpair()");
+        return 0;
+    }
+
+    if (fcntl(sv[0], F_SETFL, O_NONBLOCK) < 0) {
+        log_perror("fcntl()");
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (fcntl(sv[i], F_SETFD, FD_CLOEXEC) < 0) {
+            log_perror("fcntl()");
+        }
+    }
+
+    Stream *s = new Stream;
+    s->id = id;
+    s->fd = sv[0];
+    s->credit = m_peer_window;
+    s->unacked = 0;
+    s->read_closed = false;
+    s->write_closed = false;
+    m_streams[id] = s;
+    m_by_fd[s->fd] = s;
+    m_descriptors[s->fd] = this;
+
+    /* Edge triggered, so a job that hung up doesn't keep the daemon busy
+       while the stream waits for credit.  */
+    m_reactor.add(s->fd, true);
+
+    if (m_throttled) {
+        m_reactor.set_interest(s->fd, false);
+    }
+
+    m_last_active = time(0);
+    job_fd = sv[1];
+    return s;
+}
+
+int MuxConnection::open_stream()
+{
+    if (!alive() || !m_initiator) {
+        return -1;
+    }
+
+    int job_fd = -1;
+
+    if (!new_stream(++m_last_id, job_fd)) {
+        return -1;
+    }
+
+    /* The other side takes ids below the highest it saw as finished, so
+       announce the stream now, before a later one has its first data.  */
+    queue_frame(m_last_id, FRAME_DATA, 0, 0);
+    flush();
+    return job_fd;
+}
+
+void MuxConnection::read_stream(Stream *s)
+{
+    char buf[MAX_FRAME];
+
+    while (!s->read_closed && s->credit && !m_throttled) {
+        size_t count = s->credit < MAX_FRAME ? s->credit : MAX_FRAME;
+        ssize_t ret = read(s->fd, buf, count);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && errno == EAGAIN) {
+            return;
+        }
+
+        if (ret <= 0) {   // the job won't send anything more
+            s->read_closed = true;
+            m_reactor.set_interest(s->fd, false);
+            queue_frame(s->id, FRAME_CLOSE, 0, 0);
+            maybe_finish(s);
+            return;
+        }
+
+        s->credit -= ret;
+        queue_frame(s->id, FRAME_DATA, buf, ret);
+
+        if (m_out.size() - m_out_ofs > MAX_QUEUED) {
+            throttle(true);
+        }
+    }
+
+    // re-enabled, and so reported again if readable, once there is credit
+    if (!s->read_closed) {
+        m_reactor.set_interest(s->fd, false);
+    }
+}
+
+void MuxConnection::write_stream(Stream *s)
+{
+    size_t written = 0;
+
+    while (written < s->pending.size()) {
+        ssize_t ret = write(s->fd, s->pending.data() + written, s->pending.size() - written);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && errno == EAGAIN) {
+            break;
+        }
+
+        if (ret < 0) {   // the job is gone, nobody wants the rest
+            written = s->pending.size();
+            s->write_closed = true;
+            break;
+        }
+
+        written += ret;
+        s->unacked += ret;
+    }
+
+    s->pending.erase(0, written);
+    m_reactor.set_write_interest(s->fd, !s->pending.empty());
+
+    if (s->unacked >= MUX_WINDOW / 4 || (s->unacked && s->write_closed)) {
+        queue_frame(s->id, FRAME_WINDOW, 0, s->unacked);
+        s->unacked = 0;
+    }
+
+    if (s->write_closed && s->pending.empty()) {
+        shutdown(s->fd, SHUT_WR);
+        maybe_finish(s);
+    }
+}
+
+void MuxConnection::maybe_finish(Stream *s)
+{
+    if (!s->read_closed || !s->write_closed || !s->pending.empty()) {
+        return;
+    }
+
+    m_by_fd.erase(s->fd);
+    m_descriptors.erase(s->fd);
+    m_streams.erase(s->id);
+    m_reactor.remove(s->fd);
+    close_fd(s->fd);
+    delete s;
+    m_last_active = time(0);
+}
+
+void MuxConnection::read_connection(vector<int> &accepted)
+{
+    char buf[MAX_FRAME];
+    ssize_t ret = read(m_fd, buf, sizeof(buf));
+
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+
+    if (ret <= 0) {
+        trace() << "multiplexed connection to " << m_name << " closed" << endl;
+        fail();
+        return;
+    }
+
+    m_in.append(buf, ret);
+    size_t ofs = 0;
+
+    while (alive() && m_in.size() - ofs >= HEADER_SIZE) {
+        uint32_t header[3];
+        memcpy(header, m_in.data() + ofs, HEADER_SIZE);
+        uint32_t id = ntohl(header[0]);
+        uint32_t type = ntohl(header[1]);
+        uint32_t len = ntohl(header[2]);
+        size_t payload = type == FRAME_DATA ? len : 0;
+
+        if (payload > MAX_FRAME) {
+            log_error() << "oversized frame from " << m_name << endl;
+            fail();
+            return;
+        }
+
+        if (m_in.size() - ofs < HEADER_SIZE + payload) {
+            break;
+        }
+
+        handle_frame(id, type, m_in.data() + ofs + HEADER_SIZE, len, accepted);
+        ofs += HEADER_SIZE + payload;
+    }
+
+    if (alive()) {
+        m_in.erase(0, ofs);
+    }
+}
+
+void MuxConnection::handle_frame(uint32_t id, uint32_t type, const char *data, uint32_t len,
+                                 vector<int> &accepted)
+{
+    map<uint32_t, Stream *>::iterator it = m_streams.find(id);
+    Stream *s = it == m_streams.end() ? 0 : it->second;
+
+    if (!s) {
+        // streams are opened in order, anything older is finished already
+        if (m_initiator || id <= m_last_id) {
+            return;
+        }
+
+        m_last_id = id;
+        int job_fd = -1;
+        s = new_stream(id, job_fd);
+
+        if (!s) {
+            queue_frame(id, FRAME_CLOSE, 0, 0);
+            return;
+        }
+
+        accepted.push_back(job_fd);
+    }
+
+    switch (type) {
+    case FRAME_DATA:
+
+        if (!s->write_closed) {
+            s->pending.append(data, len);
+            write_stream(s);
+        }
+
+        break;
+    case FRAME_WINDOW:
+        s->credit += len;
+
+        if (!s->read_closed && !m_throttled) {
+            m_reactor.set_interest(s->fd, true);
+        }
+
+        break;
+    case FRAME_CLOSE:
+        s->write_closed = true;
+        write_stream(s);
+        break;
+    default:
+        log_error() << "unknown frame type " << type << " from " << m_name << endl;
+        fail();
+    }
+}
+
+void MuxConnection::queue_frame(uint32_t id, uint32_t type, const char *data, uint32_t len)
+{
+    uint32_t header[3];
+    header[0] = htonl(id);
+    header[1] = htonl(type);
+    header[2] = htonl(len);
+    m_out.append((const char *) header, HEADER_SIZE);
+
+    if (type == FRAME_DATA && len) {
+        m_out.append(data, len);
+    }
+}
+
+void MuxConnection::flush()
+{
+    if (!alive()) {
+        return;
+    }
+
+    while (m_out_ofs < m_out.size()) {
+        ssize_t ret = write(m_fd, m_out.data() + m_out_ofs, m_out.size() - m_out_ofs);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && errno == EAGAIN) {
+            break;
+        }
+
+        if (ret < 0) {
+            log_perror("writing to multiplexed connection");
+            fail();
+            return;
+        }
+
+        m_out_ofs += ret;
+    }
+
+    if (m_out_ofs == m_out.size()) {
+        m_out.clear();
+        m_out_ofs = 0;
+    } else if (m_out_ofs > MAX_QUEUED) {
+        m_out.erase(0, m_out_ofs);
+        m_out_ofs = 0;
+    }
+
+    m_reactor.set_write_interest(m_fd, !m_out.empty());
+
+    if (m_throttled && m_out.size() - m_out_ofs < MAX_QUEUED / 2) {
+        throttle(false);
+    }
+}
+
+void MuxConnection::throttle(bool on)
+{
+    m_throttled = on;
+
+    for (map<uint32_t, Stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it) {
+        Stream *s = it->second;
+
+        if (!s->read_closed) {
+            m_reactor.set_interest(s->fd, !on && s->credit);
+        }
+    }
+}
+
+bool MuxConnection::handle_readable(int fd, vector<int> &accepted)
+{
+    if (!alive()) {
+        return false;
+    }
+
+    if (fd == m_fd) {
+        read_connection(accepted);
+    } else {
+        map<int, Stream *>::iterator it = m_by_fd.find(fd);
+
+        if (it == m_by_fd.end()) {
+            return false;
+        }
+
+        read_stream(it->second);
+    }
+
+    flush();
+    return true;
+}
+
+bool MuxConnection::handle_writable(int fd)
+{
+    if (!alive()) {
+        return false;
+    }
+
+    if (fd != m_fd) {
+        map<int, Stream *>::iterator it = m_by_fd.find(fd);
+
+        if (it == m_by_fd.end()) {
+            return false;
+        }
+
+        write_stream(it->second);
+    }
+
+    flush();
+    return true;
+}
+
+string MuxConnection::dump() const
+{
+    return "mux " + m_name + " (" + (m_initiator ? "out" : "in") + "): "
+           + toString(m_streams.size()) + " streams, "
+           + toString(m_out.size() - m_out_ofs) + " bytes queued"
+           + (m_throttled ? ", throttled" : "");
+}
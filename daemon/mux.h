@@ -0,0 +1,152 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_MUX_H
+#define ICECREAM_MUX_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+class Reactor;
+class MuxConnection;
+
+/* The descriptors of multiplexed connections, the connection itself and
+   its streams, and which connection they belong to.  The MuxConnections
+   sharing it keep it up to date.  */
+typedef std::map<int, MuxConnection *> MuxDescriptors;
+
+// the per stream window both sides offer in M_MUX_START
+#define MUX_WINDOW (256 * 1024)
+
+/* Many job conversations over one connection between two daemons, after
+   M_MUX_START (IS_PROTOCOL_39).  Every job is a stream, represented on
+   both sides by a socketpair: the job uses one end like its own
+   connection (the client, or the channel of the compile server), the
+   daemon relays the other one to and from the shared connection.
+
+   Frames are three uint32 in network order (stream, type, length),
+   followed by LENGTH bytes for FRAME_DATA.  The initiator opens streams
+   with increasing ids by just using them.  At most the window of the
+   other side may be unacknowledged per stream, the receiver gives the
+   credit back with FRAME_WINDOW once the job took the data.  FRAME_CLOSE
+   ends one direction, a stream is gone after both.  */
+class MuxConnection
+{
+public:
+    MuxConnection(Reactor &reactor, MuxDescriptors &descriptors, int fd, bool initiator,
+                  uint32_t peer_window);
+    ~MuxConnection();   // closes the connection and all its streams
+
+    // false once the connection broke, the owner deletes it then
+    bool alive() const
+    {
+        return m_fd >= 0;
+    }
+
+    size_t stream_count() const
+    {
+        return m_streams.size();
+    }
+
+    // when the last stream was opened or closed
+    time_t last_active() const
+    {
+        return m_last_active;
+    }
+
+    // initiator only: opens a stream and returns the job's end, or -1
+    int open_stream();
+
+    /* Return false if FD doesn't belong to this connection.  Streams the
+       other side opened add the job's end to ACCEPTED.  */
+    bool handle_readable(int fd, std::vector<int> &accepted);
+    bool handle_writable(int fd);
+
+    // the address of the other daemon, for the channels on accepted streams
+    struct sockaddr *peer_addr()
+    {
+        return (struct sockaddr *) &m_peer;
+    }
+
+    socklen_t peer_addr_len() const
+    {
+        return m_peer_len;
+    }
+
+    std::string dump() const;
+
+private:
+    enum FrameType {
+        FRAME_DATA = 1,
+        FRAME_WINDOW,
+        FRAME_CLOSE
+    };
+
+    struct Stream {
+        uint32_t id;
+        int fd;                 // our end of the socketpair
+        uint32_t credit;        // what we may still send to the other side
+        uint32_t unacked;       // passed on to the job, but not acknowledged
+        std::string pending;    // received, but not yet taken by the job
+        bool read_closed;       // the job closed its end, FRAME_CLOSE sent
+        bool write_closed;      // FRAME_CLOSE received
+    };
+
+    Stream *new_stream(uint32_t id, int &job_fd);
+    void read_stream(Stream *s);
+    void write_stream(Stream *s);
+    void maybe_finish(Stream *s);
+    void read_connection(std::vector<int> &accepted);
+    void handle_frame(uint32_t id, uint32_t type, const char *data, uint32_t len,
+                      std::vector<int> &accepted);
+    void queue_frame(uint32_t id, uint32_t type, const char *data, uint32_t len);
+    void flush();
+    void throttle(bool on);
+    void fail();
+
+    Reactor &m_reactor;
+    MuxDescriptors &m_descriptors;
+    int m_fd;
+    bool m_initiator;
+    uint32_t m_peer_window;
+    uint32_t m_last_id;
+    bool m_throttled;           // too much output queued, streams are not read
+    time_t m_last_active;
+
+    std::string m_in;
+    std::string m_out;
+    size_t m_out_ofs;
+
+    std::map<uint32_t, Stream *> m_streams;
+    std::map<int, Stream *> m_by_fd;
+
+    struct sockaddr_storage m_peer;
+    socklen_t m_peer_len;
+    std::string m_name;
+};
+
+#endif
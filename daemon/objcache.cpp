@@ -0,0 +1,457 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+#include "objcache.h"
+
+#include <algorithm>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <comm.h>
+
+#include "exitcode.h"
+#include "fileio.h"
+#include "logging.h"
+#include "workit.h"
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+using namespace std;
+
+// how often the daemon looks through all of the cache
+static const time_t SCAN_INTERVAL = 300;
+// the scheduler gets a changed filter at most this often
+static const time_t FILTER_INTERVAL = 10;
+// what is left of unfinished entries of crashed children after this long
+static const time_t STALE_TMP_AGE = 3600;
+
+static const char *const entry_files[] = { "o", "dwo", "out", "err" };
+
+// the size of the entry NAME in DIR_FD, -1 if it is not complete
+static off_t entry_size(int dir_fd, const string &name)
+{
+    off_t size = 0;
+
+    for (size_t i = 0; i < sizeof(entry_files) / sizeof(entry_files[0]); ++i) {
+        struct stat st;
+
+        if (!fstatat(dir_fd, (name + "/" + entry_files[i]).c_str(), &st, 0)) {
+            size += st.st_size;
+        } else if (i == 0) {
+            return -1;
+        }
+    }
+
+    return size;
+}
+
+ObjectCache::ObjectCache()
+    : m_limit(0)
+    , m_size(0)
+    , m_entries(0)
+    , m_hits(0)
+    , m_stored(0)
+    , m_next_scan(0)
+    , m_next_filter(0)
+    , m_filter_sent(false)
+{
+}
+
+bool ObjectCache::setup(const string &dir, size_t limit, uid_t uid, gid_t gid)
+{
+    m_dir = dir;
+    m_limit = limit;
+
+    if (!limit) {
+        return true;
+    }
+
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+        log_perror("mkdir of the object cache failed") << "\t" << dir << endl;
+        m_limit = 0;
+        return false;
+    }
+
+    // the children store the results after they dropped their privileges
+    if (chown(dir.c_str(), uid, gid)) {
+        log_perror("chown of the object cache failed") << "\t" << dir << endl;
+        m_limit = 0;
+        return false;
+    }
+
+    return true;
+}
+
+void ObjectCache::note_hit()
+{
+    ++m_hits;
+}
+
+void ObjectCache::note_stored(const string &key)
+{
+    int dir_fd = object_cache_open(m_dir);
+
+    if (dir_fd < 0) {
+        return;
+    }
+
+    off_t size = entry_size(dir_fd, key);
+    close_fd(dir_fd);
+
+    if (size < 0) {
+        return;
+    }
+
+    m_size += size;
+    ++m_entries;
+    ++m_stored;
+
+    if (m_size > m_limit || m_filter.empty()) {
+        m_next_scan = 0;
+    } else {
+        m_filter.add(key);
+        m_filter_sent = false;
+    }
+}
+
+struct CachedObject {
+    time_t used;
+    off_t size;
+    string key;
+
+    bool operator<(const CachedObject &other) const
+    {
+        return used < other.used;
+    }
+};
+
+void ObjectCache::scan(time_t now)
+{
+    int dir_fd = object_cache_open(m_dir);
+
+    if (dir_fd < 0) {
+        return;
+    }
+
+    DIR *dir = fdopendir(dup(dir_fd));
+
+    if (!dir) {
+        log_perror("opendir of the object cache failed") << "\t" << m_dir << endl;
+        close_fd(dir_fd);
+        return;
+    }
+
+    vector<CachedObject> entries;
+    size_t size = 0;
+
+    for (struct dirent *ent = readdir(dir); ent; ent = readdir(dir)) {
+        string name = ent->d_name;
+        struct stat st;
+
+        if (name[0] == '.' || fstatat(dir_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW)
+                || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+
+        off_t esize = entry_size(dir_fd, name);
+
+        if (name.compare(0, 4, "tmp.") == 0 || esize < 0) {
+            if (st.st_mtime + STALE_TMP_AGE < now) {
+                remove_entry(dir_fd, name);
+            }
+
+            continue;
+        }
+
+        CachedObject e;
+        e.used = st.st_mtime;
+        e.size = esize;
+        e.key = name;
+        entries.push_back(e);
+        size += esize;
+    }
+
+    closedir(dir);
+
+    size_t removed = 0;
+
+    if (size > m_limit) {
+        // the oldest go until there's some room again
+        sort(entries.begin(), entries.end());
+
+        while (removed < entries.size() && size > m_limit / 10 * 8) {
+            if (remove_entry(dir_fd, entries[removed].key) < 0) {
+                log_perror("removing object cache entry failed") << "\t"
+                        << entries[removed].key << endl;
+            }
+
+            size -= entries[removed].size;
+            ++removed;
+        }
+
+        trace() << "object cache: removed " << removed << " of " << entries.size()
+                << " entries" << endl;
+    }
+
+    close_fd(dir_fd);
+
+    BloomFilter filter(entries.size() - removed);
+
+    for (size_t i = removed; i < entries.size(); ++i) {
+        filter.add(entries[i].key);
+    }
+
+    if (filter != m_filter) {
+        m_filter = filter;
+        m_filter_sent = false;
+    }
+
+    m_size = size;
+    m_entries = entries.size() - removed;
+}
+
+void ObjectCache::maintain(time_t now)
+{
+    if (!enabled() || now < m_next_scan) {
+        return;
+    }
+
+    m_next_scan = now + SCAN_INTERVAL;
+    scan(now);
+}
+
+string ObjectCache::filter_update(time_t now)
+{
+    if (!enabled() || m_filter_sent || m_filter.empty() || now < m_next_filter) {
+        return string();
+    }
+
+    m_filter_sent = true;
+    m_next_filter = now + FILTER_INTERVAL;
+    return m_filter.encode();
+}
+
+void ObjectCache::filter_lost()
+{
+    m_filter_sent = false;
+    m_next_filter = 0;
+}
+
+string ObjectCache::dump() const
+{
+    if (!enabled()) {
+        return string();
+    }
+
+    return "  Object cache: " + toString(m_entries) + " entries, " + toString(m_size)
+           + " bytes (limit " + toString(m_limit) + "), " + toString(m_hits) + " hits, "
+           + toString(m_stored) + " stored\n";
+}
+
+int object_cache_open(const string &dir)
+{
+    if (dir.empty()) {
+        return -1;
+    }
+
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0) {
+        log_perror("open of the object cache failed") << "\t" << dir << endl;
+    }
+
+    return fd;
+}
+
+static void send_file(int fd, MsgChannel *client)
+{
+    unsigned char buffer[100000];
+
+    for (;;) {
+        ssize_t bytes = read(fd, buffer, sizeof(buffer));
+
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_perror("read of cached object failed");
+            throw myexception(EXIT_DISTCC_FAILED);
+        }
+
+        if (!bytes) {
+            break;
+        }
+
+        if (!client->send_msg(FileChunkMsg(buffer, bytes))) {
+            log_info() << "write of obj chunk failed " << bytes << endl;
+            throw myexception(EXIT_DISTCC_FAILED);
+        }
+    }
+
+    if (!client->send_msg(EndMsg())) {
+        log_info() << "write of obj end failed " << endl;
+        throw myexception(EXIT_DISTCC_FAILED);
+    }
+}
+
+off_t object_cache_send(int dir_fd, const string &key, MsgChannel *client)
+{
+    if (dir_fd < 0 || key.empty() || key.find('/') != string::npos || key[0] == '.') {
+        return -1;
+    }
+
+    CompileResultMsg rmsg;
+    int fds[2] = { openat(dir_fd, (key + "/o").c_str(), O_RDONLY | O_LARGEFILE), -1 };
+
+    if (fds[0] < 0 || !read_text(dir_fd, key + "/out", rmsg.out)
+            || !read_text(dir_fd, key + "/err", rmsg.err)) {
+        if (fds[0] >= 0) {
+            close_fd(fds[0]);
+        }
+
+        return -1;
+    }
+
+    fds[1] = openat(dir_fd, (key + "/dwo").c_str(), O_RDONLY | O_LARGEFILE);
+    rmsg.have_dwo_file = fds[1] >= 0;
+    // the time of the last use, for the eviction
+    utimensat(dir_fd, key.c_str(), 0, 0);
+
+    off_t size = 0;
+
+    try {
+        if (!client->send_msg(CacheAnswerMsg(true)) || !client->send_msg(rmsg)) {
+            log_info() << "write of cached result failed" << endl;
+            throw myexception(EXIT_DISTCC_FAILED);
+        }
+
+        for (int i = 0; i < 2; ++i) {
+            struct stat st;
+
+            if (fds[i] >= 0) {
+                if (!fstat(fds[i], &st)) {
+                    size += st.st_size;
+                }
+
+                send_file(fds[i], client);
+            }
+        }
+    } catch (...) {
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i] >= 0) {
+                close_fd(fds[i]);
+            }
+        }
+
+        throw;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (fds[i] >= 0) {
+            close_fd(fds[i]);
+        }
+    }
+
+    return size;
+}
+
+// links FROM into DIR_FD as TO, or copies it if that's not possible
+static bool add_file(const string &from, int dir_fd, const string &to)
+{
+    if (!linkat(AT_FDCWD, from.c_str(), dir_fd, to.c_str(), 0)) {
+        return true;
+    }
+
+    int in = open(from.c_str(), O_RDONLY | O_LARGEFILE);
+
+    if (in < 0) {
+        return false;
+    }
+
+    int out = openat(dir_fd, to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0644);
+
+    if (out < 0) {
+        close_fd(in);
+        return false;
+    }
+
+    char buf[65536];
+    ssize_t len;
+    bool ok = true;
+
+    while (ok && (len = read(in, buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+
+        ok = write_full(out, buf, len);
+    }
+
+    close_fd(in);
+    close_fd(out);
+    return ok;
+}
+
+void object_cache_store(int dir_fd, const string &key, const string &obj_file,
+                        const string &dwo_file, const string &out, const string &err)
+{
+    if (dir_fd < 0 || key.empty() || key.find('/') != string::npos || key[0] == '.') {
+        return;
+    }
+
+    string tmp = "tmp." + toString(getpid());
+
+    if (mkdirat(dir_fd, tmp.c_str(), 0755)) {
+        log_perror("mkdir in the object cache failed") << "\t" << tmp << endl;
+        return;
+    }
+
+    if (!add_file(obj_file, dir_fd, tmp + "/o")
+            || (!dwo_file.empty() && !add_file(dwo_file, dir_fd, tmp + "/dwo"))
+            || !write_text(dir_fd, tmp + "/out", out, O_CREAT | O_EXCL, 0644)
+            || !write_text(dir_fd, tmp + "/err", err, O_CREAT | O_EXCL, 0644)) {
+        log_error() << "storing " << key << " in the object cache failed" << endl;
+        remove_entry(dir_fd, tmp);
+        return;
+    }
+
+    // fails if another job was faster, which is just as good
+    if (renameat(dir_fd, tmp.c_str(), dir_fd, key.c_str())) {
+        remove_entry(dir_fd, tmp);
+        return;
+    }
+
+    trace() << "stored " << key << " in the object cache" << endl;
+}
@@ -0,0 +1,101 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_OBJCACHE_H
+#define ICECREAM_OBJCACHE_H
+
+#include <string>
+#include <sys/types.h>
+#include <time.h>
+
+#include "bloomfilter.h"
+
+class MsgChannel;
+
+/* The results of earlier jobs, for clients sending the same job again
+   (CompileJob::cacheKey()).  Every entry is a directory <dir>/<key>
+   with the object file "o", the split DWARF file "dwo" if there is one,
+   and the "out" and "err" of the compiler.  The children started by
+   handle_connection() look the entries up and store them, the daemon
+   only keeps the size in bounds and tells the scheduler which keys it
+   has, so it can send the jobs here.  */
+class ObjectCache
+{
+public:
+    ObjectCache();
+
+    // LIMIT 0 disables the cache, the children run as UID:GID
+    bool setup(const std::string &dir, size_t limit, uid_t uid, gid_t gid);
+
+    bool enabled() const
+    {
+        return m_limit > 0;
+    }
+
+    // empty if disabled
+    std::string dir() const
+    {
+        return enabled() ? m_dir : std::string();
+    }
+
+    // a child answered a job from the cache, or stored the result of one
+    void note_hit();
+    void note_stored(const std::string &key);
+
+    // evicts the least recently used entries once in a while
+    void maintain(time_t now);
+
+    /* BloomFilter::encode() of the keys if the scheduler doesn't know
+       them yet, otherwise an empty string.  */
+    std::string filter_update(time_t now);
+    // a new scheduler connection, which needs the whole filter
+    void filter_lost();
+
+    std::string dump() const;
+
+private:
+    void scan(time_t now);
+
+    std::string m_dir;
+    size_t m_limit;
+    size_t m_size;
+    size_t m_entries;
+    unsigned int m_hits;
+    unsigned int m_stored;
+    time_t m_next_scan;
+    time_t m_next_filter;
+    bool m_filter_sent;
+    BloomFilter m_filter;
+};
+
+/* The children's side, DIR_FD is the cache directory (opened before
+   the chroot).  object_cache_send() answers the job from the entry of
+   KEY with M_CACHE_ANSWER, M_COMPILE_RESULT and the files, and returns
+   the size of them, or -1 if there is no entry.  */
+extern int object_cache_open(const std::string &dir);
+extern off_t object_cache_send(int dir_fd, const std::string &key, MsgChannel *client);
+extern void object_cache_store(int dir_fd, const std::string &key, const std::string &obj_file,
+                               const std::string &dwo_file, const std::string &out,
+                               const std::string &err);
+
+#endif
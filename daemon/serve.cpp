@@ -45,11 +45,15 @@
 #include <job.h>
 #include <comm.h>
 
+#include "chunksender.h"
+#include "compression.h"
 #include "environment.h"
 #include "exitcode.h"
+#include "headercache.h"
 #include "tempfile.h"
 #include "workit.h"
 #include "logging.h"
+#include "objcache.h"
 #include "serve.h"
 #include "util.h"
 #include "file_util.h"
@@ -93,35 +97,23 @@ static void write_output_file( const string& file, MsgChannel* client )
             throw myexception(EXIT_DISTCC_FAILED);
         }
 
-        unsigned char buffer[100000];
+        FdChunkSource source(obj_fd);
+        ChunkSender sender(client);
+        ChunkSender::Result result = sender.send(source);
 
-        do {
-            ssize_t bytes = read(obj_fd, buffer, sizeof(buffer));
-
-            if (bytes < 0) {
-                if (errno == EINTR) {
-                    continue;
-                }
-
-                throw myexception(EXIT_DISTCC_FAILED);
-            }
-
-            if (!bytes) {
-                if( !client->send_msg(EndMsg())) {
-                    log_info() << "write of obj end failed " << endl;
-                    throw myexception(EXIT_DISTCC_FAILED);
-                }
-                break;
-            }
-
-            FileChunkMsg fcmsg(buffer, bytes);
+        if (result != ChunkSender::SENT) {
+            log_info() << "write of obj chunks failed" << endl;
+            throw myexception(EXIT_DISTCC_FAILED);
+        }
 
-            if (!client->send_msg(fcmsg)) {
-                log_info() << "write of obj chunk failed " << bytes << endl;
-                throw myexception(EXIT_DISTCC_FAILED);
-            }
-        } while (1);
+        if (!client->send_msg(EndMsg())) {
+            log_info() << "write of obj end failed " << endl;
+            throw myexception(EXIT_DISTCC_FAILED);
+        }
 
+        if ((-1 == close(obj_fd)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
     } catch(...) {
         if( obj_fd != -1 )
             if ((-1 == close( obj_fd )) && (errno != EBADF)){
@@ -131,12 +123,52 @@ static void write_output_file( const string& file, MsgChannel* client )
     }
 }
 
+// replaces ROOT in what the compiler wrote with the paths of the client
+static void strip_root(string &text, const string &root)
+{
+    string prefix = root + "/";
+    size_t pos = 0;
+
+    while ((pos = text.find(prefix, pos)) != string::npos) {
+        text.replace(pos, prefix.size(), "/");
+        ++pos;
+    }
+}
+
+static void strip_root_from_file(const string &file, const string &root)
+{
+    FILE *f = fopen(file.c_str(), "r+");
+
+    if (!f) {
+        return;
+    }
+
+    string text;
+    char buffer[4096];
+    size_t len;
+
+    while ((len = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        text.append(buffer, len);
+    }
+
+    strip_root(text, root);
+    rewind(f);
+
+    if (fwrite(text.data(), 1, text.size(), f) != text.size()
+            || ftruncate(fileno(f), text.size())) {
+        log_perror("rewriting dependencies failed") << "\t" << file << endl;
+    }
+
+    fclose(f);
+}
+
 /**
  * Read a request, run the compiler, and send a response.
  **/
 int handle_connection(const string &basedir, CompileJob *job,
                       MsgChannel *client, int &out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid)
+                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                      const string &objects_dir, const string &headers_dir)
 {
     int socket[2];
 
@@ -175,7 +207,10 @@ int handle_connection(const string &basedir, CompileJob *job,
 
     Msg *msg = 0; // The current read message
     unsigned int job_id = 0;
-    string tmp_path, obj_file, dwo_file;
+    string tmp_path, obj_file, dwo_file, dep_file, input_hash;
+    int cache_fd = -1;
+    int header_fd = -1;
+    bool deps = false;
 
     try {
         if (job->environmentVersion().size()) {
@@ -187,6 +222,44 @@ int handle_connection(const string &basedir, CompileJob *job,
                 throw myexception(EXIT_DISTCC_FAILED);   // the scheduler didn't listen to us!
             }
 
+            // has to be loaded before we're locked into the chroot
+            if (client->set_compression_dictionary(dirname + "/" COMPRESSION_DICTIONARY_NAME)) {
+                if (client->compression_dictionary_id() == client->remote_dictionary_id()) {
+                    trace() << "using the compression dictionary of the environment" << endl;
+                } else {
+                    log_warning() << "compression dictionary of " << job->environmentVersion()
+                                  << " differs from the one of the client, not using it" << endl;
+                }
+            }
+
+            if (!job->cacheKey().empty()) {
+                cache_fd = object_cache_open(objects_dir);
+                off_t size = object_cache_send(cache_fd, job->cacheKey(), client);
+
+                if (size >= 0) {
+                    trace() << "job " << job->jobID() << " answered from the object cache" << endl;
+                    unsigned int job_stat[JobStatistics::num_job_stats];
+                    memset(job_stat, 0, sizeof(job_stat));
+                    job_stat[JobStatistics::out_uncompressed] = size;
+                    job_stat[JobStatistics::from_cache] = 1;
+                    ignore_result(write(out_fd, job_stat, sizeof(job_stat)));
+                    throw myexception(0);
+                }
+            }
+
+            // the client waits to hear whether to send the source at all and
+            // which compression dictionary we have
+            if (!job->cacheKey().empty() || client->remote_dictionary_id()) {
+                if (!client->send_msg(CacheAnswerMsg(false))) {
+                    log_info() << "write of cache answer failed" << endl;
+                    throw myexception(EXIT_DISTCC_FAILED);
+                }
+            }
+
+            if (job->preprocessRemotely()) {
+                header_fd = header_cache_open(headers_dir);
+            }
+
             chdir_to_environment(client, dirname, user_uid, user_gid);
         } else {
             error_client(client, "empty environment");
@@ -201,7 +274,7 @@ int handle_connection(const string &basedir, CompileJob *job,
         }
 
         int ret;
-        unsigned int job_stat[8];
+        unsigned int job_stat[JobStatistics::num_job_stats];
         CompileResultMsg rmsg;
         job_id = job->jobID();
 
@@ -211,7 +284,8 @@ int handle_connection(const string &basedir, CompileJob *job,
         char prefix_output[32]; // 20 for 2^64 + 6 for "icecc-" + 1 for trailing NULL
         sprintf(prefix_output, "icecc-%d", job_id);
 
-        if (job->dwarfFissionEnabled() && (ret = dcc_make_tmpdir(&tmp_output)) == 0) {
+        if ((job->dwarfFissionEnabled() || job->preprocessRemotely())
+                && (ret = dcc_make_tmpdir(&tmp_output)) == 0) {
             tmp_path = tmp_output;
             free(tmp_output);
 
@@ -225,6 +299,9 @@ int handle_connection(const string &basedir, CompileJob *job,
             // the work_it() function will rewrite the tmp build directory as root, effectively
             // letting us set up a "chroot"ed environment inside the build folder and letting
             // us set up the paths to mimic the client system
+            //
+            // jobs preprocessed here need that as well, their source and headers
+            // are put into the same places as on the client
 
             string job_output_file = job->outputFile();
             string job_working_dir = job->workingDirectory();
@@ -260,9 +337,21 @@ int handle_connection(const string &basedir, CompileJob *job,
             }
 
             obj_file = output_dir + '/' + file_name;
-            dwo_file = obj_file.substr(0, obj_file.find_last_of('.')) + ".dwo";
 
-            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd, -1);
+            if (job->dwarfFissionEnabled()) {
+                dwo_file = obj_file.substr(0, obj_file.find_last_of('.')) + ".dwo";
+            }
+
+            if (job->preprocessRemotely()) {
+                dep_file = tmp_path + "/.icecc.d";
+                deps = header_cache_receive(header_fd, client, *job, tmp_path, dep_file, job_stat);
+            }
+
+            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd, -1, &input_hash);
+        }
+        else if (job->preprocessRemotely()) {
+            error_client(client, "could not create tmp directory for the sources");
+            throw myexception(EXIT_IO_ERROR);
         }
         else if ((ret = dcc_make_tmpnam(prefix_output, ".o", &tmp_output, 0)) == 0) {
             obj_file = tmp_output;
@@ -270,7 +359,7 @@ int handle_connection(const string &basedir, CompileJob *job,
             string build_path = obj_file.substr(0, obj_file.find_last_of('/'));
             string file_name = obj_file.substr(obj_file.find_last_of('/')+1);
 
-            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd, -1);
+            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd, -1, &input_hash);
         }
 
         if (ret) {
@@ -281,6 +370,11 @@ int handle_connection(const string &basedir, CompileJob *job,
             }
         }
 
+        if (job->preprocessRemotely()) {
+            strip_root(rmsg.out, tmp_path);
+            strip_root(rmsg.err, tmp_path);
+        }
+
         if (!client->send_msg(rmsg)) {
             log_info() << "write of result failed" << endl;
             throw myexception(EXIT_DISTCC_FAILED);
@@ -295,6 +389,16 @@ int handle_connection(const string &basedir, CompileJob *job,
             job_stat[JobStatistics::out_uncompressed] += st.st_size;
         }
 
+        // the key is only good for the source it was derived from
+        if (rmsg.status == 0 && cache_fd >= 0 && input_hash != job->sourceHash()) {
+            log_warning() << "job " << job->jobID() << " from " << client->name
+                          << " sent other source than it said, not caching it" << endl;
+        } else if (rmsg.status == 0 && cache_fd >= 0) {
+            object_cache_store(cache_fd, job->cacheKey(), obj_file,
+                               rmsg.have_dwo_file ? dwo_file : string(), rmsg.out, rmsg.err);
+            job_stat[JobStatistics::to_cache] = 1;
+        }
+
         /* wake up parent and tell him that compile finished */
         /* if the write failed, well, doesn't matter */
         ignore_result(write(out_fd, job_stat, sizeof(job_stat)));
@@ -307,11 +411,19 @@ int handle_connection(const string &basedir, CompileJob *job,
             if (rmsg.have_dwo_file) {
                 write_output_file(dwo_file, client);
             }
+            if (deps) {
+                strip_root_from_file(dep_file, tmp_path);
+                write_output_file(dep_file, client);
+            }
         }
 
         throw myexception(rmsg.status);
 
     } catch (myexception e) {
+        if (client) {
+            trace() << "compression: " << client->compression_stats() << endl;
+        }
+
         delete client;
         client = 0;
 
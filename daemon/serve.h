@@ -33,6 +33,7 @@ extern int nice_level;
 
 int handle_connection(const std::string &basedir, CompileJob *job,
                       MsgChannel *serv, int & out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid);
+                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                      const std::string &objects_dir, const std::string &headers_dir);
 
 #endif
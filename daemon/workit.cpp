@@ -46,6 +46,9 @@
 #  include <sys/user.h>
 #endif
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 
 #if defined(__FreeBSD__) || defined(__DragonFly__) || defined(__APPLE__)
 #ifndef RUSAGE_SELF
@@ -59,8 +62,10 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string>
+#include <list>
 
 #include "comm.h"
+#include "fileio.h"
 #include "platform.h"
 #include "util.h"
 
@@ -68,6 +73,69 @@ using namespace std;
 
 static int death_pipe[2];
 
+/* The chunk buffers given to the compiler's stdin pipe with vmsplice().  The
+   pipe references their pages until the compiler has read them, so they
+   can't go back to the pool before that.  Whatever is left goes back when
+   work_it() is done, however it returns, as the compiler is gone by then
+   or its input doesn't matter anymore.  */
+class SplicedBuffers
+{
+public:
+    ~SplicedBuffers()
+    {
+        release(-1, 0);
+    }
+
+    bool empty() const
+    {
+        return m_buffers.empty();
+    }
+
+    // END is the pipe offset after the last byte of BUFFER
+    void add(unsigned char *buffer, size_t len, unsigned long long end)
+    {
+        m_buffers.push_back(Buffer(buffer, len, end));
+    }
+
+    /* Gives back the buffers the compiler is done with.  FD is the write
+       end of the pipe, or -1 if that is closed and the compiler is gone -
+       then all of them are done.  */
+    void release(int fd, unsigned long long written)
+    {
+        bool all = fd < 0;
+        unsigned long long consumed = written;
+
+        if (!all) {
+            int pending = 0;
+
+            if (ioctl(fd, FIONREAD, &pending) < 0) {
+                return;
+            }
+
+            consumed -= pending;
+        }
+
+        while (!m_buffers.empty() && (all || m_buffers.front().end <= consumed)) {
+            free_chunk_buffer(m_buffers.front().buffer, m_buffers.front().len);
+            m_buffers.pop_front();
+        }
+    }
+
+private:
+    struct Buffer {
+        Buffer(unsigned char *_buffer, size_t _len, unsigned long long _end)
+            : buffer(_buffer)
+            , len(_len)
+            , end(_end) {}
+
+        unsigned char *buffer;
+        size_t len;
+        unsigned long long end;
+    };
+
+    std::list<Buffer> m_buffers;
+};
+
 extern "C" {
 
     static void theSigCHLDHandler(int)
@@ -86,6 +154,24 @@ error_client(MsgChannel *client, string error)
     }
 }
 
+/* The smoothed round trip time the kernel measured on the connection to
+   the client, 0 if unknown (e.g. the job came over a multiplexed stream).  */
+static unsigned int connection_rtt(int fd)
+{
+#if defined(TCP_INFO) && defined(__linux__)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (fd >= 0 && !getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+        return info.tcpi_rtt;
+    }
+#else
+    (void) fd;
+#endif
+
+    return 0;
+}
+
 /*
  * This is all happening in a forked child.
  * That means that we can block and be lazy about closing fds
@@ -94,14 +180,20 @@ error_client(MsgChannel *client, string error)
 
 int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileResultMsg &rmsg,
             const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-            unsigned long int mem_limit, int client_fd, int /*job_in_fd*/)
+            unsigned long int mem_limit, int client_fd, int /*job_in_fd*/, string *input_hash)
 {
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
 
+    // the source and headers are in TMP_ROOT then, the compiler preprocesses
+    bool preprocess = j.preprocessRemotely();
     std::list<string> list = j.remoteFlags();
     appendList(list, j.restFlags());
 
+    if (preprocess) {
+        appendList(list, j.localFlags());
+    }
+
     if (j.dwarfFissionEnabled()) {
         list.push_back("-gsplit-dwarf");
     }
@@ -128,19 +220,32 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         return EXIT_DISTCC_FAILED;
     }
 
-    // We use a socket pair instead of a pipe to get a "slightly" bigger
-    // output buffer. This saves context switches and latencies.
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock_in) < 0) {
-        return EXIT_DISTCC_FAILED;
-    }
+    bool use_splice = false;
+#if defined(HAVE_VMSPLICE) && defined(F_SETPIPE_SZ)
+
+    // With a pipe the received chunks can be handed to the compiler with
+    // vmsplice(), without copying them into the kernel.
+    if (pipe(sock_in) == 0) {
+        // may fail if above /proc/sys/fs/pipe-max-size, the default works too
+        fcntl(sock_in[1], F_SETPIPE_SZ, 1024 * 1024);
+        use_splice = true;
+    } else
+#endif
+    {
+        // We use a socket pair instead of a pipe to get a "slightly" bigger
+        // output buffer. This saves context switches and latencies.
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock_in) < 0) {
+            return EXIT_DISTCC_FAILED;
+        }
 
-    int maxsize = 2 * 1024 * 2024;
+        int maxsize = 2 * 1024 * 2024;
 #ifdef SO_SNDBUFFORCE
 
-    if (setsockopt(sock_in[1], SOL_SOCKET, SO_SNDBUFFORCE, &maxsize, sizeof(maxsize)) < 0)
+        if (setsockopt(sock_in[1], SOL_SOCKET, SO_SNDBUFFORCE, &maxsize, sizeof(maxsize)) < 0)
 #endif
-    {
-        setsockopt(sock_in[1], SOL_SOCKET, SO_SNDBUF, &maxsize, sizeof(maxsize));
+        {
+            setsockopt(sock_in[1], SOL_SOCKET, SO_SNDBUF, &maxsize, sizeof(maxsize));
+        }
     }
 
     if (fcntl(sock_in[1], F_SETFL, O_NONBLOCK)) {
@@ -202,6 +307,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         argc += 4; // gpc parameters
         argc += 1; // -pipe
         argc += 9; // clang extra flags
+        argc += 2; // prefix maps
         char **argv = new char*[argc + 1];
         int i = 0;
         bool clang = false;
@@ -226,7 +332,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         if( clang ) {
             // gcc seems to handle setting main file name and working directory fine
             // (it gets it from the preprocessed info), but clang needs help
-            if( !j.inputFile().empty()) {
+            if( !j.inputFile().empty() && !preprocess) {
                 argv[i++] = strdup("-Xclang");
                 argv[i++] = strdup("-main-file-name");
                 argv[i++] = strdup("-Xclang");
@@ -256,7 +362,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             argv[i++] = strdup(it->c_str());
         }
 
-        if (!clang) {
+        if (!clang && !preprocess) {
             argv[i++] = strdup("-fpreprocessed");
         }
 
@@ -264,7 +370,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             argv[i++] = strdup("-pipe");
         }
 
-        argv[i++] = strdup("-");
+        argv[i++] = strdup(preprocess ? j.inputFile().c_str() : "-");
         argv[i++] = strdup("-o");
         argv[i++] = strdup(file_name.c_str());
 
@@ -281,11 +387,17 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             argv[i++] = strdup("-no-canonical-prefixes");    // otherwise clang tries to access /proc/self/exe
         }
 
-        if (!clang && j.dwarfFissionEnabled()) {
+        if (preprocess || (!clang && j.dwarfFissionEnabled())) {
             sprintf(buffer, "-fdebug-prefix-map=%s/=/", tmp_root.c_str());
             argv[i++] = strdup(buffer);
         }
 
+        // __FILE__ of the headers
+        if (preprocess) {
+            sprintf(buffer, "-fmacro-prefix-map=%s/=/", tmp_root.c_str());
+            argv[i++] = strdup(buffer);
+        }
+
         // before you add new args, check above for argc
         argv[i] = 0;
         assert(i <= argc);
@@ -400,17 +512,40 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
 
     struct timeval starttv;
     gettimeofday(&starttv, 0);
+    // when the first chunk of the preprocessed source came in
+    struct timeval inputtv;
+    timerclear(&inputtv);
 
     int return_value = 0;
     // Got EOF for preprocessed input. stdout send may be still pending.
-    bool input_complete = false;
+    bool input_complete = preprocess;
     // Pending data to send to stdin
     FileChunkMsg *fcmsg = 0;
     size_t off = 0;
+    // what went into the compiler's stdin, with and without copying
+    unsigned long long spliced_bytes = 0;
+    unsigned long long copied_bytes = 0;
+    SplicedBuffers spliced_buffers;
+    md5_state_t input_md5;
+    md5_init(&input_md5);
+
+    if (preprocess) {
+        // the compiler reads the source itself
+        job_stat[JobStatistics::rtt_usec] = connection_rtt(client_fd);
+
+        if (-1 == close(sock_in[1])){
+            log_perror("close failed");
+        }
+        sock_in[1] = -1;
+    }
 
     log_block parent_wait("parent, waiting");
 
     for (;;) {
+        if (!spliced_buffers.empty() && sock_in[1] != -1) {
+            spliced_buffers.release(sock_in[1], spliced_bytes + copied_bytes);
+        }
+
         if (client_fd >= 0 && !fcmsg) {
             if (Msg *msg = client->get_msg(0)) {
                 if (input_complete) {
@@ -425,6 +560,18 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     if (msg->type == M_END) {
                         input_complete = true;
 
+                        /* What the link to the submitter achieved, for the
+                           scheduler to place jobs by it.  Input that came
+                           as cpp produced it says nothing about the link.  */
+                        if (timerisset(&inputtv) && !j.inputFromCpp()) {
+                            struct timeval endtv;
+                            gettimeofday(&endtv, 0);
+                            job_stat[JobStatistics::in_msec] = (endtv.tv_sec - inputtv.tv_sec) * 1000
+                                                               + (endtv.tv_usec - inputtv.tv_usec) / 1000;
+                        }
+
+                        job_stat[JobStatistics::rtt_usec] = connection_rtt(client_fd);
+
                         if (!fcmsg && sock_in[1] != -1) {
                             if (-1 == close(sock_in[1])){
                                 log_perror("close failed");
@@ -437,8 +584,16 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                         fcmsg = static_cast<FileChunkMsg*>(msg);
                         off = 0;
 
+                        if (!timerisset(&inputtv)) {
+                            gettimeofday(&inputtv, 0);
+                        }
+
                         job_stat[JobStatistics::in_uncompressed] += fcmsg->len;
                         job_stat[JobStatistics::in_compressed] += fcmsg->compressed;
+
+                        if (input_hash) {
+                            md5_append(&input_md5, fcmsg->buffer, fcmsg->len);
+                        }
                     } else {
                         log_error() << "protocol error while reading preprocessed file" << endl;
                         return_value = EXIT_IO_ERROR;
@@ -559,10 +714,36 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         default:
 
             if (fcmsg && FD_ISSET(sock_in[1], &wfds)) {
-                ssize_t bytes = write(sock_in[1], fcmsg->buffer + off, fcmsg->len - off);
+                ssize_t bytes;
+#ifdef HAVE_VMSPLICE
+
+                if (use_splice) {
+                    struct iovec iov;
+                    iov.iov_base = fcmsg->buffer + off;
+                    iov.iov_len = fcmsg->len - off;
+                    bytes = vmsplice(sock_in[1], &iov, 1, SPLICE_F_NONBLOCK);
+
+                    if (bytes < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                        log_warning() << "vmsplice() not usable, copying compiler input" << endl;
+                        use_splice = false;
+                        continue;
+                    }
+
+                    if (bytes > 0) {
+                        spliced_bytes += bytes;
+                    }
+                } else
+#endif
+                {
+                    bytes = write(sock_in[1], fcmsg->buffer + off, fcmsg->len - off);
+
+                    if (bytes > 0) {
+                        copied_bytes += bytes;
+                    }
+                }
 
                 if (bytes < 0) {
-                    if (errno == EINTR) {
+                    if (errno == EINTR || errno == EAGAIN) {
                         continue;
                     }
 
@@ -585,6 +766,11 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                 off += bytes;
 
                 if (off == fcmsg->len) {
+                    if (spliced_bytes) {
+                        spliced_buffers.add(fcmsg->buffer, fcmsg->len, spliced_bytes + copied_bytes);
+                        fcmsg->del_buf = false;
+                    }
+
                     delete fcmsg;
                     fcmsg = 0;
 
@@ -639,6 +825,12 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     return EXIT_DISTCC_FAILED;
                 }
 
+                // the compiler is gone, nobody references the pipe anymore
+                spliced_buffers.release(-1, spliced_bytes + copied_bytes);
+                trace() << "compiler input: " << spliced_bytes << " bytes spliced, "
+                        << copied_bytes << " bytes copied, "
+                        << chunk_buffers_allocated() << " chunk buffers allocated" << endl;
+
                 if (shell_exit_status(status) != 0) {
                     unsigned long int mem_used = ((ru.ru_minflt + ru.ru_majflt) * getpagesize()) / 1024;
                     rmsg.status = EXIT_OUT_OF_MEMORY;
@@ -659,6 +851,10 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     gettimeofday(&endtv, 0);
                     rmsg.status = shell_exit_status(status);
                     rmsg.have_dwo_file = j.dwarfFissionEnabled();
+
+                    if (input_hash && input_complete && !preprocess) {
+                        *input_hash = md5_hex(input_md5);
+                    }
                     job_stat[JobStatistics::exit_code] = shell_exit_status(status);
                     job_stat[JobStatistics::real_msec] = ((endtv.tv_sec - starttv.tv_sec) * 1000)
                                                          + ((long(endtv.tv_usec) - long(starttv.tv_usec)) / 1000);
@@ -47,12 +47,15 @@ public:
 namespace JobStatistics
 {
 enum job_stat_fields { in_compressed, in_uncompressed, out_uncompressed, exit_code,
-                       real_msec, user_msec, sys_msec, sys_pfaults
+                       real_msec, user_msec, sys_msec, sys_pfaults,
+                       in_msec, rtt_usec, from_cache, to_cache, num_job_stats
                      };
 }
 
+// INPUT_HASH, if given, gets the md5 sum of the source the client sent
 extern int work_it(CompileJob &j, unsigned int job_stats[], MsgChannel *client, CompileResultMsg &msg,
                    const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-                   unsigned long int mem_limit, int client_fd, int job_in_fd);
+                   unsigned long int mem_limit, int client_fd, int job_in_fd,
+                   std::string *input_hash = 0);
 
 #endif
@@ -24,6 +24,7 @@
 #include "compileserver.h"
 
 #include <algorithm>
+#include <stdio.h>
 #include <time.h>
 
 #include "../services/logging.h"
@@ -46,6 +47,12 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_noRemote(false)
     , m_jobList()
     , m_submittedJobsCount(0)
+    , m_leases()
+    , m_objectFilter()
+    , m_envSpace(0)
+    , m_preinstalling()
+    , m_preinstallingSince(0)
+    , m_preinstallFailed()
     , m_state(CONNECTED)
     , m_type(UNKNOWN)
     , m_chrootPossible(false)
@@ -56,6 +63,8 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_cumRequested()
     , m_clientMap()
     , m_blacklist()
+    , m_links()
+    , m_transferSize(0)
 {
 }
 
@@ -271,6 +280,68 @@ void CompileServer::submittedJobsDecrement()
     m_submittedJobsCount--;
 }
 
+list<Job *> CompileServer::leases() const
+{
+    return m_leases;
+}
+
+void CompileServer::appendLease(Job *job)
+{
+    m_leases.push_back(job);
+}
+
+void CompileServer::removeLease(Job *job)
+{
+    m_leases.remove(job);
+}
+
+void CompileServer::setObjectFilter(const BloomFilter &filter)
+{
+    m_objectFilter = filter;
+}
+
+bool CompileServer::mayHaveObject(const string &key) const
+{
+    return !key.empty() && m_objectFilter.may_contain(key);
+}
+
+unsigned int CompileServer::envSpace() const
+{
+    return m_envSpace;
+}
+
+void CompileServer::setEnvSpace(unsigned int space)
+{
+    m_envSpace = space;
+}
+
+string CompileServer::preinstalling() const
+{
+    return m_preinstalling;
+}
+
+time_t CompileServer::preinstallingSince() const
+{
+    return m_preinstallingSince;
+}
+
+void CompileServer::setPreinstalling(const string &env, time_t since)
+{
+    m_preinstalling = env;
+    m_preinstallingSince = since;
+}
+
+time_t CompileServer::preinstallFailed(const string &env) const
+{
+    map<string, time_t>::const_iterator it = m_preinstallFailed.find(env);
+    return it != m_preinstallFailed.end() ? it->second : 0;
+}
+
+void CompileServer::setPreinstallFailed(const string &env, time_t when)
+{
+    m_preinstallFailed[env] = when;
+}
+
 CompileServer::State CompileServer::state() const
 {
     return m_state;
@@ -401,3 +472,72 @@ bool CompileServer::blacklisted(const Job *job, const pair<string, string> &envi
     Environments blacklist = job->submitter()->getEnvsForBlacklistedCS(this);
     return find(blacklist.begin(), blacklist.end(), environment) != blacklist.end();
 }
+
+/* Weight of a new measurement in the running averages of the links.  */
+static const float new_sample_weight = 0.25;
+
+static void update_average(float &avg, float sample)
+{
+    if (avg <= 0) {
+        avg = sample;
+    } else {
+        avg = avg * (1 - new_sample_weight) + sample * new_sample_weight;
+    }
+}
+
+void CompileServer::recordTransfer(const string &submitter, unsigned int bytes,
+                                   unsigned int msec, unsigned int rtt_usec)
+{
+    Link &link = m_links[submitter];
+
+    // small inputs say more about latency and the preprocessor than the link
+    if (bytes >= 16384 && msec > 0) {
+        update_average(link.bytesPerMsec, float(bytes) / msec);
+    }
+
+    if (rtt_usec > 0) {
+        update_average(link.rttMsec, rtt_usec / 1000.0);
+    }
+}
+
+float CompileServer::transferTime(const string &submitter, float bytes) const
+{
+    map<string, Link>::const_iterator it = m_links.find(submitter);
+
+    if (it == m_links.end()) {
+        return 0;
+    }
+
+    // connecting and the protocol setup take a few round trips
+    float t = 3 * it->second.rttMsec;
+
+    if (it->second.bytesPerMsec > 0) {
+        t += bytes / it->second.bytesPerMsec;
+    }
+
+    return t;
+}
+
+string CompileServer::linkStats() const
+{
+    string result;
+    char buffer[200];
+
+    for (map<string, Link>::const_iterator it = m_links.begin(); it != m_links.end(); ++it) {
+        sprintf(buffer, " from %s: %.0f KiB/s rtt=%.2fms", it->first.c_str(),
+                it->second.bytesPerMsec * 1000 / 1024, it->second.rttMsec);
+        result += buffer;
+    }
+
+    return result;
+}
+
+float CompileServer::averageTransferSize() const
+{
+    return m_transferSize;
+}
+
+void CompileServer::recordTransferSize(unsigned int bytes)
+{
+    update_average(m_transferSize, bytes);
+}
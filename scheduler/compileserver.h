@@ -28,6 +28,7 @@
 #include <list>
 #include <map>
 
+#include "../services/bloomfilter.h"
 #include "../services/comm.h"
 #include "jobstat.h"
 
@@ -94,6 +95,28 @@ public:
     void submittedJobsIncrement();
     void submittedJobsDecrement();
 
+    // jobs placed ahead for this submitter, which it didn't ask for yet
+    list<Job *> leases() const;
+    void appendLease(Job *job);
+    void removeLease(Job *job);
+
+    // from M_STATS, what the daemon has in its object cache
+    void setObjectFilter(const BloomFilter &filter);
+    bool mayHaveObject(const string &key) const;
+
+    // from M_STATS, how many MB of environments the daemon can still take
+    unsigned int envSpace() const;
+    void setEnvSpace(unsigned int space);
+
+    /* The environment (<target>/<name>) the daemon was told to install
+       ahead of demand, and since when, or empty.  */
+    string preinstalling() const;
+    time_t preinstallingSince() const;
+    void setPreinstalling(const string &env, time_t since);
+    // when installing ENV ahead failed the last time, 0 if it never did
+    time_t preinstallFailed(const string &env) const;
+    void setPreinstallFailed(const string &env, time_t when);
+
     State state() const;
     void setState(const State state);
 
@@ -120,6 +143,17 @@ public:
     JobStat cumRequested() const;
     void setCumRequested(const JobStat &stats);
 
+    /* What moving the input of a job from the node SUBMITTER to this
+       server achieved.  Either of BYTES/MSEC or RTT_USEC may be 0.  */
+    void recordTransfer(const string &submitter, unsigned int bytes, unsigned int msec,
+                        unsigned int rtt_usec);
+    // predicted milliseconds to move BYTES from SUBMITTER here, 0 if never measured
+    float transferTime(const string &submitter, float bytes) const;
+    string linkStats() const;
+
+    // what the jobs of this submitter usually move over the network, in bytes
+    float averageTransferSize() const;
+    void recordTransferSize(unsigned int bytes);
 
     unsigned int hostidCounter() const;
 
@@ -135,6 +169,15 @@ public:
 private:
     bool blacklisted(const Job *job, const pair<string, string> &environment);
 
+    struct Link {
+        Link()
+            : bytesPerMsec(0)
+            , rttMsec(0) {}
+
+        float bytesPerMsec;   // 0 if unknown
+        float rttMsec;        // 0 if unknown
+    };
+
     /* The listener port, on which it takes compile requests.  */
     unsigned int m_remotePort;
     unsigned int m_hostId;
@@ -148,6 +191,12 @@ private:
     bool m_noRemote;
     list<Job *> m_jobList;
     int m_submittedJobsCount;
+    list<Job *> m_leases;
+    BloomFilter m_objectFilter;
+    unsigned int m_envSpace;
+    string m_preinstalling;
+    time_t m_preinstallingSince;
+    map<string, time_t> m_preinstallFailed;
     State m_state;
     Type m_type;
     bool m_chrootPossible;
@@ -162,6 +211,9 @@ private:
     static unsigned int s_hostIdCounter;
     map<int, int> m_clientMap; // map client ID for daemon to our IDs
     map<CompileServer *, Environments> m_blacklist;
+
+    map<string, Link> m_links;  // by the node name of the submitter
+    float m_transferSize;
 };
 
 #endif
@@ -41,6 +41,8 @@ Job::Job(const unsigned int _id, CompileServer *subm)
     , m_language()
     , m_preferredHost()
     , m_minimalHostVersion(0)
+    , m_leaseExpiry(0)
+    , m_cacheKey()
 {
     m_submitter->submittedJobsIncrement();
 }
@@ -222,3 +224,23 @@ void Job::setMinimalHostVersion(int version)
 {
     m_minimalHostVersion = version;
 }
+
+time_t Job::leaseExpiry() const
+{
+    return m_leaseExpiry;
+}
+
+void Job::setLeaseExpiry(const time_t time)
+{
+    m_leaseExpiry = time;
+}
+
+std::string Job::cacheKey() const
+{
+    return m_cacheKey;
+}
+
+void Job::setCacheKey(const std::string &key)
+{
+    m_cacheKey = key;
+}
@@ -94,6 +94,14 @@ public:
     int minimalHostVersion() const;
     void setMinimalHostVersion( int version );
 
+    // non-zero while the job is leased to the submitter, but not used yet
+    time_t leaseExpiry() const;
+    void setLeaseExpiry(const time_t time);
+
+    // of the result, if the submitter asks the object caches of the hosts
+    std::string cacheKey() const;
+    void setCacheKey(const std::string &key);
+
 private:
     unsigned int m_id;
     unsigned int m_localClientId;
@@ -118,6 +126,8 @@ private:
     std::string m_language; // for debugging
     std::string m_preferredHost; // for debugging daemons
     int m_minimalHostVersion; // minimal version required for the the remote server
+    time_t m_leaseExpiry;
+    std::string m_cacheKey;
 };
 
 #endif
@@ -0,0 +1,89 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "lease.h"
+#include "compileserver.h"
+#include "job.h"
+
+using namespace std;
+
+int leases_wanted(const CompileServer *submitter)
+{
+    int leases = submitter->leases().size();
+
+    if (!IS_PROTOCOL_41(submitter) || submitter->submittedJobsCount() - leases < LEASE_BUSY_JOBS) {
+        return 0;
+    }
+
+    return MAX_LEASES - leases;
+}
+
+bool can_lease(CompileServer *cs, const Job *lease)
+{
+    return cs != lease->submitter() && int(cs->jobList().size()) < cs->maxJobs();
+}
+
+void grant_lease(Job *lease, CompileServer *cs, time_t now)
+{
+    lease->setState(Job::WAITINGFORCS);
+    lease->setServer(cs);
+    lease->setLeaseExpiry(now + LEASE_TIME + LEASE_GRACE);
+    cs->appendJob(lease);
+    lease->submitter()->appendLease(lease);
+}
+
+/* JOB_BEGIN and USE_LEASE may come in any order, the second one finds
+   the lease used already.  */
+void use_lease(Job *lease)
+{
+    if (lease->leaseExpiry()) {
+        lease->setLeaseExpiry(0);
+        lease->submitter()->removeLease(lease);
+    }
+}
+
+void revoke_lease(Job *lease)
+{
+    lease->submitter()->removeLease(lease);
+
+    if (lease->server()) {
+        lease->server()->removeJob(lease);
+    }
+}
+
+list<Job *> expire_leases(CompileServer *submitter, time_t now, time_t &next)
+{
+    list<Job *> leases = submitter->leases();
+    list<Job *> expired;
+    next = 0;
+
+    for (list<Job *>::const_iterator it = leases.begin(); it != leases.end(); ++it) {
+        if ((*it)->leaseExpiry() <= now) {
+            revoke_lease(*it);
+            expired.push_back(*it);
+        } else if (!next || (*it)->leaseExpiry() < next) {
+            next = (*it)->leaseExpiry();
+        }
+    }
+
+    return expired;
+}
@@ -0,0 +1,64 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <list>
+#include <time.h>
+
+class CompileServer;
+class Job;
+
+// how many jobs a busy submitter may get placed ahead, and for how long
+#define MAX_LEASES 4
+#define LEASE_TIME 5
+// the daemon gives leases back after LEASE_TIME, we drop them a bit later
+#define LEASE_GRACE 5
+// jobs a submitter needs to have running or waiting to count as busy
+#define LEASE_BUSY_JOBS 2
+
+/* Leases are jobs placed ahead of time for a busy submitter
+   (IS_PROTOCOL_41), so its daemon can answer the next clients itself.
+   Until the daemon uses it, a lease takes a slot on its server and has
+   a lease expiry.  */
+
+// how many more leases SUBMITTER should get now
+int leases_wanted(const CompileServer *submitter);
+
+// whether CS has a slot for LEASE, never one of the submitter itself
+bool can_lease(CompileServer *cs, const Job *lease);
+
+// places LEASE on CS until NOW + LEASE_TIME + LEASE_GRACE
+void grant_lease(Job *lease, CompileServer *cs, time_t now);
+
+// the submitter uses LEASE, it is a normal job from now on
+void use_lease(Job *lease);
+
+// takes LEASE from its server and its submitter, for the caller to delete
+void revoke_lease(Job *lease);
+
+/* The leases of SUBMITTER that expired at NOW, already revoked.  NEXT is
+   set to the expiry of the first one left, 0 if there is none.  */
+std::list<Job *> expire_leases(CompileServer *submitter, time_t now, time_t &next);
+
+#endif
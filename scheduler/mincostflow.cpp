@@ -0,0 +1,108 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "mincostflow.h"
+
+#include <deque>
+#include <limits>
+
+using namespace std;
+
+MinCostFlow::MinCostFlow(int nodes)
+    : m_out(nodes)
+{
+}
+
+int MinCostFlow::add_edge(int from, int to, long long capacity, long long cost)
+{
+    Edge forward = { to, capacity, cost };
+    Edge backward = { from, 0, -cost };
+
+    m_out[from].push_back(m_edges.size());
+    m_edges.push_back(forward);
+    m_initial.push_back(capacity);
+    m_out[to].push_back(m_edges.size());
+    m_edges.push_back(backward);
+    m_initial.push_back(0);
+    return m_edges.size() - 2;
+}
+
+long long MinCostFlow::solve(int source, int sink)
+{
+    const long long unreached = numeric_limits<long long>::max();
+    long long total = 0;
+    vector<long long> dist(m_out.size());
+    vector<int> via(m_out.size());
+    vector<bool> queued(m_out.size());
+
+    for (;;) {
+        // the cheapest path with capacity left, Bellman-Ford with a queue
+        dist.assign(m_out.size(), unreached);
+        via.assign(m_out.size(), -1);
+        dist[source] = 0;
+        deque<int> todo(1, source);
+        queued[source] = true;
+
+        while (!todo.empty()) {
+            int node = todo.front();
+            todo.pop_front();
+            queued[node] = false;
+
+            for (vector<int>::const_iterator it = m_out[node].begin(); it != m_out[node].end(); ++it) {
+                const Edge &e = m_edges[*it];
+
+                if (e.capacity > 0 && dist[node] + e.cost < dist[e.to]) {
+                    dist[e.to] = dist[node] + e.cost;
+                    via[e.to] = *it;
+
+                    if (!queued[e.to]) {
+                        queued[e.to] = true;
+                        todo.push_back(e.to);
+                    }
+                }
+            }
+        }
+
+        if (dist[sink] == unreached) {
+            return total;
+        }
+
+        long long amount = unreached;
+
+        for (int node = sink; node != source; node = m_edges[via[node] ^ 1].to) {
+            amount = min(amount, m_edges[via[node]].capacity);
+        }
+
+        for (int node = sink; node != source; node = m_edges[via[node] ^ 1].to) {
+            m_edges[via[node]].capacity -= amount;
+            m_edges[via[node] ^ 1].capacity += amount;
+        }
+
+        total += amount;
+    }
+}
+
+long long MinCostFlow::flow(int edge) const
+{
+    return m_initial[edge] - m_edges[edge].capacity;
+}
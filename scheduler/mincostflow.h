@@ -0,0 +1,60 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef MINCOSTFLOW_H
+#define MINCOSTFLOW_H
+
+#include <vector>
+
+/* Minimum cost flow by successive shortest paths.  Meant for the small
+   networks of the job placement (a node per kind of job and per host),
+   so the paths are found with Bellman-Ford, which also copes with the
+   negative costs some edges have.  The network must not contain a cycle
+   of negative cost.  */
+class MinCostFlow
+{
+public:
+    explicit MinCostFlow(int nodes);
+
+    // returns the edge's index, to ask for its flow later
+    int add_edge(int from, int to, long long capacity, long long cost);
+
+    // sends as much as possible from SOURCE to SINK, as cheap as possible
+    long long solve(int source, int sink);
+
+    long long flow(int edge) const;
+
+private:
+    struct Edge {
+        int to;
+        long long capacity;   // what is left
+        long long cost;
+    };
+
+    // edges come in pairs, the odd ones are the reverse of the one before
+    std::vector<Edge> m_edges;
+    std::vector<std::vector<int> > m_out;
+    std::vector<long long> m_initial;
+};
+
+#endif
@@ -0,0 +1,122 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "preinstall.h"
+#include "compileserver.h"
+#include "../services/logging.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static void decay_demand(EnvDemand &demand, time_t now)
+{
+    time_t periods = (now - demand.decayed) / DEMAND_PERIOD;
+
+    if (periods > 0) {
+        demand.recent = periods >= 32 ? 0 : demand.recent >> periods;
+        demand.decayed += periods * DEMAND_PERIOD;
+    }
+}
+
+void note_env_demand(EnvDemands &demands, const EnvRequest &request, unsigned int count,
+                     time_t now)
+{
+    EnvDemand &demand = demands[request];
+    decay_demand(demand, now);
+    demand.recent += count;
+}
+
+list<pair<unsigned int, const EnvRequest *> > hot_env_requests(EnvDemands &demands, time_t now)
+{
+    multimap<unsigned int, const EnvRequest *> hot;   // by demand
+
+    for (EnvDemands::iterator it = demands.begin(); it != demands.end();) {
+        decay_demand(it->second, now);
+
+        if (!it->second.recent) {
+            demands.erase(it++);
+            continue;
+        }
+
+        if (it->second.recent >= PREINSTALL_MIN_DEMAND) {
+            hot.insert(make_pair(it->second.recent, &it->first));
+        }
+
+        ++it;
+    }
+
+    return list<pair<unsigned int, const EnvRequest *> >(hot.rbegin(), hot.rend());
+}
+
+bool preinstall_running(CompileServer *cs, time_t now)
+{
+    if (cs->preinstalling().empty()) {
+        return false;
+    }
+
+    if (now - cs->preinstallingSince() < PREINSTALL_TIMEOUT) {
+        return true;
+    }
+
+    log_info() << "PREINSTALL " << cs->preinstalling() << " on " << cs->nodeName()
+               << " timed out" << endl;
+    cs->setPreinstallFailed(cs->preinstalling(), now);
+    cs->setPreinstalling(string(), 0);
+    return false;
+}
+
+bool can_preinstall(const CompileServer *cs)
+{
+    return IS_PROTOCOL_47(cs) && cs->maxJobs() > 0 && !cs->noRemote() && cs->remotePort()
+           && cs->chrootPossible() && cs->envSpace() && !cs->busyInstalling()
+           && cs->jobList().empty() && cs->load() < PREINSTALL_MAX_LOAD;
+}
+
+string missing_env(const CompileServer *cs, const string &target, const Environments &versions)
+{
+    Environments installed = cs->compilerVersions();
+    string name;
+
+    for (Environments::const_iterator it = versions.begin(); it != versions.end(); ++it) {
+        if (!cs->platforms_compatible(it->first)) {
+            continue;
+        }
+
+        if (find(installed.begin(), installed.end(), make_pair(target, it->second))
+                != installed.end()) {
+            return string();
+        }
+
+        if (name.empty()) {
+            name = it->second;
+        }
+    }
+
+    return name;
+}
+
+bool preinstall_failed_recently(const CompileServer *cs, const string &env, time_t now)
+{
+    time_t failed = cs->preinstallFailed(env);
+    return failed && now - failed < PREINSTALL_RETRY;
+}
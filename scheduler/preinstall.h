@@ -0,0 +1,86 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PREINSTALL_H
+#define PREINSTALL_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <time.h>
+
+#include "../services/comm.h"
+
+class CompileServer;
+
+/* Installing environments ahead of demand, see plan_preinstalls(): how
+   often to look for idle hosts, how many jobs (halved every DEMAND_PERIOD
+   seconds) make an environment worth it, how many hosts do it at a time,
+   and when to give up on one or try it again after it failed.  */
+#define PREINSTALL_INTERVAL 30
+#define PREINSTALL_MIN_DEMAND 8
+#define DEMAND_PERIOD 600
+#define MAX_PREINSTALLS 2
+#define PREINSTALL_TIMEOUT 600
+#define PREINSTALL_RETRY 1800
+// hosts with more load than this are not idle
+#define PREINSTALL_MAX_LOAD 300
+
+/* How many jobs were asked for lately with the environments a client
+   offered for a target platform, halved every DEMAND_PERIOD.  */
+struct EnvDemand {
+    EnvDemand()
+        : recent(0)
+        , decayed(time(0)) {}
+
+    unsigned int recent;
+    time_t decayed;
+};
+typedef std::pair<std::string, Environments> EnvRequest;   // target, environments
+typedef std::map<EnvRequest, EnvDemand> EnvDemands;
+
+// COUNT jobs were asked for with REQUEST at NOW
+void note_env_demand(EnvDemands &demands, const EnvRequest &request, unsigned int count,
+                     time_t now);
+
+/* The requests of DEMANDS wanted enough at NOW to install them ahead,
+   most wanted first, with their recent jobs.  The ones nobody asked for
+   lately are forgotten.  */
+std::list<std::pair<unsigned int, const EnvRequest *> > hot_env_requests(EnvDemands &demands,
+                                                                         time_t now);
+
+/* Whether CS is still installing an environment ahead.  One that took
+   longer than PREINSTALL_TIMEOUT is given up on and counts as failed.  */
+bool preinstall_running(CompileServer *cs, time_t now);
+
+// whether CS is an idle host with room for another environment
+bool can_preinstall(const CompileServer *cs);
+
+/* The environment of VERSIONS for TARGET that CS would install, empty
+   if it has one of them already or can run none of them.  */
+std::string missing_env(const CompileServer *cs, const std::string &target,
+                        const Environments &versions);
+
+// whether installing ENV failed on CS too recently to try it again
+bool preinstall_failed_recently(const CompileServer *cs, const std::string &env, time_t now);
+
+#endif
@@ -31,7 +31,6 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
 #include <sys/signal.h>
 #include <unistd.h>
 #include <errno.h>
@@ -42,23 +41,42 @@
 #include <string>
 #include <list>
 #include <map>
+#include <set>
+#include <vector>
 #include <queue>
 #include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <string>
 #include <stdio.h>
+#include <float.h>
 #include <pwd.h>
 #include "../services/comm.h"
 #include "../services/logging.h"
+#include "../services/reactor.h"
 #include "../services/job.h"
 #include "config.h"
 
 #include "compileserver.h"
 #include "job.h"
+#include "lease.h"
+#include "mincostflow.h"
+#include "preinstall.h"
+#include "timerwheel.h"
 
 #define DEBUG_SCHEDULER 0
 
+// how many waiting jobs place_jobs() looks at per free slot
+#define PLACE_LOOKAHEAD 4
+/* The costs of placing a job, in milliseconds: installing an environment,
+   a host whose speed we don't know yet, and a submitter that has to take
+   its own job although it's not eligible (see empty_queue()).  */
+#define INSTALL_COST 2000
+#define UNKNOWN_SPEED_COST 600000
+#define LAST_RESORT_COST (4 * UNKNOWN_SPEED_COST)
+// how many daemons with the environment a server that lacks it is told about
+#define MAX_ENV_PEERS 3
+
 /* TODO:
    * leak check
    * are all filedescs closed when done?
@@ -94,6 +112,25 @@ using namespace std;
 static string pidFilePath;
 
 static map<int, CompileServer *> fd2cs;
+static Reactor reactor;
+// deadlines of daemons and control connections, see check_timeouts()
+static TimerWheel timers;
+// channels with input buffered outside of the main loop
+static set<int> buffered_fds;
+
+static void add_channel(CompileServer *cs)
+{
+    fd2cs[cs->fd] = cs;
+    reactor.add(cs->fd, true);
+}
+
+static void remove_channel(CompileServer *cs)
+{
+    fd2cs.erase(cs->fd);
+    reactor.remove(cs->fd);
+    timers.cancel(cs->fd);
+    buffered_fds.erase(cs->fd);
+}
 static volatile sig_atomic_t exit_main_loop = false;
 
 time_t starttime;
@@ -116,10 +153,16 @@ struct UnansweredList {
     bool remove_job(Job *);
 };
 static list<UnansweredList *> toanswer;
+/* Ids of the waiting jobs whose result is probably in the object cache
+   of some host, see place_cached_job().  */
+static set<unsigned int> cached_jobs;
 
 static list<JobStat> all_job_stats;
 static JobStat cum_job_stats;
 
+static EnvDemands env_demand;
+static time_t last_preinstall_plan;
+
 static float server_speed(CompileServer *cs, Job *job = 0);
 static void broadcast_scheduler_version();
 
@@ -142,9 +185,10 @@ static void add_job_stats(Job *job, JobDoneMsg *msg)
 {
     JobStat st;
 
-    /* We don't want to base our timings on failed or too small jobs.  */
+    /* We don't want to base our timings on failed, too small or cached jobs.  */
     if (msg->out_uncompressed < 4096
-            || msg->exitcode != 0) {
+            || msg->exitcode != 0
+            || msg->is_from_cache()) {
         return;
     }
 
@@ -385,6 +429,10 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
 
     CompileServer *submitter = static_cast<CompileServer *>(cs);
 
+    if (!m->versions.empty()) {
+        note_env_demand(env_demand, make_pair(m->target, m->versions), m->count, time(0));
+    }
+
     Job *master_job = 0;
 
     for (unsigned int i = 0; i < m->count; ++i) {
@@ -397,7 +445,16 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
         job->setLocalClientId(m->client_id);
         job->setPreferredHost(m->preferred_host);
         job->setMinimalHostVersion(m->minimal_host_version);
+        job->setCacheKey(m->cache_key);
         enqueue_job_request(job);
+
+        for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+            if ((*it)->mayHaveObject(job->cacheKey())) {
+                cached_jobs.insert(job->id());
+                break;
+            }
+        }
+
         std::ostream &dbg = log_info();
         dbg << "NEW " << job->id() << " client="
             << submitter->nodeName() << " versions=[";
@@ -426,6 +483,76 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
     return true;
 }
 
+// JOB is a revoked lease
+static void drop_lease(Job *job)
+{
+    trace() << "LEASE " << job->id() << " dropped" << endl;
+    jobs.erase(job->id());
+    delete job;
+}
+
+static void drop_expired_leases(CompileServer *submitter, time_t now)
+{
+    time_t next;
+    list<Job *> expired = expire_leases(submitter, now, next);
+
+    for (list<Job *>::const_iterator it = expired.begin(); it != expired.end(); ++it) {
+        drop_lease(*it);
+    }
+
+    if (next) {
+        timers.schedule(submitter->fd, next);
+    }
+}
+
+static bool handle_use_lease(CompileServer *cs, Msg *_m)
+{
+    UseLeaseMsg *m = dynamic_cast<UseLeaseMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    map<unsigned int, Job *>::const_iterator it = jobs.find(m->job_id);
+
+    if (it == jobs.end() || it->second->submitter() != cs) {
+        trace() << "handle_use_lease: no valid job id " << m->job_id << endl;
+        return true;
+    }
+
+    Job *job = it->second;
+    use_lease(job);
+    job->setLocalClientId(m->client_id);
+    job->setFileName(m->filename);
+    log_info() << "NEW " << job->id() << " client=" << cs->nodeName() << " leased "
+               << job->server()->nodeName() << " " << m->filename << " " << job->language()
+               << endl;
+
+    GetCSMsg request(Environments(), m->filename,
+                     (job->language() == "C") ? CompileJob::Lang_C : CompileJob::Lang_CXX, 1,
+                     job->targetPlatform(), job->argFlags(), string(), 0);
+    notify_monitors(new MonGetCSMsg(job->id(), cs->hostId(), &request));
+    return true;
+}
+
+static bool handle_return_lease(CompileServer *cs, Msg *_m)
+{
+    ReturnLeaseMsg *m = dynamic_cast<ReturnLeaseMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    map<unsigned int, Job *>::const_iterator it = jobs.find(m->job_id);
+
+    if (it != jobs.end() && it->second->submitter() == cs && it->second->leaseExpiry()) {
+        revoke_lease(it->second);
+        drop_lease(it->second);
+    }
+
+    return true;
+}
+
 static bool handle_local_job(CompileServer *cs, Msg *_m)
 {
     JobLocalBeginMsg *m = dynamic_cast<JobLocalBeginMsg *>(_m);
@@ -492,7 +619,66 @@ static string envs_match(CompileServer *cs, const Job *job)
     return string();
 }
 
-static CompileServer *pick_server(Job *job)
+/* Guesses what JOB will be like: the average of the jobs its submitter
+   had recently, or of all jobs if it had none.  */
+static JobStat guess_job(Job *job)
+{
+    if (job->submitter()->lastRequestedJobs().size() > 0) {
+        return job->submitter()->cumRequested() / job->submitter()->lastRequestedJobs().size();
+    }
+
+    return cum_job_stats / all_job_stats.size();
+}
+
+/* Milliseconds until JOB would be done on CS, looking like GUESS: moving
+   its data there and back plus compiling it.  */
+static float predicted_time(CompileServer *cs, Job *job, const JobStat &guess)
+{
+    float speed = server_speed(cs, job);
+
+    if (speed <= 0) {
+        return FLT_MAX;
+    }
+
+    float t = guess.outputSize() / speed;
+
+    if (cs != job->submitter()) {
+        t += cs->transferTime(job->submitter()->nodeName(),
+                              job->submitter()->averageTransferSize());
+    }
+
+    return t;
+}
+
+/* The least busy host with a free slot whose object cache probably has
+   the result of JOB, or 0.  A false positive of the filter only costs
+   the compile there.  */
+static CompileServer *pick_holder(Job *job)
+{
+    if (job->cacheKey().empty() || !job->preferredHost().empty()) {
+        return 0;
+    }
+
+    CompileServer *best = 0;
+
+    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *cs = *it;
+
+        if (!cs->mayHaveObject(job->cacheKey()) || !cs->is_eligible(job)
+                || envs_match(cs, job).empty()) {
+            continue;
+        }
+
+        if (!best || cs->jobList().size() < best->jobList().size()) {
+            best = cs;
+        }
+    }
+
+    return best;
+}
+
+// the best server for JOB, never EXCLUDE
+static CompileServer *pick_server(Job *job, const CompileServer *exclude = 0)
 {
 #if DEBUG_SCHEDULER > 1
     trace() << "pick_server " << job->id() << " " << job->targetPlatform() << endl;
@@ -534,13 +720,18 @@ static CompileServer *pick_server(Job *job)
         return 0;
     }
 
+    if (CompileServer *holder = pick_holder(job)) {
+        trace() << "taking " << holder->nodeName() << ", it has " << job->id() << " cached" << endl;
+        return holder;
+    }
+
     /* If we have no statistics simply use any server which is usable.  */
     if (!all_job_stats.size ()) {
         CompileServer *selected = NULL;
         int eligible_count = 0;
 
         for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
-            if ((*it)->is_eligible( job )) {
+            if (*it != exclude && (*it)->is_eligible( job )) {
                 ++eligible_count;
                 // Do not select the first one (which could be broken and so we might never get job stats),
                 // but rather select randomly.
@@ -557,17 +748,7 @@ static CompileServer *pick_server(Job *job)
         return 0;
     }
 
-    /* Now guess about the job.  First see, if this submitter already
-       had other jobs.  Use them as base.  */
-    JobStat guess;
-
-    if (job->submitter()->lastRequestedJobs().size() > 0) {
-        guess = job->submitter()->cumRequested()
-                / job->submitter()->lastRequestedJobs().size();
-    } else {
-        /* Otherwise simply average over all jobs.  */
-        guess = cum_job_stats / all_job_stats.size();
-    }
+    JobStat guess = guess_job(job);
 
     CompileServer *best = 0;
     // best uninstalled
@@ -580,6 +761,10 @@ static CompileServer *pick_server(Job *job)
     for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
         CompileServer *cs = *it;
 
+        if (cs == exclude) {
+            continue;
+        }
+
         /* For now ignore overloaded servers.  */
         /* Pre-loadable (cs->jobList().size()) == (cs->maxJobs()) is checked later.  */
         if ((int(cs->jobList().size()) > cs->maxJobs()) || (cs->load() >= 1000)) {
@@ -620,7 +805,8 @@ static CompileServer *pick_server(Job *job)
 #if DEBUG_SCHEDULER > 1
         trace() << cs->nodeName() << " compiled " << cs->lastCompiledJobs().size() << " got now: " <<
                 cs->jobList().size() << " speed: " << server_speed(cs, job) << " compile time " <<
-                cs->cumCompiled().compileTimeUser() << " produced code " << cs->cumCompiled().outputSize() << endl;
+                cs->cumCompiled().compileTimeUser() << " produced code " << cs->cumCompiled().outputSize() <<
+                " predicted " << predicted_time(cs, job, guess) << "ms" << endl;
 #endif
 
         if ((cs->lastCompiledJobs().size() == 0) && (cs->jobList().size() == 0) && cs->maxJobs()) {
@@ -642,10 +828,10 @@ static CompileServer *pick_server(Job *job)
             if (!best) {
                 best = cs;
             }
-            /* Search the server with the earliest projected time to compile
-               the job.  (XXX currently this is equivalent to the fastest one)  */
+            /* Search the server with the earliest projected time to have
+               the job done, including getting the data there and back.  */
             else if ((best->lastCompiledJobs().size() != 0)
-                     && (server_speed(best, job) < server_speed(cs, job))) {
+                     && (predicted_time(cs, job, guess) < predicted_time(best, job, guess))) {
                 if (int(cs->jobList().size()) < cs->maxJobs()) {
                     best = cs;
                 } else {
@@ -658,10 +844,10 @@ static CompileServer *pick_server(Job *job)
             if (!bestui) {
                 bestui = cs;
             }
-            /* Search the server with the earliest projected time to compile
-               the job.  (XXX currently this is equivalent to the fastest one)  */
+            /* Search the server with the earliest projected time to have
+               the job done, including getting the data there and back.  */
             else if ((bestui->lastCompiledJobs().size() != 0)
-                     && (server_speed(bestui, job) < server_speed(cs, job))) {
+                     && (predicted_time(cs, job, guess) < predicted_time(bestui, job, guess))) {
                 if (int(cs->jobList().size()) < cs->maxJobs()) {
                     bestui = cs;
                 } else {
@@ -700,83 +886,93 @@ static CompileServer *pick_server(Job *job)
     return bestpre;
 }
 
-/* Prunes the list of connected servers by those which haven't
-   answered for a long time. Return the number of seconds when
-   we have to cleanup next time. */
-static time_t prune_servers()
+/* Checks the deadlines of CS, removes it if it hasn't answered for a
+   long time and arms its timer for the next deadline.  Returns false
+   if CS was removed.  */
+static bool check_timeouts(CompileServer *cs, time_t now)
 {
-    list<CompileServer *>::iterator it;
-
-    time_t now = time(0);
-    time_t min_time = MAX_SCHEDULER_PING;
-
-    for (it = controls.begin(); it != controls.end();) {
-        if ((now - (*it)->last_talk) >= MAX_SCHEDULER_PING) {
-            CompileServer *old = *it;
-            ++it;
-            handle_end(old, 0);
-            continue;
+    if (cs->type() == CompileServer::LINE) {
+        if ((now - cs->last_talk) >= MAX_SCHEDULER_PING) {
+            handle_end(cs, 0);
+            return false;
         }
 
-        min_time = min(min_time, MAX_SCHEDULER_PING - now + (*it)->last_talk);
-        ++it;
+        timers.schedule(cs->fd, cs->last_talk + MAX_SCHEDULER_PING);
+        return true;
     }
 
-    for (it = css.begin(); it != css.end();) {
-        if ((*it)->busyInstalling() && ((now - (*it)->busyInstalling()) >= MAX_BUSY_INSTALLING)) {
-            trace() << "busy installing for a long time - removing " << (*it)->nodeName() << endl;
-            CompileServer *old = *it;
-            ++it;
-            handle_end(old, 0);
-            continue;
-        }
+    if (cs->type() != CompileServer::DAEMON) {
+        return true;
+    }
 
-        /* protocol version 27 and newer use TCP keepalive */
-        if (IS_PROTOCOL_27(*it)) {
-            ++it;
-            continue;
+    drop_expired_leases(cs, now);
+
+    if (cs->busyInstalling()) {
+        if ((now - cs->busyInstalling()) >= MAX_BUSY_INSTALLING) {
+            trace() << "busy installing for a long time - removing " << cs->nodeName() << endl;
+            handle_end(cs, 0);
+            return false;
         }
 
-        if ((now - (*it)->last_talk) >= MAX_SCHEDULER_PING) {
-            if ((*it)->maxJobs() >= 0) {
-                trace() << "send ping " << (*it)->nodeName() << endl;
-                (*it)->setMaxJobs((*it)->maxJobs() * -1);   // better not give it away
+        timers.schedule(cs->fd, cs->busyInstalling() + MAX_BUSY_INSTALLING);
+    }
 
-                if ((*it)->send_msg(PingMsg())) {
-                    // give it MAX_SCHEDULER_PONG to answer a ping
-                    (*it)->last_talk = time(0) - MAX_SCHEDULER_PING
-                                       + 2 * MAX_SCHEDULER_PONG;
-                    min_time = min(min_time, (time_t) 2 * MAX_SCHEDULER_PONG);
-                    ++it;
-                    continue;
-                }
-            }
+    /* protocol version 27 and newer use TCP keepalive */
+    if (IS_PROTOCOL_27(cs)) {
+        return true;
+    }
 
-            // R.I.P.
-            trace() << "removing " << (*it)->nodeName() << endl;
-            CompileServer *old = *it;
-            ++it;
-            handle_end(old, 0);
-            continue;
-        } else {
-            min_time = min(min_time, MAX_SCHEDULER_PING - now + (*it)->last_talk);
+    if ((now - cs->last_talk) >= MAX_SCHEDULER_PING) {
+        if (cs->maxJobs() >= 0) {
+            trace() << "send ping " << cs->nodeName() << endl;
+            cs->setMaxJobs(cs->maxJobs() * -1);   // better not give it away
+
+            if (cs->send_msg(PingMsg())) {
+                // give it MAX_SCHEDULER_PONG to answer a ping
+                cs->last_talk = time(0) - MAX_SCHEDULER_PING
+                                + 2 * MAX_SCHEDULER_PONG;
+                timers.schedule(cs->fd, cs->last_talk + MAX_SCHEDULER_PING);
+                return true;
+            }
         }
 
+        // R.I.P.
+        trace() << "removing " << cs->nodeName() << endl;
+        handle_end(cs, 0);
+        return false;
+    }
+
 #if DEBUG_SCHEDULER > 1
-        if ((random() % 400) < 0) {
-            // R.I.P.
-            trace() << "FORCED removing " << (*it)->nodeName() << endl;
-            CompileServer *old = *it;
-            ++it;
-            handle_end(old, 0);
-            continue;
-        }
+    if ((random() % 400) < 0) {
+        // R.I.P.
+        trace() << "FORCED removing " << cs->nodeName() << endl;
+        handle_end(cs, 0);
+        return false;
+    }
 #endif
 
-        ++it;
+    timers.schedule(cs->fd, cs->last_talk + MAX_SCHEDULER_PING);
+    return true;
+}
+
+/* Prunes the connected servers whose timers expired and haven't
+   answered for a long time.  Return the number of seconds when
+   we have to cleanup next time. */
+static time_t prune_servers()
+{
+    time_t now = time(0);
+    list<int> expired;
+    timers.expire(now, expired);
+
+    for (list<int>::const_iterator it = expired.begin(); it != expired.end(); ++it) {
+        map<int, CompileServer *>::const_iterator cit = fd2cs.find(*it);
+
+        if (cit != fd2cs.end()) {
+            check_timeouts(cit->second, now);
+        }
     }
 
-    return min_time;
+    return timers.next_timeout(now, MAX_SCHEDULER_PING);
 }
 
 static Job *delay_current_job()
@@ -793,47 +989,185 @@ static Job *delay_current_job()
     return get_job_request();
 }
 
-static bool empty_queue()
+/* JOB was just placed and nobody else is waiting: if its submitter
+   keeps asking for more, place some jobs like it ahead of time, so its
+   daemon can answer the next clients itself.  Only free slots on hosts
+   that have the environment are leased, installing is left to real
+   jobs.  Never the submitter's own slots, its daemon has those anyway.
+   Returns false if the submitter is gone.  */
+static bool grant_leases(Job *job)
 {
-    Job *job = get_job_request();
+    CompileServer *submitter = job->submitter();
 
-    if (!job) {
-        return false;
+    if (!toanswer.empty() || !job->preferredHost().empty()) {
+        return true;
     }
 
-    assert(!css.empty());
+    time_t now = time(0);
 
-    Job *first_job = job;
-    CompileServer *cs = 0;
+    for (int wanted = leases_wanted(submitter); wanted > 0; --wanted) {
+        Job *lease = create_new_job(submitter);
+        lease->setEnvironments(job->environments());
+        lease->setTargetPlatform(job->targetPlatform());
+        lease->setArgFlags(job->argFlags());
+        lease->setLanguage(job->language());
+        lease->setMinimalHostVersion(job->minimalHostVersion());
 
-    while (true) {
-        cs = pick_server(job);
+        CompileServer *cs = pick_server(lease, submitter);
+        string host_platform;
 
-        if (cs) {
-            break;
+        if (cs && can_lease(cs, lease)) {
+            host_platform = envs_match(cs, lease);
         }
 
-        /* Ignore the load on the submitter itself if no other host could
-           be found.  We only obey to its max job number.  */
-        cs = job->submitter();
-
-        if (!((int(cs->jobList().size()) < cs->maxJobs())
-                && job->preferredHost().empty()
-                /* This should be trivially true.  */
-                && cs->can_install(job).size())) {
-            job = delay_current_job();
+        string version;
+        Environments environments = lease->environments();
 
-            if ((job == first_job) || !job) { // no job found in the whole toanswer list
-                trace() << "No suitable host found, delaying" << endl;
-                return false;
+        for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+            if (it->first == host_platform) {
+                version = it->second;
+                break;
             }
-        } else {
-            break;
         }
+
+        if (version.empty()) {
+            jobs.erase(lease->id());
+            delete lease;
+            return true;
+        }
+
+        grant_lease(lease, cs, now);
+
+        if (!submitter->send_msg(CSLeaseMsg(lease->id(), cs->name, cs->remotePort(),
+                                            host_platform, version, true, cs->protocol,
+                                            LEASE_TIME))) {
+            handle_end(submitter, 0);   // will care for the rest
+            return false;
+        }
+
+        trace() << "LEASE " << lease->id() << " client=" << submitter->nodeName()
+                << " server=" << cs->nodeName() << endl;
+        timers.schedule(submitter->fd, lease->leaseExpiry());
     }
 
-    remove_job_request();
+    return true;
+}
 
+/* Other daemons that have the environment TARGET/NAME installed, for CS
+   to get it from them instead of from the client, the least busy first.
+   Not the submitter SUBMITTER, that's the link to spare.  */
+static list<string> env_peers(const string &target, const string &name, const CompileServer *cs,
+                              const CompileServer *submitter)
+{
+    list<string> peers;
+
+    if (!IS_PROTOCOL_46(cs)) {
+        return peers;
+    }
+
+    pair<string, string> env(target, name);
+    multimap<unsigned int, CompileServer *> candidates;   // by load
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *peer = *it;
+
+        if (peer == cs || peer == submitter || !IS_PROTOCOL_46(peer)
+                || peer->noRemote() || !peer->remotePort()) {
+            continue;
+        }
+
+        Environments versions = peer->compilerVersions();
+
+        if (find(versions.begin(), versions.end(), env) != versions.end()) {
+            candidates.insert(make_pair(peer->load() + 1000 * peer->jobList().size()
+                                        / max(peer->maxJobs(), 1), peer));
+        }
+    }
+
+    for (multimap<unsigned int, CompileServer *>::const_iterator it = candidates.begin();
+            it != candidates.end() && peers.size() < MAX_ENV_PEERS; ++it) {
+        peers.push_back(it->second->name + ":" + toString(it->second->remotePort()));
+    }
+
+    return peers;
+}
+
+// the same for the environment of JOB for HOST_PLATFORM
+static list<string> env_peers(const Job *job, const CompileServer *cs,
+                              const string &host_platform)
+{
+    Environments environments = job->environments();
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        if (it->first == host_platform) {
+            return env_peers(job->targetPlatform(), it->second, cs, job->submitter());
+        }
+    }
+
+    return list<string>();
+}
+
+/* In quiet periods, tells idle hosts with room for environments to get
+   the ones most in demand that they lack from the hosts that have them,
+   so they are ready when the next build comes.  The daemons report back
+   with M_ENV_FETCH_DONE.  */
+static void plan_preinstalls(time_t now)
+{
+    unsigned int running = 0;
+    list<CompileServer *> idle;
+
+    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *cs = *it;
+
+        if (preinstall_running(cs, now)) {
+            ++running;
+        } else if (can_preinstall(cs)) {
+            idle.push_back(cs);
+        }
+    }
+
+    // the jobs waiting for a host come first
+    if (!toanswer.empty() || idle.empty() || running >= MAX_PREINSTALLS) {
+        return;
+    }
+
+    list<pair<unsigned int, const EnvRequest *> > hot = hot_env_requests(env_demand, now);
+
+    for (list<pair<unsigned int, const EnvRequest *> >::const_iterator it = hot.begin();
+            it != hot.end() && running < MAX_PREINSTALLS; ++it) {
+        const string &target = it->second->first;
+
+        for (list<CompileServer *>::iterator cit = idle.begin();
+                cit != idle.end() && running < MAX_PREINSTALLS;) {
+            CompileServer *cs = *cit;
+            string name = missing_env(cs, target, it->second->second);
+            string env = target + "/" + name;
+
+            if (name.empty() || preinstall_failed_recently(cs, env, now)) {
+                ++cit;
+                continue;
+            }
+
+            list<string> peers = env_peers(target, name, cs, 0);
+
+            if (peers.empty() || !cs->send_msg(EnvFetchMsg(target, name, peers))) {
+                ++cit;
+                continue;
+            }
+
+            log_info() << "PREINSTALL " << env << " on " << cs->nodeName() << " from "
+                       << peers.front() << ", " << it->first << " recent jobs" << endl;
+            cs->setPreinstalling(env, now);
+            ++running;
+            cit = idle.erase(cit);
+        }
+    }
+}
+
+/* Sends JOB to CS.  Returns false if the submitter of JOB couldn't be
+   told and is gone now, with all its jobs.  */
+static bool assign_job(Job *job, CompileServer *cs)
+{
     job->setState(Job::WAITINGFORCS);
     job->setServer(cs);
 
@@ -874,15 +1208,20 @@ static bool empty_queue()
     UseCSMsg m2(host_platform, cs->name, cs->remotePort(), job->id(),
                 gotit, job->localClientId(), matched_job_id);
 
+    if (!gotit) {
+        m2.env_peers = env_peers(job, cs, host_platform);
+    }
+
     if (!job->submitter()->send_msg(m2)) {
         trace() << "failed to deliver job " << job->id() << endl;
         handle_end(job->submitter(), 0);   // will care for the rest
-        return true;
+        return false;
     }
 
 #if DEBUG_SCHEDULER >= 0
     if (!gotit) {
-        trace() << "put " << job->id() << " in joblist of " << cs->nodeName() << " (will install now)" << endl;
+        trace() << "put " << job->id() << " in joblist of " << cs->nodeName() << " (will install now, "
+                << m2.env_peers.size() << " peers have it)" << endl;
     } else {
         trace() << "put " << job->id() << " in joblist of " << cs->nodeName() << endl;
     }
@@ -892,6 +1231,7 @@ static bool empty_queue()
     /* if it doesn't have the environment, it will get it. */
     if (!gotit) {
         cs->setBusyInstalling(time(0));
+        timers.schedule(cs->fd, cs->busyInstalling() + MAX_BUSY_INSTALLING);
     }
 
     string env;
@@ -915,6 +1255,302 @@ static bool empty_queue()
         }
     }
 
+    return grant_leases(job);
+}
+
+static bool empty_queue()
+{
+    Job *job = get_job_request();
+
+    if (!job) {
+        return false;
+    }
+
+    assert(!css.empty());
+
+    Job *first_job = job;
+    CompileServer *cs = 0;
+
+    while (true) {
+        cs = pick_server(job);
+
+        if (cs) {
+            break;
+        }
+
+        /* Ignore the load on the submitter itself if no other host could
+           be found.  We only obey to its max job number.  */
+        cs = job->submitter();
+
+        if (!((int(cs->jobList().size()) < cs->maxJobs())
+                && job->preferredHost().empty()
+                /* This should be trivially true.  */
+                && cs->can_install(job).size())) {
+            job = delay_current_job();
+
+            if ((job == first_job) || !job) { // no job found in the whole toanswer list
+                trace() << "No suitable host found, delaying" << endl;
+                return false;
+            }
+        } else {
+            break;
+        }
+    }
+
+    remove_job_request();
+    assign_job(job, cs);
+    return true;
+}
+
+// whether A and B can go to the same hosts
+static bool same_kind(const Job *a, const Job *b)
+{
+    return a->submitter() == b->submitter()
+           && a->environments() == b->environments()
+           && a->targetPlatform() == b->targetPlatform()
+           && a->argFlags() == b->argFlags()
+           && a->minimalHostVersion() == b->minimalHostVersion()
+           && a->preferredHost() == b->preferredHost();
+}
+
+// takes JOB out of the requests of its submitter
+static void forget_job_request(Job *job)
+{
+    for (list<UnansweredList *>::iterator it = toanswer.begin(); it != toanswer.end(); ++it) {
+        if ((*it)->server == job->submitter() && (*it)->remove_job(job)) {
+            if ((*it)->l.empty()) {
+                delete *it;
+                toanswer.erase(it);
+            }
+
+            return;
+        }
+    }
+}
+
+/* Sends the first waiting job that a host has cached there, before the
+   others take the slot.  Returns false if there was none.  */
+static bool place_cached_job()
+{
+    for (set<unsigned int>::iterator it = cached_jobs.begin(); it != cached_jobs.end();) {
+        map<unsigned int, Job *>::const_iterator jit = jobs.find(*it);
+
+        // placed some other way meanwhile, or gone
+        if (jit == jobs.end() || jit->second->state() != Job::PENDING || jit->second->server()) {
+            cached_jobs.erase(it++);
+            continue;
+        }
+
+        Job *job = jit->second;
+        CompileServer *cs = pick_holder(job);
+
+        if (cs) {
+            trace() << "taking " << cs->nodeName() << ", it has " << job->id() << " cached"
+                    << endl;
+            cached_jobs.erase(it);
+            forget_job_request(job);
+            assign_job(job, cs);
+            return true;
+        }
+
+        ++it;
+    }
+
+    return false;
+}
+
+/* CS sent a new object cache filter, the waiting jobs it probably has
+   are candidates for place_cached_job() now.  */
+static void note_cached_jobs(CompileServer *cs)
+{
+    for (list<UnansweredList *>::const_iterator it = toanswer.begin(); it != toanswer.end(); ++it) {
+        for (list<Job *>::const_iterator jit = (*it)->l.begin(); jit != (*it)->l.end(); ++jit) {
+            if (cs->mayHaveObject((*jit)->cacheKey())) {
+                cached_jobs.insert((*jit)->id());
+            }
+        }
+    }
+}
+
+/* Places as many waiting jobs as there are free slots in one go, instead
+   of one after the other like empty_queue().  Jobs that can go to the
+   same hosts are taken together, every host costs what predicted_time()
+   says, plus INSTALL_COST if the environment is missing (at most one
+   install per host).  The placement is then solved as a minimum cost
+   flow from the kinds of jobs to the free slots, so a job doesn't take
+   the slot that another one needs more.  Returns false if nothing was
+   placed.  */
+static bool place_jobs()
+{
+    if (toanswer.empty()) {
+        return false;
+    }
+
+    if (place_cached_job()) {
+        return true;
+    }
+
+    if (all_job_stats.empty()) {
+        // nothing to weigh the hosts with yet, try them one by one
+        bool placed = false;
+
+        while (empty_queue()) {
+            placed = true;
+        }
+
+        return placed;
+    }
+
+    vector<CompileServer *> servers;
+    int free_slots = 0;
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        int free = (*it)->maxJobs() - int((*it)->jobList().size());
+
+        if (free > 0 && !(*it)->busyInstalling()) {
+            servers.push_back(*it);
+            free_slots += free;
+        }
+    }
+
+    if (!free_slots) {
+        return false;
+    }
+
+    /* The waiting jobs in the order empty_queue() would take them, taking
+       turns between the submitters.  */
+    vector<Job *> kinds;   // the first job of every kind
+    vector<list<Job *> > members;
+    vector<list<Job *>::const_iterator> next;
+    size_t wanted = size_t(free_slots) * PLACE_LOOKAHEAD;
+    size_t taken = 0;
+
+    for (list<UnansweredList *>::const_iterator it = toanswer.begin(); it != toanswer.end(); ++it) {
+        next.push_back((*it)->l.begin());
+    }
+
+    for (bool more = true; more && taken < wanted;) {
+        more = false;
+        size_t i = 0;
+
+        for (list<UnansweredList *>::const_iterator it = toanswer.begin();
+                it != toanswer.end() && taken < wanted; ++it, ++i) {
+            if (next[i] == (*it)->l.end()) {
+                continue;
+            }
+
+            Job *job = *next[i]++;
+            size_t k = 0;
+
+            while (k < kinds.size() && !same_kind(kinds[k], job)) {
+                ++k;
+            }
+
+            if (k == kinds.size()) {
+                kinds.push_back(job);
+                members.push_back(list<Job *>());
+            }
+
+            members[k].push_back(job);
+            ++taken;
+            more = true;
+        }
+    }
+
+    const int K = kinds.size();
+    const int S = servers.size();
+    const int source = 0;
+    const int sink = 1;
+    MinCostFlow net(2 + K + 2 * S);
+    vector<int> direct(K * S, -1);
+    vector<int> install(K * S, -1);
+
+    for (int k = 0; k < K; ++k) {
+        net.add_edge(source, 2 + k, members[k].size(), 0);
+    }
+
+    for (int s = 0; s < S; ++s) {
+        CompileServer *cs = servers[s];
+        int free = cs->maxJobs() - int(cs->jobList().size());
+
+        /* Make all servers compile a job at least once, so we'll get an
+           idea about their speed.  */
+        if (cs->lastCompiledJobs().empty() && cs->jobList().empty()) {
+            net.add_edge(2 + K + s, sink, 1, -UNKNOWN_SPEED_COST);
+            --free;
+        }
+
+        net.add_edge(2 + K + s, sink, free, 0);
+        net.add_edge(2 + K + S + s, 2 + K + s, 1, 0);
+    }
+
+    for (int k = 0; k < K; ++k) {
+        Job *job = kinds[k];
+        JobStat guess = guess_job(job);
+
+        for (int s = 0; s < S; ++s) {
+            CompileServer *cs = servers[s];
+
+            if (!job->preferredHost().empty() && !cs->matches(job->preferredHost())) {
+                continue;
+            }
+
+            if (!cs->is_eligible(job)) {
+                /* Ignore the load on the submitter itself if no other host
+                   could be found.  We only obey to its max job number.  */
+                if (cs == job->submitter() && job->preferredHost().empty()
+                        && cs->can_install(job).size()) {
+                    direct[k * S + s] = net.add_edge(2 + k, 2 + K + s, members[k].size(),
+                                                     LAST_RESORT_COST);
+                }
+
+                continue;
+            }
+
+            float t = predicted_time(cs, job, guess);
+            long long cost = t < UNKNOWN_SPEED_COST ? (long long) t : UNKNOWN_SPEED_COST;
+
+            if (!envs_match(cs, job).empty()) {
+                direct[k * S + s] = net.add_edge(2 + k, 2 + K + s, members[k].size(), cost);
+            } else {
+                install[k * S + s] = net.add_edge(2 + k, 2 + K + S + s, 1, cost + INSTALL_COST);
+            }
+        }
+    }
+
+    if (!net.solve(source, sink)) {
+        return false;
+    }
+
+#if DEBUG_SCHEDULER >= 0
+    trace() << "placing " << taken << " jobs of " << K << " kinds on " << S << " hosts ("
+            << free_slots << " free slots)" << endl;
+#endif
+
+    for (int k = 0; k < K; ++k) {
+        for (int s = 0; s < S; ++s) {
+            long long count = 0;
+
+            if (direct[k * S + s] >= 0) {
+                count += net.flow(direct[k * S + s]);
+            }
+
+            if (install[k * S + s] >= 0) {
+                count += net.flow(install[k * S + s]);
+            }
+
+            for (; count > 0; --count) {
+                Job *job = members[k].front();
+                members[k].pop_front();
+                forget_job_request(job);
+
+                if (!assign_job(job, servers[s])) {
+                    return true;   // the submitter is gone, start over
+                }
+            }
+        }
+    }
+
     return true;
 }
 
@@ -974,6 +1610,7 @@ static bool handle_login(CompileServer *cs, Msg *_m)
     }
 
     css.push_back(cs);
+    check_timeouts(cs, time(0));
 
     /* Configure the daemon */
     if (IS_PROTOCOL_24(cs)) {
@@ -1028,7 +1665,7 @@ static bool handle_mon_login(CompileServer *cs, Msg *_m)
         handle_monitor_stats(*it);
     }
 
-    fd2cs.erase(cs->fd);   // no expected data from them
+    remove_channel(cs);   // no expected data from them
     return true;
 }
 
@@ -1052,6 +1689,7 @@ static bool handle_job_begin(CompileServer *cs, Msg *_m)
         return false;
     }
 
+    use_lease(job);
     job->setState(Job::COMPILING);
     job->setStartTime(m->stime);
     job->setStartOnScheduler(time(0));
@@ -1172,16 +1810,25 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
             << " sys=" << m->sys_msec
             << " pfaults=" << m->pfaults
             << " server=" << j->server()->nodeName()
+            << (m->is_from_cache() ? " cached" : "")
             << endl;
     } else {
         trace() << "END " << m->job_id
                 << " status=" << m->exitcode << endl;
     }
 
+    if (m->is_from_server() && m->exitcode == 0 && j->server() != j->submitter()
+            && !m->is_from_cache()) {
+        j->server()->recordTransfer(j->submitter()->nodeName(), m->in_compressed,
+                                    m->transfer_msec, m->rtt_usec);
+        j->submitter()->recordTransferSize(m->in_compressed + m->out_compressed);
+    }
+
     if (j->server()) {
         j->server()->removeJob(j);
     }
 
+    use_lease(j);
     add_job_stats(j, m);
     notify_monitors(new MonJobDoneMsg(*m));
     jobs.erase(m->job_id);
@@ -1222,6 +1869,19 @@ static bool handle_stats(CompileServer *cs, Msg *_m)
     for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it)
         if (*it == cs) {
             (*it)->setLoad(m->load);
+            (*it)->setEnvSpace(m->env_space);
+
+            if (!m->object_filter.empty()) {
+                BloomFilter filter;
+
+                if (!filter.decode(m->object_filter)) {
+                    log_warning() << "bad object cache filter from " << cs->nodeName() << endl;
+                }
+
+                cs->setObjectFilter(filter);
+                note_cached_jobs(cs);
+            }
+
             handle_monitor_stats(*it, m);
             return true;
         }
@@ -1229,6 +1889,33 @@ static bool handle_stats(CompileServer *cs, Msg *_m)
     return false;
 }
 
+// a daemon installed the environment it was told to in plan_preinstalls()
+static bool handle_env_fetch_done(CompileServer *cs, Msg *_m)
+{
+    EnvFetchDoneMsg *m = dynamic_cast<EnvFetchDoneMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    // it took too long, and was given up on already
+    if (cs->preinstalling().empty()) {
+        return true;
+    }
+
+    time_t now = time(0);
+    log_info() << "PREINSTALL " << cs->preinstalling() << " on " << cs->nodeName()
+               << (m->ok ? " done" : " failed") << " after " << now - cs->preinstallingSince()
+               << " s" << endl;
+
+    if (!m->ok) {
+        cs->setPreinstallFailed(cs->preinstalling(), now);
+    }
+
+    cs->setPreinstalling(string(), 0);
+    return true;
+}
+
 static bool handle_blacklist_host_env(CompileServer *cs, Msg *_m)
 {
     BlacklistHostEnvMsg *m = dynamic_cast<BlacklistHostEnvMsg *>(_m);
@@ -1310,6 +1997,7 @@ static bool handle_control_login(CompileServer *cs)
     cs->setState(CompileServer::LOGGEDIN);
     assert(find(controls.begin(), controls.end(), cs) == controls.end());
     controls.push_back(cs);
+    check_timeouts(cs, time(0));
 
     std::ostringstream o;
     o << "200-ICECC " VERSION ": "
@@ -1353,12 +2041,18 @@ static bool handle_line(CompileServer *cs, Msg *_m)
             sprintf(buffer, "%.2f jobs=%d/%d load=%d", server_speed(*it),
                     (int)(*it)->jobList().size(), (*it)->maxJobs(), (*it)->load());
             line += buffer;
+            line += (*it)->linkStats();
 
             if ((*it)->busyInstalling()) {
                 sprintf(buffer, " busy installing since %ld s",  time(0) - (*it)->busyInstalling());
                 line += buffer;
             }
 
+            if (!(*it)->preinstalling().empty()) {
+                sprintf(buffer, " since %ld s", time(0) - (*it)->preinstallingSince());
+                line += " pre-installing " + (*it)->preinstalling() + buffer;
+            }
+
             if (!cs->send_msg(TextMsg(line))) {
                 return false;
             }
@@ -1440,6 +2134,11 @@ static bool handle_line(CompileServer *cs, Msg *_m)
 
             if ((*it)->send_msg(GetInternalStatus())) {
                 msg = (*it)->get_msg();
+
+                // anything read on the way is not reported by the reactor
+                if ((*it)->has_msg()) {
+                    buffered_fds.insert((*it)->fd);
+                }
             }
 
             if (msg && msg->type == M_STATUS_TEXT) {
@@ -1570,6 +2269,10 @@ static bool handle_end(CompileServer *toremove, Msg *m)
                     job->server()->removeJob(job);
                 }
 
+                if (job->submitter() != toremove) {
+                    use_lease(job);
+                }
+
                 if (job->server()) {
                     job->server()->setBusyInstalling(0);
                 }
@@ -1596,7 +2299,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
         break;
     }
 
-    fd2cs.erase(toremove->fd);
+    remove_channel(toremove);
     delete toremove;
     return true;
 }
@@ -1653,6 +2356,15 @@ static bool handle_activity(CompileServer *cs)
     case M_BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(cs, m);
         break;
+    case M_USE_LEASE:
+        ret = handle_use_lease(cs, m);
+        break;
+    case M_RETURN_LEASE:
+        ret = handle_return_lease(cs, m);
+        break;
+    case M_ENV_FETCH_DONE:
+        ret = handle_env_fetch_done(cs, m);
+        break;
     default:
         log_info() << "Invalid message type arrived " << (char)m->type << endl;
         handle_end(cs, m);
@@ -1664,6 +2376,28 @@ static bool handle_activity(CompileServer *cs)
     return ret;
 }
 
+/* Reads CS until its socket would block and handles all complete
+   messages, the reactor reports it again only for new input.
+   Returns TRUE if CS was not closed.  */
+static bool handle_input(CompileServer *cs)
+{
+    for (;;) {
+        bool ok = cs->read_a_bit();
+
+        if (!ok || cs->has_msg()) {
+            if (!handle_activity(cs)) {
+                return false;
+            }
+
+            continue;
+        }
+
+        if (cs->input_drained()) {
+            return true;
+        }
+    }
+}
+
 static int open_broad_listener(int port)
 {
     int listen_fd;
@@ -2020,20 +2754,36 @@ int main(int argc, char *argv[])
     signal(SIGINT, trigger_exit);
     signal(SIGALRM, trigger_exit);
 
+    if (!reactor.ok()) {
+        return 1;
+    }
+
+    /* The listeners are level triggered, they get one accept() (or
+       recvfrom()) per wakeup.  */
+    reactor.add(listen_fd, false);
+    reactor.add(text_fd, false);
+    reactor.add(broad_fd, false);
+
     time_t next_listen = 0;
+    vector<int> ready;
 
     broadcast_scheduler_version();
     last_announce = starttime;
 
     while (!exit_main_loop) {
-        struct timeval tv;
-        tv.tv_usec = 0;
-        tv.tv_sec = prune_servers();
+        time_t timeout = prune_servers();
 
-        while (empty_queue()) {
+        while (place_jobs()) {
             continue;
         }
 
+        if (time(0) >= last_preinstall_plan + PREINSTALL_INTERVAL) {
+            plan_preinstalls(time(0));
+            last_preinstall_plan = time(0);
+        }
+
+        timeout = min(timeout, last_preinstall_plan + PREINSTALL_INTERVAL - time(0));
+
         /* Announce ourselves from time to time, to make other possible schedulers disconnect
            their daemons if we are the preferred scheduler (daemons with version new enough
            should automatically select the best scheduler, but old daemons connect randomly). */
@@ -2042,207 +2792,157 @@ int main(int argc, char *argv[])
             last_announce = time(NULL);
         }
 
-        fd_set read_set;
-        int max_fd = 0;
-        FD_ZERO(&read_set);
+        while (!buffered_fds.empty()) {
+            map<int, CompileServer *>::const_iterator it = fd2cs.find(*buffered_fds.begin());
+            buffered_fds.erase(buffered_fds.begin());
 
-        if (time(0) >= next_listen) {
-            max_fd = listen_fd;
-            FD_SET(listen_fd, &read_set);
-
-            if (text_fd > max_fd) {
-                max_fd = text_fd;
+            if (it != fd2cs.end()) {
+                handle_input(it->second);
             }
-
-            FD_SET(text_fd, &read_set);
         }
 
-        if (broad_fd > max_fd) {
-            max_fd = broad_fd;
+        time_t now = time(0);
+
+        if (now >= next_listen) {
+            reactor.set_interest(listen_fd, true);
+            reactor.set_interest(text_fd, true);
+        } else {
+            timeout = min(timeout, next_listen - now);
         }
 
-        FD_SET(broad_fd, &read_set);
+        if (reactor.wait(timeout * 1000, ready) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-        for (map<int, CompileServer *>::const_iterator it = fd2cs.begin(); it != fd2cs.end();) {
-            int i = it->first;
-            CompileServer *cs = it->second;
-            bool ok = true;
-            ++it;
+            log_perror("wait()");
+            return 1;
+        }
 
-            /* handle_activity() can delete c and make the iterator
-               invalid.  */
-            while (ok && cs->has_msg()) {
-                if (!handle_activity(cs)) {
-                    ok = false;
-                }
-            }
+        for (vector<int>::const_iterator rit = ready.begin(); rit != ready.end(); ++rit) {
+            if (*rit == listen_fd) {
+                bool pending_connections = true;
 
-            if (ok) {
-                if (i > max_fd) {
-                    max_fd = i;
-                }
+                while (pending_connections) {
+                    remote_len = sizeof(remote_addr);
+                    remote_fd = accept(listen_fd,
+                                       (struct sockaddr *) &remote_addr,
+                                       &remote_len);
 
-                FD_SET(i, &read_set);
-            }
-        }
+                    if (remote_fd < 0) {
+                        pending_connections = false;
+                    }
 
-        max_fd = select(max_fd + 1, &read_set, NULL, NULL, &tv);
+                    if (remote_fd < 0 && errno != EAGAIN && errno != EINTR
+                            && errno != EWOULDBLOCK) {
+                        log_perror("accept()");
+                        /* don't quit because of ECONNABORTED, this can happen during
+                         * floods  */
+                    }
 
-        if (max_fd < 0 && errno == EINTR) {
-            continue;
-        }
+                    if (remote_fd >= 0) {
+                        CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, false);
+                        trace() << "accepted " << cs->name << endl;
+                        cs->last_talk = time(0);
 
-        if (max_fd < 0) {
-            log_perror("select()");
-            return 1;
-        }
+                        if (!cs->protocol) { // protocol mismatch
+                            delete cs;
+                            continue;
+                        }
 
-        if (FD_ISSET(listen_fd, &read_set)) {
-            max_fd--;
-            bool pending_connections = true;
+                        add_channel(cs);
+                        handle_input(cs);
+                    }
+                }
 
-            while (pending_connections) {
+                next_listen = time(0) + 1;
+                reactor.set_interest(listen_fd, false);
+                reactor.set_interest(text_fd, false);
+            } else if (*rit == text_fd) {
                 remote_len = sizeof(remote_addr);
-                remote_fd = accept(listen_fd,
+                remote_fd = accept(text_fd,
                                    (struct sockaddr *) &remote_addr,
                                    &remote_len);
 
-                if (remote_fd < 0) {
-                    pending_connections = false;
-                }
-
-                if (remote_fd < 0 && errno != EAGAIN && errno != EINTR
-                        && errno != EWOULDBLOCK) {
+                if (remote_fd < 0 && errno != EAGAIN && errno != EINTR) {
                     log_perror("accept()");
-                    /* don't quit because of ECONNABORTED, this can happen during
-                     * floods  */
+                    /* Don't quit the scheduler just because a debugger couldn't
+                       connect.  */
                 }
 
                 if (remote_fd >= 0) {
-                    CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, false);
-                    trace() << "accepted " << cs->name << endl;
-                    cs->last_talk = time(0);
+                    CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, true);
+                    add_channel(cs);
 
-                    if (!cs->protocol) { // protocol mismatch
-                        delete cs;
+                    if (!handle_control_login(cs)) {
+                        handle_end(cs, 0);
                         continue;
                     }
 
-                    fd2cs[cs->fd] = cs;
-
-                    while (!cs->read_a_bit() || cs->has_msg()) {
-                        if (! handle_activity(cs)) {
-                            break;
-                        }
-                    }
-                }
-            }
-
-            next_listen = time(0) + 1;
-        }
-
-        if (max_fd && FD_ISSET(text_fd, &read_set)) {
-            max_fd--;
-            remote_len = sizeof(remote_addr);
-            remote_fd = accept(text_fd,
-                               (struct sockaddr *) &remote_addr,
-                               &remote_len);
-
-            if (remote_fd < 0 && errno != EAGAIN && errno != EINTR) {
-                log_perror("accept()");
-                /* Don't quit the scheduler just because a debugger couldn't
-                   connect.  */
-            }
-
-            if (remote_fd >= 0) {
-                CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, true);
-                fd2cs[cs->fd] = cs;
-
-                if (!handle_control_login(cs)) {
-                    handle_end(cs, 0);
-                    continue;
+                    handle_input(cs);
                 }
-
-                while (!cs->read_a_bit() || cs->has_msg())
-                    if (!handle_activity(cs)) {
-                        break;
+            } else if (*rit == broad_fd) {
+                char buf[BROAD_BUFLEN];
+                struct sockaddr_in broad_addr;
+                socklen_t broad_len = sizeof(broad_addr);
+                /* We can get either a daemon request for a scheduler (1 byte) or another scheduler
+                   announcing itself (4 bytes + time). */
+                const int schedbuflen = 4 + sizeof(uint64_t);
+
+                int buflen = recvfrom(broad_fd, buf, max( 1, schedbuflen), 0, (struct sockaddr *) &broad_addr,
+                                      &broad_len);
+                if (buflen != 1 && buflen != schedbuflen) {
+                    int err = errno;
+                    log_perror("recvfrom()");
+
+                    /* Some linux 2.6 kernels can return from select with
+                       data available, and then return from read() with EAGAIN
+                    even on a blocking socket (breaking POSIX).  Happens
+                     when the arriving packet has a wrong checksum.  So
+                     we ignore EAGAIN here, but still abort for all other errors. */
+                    if (err != EAGAIN) {
+                        return -1;
                     }
-            }
-        }
-
-        if (max_fd && FD_ISSET(broad_fd, &read_set)) {
-            max_fd--;
-            char buf[BROAD_BUFLEN];
-            struct sockaddr_in broad_addr;
-            socklen_t broad_len = sizeof(broad_addr);
-            /* We can get either a daemon request for a scheduler (1 byte) or another scheduler
-               announcing itself (4 bytes + time). */
-            const int schedbuflen = 4 + sizeof(uint64_t);
-
-            int buflen = recvfrom(broad_fd, buf, max( 1, schedbuflen), 0, (struct sockaddr *) &broad_addr,
-                                  &broad_len);
-            if (buflen != 1 && buflen != schedbuflen) {
-                int err = errno;
-                log_perror("recvfrom()");
-
-                /* Some linux 2.6 kernels can return from select with
-                   data available, and then return from read() with EAGAIN
-                even on a blocking socket (breaking POSIX).  Happens
-                 when the arriving packet has a wrong checksum.  So
-                 we ignore EAGAIN here, but still abort for all other errors. */
-                if (err != EAGAIN) {
-                    return -1;
-                }
-            }
-            /* Daemon is searching for a scheduler, only answer if daemon would be able to talk to us. */
-            else if (buflen == 1 && buf[0] >= MIN_PROTOCOL_VERSION) {
-                log_info() << "broadcast from " << inet_ntoa(broad_addr.sin_addr)
-                           << ":" << ntohs(broad_addr.sin_port)
-                           << " (version " << int(buf[0]) << ")\n";
-                int reply_len = prepare_broadcast_reply(buf, netname);
-                if (sendto(broad_fd, buf, reply_len, 0,
-                           (struct sockaddr *) &broad_addr, broad_len) != reply_len) {
-                    log_perror("sendto()");
                 }
-            }
-            else if (!persistent_clients && buflen == schedbuflen && buf[0] == 'I' && buf[1] == 'C' && buf[2] == 'E') {
-                /* Another scheduler is announcing it's running, disconnect daemons if it has a better version
-                   or the same version but was started earlier. */
-                uint64_t tmp_time;
-                memcpy(&tmp_time, buf + 4, sizeof(uint64_t));
-                time_t other_time = tmp_time;
-                if (buf[3] > PROTOCOL_VERSION || other_time < starttime) {
-                    if (!css.empty() || !monitors.empty()) {
-                        log_info() << "Scheduler from " << inet_ntoa(broad_addr.sin_addr)
+                /* Daemon is searching for a scheduler, only answer if daemon would be able to talk to us. */
+                else if (buflen == 1 && buf[0] >= MIN_PROTOCOL_VERSION) {
+                    log_info() << "broadcast from " << inet_ntoa(broad_addr.sin_addr)
                                << ":" << ntohs(broad_addr.sin_port)
-                               << " (version " << int(buf[3]) << ") has announced itself as a preferred"
-                            " scheduler, disconnecting all connections." << endl;
-                        while (!css.empty())
-                            handle_end(css.front(), NULL);
-                        while (!monitors.empty())
-                            handle_end(monitors.front(), NULL);
+                               << " (version " << int(buf[0]) << ")\n";
+                    int reply_len = prepare_broadcast_reply(buf, netname);
+                    if (sendto(broad_fd, buf, reply_len, 0,
+                               (struct sockaddr *) &broad_addr, broad_len) != reply_len) {
+                        log_perror("sendto()");
                     }
                 }
-            }
-        }
-
-        for (map<int, CompileServer *>::const_iterator it = fd2cs.begin();
-                max_fd && it != fd2cs.end();) {
-            int i = it->first;
-            CompileServer *cs = it->second;
-            /* handle_activity can delete the channel from the fd2cs list,
-               hence advance the iterator right now, so it doesn't become
-               invalid.  */
-            ++it;
-
-            if (FD_ISSET(i, &read_set)) {
-                while (!cs->read_a_bit() || cs->has_msg()) {
-                    if (!handle_activity(cs)) {
-                        break;
+                else if (!persistent_clients && buflen == schedbuflen && buf[0] == 'I' && buf[1] == 'C' && buf[2] == 'E') {
+                    /* Another scheduler is announcing it's running, disconnect daemons if it has a better version
+                       or the same version but was started earlier. */
+                    uint64_t tmp_time;
+                    memcpy(&tmp_time, buf + 4, sizeof(uint64_t));
+                    time_t other_time = tmp_time;
+                    if (buf[3] > PROTOCOL_VERSION || other_time < starttime) {
+                        if (!css.empty() || !monitors.empty()) {
+                            log_info() << "Scheduler from " << inet_ntoa(broad_addr.sin_addr)
+                                   << ":" << ntohs(broad_addr.sin_port)
+                                   << " (version " << int(buf[3]) << ") has announced itself as a preferred"
+                                " scheduler, disconnecting all connections." << endl;
+                            while (!css.empty())
+                                handle_end(css.front(), NULL);
+                            while (!monitors.empty())
+                                handle_end(monitors.front(), NULL);
+                        }
                     }
                 }
+            } else {
+                /* Only new input gets reported, handle_input() reads it all.
+                   The channel may be gone already, if handling an earlier one
+                   removed it.  */
+                map<int, CompileServer *>::const_iterator it = fd2cs.find(*rit);
 
-                max_fd--;
+                if (it != fd2cs.end()) {
+                    handle_input(it->second);
+                }
             }
         }
     }
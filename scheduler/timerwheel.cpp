@@ -0,0 +1,113 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "timerwheel.h"
+
+using namespace std;
+
+TimerWheel::TimerWheel()
+    : m_last(time(0))
+{
+}
+
+void TimerWheel::schedule(int fd, time_t when)
+{
+    if (fd < 0) {
+        return;
+    }
+
+    if ((size_t) fd >= m_timers.size()) {
+        m_timers.resize(fd + 1);
+    }
+
+    Timer &timer = m_timers[fd];
+
+    if (timer.armed) {
+        if (timer.when <= when) {
+            return;
+        }
+
+        m_slots[timer.when % SLOTS].erase(timer.pos);
+    }
+
+    // an overdue timer goes into the slot expire() looks at next
+    if (when < m_last) {
+        when = m_last;
+    }
+
+    list<int> &slot = m_slots[when % SLOTS];
+    timer.when = when;
+    timer.armed = true;
+    timer.pos = slot.insert(slot.end(), fd);
+}
+
+void TimerWheel::cancel(int fd)
+{
+    if (fd < 0 || (size_t) fd >= m_timers.size() || !m_timers[fd].armed) {
+        return;
+    }
+
+    Timer &timer = m_timers[fd];
+    m_slots[timer.when % SLOTS].erase(timer.pos);
+    timer.armed = false;
+}
+
+void TimerWheel::expire(time_t now, list<int> &expired)
+{
+    /* After a longer sleep (or a clock jump) every slot is due, but each
+       needs to be looked at only once.  */
+    time_t first = m_last;
+
+    if (now - first >= SLOTS) {
+        first = now - SLOTS + 1;
+    }
+
+    for (time_t t = first; t <= now; ++t) {
+        list<int> &slot = m_slots[t % SLOTS];
+
+        for (list<int>::iterator it = slot.begin(); it != slot.end();) {
+            Timer &timer = m_timers[*it];
+
+            if (timer.when > now) {   // due in a later round
+                ++it;
+                continue;
+            }
+
+            timer.armed = false;
+            expired.push_back(*it);
+            it = slot.erase(it);
+        }
+    }
+
+    m_last = now + 1;
+}
+
+time_t TimerWheel::next_timeout(time_t now, time_t limit) const
+{
+    for (time_t t = 0; t < limit && t < SLOTS; ++t) {
+        if (now + t >= m_last && !m_slots[(now + t) % SLOTS].empty()) {
+            return t;
+        }
+    }
+
+    return limit;
+}
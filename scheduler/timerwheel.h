@@ -0,0 +1,70 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <list>
+#include <vector>
+#include <time.h>
+
+/* One timer per file descriptor, with a resolution of one second.
+   Timers live in the slot of their deadline, so arming, cancelling and
+   expiring are O(1) per timer, no matter how many connections there are.
+   Deadlines further away than the size of the wheel just stay in their
+   slot for more rounds.  */
+class TimerWheel
+{
+public:
+    TimerWheel();
+
+    /* Makes sure the timer of FD fires not later than WHEN.  An already
+       armed earlier timer is kept, the owner rechecks its deadlines when
+       it fires anyway.  */
+    void schedule(int fd, time_t when);
+    void cancel(int fd);
+
+    // moves the descriptors whose timers are due at NOW to EXPIRED
+    void expire(time_t now, std::list<int> &expired);
+
+    // seconds until the next slot holding a timer, at most LIMIT
+    time_t next_timeout(time_t now, time_t limit) const;
+
+private:
+    enum { SLOTS = 256 };
+
+    struct Timer {
+        Timer()
+            : when(0)
+            , armed(false) {}
+
+        time_t when;
+        bool armed;
+        std::list<int>::iterator pos;
+    };
+
+    std::list<int> m_slots[SLOTS];
+    std::vector<Timer> m_timers;   // indexed by fd
+    time_t m_last;                 // everything before this has expired
+};
+
+#endif
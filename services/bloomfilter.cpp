@@ -0,0 +1,129 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "bloomfilter.h"
+
+#include <stdlib.h>
+
+using namespace std;
+
+#define MIN_BITS 1024
+#define MAX_BITS (1024 * 1024)
+
+BloomFilter::BloomFilter(size_t entries)
+{
+    size_t bits = MIN_BITS;
+
+    while (bits < entries * 10 && bits < MAX_BITS) {
+        bits *= 2;
+    }
+
+    m_bits.resize(bits / 8, 0);
+}
+
+bool BloomFilter::positions(const string &key, uint32_t pos[4]) const
+{
+    if (m_bits.empty() || key.size() != 32) {
+        return false;
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        char *end;
+        string word = key.substr(i * 8, 8);
+        pos[i] = strtoul(word.c_str(), &end, 16) & (m_bits.size() * 8 - 1);
+
+        if (*end) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void BloomFilter::add(const string &key)
+{
+    uint32_t pos[4];
+
+    if (positions(key, pos)) {
+        for (int i = 0; i < 4; ++i) {
+            m_bits[pos[i] / 8] |= 1 << (pos[i] % 8);
+        }
+    }
+}
+
+bool BloomFilter::may_contain(const string &key) const
+{
+    uint32_t pos[4];
+
+    if (!positions(key, pos)) {
+        return false;
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        if (!(m_bits[pos[i] / 8] & (1 << (pos[i] % 8)))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+string BloomFilter::encode() const
+{
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    hex.reserve(m_bits.size() * 2);
+
+    for (size_t i = 0; i < m_bits.size(); ++i) {
+        hex += digits[m_bits[i] >> 4];
+        hex += digits[m_bits[i] & 15];
+    }
+
+    return hex;
+}
+
+bool BloomFilter::decode(const string &hex)
+{
+    size_t bytes = hex.size() / 2;
+
+    // the bit positions are masked, so only powers of two will do
+    if (hex.size() % 2 || bytes < MIN_BITS / 8 || bytes > MAX_BITS / 8 || (bytes & (bytes - 1))) {
+        m_bits.clear();
+        return false;
+    }
+
+    m_bits.resize(bytes);
+
+    for (size_t i = 0; i < bytes; ++i) {
+        char byte[3] = { hex[i * 2], hex[i * 2 + 1], 0 };
+        char *end;
+        m_bits[i] = strtoul(byte, &end, 16);
+
+        if (*end) {
+            m_bits.clear();
+            return false;
+        }
+    }
+
+    return true;
+}
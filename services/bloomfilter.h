@@ -0,0 +1,71 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_BLOOMFILTER_H
+#define ICECREAM_BLOOMFILTER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/* The set of objects a daemon has in its cache, as it tells the scheduler
+   in M_STATS.  Keys are the 32 hex digits of an MD5 sum, the four words
+   of it are the four bit positions, so nothing needs hashing again.  A
+   false positive only costs a compile on a host that was thought to have
+   the result.  */
+class BloomFilter
+{
+public:
+    BloomFilter() {}
+    // about 10 bits for every one of ENTRIES keys, that is 1% false positives
+    explicit BloomFilter(size_t entries);
+
+    void add(const std::string &key);
+    bool may_contain(const std::string &key) const;
+
+    bool empty() const
+    {
+        return m_bits.empty();
+    }
+
+    bool operator==(const BloomFilter &other) const
+    {
+        return m_bits == other.m_bits;
+    }
+
+    bool operator!=(const BloomFilter &other) const
+    {
+        return m_bits != other.m_bits;
+    }
+
+    // as hex digits, the messages only carry C strings
+    std::string encode() const;
+    bool decode(const std::string &hex);
+
+private:
+    bool positions(const std::string &key, uint32_t pos[4]) const;
+
+    std::vector<uint8_t> m_bits;
+};
+
+#endif
@@ -0,0 +1,416 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <config.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "chunksender.h"
+#include "comm.h"
+#include "compression.h"
+#include "logging.h"
+
+using namespace std;
+
+// more would only wait for the network
+#define MAX_COMPRESS_THREADS 4
+
+const size_t ChunkSender::CHUNK_SIZE;
+
+ssize_t FdChunkSource::read(unsigned char *buf, size_t len)
+{
+    for (;;) {
+        ssize_t bytes = ::read(m_fd, buf, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        return bytes;
+    }
+}
+
+// reads until there are LEN bytes or the source ends
+static ssize_t fill_chunk(ChunkSource &source, unsigned char *buf, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t bytes = source.read(buf + got, len - got);
+
+        if (bytes < 0) {
+            return -1;
+        }
+
+        if (!bytes) {
+            break;
+        }
+
+        got += bytes;
+    }
+
+    return got;
+}
+
+unsigned int ChunkSender::compress_threads()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1) {
+        return 1;
+    }
+
+    return min(cpus, (long) MAX_COMPRESS_THREADS);
+}
+
+enum PipeChunkState {
+    CHUNK_FREE,
+    CHUNK_READ,         // waits for a codec
+    CHUNK_QUEUED,       // waits for a thread to compress it
+    CHUNK_COMPRESSING,
+    CHUNK_DONE          // waits to be sent
+};
+
+struct PipeChunk {
+    PipeChunkState state;
+    unsigned long seq;
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+    int codec;
+    int level;
+    unsigned long usecs;
+    bool failed;
+};
+
+/* What the threads of one ChunkSender::send() share, all of it guarded
+   by LOCK.  Every change is announced on CHANGED, there are few enough
+   threads to just wake them all.  */
+struct ChunkPipe {
+    ChunkSource *source;
+    const CompressionDictionary *dict;
+    size_t out_size;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    vector<PipeChunk> chunks;
+    unsigned long next_read;
+    bool read_done;
+    int read_errno;     // set if reading failed
+    bool stop;
+};
+
+static void *read_chunks(void *arg)
+{
+    ChunkPipe *pipe = (ChunkPipe *) arg;
+    pthread_mutex_lock(&pipe->lock);
+
+    while (!pipe->stop && !pipe->read_done) {
+        PipeChunk *chunk = 0;
+
+        for (size_t i = 0; i < pipe->chunks.size() && !chunk; ++i) {
+            if (pipe->chunks[i].state == CHUNK_FREE) {
+                chunk = &pipe->chunks[i];
+            }
+        }
+
+        if (!chunk) {
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+            continue;
+        }
+
+        // nobody else takes free chunks
+        pthread_mutex_unlock(&pipe->lock);
+        ssize_t len = fill_chunk(*pipe->source, chunk->in, ChunkSender::CHUNK_SIZE);
+        int saved_errno = errno;
+        pthread_mutex_lock(&pipe->lock);
+
+        if (len < 0) {
+            pipe->read_errno = saved_errno ? saved_errno : EIO;
+            pipe->read_done = true;
+        } else {
+            if (len) {
+                chunk->seq = pipe->next_read++;
+                chunk->in_len = len;
+                chunk->state = CHUNK_READ;
+            }
+
+            pipe->read_done = size_t(len) < ChunkSender::CHUNK_SIZE;
+        }
+
+        pthread_cond_broadcast(&pipe->changed);
+    }
+
+    pthread_mutex_unlock(&pipe->lock);
+    return 0;
+}
+
+static void *compress_chunks(void *arg)
+{
+    ChunkPipe *pipe = (ChunkPipe *) arg;
+    pthread_mutex_lock(&pipe->lock);
+
+    while (!pipe->stop) {
+        PipeChunk *chunk = 0;
+
+        for (size_t i = 0; i < pipe->chunks.size(); ++i) {
+            if (pipe->chunks[i].state == CHUNK_QUEUED
+                    && (!chunk || pipe->chunks[i].seq < chunk->seq)) {
+                chunk = &pipe->chunks[i];
+            }
+        }
+
+        if (!chunk) {
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+            continue;
+        }
+
+        chunk->state = CHUNK_COMPRESSING;
+        pthread_mutex_unlock(&pipe->lock);
+
+        struct timeval start, end;
+        gettimeofday(&start, 0);
+        chunk->out_len = pipe->out_size;
+        chunk->failed = !compress_chunk((CompressionCodec) chunk->codec, chunk->level,
+                                        chunk->in, chunk->in_len, chunk->out, chunk->out_len,
+                                        pipe->dict);
+        gettimeofday(&end, 0);
+        chunk->usecs = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+
+        pthread_mutex_lock(&pipe->lock);
+        chunk->state = CHUNK_DONE;
+        pthread_cond_broadcast(&pipe->changed);
+    }
+
+    pthread_mutex_unlock(&pipe->lock);
+    return 0;
+}
+
+static bool send_chunk(MsgChannel *channel, const PipeChunk &chunk, size_t &uncompressed,
+                       size_t &compressed)
+{
+    unsigned char *data = chunk.out;
+    size_t len = chunk.out_len;
+
+    if (chunk.codec == C_NONE) {
+        data = chunk.in;
+        len = chunk.in_len;
+    } else if (chunk.failed) {
+        /* this should NEVER happen */
+        log_error() << "internal error - compression failed (" << codec_name(chunk.codec) << ")"
+                    << endl;
+        len = 0;
+    } else {
+        channel->record_compression(chunk.codec, chunk.level, chunk.in_len, len, chunk.usecs);
+    }
+
+    FileChunkMsg fcmsg(data, len, chunk.in_len, chunk.codec, chunk.level);
+
+    if (!channel->send_msg(fcmsg)) {
+        return false;
+    }
+
+    uncompressed += chunk.in_len;
+    compressed += fcmsg.compressed;
+    return true;
+}
+
+ChunkSender::Result ChunkSender::send_serially(ChunkSource &source, unsigned char *buffer,
+                                               size_t len)
+{
+    for (;;) {
+        if (len) {
+            FileChunkMsg fcmsg(buffer, len);
+
+            if (!m_channel->send_msg(fcmsg)) {
+                return SEND_FAILED;
+            }
+
+            m_uncompressed += fcmsg.len;
+            m_compressed += fcmsg.compressed;
+        }
+
+        if (len < CHUNK_SIZE) {
+            return SENT;
+        }
+
+        ssize_t bytes = fill_chunk(source, buffer, CHUNK_SIZE);
+
+        if (bytes < 0) {
+            return READ_FAILED;
+        }
+
+        len = bytes;
+    }
+}
+
+ChunkSender::Result ChunkSender::send(ChunkSource &source)
+{
+    unsigned char *first = (unsigned char *) malloc(CHUNK_SIZE);
+    ssize_t len = fill_chunk(source, first, CHUNK_SIZE);
+
+    if (len < 0) {
+        free(first);
+        return READ_FAILED;
+    }
+
+    // the usual source or object file
+    if (size_t(len) < CHUNK_SIZE) {
+        Result result = send_serially(source, first, len);
+        free(first);
+        return result;
+    }
+
+    // even with one core, reading and sending go on while compressing
+    unsigned int threads = compress_threads();
+    ChunkPipe pipe;
+    pipe.source = &source;
+    pipe.dict = m_channel->compression_dictionary();
+    pipe.out_size = 0;
+
+    for (int codec = C_NONE; codec <= C_LAST; ++codec) {
+        pipe.out_size = max(pipe.out_size, compress_bound((CompressionCodec) codec, CHUNK_SIZE));
+    }
+
+    pthread_mutex_init(&pipe.lock, 0);
+    pthread_cond_init(&pipe.changed, 0);
+    pipe.chunks.resize(threads * 2 + 2);
+
+    for (size_t i = 0; i < pipe.chunks.size(); ++i) {
+        pipe.chunks[i].state = CHUNK_FREE;
+        pipe.chunks[i].in = i ? (unsigned char *) malloc(CHUNK_SIZE) : first;
+        pipe.chunks[i].out = (unsigned char *) malloc(pipe.out_size);
+    }
+
+    pipe.chunks[0].state = CHUNK_READ;
+    pipe.chunks[0].seq = 0;
+    pipe.chunks[0].in_len = len;
+    pipe.next_read = 1;
+    pipe.read_done = false;
+    pipe.read_errno = 0;
+    pipe.stop = false;
+
+    vector<pthread_t> workers;
+    pthread_t reader;
+
+    for (unsigned int i = 0; i < threads; ++i) {
+        pthread_t thread;
+
+        if (!pthread_create(&thread, 0, compress_chunks, &pipe)) {
+            workers.push_back(thread);
+        }
+    }
+
+    bool have_reader = !workers.empty() && !pthread_create(&reader, 0, read_chunks, &pipe);
+    Result result = SENT;
+    unsigned long next_send = 0;
+
+    pthread_mutex_lock(&pipe.lock);
+
+    while (have_reader) {
+        PipeChunk *ready = 0;
+        bool queued = false;
+
+        // only this thread uses the channel, and with it the cost model
+        for (size_t i = 0; i < pipe.chunks.size(); ++i) {
+            PipeChunk &chunk = pipe.chunks[i];
+
+            if (chunk.state == CHUNK_READ) {
+                m_channel->pick_codec(chunk.in_len, chunk.codec, chunk.level);
+                chunk.state = chunk.codec == C_NONE ? CHUNK_DONE : CHUNK_QUEUED;
+                queued = true;
+            }
+
+            if (chunk.state == CHUNK_DONE && chunk.seq == next_send) {
+                ready = &chunk;
+            }
+        }
+
+        if (queued) {
+            pthread_cond_broadcast(&pipe.changed);
+        }
+
+        if (ready) {
+            pthread_mutex_unlock(&pipe.lock);
+            bool sent = send_chunk(m_channel, *ready, m_uncompressed, m_compressed);
+            pthread_mutex_lock(&pipe.lock);
+
+            ready->state = CHUNK_FREE;
+            pthread_cond_broadcast(&pipe.changed);
+
+            if (!sent) {
+                result = SEND_FAILED;
+                break;
+            }
+
+            ++next_send;
+            continue;
+        }
+
+        if (pipe.read_done && next_send == pipe.next_read) {
+            if (pipe.read_errno) {
+                result = READ_FAILED;
+            }
+
+            break;
+        }
+
+        pthread_cond_wait(&pipe.changed, &pipe.lock);
+    }
+
+    pipe.stop = true;
+    pthread_cond_broadcast(&pipe.changed);
+    pthread_mutex_unlock(&pipe.lock);
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        pthread_join(workers[i], 0);
+    }
+
+    if (have_reader) {
+        pthread_join(reader, 0);
+    } else {
+        // no threads to be had, the first chunk is still there
+        log_warning() << "could not start compression threads" << endl;
+        result = send_serially(source, first, len);
+    }
+
+    for (size_t i = 0; i < pipe.chunks.size(); ++i) {
+        free(pipe.chunks[i].in);
+        free(pipe.chunks[i].out);
+    }
+
+    pthread_cond_destroy(&pipe.changed);
+    pthread_mutex_destroy(&pipe.lock);
+
+    if (result == READ_FAILED && pipe.read_errno) {
+        errno = pipe.read_errno;
+    }
+
+    return result;
+}
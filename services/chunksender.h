@@ -0,0 +1,102 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_CHUNKSENDER_H
+#define ICECREAM_CHUNKSENDER_H
+
+#include <sys/types.h>
+
+class MsgChannel;
+
+/* Where ChunkSender gets the data to send from.  read() is called on a
+   thread of its own, and only from one at a time.  */
+class ChunkSource
+{
+public:
+    virtual ~ChunkSource() {}
+
+    // like read(2), 0 at the end and -1 with errno set on failure
+    virtual ssize_t read(unsigned char *buf, size_t len) = 0;
+};
+
+class FdChunkSource : public ChunkSource
+{
+public:
+    explicit FdChunkSource(int fd)
+        : m_fd(fd) {}
+
+    virtual ssize_t read(unsigned char *buf, size_t len);
+
+private:
+    int m_fd;
+};
+
+/* Sends what a ChunkSource has as FileChunkMsgs, without the M_END.
+   Reading, compressing and sending overlap: one thread reads chunks, a
+   few compress them, and the calling thread sends them in order, with a
+   bounded number of chunks in between.  The calling thread is the only
+   one that touches the channel, so the cost model picks the codecs like
+   before.  What fits into one chunk is sent right away, without starting
+   any threads.  */
+class ChunkSender
+{
+public:
+    enum Result {
+        SENT,
+        READ_FAILED,
+        SEND_FAILED
+    };
+
+    // what is read and compressed at a time
+    static const size_t CHUNK_SIZE = 100000;
+
+    explicit ChunkSender(MsgChannel *channel)
+        : m_channel(channel)
+        , m_uncompressed(0)
+        , m_compressed(0) {}
+
+    Result send(ChunkSource &source);
+
+    // totals of everything sent so far
+    size_t uncompressed() const
+    {
+        return m_uncompressed;
+    }
+
+    size_t compressed() const
+    {
+        return m_compressed;
+    }
+
+    // how many threads compress, at most
+    static unsigned int compress_threads();
+
+private:
+    Result send_serially(ChunkSource &source, unsigned char *buffer, size_t len);
+
+    MsgChannel *m_channel;
+    size_t m_uncompressed;
+    size_t m_compressed;
+};
+
+#endif
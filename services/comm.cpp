@@ -29,6 +29,7 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
 #include <netinet/in.h>
@@ -39,14 +40,19 @@
 #endif
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
 #include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <assert.h>
-#include <lzo/lzo1x.h>
 #include <stdio.h>
+#include <sys/time.h>
 #ifdef HAVE_LIBCAP_NG
 #include <cap-ng.h>
 #endif
@@ -54,6 +60,8 @@
 #include "logging.h"
 #include "job.h"
 #include "comm.h"
+#include "compression.h"
+#include "objectkey.h"
 
 using namespace std;
 
@@ -79,6 +87,88 @@ using namespace std;
  */
 
 /* Tries to fill the inbuf completely.  */
+/* Like read(), but keeps the descriptors that came along with the data
+   on a unix domain socket.  */
+static ssize_t read_with_fds(int fd, char *buf, size_t count, list<int> &fds)
+{
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = count;
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } control;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+#ifdef MSG_CMSG_CLOEXEC
+    ssize_t ret = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+#else
+    ssize_t ret = recvmsg(fd, &mh, 0);
+#endif
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (size_t i = 0; i < n; ++i) {
+            int passed;
+            memcpy(&passed, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+            fcntl(passed, F_SETFD, FD_CLOEXEC);
+#endif
+            fds.push_back(passed);
+        }
+    }
+
+    if (mh.msg_flags & MSG_CTRUNC) {
+        log_warning() << "lost file descriptors passed over a unix socket" << endl;
+    }
+
+    return ret;
+}
+
+/* Like send(), but gathers the data from IOV, and attaches PASS_FD
+   to it unless that is -1.  */
+static ssize_t send_iov(int fd, struct iovec *iov, int iovcnt, int pass_fd, int flags)
+{
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovcnt;
+
+    if (pass_fd >= 0) {
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &pass_fd, sizeof(int));
+    }
+
+    return sendmsg(fd, &mh, flags);
+}
+
 bool MsgChannel::read_a_bit()
 {
     chop_input();
@@ -92,15 +182,24 @@ bool MsgChannel::read_a_bit()
 
     char *buf = inbuf + inofs;
     bool error = false;
+    drained = true;
 
     while (count) {
         if (eof) {
             break;
         }
 
-        ssize_t ret = read(fd, buf, count);
+        ssize_t ret;
+
+        if (can_pass_fds()) {
+            ret = read_with_fds(fd, buf, count, received_fds);
+        } else {
+            ret = read(fd, buf, count);
+        }
 
         if (ret > 0) {
+            // a short read means the socket is empty for now
+            drained = (size_t) ret < count;
             count -= ret;
             buf += ret;
         } else if (ret < 0 && errno == EINTR) {
@@ -165,6 +264,18 @@ bool MsgChannel::update_state(void)
 
                 writefull(vers, 4);
 
+                /* Both sides know the final protocol version now, so
+                   announce the codecs we can decompress right away.  */
+                if (remote_prot >= 36) {
+                    uint32_t codecs = supported_codecs();
+
+                    for (int i = 0; i < 4; ++i) {
+                        vers[i] = codecs >> (i * 8);
+                    }
+
+                    writefull(vers, 4);
+                }
+
                 if (!flush_writebuf(true)) {
                     return false;
                 }
@@ -179,7 +290,7 @@ bool MsgChannel::update_state(void)
                     return false;
                 }
 
-                instate = NEED_LEN;
+                instate = IS_PROTOCOL_36(this) ? NEED_CODECS : NEED_LEN;
                 /* Don't consume bytes from messages.  */
                 break;
             } else {
@@ -188,11 +299,31 @@ bool MsgChannel::update_state(void)
         }
 
         /* FALLTHROUGH if the protocol setup was complete (instate was changed
-        to NEED_LEN then).  */
-        if (instate != NEED_LEN) {
+        to NEED_CODECS or NEED_LEN then).  */
+        if (instate == NEED_PROTO) {
             break;
         }
 
+    case NEED_CODECS:
+
+        if (instate == NEED_CODECS) {
+            if (inofs - intogo < 4) {
+                break;
+            }
+
+            unsigned char codecs[4];
+            memcpy(codecs, inbuf + intogo, 4);
+            intogo += 4;
+            remote_codecs = 0;
+
+            for (int i = 0; i < 4; ++i) {
+                remote_codecs |= codecs[i] << (i * 8);
+            }
+
+            instate = NEED_LEN;
+        }
+        /* FALLTHROUGH */
+
     case NEED_LEN:
 
         if (text_based) {
@@ -271,8 +402,25 @@ void MsgChannel::chop_output()
     }
 }
 
+void MsgChannel::copy_payload()
+{
+    const unsigned char *p = payload;
+    size_t len = payload_len;
+    payload = 0;
+    payload_len = 0;
+
+    if (len) {
+        writefull(p, len);
+    }
+}
+
 void MsgChannel::writefull(const void *_buf, size_t count)
 {
+    // more after a chunk in the same message, it has to go in order
+    if (payload_len) {
+        copy_payload();
+    }
+
     if (msgtogo + count >= msgbuflen) {
         /* Realloc to a multiple of 128.  */
         msgbuflen = (msgtogo + count + 127) & ~(size_t)127;
@@ -283,19 +431,60 @@ void MsgChannel::writefull(const void *_buf, size_t count)
     msgtogo += count;
 }
 
+/* Bytes written to the socket that the other side didn't acknowledge
+   yet, -1 if unknown.  */
+static int unacked_bytes(int fd)
+{
+#ifdef SIOCOUTQ
+    int queued;
+
+    if (ioctl(fd, SIOCOUTQ, &queued) == 0) {
+        return queued;
+    }
+#else
+    (void) fd;
+#endif
+
+    return -1;
+}
+
 bool MsgChannel::flush_writebuf(bool blocking)
 {
     const char *buf = msgbuf + msgofs;
     bool error = false;
+    bool waited = false;
+    size_t total = msgtogo + payload_len;
+    struct timeval start;
+    int unacked = -1;
+
+    if (blocking && tcp_link && compression) {
+        gettimeofday(&start, 0);
+        unacked = unacked_bytes(fd);
+    }
+
+    while (msgtogo || payload_len) {
+        struct iovec iov[2];
+        int iovcnt = 0;
+
+        if (msgtogo) {
+            iov[iovcnt].iov_base = (void *) buf;
+            iov[iovcnt].iov_len = msgtogo;
+            ++iovcnt;
+        }
+
+        if (payload_len) {
+            iov[iovcnt].iov_base = (void *) payload;
+            iov[iovcnt].iov_len = payload_len;
+            ++iovcnt;
+        }
 
-    while (msgtogo) {
 #ifdef MSG_NOSIGNAL
-        ssize_t ret = send(fd, buf, msgtogo, MSG_NOSIGNAL);
+        ssize_t ret = send_iov(fd, iov, iovcnt, pass_fd, MSG_NOSIGNAL);
 #else
         void (*oldsigpipe)(int);
 
         oldsigpipe = signal(SIGPIPE, SIG_IGN);
-        ssize_t ret = send(fd, buf, msgtogo, 0);
+        ssize_t ret = send_iov(fd, iov, iovcnt, pass_fd, 0);
         signal(SIGPIPE, oldsigpipe);
 #endif
 
@@ -308,6 +497,7 @@ bool MsgChannel::flush_writebuf(bool blocking)
                select on the fd.  */
             if (blocking && errno == EAGAIN) {
                 int ready;
+                waited = true;
 
                 for (;;) {
                     fd_set write_set;
@@ -342,12 +532,49 @@ bool MsgChannel::flush_writebuf(bool blocking)
             break;
         }
 
-        msgtogo -= ret;
-        buf += ret;
+        // the descriptor went out with the first byte
+        pass_fd = -1;
+        size_t sent = ret;
+
+        if (sent < msgtogo) {
+            msgtogo -= sent;
+            buf += sent;
+        } else {
+            sent -= msgtogo;
+            buf += msgtogo;
+            msgtogo = 0;
+            payload += sent;
+            payload_len -= sent;
+        }
+    }
+
+    /* How fast the other side takes our data is what decides whether
+       compressing harder pays off.  A write that didn't have to wait only
+       filled the socket buffer, that says nothing about the link.  What
+       got delivered meanwhile is what left the send queue.  */
+    if (waited && !error && tcp_link && compression) {
+        struct timeval end;
+        gettimeofday(&end, 0);
+        int unacked_now = unacked_bytes(fd);
+        size_t delivered = total;
+
+        if (unacked >= 0 && unacked_now >= 0 && total + unacked >= (size_t) unacked_now) {
+            delivered = total + unacked - unacked_now;
+        }
+
+        compression->record_link(delivered, (end.tv_sec - start.tv_sec) * 1000000
+                                 + (end.tv_usec - start.tv_usec));
     }
 
     msgofs = buf - msgbuf;
     chop_output();
+
+    // what didn't go out yet must not depend on the caller's buffer
+    if (error) {
+        payload_len = 0;
+    }
+
+    copy_payload();
     return !error;
 }
 
@@ -462,9 +689,16 @@ void MsgChannel::read_environments(Environments &envs)
 
 void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen, size_t &_clen)
 {
-    lzo_uint uncompressed_len;
-    lzo_uint compressed_len;
+    size_t uncompressed_len;
+    size_t compressed_len;
     uint32_t tmp;
+    CompressionCodec codec = C_LZO;
+
+    if (IS_PROTOCOL_36(this)) {
+        *this >> tmp;
+        codec = (CompressionCodec)(tmp & 0xff);
+    }
+
     *this >> tmp;
     uncompressed_len = tmp;
     *this >> tmp;
@@ -476,7 +710,8 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
     if (uncompressed_len > MAX_MSG_SIZE
             || compressed_len > (inofs - intogo)
             || (uncompressed_len && !compressed_len)
-            || inofs < intogo + compressed_len) {
+            || inofs < intogo + compressed_len
+            || codec > C_LAST) {
         log_error() << "failure in readcompressed() length checking" << endl;
         *uncompressed_buf = 0;
         uncompressed_len = 0;
@@ -485,25 +720,26 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
         return;
     }
 
-    *uncompressed_buf = new unsigned char[uncompressed_len];
+    *uncompressed_buf = alloc_chunk_buffer(uncompressed_len);
 
     if (uncompressed_len && compressed_len) {
-        const lzo_byte *compressed_buf = (lzo_byte *)(inbuf + intogo);
-        lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
-        int ret = lzo1x_decompress(compressed_buf, compressed_len,
-                                   *uncompressed_buf, &uncompressed_len, wrkmem);
-        free(wrkmem);
+        const unsigned char *compressed_buf = (unsigned char *)(inbuf + intogo);
+        size_t expected_len = uncompressed_len;
 
-        if (ret != LZO_E_OK) {
+        if (!decompress_chunk(codec, compressed_buf, compressed_len,
+                              *uncompressed_buf, uncompressed_len, dictionary)
+                || uncompressed_len != expected_len) {
             /* This should NEVER happen.
             Remove the buffer, and indicate there is nothing in it,
             but don't reset the compressed_len, so our caller know,
             that there actually was something read in.  */
             log_error() << "internal error - decompression of data from " << dump().c_str()
-                        << " failed: " << ret << endl;
-            delete [] *uncompressed_buf;
+                        << " failed (" << codec_name(codec) << ")" << endl;
+            free_chunk_buffer(*uncompressed_buf, expected_len);
             *uncompressed_buf = 0;
             uncompressed_len = 0;
+        } else {
+            compression->count_received(codec, uncompressed_len, compressed_len);
         }
     }
 
@@ -515,38 +751,138 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
     _clen = compressed_len;
 }
 
+void MsgChannel::pick_codec(size_t in_len, int &codec, int &level) const
+{
+    codec = C_LZO;
+    level = 0;
+
+    if (IS_PROTOCOL_36(this)) {
+        uint32_t usable = remote_codecs & supported_codecs();
+
+        if (dictionary && IS_PROTOCOL_49(this) && dictionary->id() == remote_dictionary
+                && (usable & (1 << C_ZSTD))) {
+            usable |= 1 << C_ZSTD_DICT;
+        }
+
+        CompressionCodec picked;
+        compression->pick(in_len, usable, picked, level);
+        codec = picked;
+    }
+}
+
+const CompressionDictionary *MsgChannel::compression_dictionary() const
+{
+    return dictionary;
+}
+
+void MsgChannel::record_compression(int codec, int level, size_t in_len, size_t out_len,
+                                    unsigned long usecs)
+{
+    compression->record_compression((CompressionCodec) codec, level, in_len, out_len, usecs);
+}
+
 void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, size_t &_out_len)
 {
-    lzo_uint in_len = _in_len;
-    lzo_uint out_len = _out_len;
-    out_len = in_len + in_len / 64 + 16 + 3;
-    *this << in_len;
+    size_t in_len = _in_len;
+    int picked;
+    int level;
+
+    pick_codec(in_len, picked, level);
+    CompressionCodec codec = (CompressionCodec) picked;
+
+    if (IS_PROTOCOL_36(this)) {
+        *this << (uint32_t)(codec | (level << 8));
+    }
+
+    size_t out_len = compress_bound(codec, in_len);
+    *this << (uint32_t) in_len;
     size_t msgtogo_old = msgtogo;
     *this << (uint32_t) 0;
 
-    if (msgtogo + out_len >= msgbuflen) {
-        /* Realloc to a multiple of 128.  */
-        msgbuflen = (msgtogo + out_len + 127) & ~(size_t)127;
-        msgbuf = (char *) realloc(msgbuf, msgbuflen);
+    /* The data itself is not copied into msgbuf, flush_writebuf() sends
+       it from where it is.  Uncompressed that's the caller's buffer.  */
+    if (codec == C_NONE) {
+        payload = in_buf;
+        payload_len = in_len;
+        uint32_t _olen = htonl(in_len);
+        memcpy(msgbuf + msgtogo_old, &_olen, 4);
+        compression->count_sent(codec, in_len, in_len);
+        _out_len = in_len;
+        return;
+    }
+
+    if (out_len > zbuflen) {
+        zbuflen = (out_len + 127) & ~(size_t)127;
+        zbuf = (unsigned char *) realloc(zbuf, zbuflen);
     }
 
-    lzo_byte *out_buf = (lzo_byte *)(msgbuf + msgtogo);
-    lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
-    int ret = lzo1x_1_compress(in_buf, in_len, out_buf, &out_len, wrkmem);
-    free(wrkmem);
+    unsigned char *out_buf = zbuf;
+    struct timeval start, end;
+    gettimeofday(&start, 0);
 
-    if (ret != LZO_E_OK) {
+    if (!compress_chunk(codec, level, in_buf, in_len, out_buf, out_len, dictionary)) {
         /* this should NEVER happen */
-        log_error() << "internal error - compression failed: " << ret << endl;
+        log_error() << "internal error - compression failed (" << codec_name(codec) << ")" << endl;
         out_len = 0;
+    } else {
+        gettimeofday(&end, 0);
+        compression->record_compression(codec, level, in_len, out_len,
+                                        (end.tv_sec - start.tv_sec) * 1000000
+                                        + (end.tv_usec - start.tv_usec));
+        compression->count_sent(codec, in_len, out_len);
     }
 
     uint32_t _olen = htonl(out_len);
     memcpy(msgbuf + msgtogo_old, &_olen, 4);
-    msgtogo += out_len;
+    payload = zbuf;
+    payload_len = out_len;
     _out_len = out_len;
 }
 
+void MsgChannel::writeprecompressed(int codec, int level, size_t in_len,
+                                    const unsigned char *out_buf, size_t out_len)
+{
+    if (IS_PROTOCOL_36(this)) {
+        *this << (uint32_t)(codec | (level << 8));
+    }
+
+    *this << (uint32_t) in_len;
+    *this << (uint32_t) out_len;
+    payload = out_buf;
+    payload_len = out_len;
+    compression->count_sent((CompressionCodec) codec, in_len, out_len);
+}
+
+string MsgChannel::compression_stats() const
+{
+    return compression->dump_stats();
+}
+
+bool MsgChannel::set_compression_dictionary(const string &file)
+{
+    if (!IS_PROTOCOL_37(this)) {
+        return false;
+    }
+
+    dictionary = CompressionDictionary::load(file);
+    return dictionary != 0;
+}
+
+uint32_t MsgChannel::compression_dictionary_id() const
+{
+    return dictionary ? dictionary->id() : 0;
+}
+
+void MsgChannel::set_remote_dictionary_id(uint32_t id)
+{
+    remote_dictionary = id;
+}
+
+uint32_t MsgChannel::remote_dictionary_id() const
+{
+    return remote_dictionary;
+}
+
 void MsgChannel::read_line(string &line)
 {
     /* XXX handle DOS and MAC line endings and null bytes as string endings.  */
@@ -755,10 +1091,20 @@ bool MsgChannel::eq_ip(const MsgChannel &s) const
             && memcmp(&s1->sin_addr, &s2->sin_addr, sizeof(s1->sin_addr)) == 0);
 }
 
-MsgChannel *Service::createChannel(int fd, struct sockaddr *_a, socklen_t _l)
+MsgChannel *Service::createChannel(int fd, struct sockaddr *_a, socklen_t _l,
+                                   bool wait_for_setup)
 {
     MsgChannel *c = new MsgChannel(fd, _a, _l, false);
 
+    if (!wait_for_setup) {
+        if (!c->protocol) {   // not even our version went out
+            delete c;
+            c = 0;
+        }
+
+        return c;
+    }
+
     if (!c->wait_for_protocol()) {
         delete c;
         c = 0;
@@ -767,8 +1113,51 @@ MsgChannel *Service::createChannel(int fd, struct sockaddr *_a, socklen_t _l)
     return c;
 }
 
-MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
+MsgChannel *Service::createChannel(int fd, const string &hostname, unsigned short p)
+{
+    /* The descriptor is a socketpair, but the compression wants to
+       know about the other end.  */
+    struct sockaddr_in remote_addr;
+    memset(&remote_addr, 0, sizeof(remote_addr));
+    remote_addr.sin_family = AF_INET;
+    remote_addr.sin_port = htons(p);
+
+    if (!inet_aton(hostname.c_str(), &remote_addr.sin_addr)) {
+        log_warning() << "stream to unknown address " << hostname << endl;
+    }
+
+    return createChannel(fd, (struct sockaddr *) &remote_addr, sizeof(remote_addr));
+}
+
+MsgChannel *Service::adoptChannel(int fd, int protocol, uint32_t remote_codecs)
+{
+    struct sockaddr_storage remote_addr;
+    socklen_t remote_len = sizeof(remote_addr);
+
+    if (protocol < MIN_PROTOCOL_VERSION || protocol > PROTOCOL_VERSION
+            || getpeername(fd, (struct sockaddr *) &remote_addr, &remote_len) < 0) {
+        log_error() << "can't take over connection with protocol " << protocol << endl;
+
+        if ((-1 == close(fd)) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+
+        return 0;
+    }
+
+    MsgChannel *c = new MsgChannel(fd, (struct sockaddr *) &remote_addr, remote_len, false,
+                                   protocol);
+    c->remote_codecs = remote_codecs;
+    return c;
+}
+
+MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text,
+                       int negotiated_protocol)
     : fd(_fd)
+    , remote_codecs(1 << C_LZO)
+    , compression(new CompressionModel)
+    , dictionary(0)
+    , remote_dictionary(0)
 {
     addr_len = (sizeof(struct sockaddr) > _l) ? sizeof(struct sockaddr) : _l;
  
@@ -777,6 +1166,8 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
         memcpy(addr, _a, _l);
         if(addr->sa_family == AF_UNIX) {
             name = "local unix domain socket";
+            // nothing to gain from compressing, memcpy speed
+            compression->set_link_estimate(4e9);
         } else {
             char buf[16384] = "";
             if(int error = getnameinfo(addr, _l, buf, sizeof(buf), NULL, 0, NI_NUMERICHOST))
@@ -788,6 +1179,12 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
         name = "";
     }
 
+    // streams of a multiplexed connection carry the address of its other end
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    tcp_link = !getsockname(_fd, (struct sockaddr *) &local, &local_len)
+               && (local.ss_family == AF_INET || local.ss_family == AF_INET6);
+
     // not using new/delete because of the need of realloc()
     msgbuf = (char *) malloc(128);
     msgbuflen = 128;
@@ -798,7 +1195,13 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     inofs = 0;
     intogo = 0;
     eof = false;
+    drained = false;
     text_based = text;
+    pass_fd = -1;
+    payload = 0;
+    payload_len = 0;
+    zbuf = 0;
+    zbuflen = 0;
 
     int on = 1;
 
@@ -839,6 +1242,9 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     if (text_based) {
         instate = NEED_LEN;
         protocol = PROTOCOL_VERSION;
+    } else if (negotiated_protocol) {
+        instate = NEED_LEN;
+        protocol = negotiated_protocol;
     } else {
         instate = NEED_PROTO;
         protocol = -1;
@@ -864,6 +1270,14 @@ MsgChannel::~MsgChannel()
 
     fd = -1;
 
+    while (!received_fds.empty()) {
+        if ((-1 == close(received_fds.front())) && (errno != EBADF)){
+            log_perror("close failed");
+        }
+
+        received_fds.pop_front();
+    }
+
     if (msgbuf) {
         free(msgbuf);
     }
@@ -872,11 +1286,28 @@ MsgChannel::~MsgChannel()
         free(inbuf);
     }
 
+    if (zbuf) {
+        free(zbuf);
+    }
+
+    delete compression;
+
     if (addr) {
         free(addr);
     }
 }
 
+int MsgChannel::take_received_fd()
+{
+    if (received_fds.empty()) {
+        return -1;
+    }
+
+    int ret = received_fds.front();
+    received_fds.pop_front();
+    return ret;
+}
+
 string MsgChannel::dump() const
 {
     return name + ": (" + char((int)instate + 'A') + " eof: " + char(eof + '0') + ")";
@@ -891,7 +1322,7 @@ bool MsgChannel::wait_for_protocol()
         return false;
     }
 
-    while (instate == NEED_PROTO) {
+    while (instate == NEED_PROTO || instate == NEED_CODECS) {
         fd_set set;
         FD_ZERO(&set);
         FD_SET(fd, &set);
@@ -1106,6 +1537,45 @@ Msg *MsgChannel::get_msg(int timeout)
     case M_BLACKLIST_HOST_ENV:
         m = new BlacklistHostEnvMsg;
         break;
+    case M_MUX_START:
+        m = new MuxStartMsg;
+        break;
+    case M_CS_LEASE:
+        m = new CSLeaseMsg;
+        break;
+    case M_USE_LEASE:
+        m = new UseLeaseMsg;
+        break;
+    case M_RETURN_LEASE:
+        m = new ReturnLeaseMsg;
+        break;
+    case M_CACHE_ANSWER:
+        m = new CacheAnswerMsg;
+        break;
+    case M_PUMP_FILES:
+        m = new PumpFilesMsg;
+        break;
+    case M_PUMP_NEED:
+        m = new PumpNeedMsg;
+        break;
+    case M_ENV_FILES:
+        m = new EnvFilesMsg;
+        break;
+    case M_ENV_NEED:
+        m = new EnvNeedMsg;
+        break;
+    case M_ENV_FETCH:
+        m = new EnvFetchMsg;
+        break;
+    case M_ENV_FETCH_DONE:
+        m = new EnvFetchDoneMsg;
+        break;
+    case M_GET_ENV:
+        m = new GetEnvMsg;
+        break;
+    case M_INPUT_SIZE:
+        m = new InputSizeMsg;
+        break;
     case M_TIMEOUT:
         break;
     }
@@ -1124,7 +1594,7 @@ Msg *MsgChannel::get_msg(int timeout)
 
 bool MsgChannel::send_msg(const Msg &m, int flags)
 {
-    if (instate == NEED_PROTO && !wait_for_protocol()) {
+    if ((instate == NEED_PROTO || instate == NEED_CODECS) && !wait_for_protocol()) {
         return false;
     }
 
@@ -1136,17 +1606,36 @@ bool MsgChannel::send_msg(const Msg &m, int flags)
     } else {
         *this << (uint32_t) 0;
         m.send_to_channel(this);
-        uint32_t len = htonl(msgtogo - msgtogo_old - 4);
+        uint32_t len = htonl(msgtogo - msgtogo_old - 4 + payload_len);
         memcpy(msgbuf + msgtogo_old, &len, 4);
     }
 
-    if ((flags & SendBulkOnly) && msgtogo < 4096) {
+    if ((flags & SendBulkOnly) && msgtogo + payload_len < 4096) {
+        // stays queued, so it has to be copied after all
+        copy_payload();
         return true;
     }
 
     return flush_writebuf((flags & SendBlocking));
 }
 
+bool MsgChannel::send_msg_with_fd(const Msg &m, int _pass_fd)
+{
+    if (!can_pass_fds()) {
+        return false;
+    }
+
+    // what is queued already must not carry the descriptor
+    if (msgtogo && !flush_writebuf(true)) {
+        return false;
+    }
+
+    pass_fd = _pass_fd;
+    bool ret = send_msg(m, SendBlocking);
+    pass_fd = -1;
+    return ret;
+}
+
 #include "getifaddrs.h"
 #include <net/if.h>
 #include <sys/ioctl.h>
@@ -1545,6 +2034,24 @@ void GetCSMsg::fill_from_channel(MsgChannel *c)
         *c >> version;
         minimal_host_version = max( minimal_host_version, int( version ));
     }
+
+    cache_key = string();
+
+    if (IS_PROTOCOL_42(c)) {
+        *c >> cache_key;
+    }
+
+    input_size = 0;
+
+    if (IS_PROTOCOL_44(c)) {
+        *c >> input_size;
+    }
+
+    preprocessed_size = 0;
+
+    if (IS_PROTOCOL_50(c)) {
+        *c >> preprocessed_size;
+    }
 }
 
 void GetCSMsg::send_to_channel(MsgChannel *c) const
@@ -1568,6 +2075,18 @@ void GetCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_34(c)) {
         *c << minimal_host_version;
     }
+
+    if (IS_PROTOCOL_42(c)) {
+        *c << cache_key;
+    }
+
+    if (IS_PROTOCOL_44(c)) {
+        *c << input_size;
+    }
+
+    if (IS_PROTOCOL_50(c)) {
+        *c << preprocessed_size;
+    }
 }
 
 void UseCSMsg::fill_from_channel(MsgChannel *c)
@@ -1585,6 +2104,28 @@ void UseCSMsg::fill_from_channel(MsgChannel *c)
     } else {
         matched_job_id = 0;
     }
+
+    if (IS_PROTOCOL_38(c)) {
+        *c >> pooled_protocol;
+        *c >> pooled_codecs;
+    } else {
+        pooled_protocol = 0;
+        pooled_codecs = 0;
+    }
+
+    if (IS_PROTOCOL_39(c)) {
+        *c >> pooled_stream;
+    } else {
+        pooled_stream = 0;
+    }
+
+    if (IS_PROTOCOL_46(c)) {
+        *c >> env_peers;
+    }
+
+    if (pooled_protocol || pooled_stream) {
+        pooled_fd = c->take_received_fd();
+    }
 }
 
 void UseCSMsg::send_to_channel(MsgChannel *c) const
@@ -1600,6 +2141,26 @@ void UseCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_28(c)) {
         *c << matched_job_id;
     }
+
+    if (IS_PROTOCOL_38(c)) {
+        *c << pooled_protocol;
+        *c << pooled_codecs;
+    }
+
+    if (IS_PROTOCOL_39(c)) {
+        *c << pooled_stream;
+    }
+
+    if (IS_PROTOCOL_46(c)) {
+        *c << env_peers;
+    }
+}
+
+UseCSMsg::~UseCSMsg()
+{
+    if (pooled_fd >= 0 && (-1 == close(pooled_fd)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
 }
 
 void CompileFileMsg::fill_from_channel(MsgChannel *c)
@@ -1653,6 +2214,31 @@ void CompileFileMsg::fill_from_channel(MsgChannel *c)
         job->setOutputFile(outputFile);
         job->setDwarfFissionEnabled(dwarfFissionEnabled);
     }
+    if (IS_PROTOCOL_42(c)) {
+        // the key itself before, which the compile server had to take on trust
+        string sourceHash;
+        *c >> sourceHash;
+
+        if (IS_PROTOCOL_48(c) && !sourceHash.empty()) {
+            job->setSourceHash(sourceHash);
+            job->setCacheKey(object_key(*job, version, sourceHash));
+        }
+    }
+    if (IS_PROTOCOL_43(c)) {
+        uint32_t preprocessRemotely = 0;
+        *c >> preprocessRemotely;
+        job->setPreprocessRemotely(preprocessRemotely);
+    }
+    if (IS_PROTOCOL_49(c)) {
+        uint32_t dictionary_id = 0;
+        *c >> dictionary_id;
+        c->set_remote_dictionary_id(dictionary_id);
+    }
+    if (IS_PROTOCOL_51(c)) {
+        uint32_t inputFromCpp = 0;
+        *c >> inputFromCpp;
+        job->setInputFromCpp(inputFromCpp);
+    }
 }
 
 void CompileFileMsg::send_to_channel(MsgChannel *c) const
@@ -1689,6 +2275,22 @@ void CompileFileMsg::send_to_channel(MsgChannel *c) const
         *c << job->outputFile();
         *c << (uint32_t) job->dwarfFissionEnabled();
     }
+
+    if (IS_PROTOCOL_42(c)) {
+        *c << (IS_PROTOCOL_48(c) ? job->sourceHash() : string());
+    }
+
+    if (IS_PROTOCOL_43(c)) {
+        *c << (uint32_t) job->preprocessRemotely();
+    }
+
+    if (IS_PROTOCOL_49(c)) {
+        *c << c->compression_dictionary_id();
+    }
+
+    if (IS_PROTOCOL_51(c)) {
+        *c << (uint32_t) job->inputFromCpp();
+    }
 }
 
 // Environments created by icecc-create-env always use the same binary name
@@ -1711,10 +2313,53 @@ CompileJob *CompileFileMsg::takeJob()
     return job;
 }
 
+/* The chunks the client and the daemon send are 100000 bytes,
+   anything up to this size uses the pool.  */
+#define CHUNK_BUFFER_SIZE (128 * 1024)
+#define MAX_POOLED_CHUNK_BUFFERS 16
+
+static vector<unsigned char *> chunk_buffer_pool;
+static size_t chunk_buffer_allocations = 0;
+
+unsigned char *alloc_chunk_buffer(size_t len)
+{
+    if (len > CHUNK_BUFFER_SIZE) {
+        return new unsigned char[len];
+    }
+
+    if (!chunk_buffer_pool.empty()) {
+        unsigned char *buffer = chunk_buffer_pool.back();
+        chunk_buffer_pool.pop_back();
+        return buffer;
+    }
+
+    ++chunk_buffer_allocations;
+    return new unsigned char[CHUNK_BUFFER_SIZE];
+}
+
+void free_chunk_buffer(unsigned char *buffer, size_t len)
+{
+    if (!buffer) {
+        return;
+    }
+
+    if (len > CHUNK_BUFFER_SIZE || chunk_buffer_pool.size() >= MAX_POOLED_CHUNK_BUFFERS) {
+        delete [] buffer;
+        return;
+    }
+
+    chunk_buffer_pool.push_back(buffer);
+}
+
+size_t chunk_buffers_allocated()
+{
+    return chunk_buffer_allocations;
+}
+
 void FileChunkMsg::fill_from_channel(MsgChannel *c)
 {
     if (del_buf) {
-        delete [] buffer;
+        free_chunk_buffer(buffer, len);
     }
 
     buffer = 0;
@@ -1727,13 +2372,19 @@ void FileChunkMsg::fill_from_channel(MsgChannel *c)
 void FileChunkMsg::send_to_channel(MsgChannel *c) const
 {
     Msg::send_to_channel(c);
-    c->writecompressed(buffer, len, compressed);
+
+    if (codec >= 0) {
+        c->writeprecompressed(codec, level, raw_len, buffer, len);
+        compressed = len;
+    } else {
+        c->writecompressed(buffer, len, compressed);
+    }
 }
 
 FileChunkMsg::~FileChunkMsg()
 {
     if (del_buf) {
-        delete [] buffer;
+        free_chunk_buffer(buffer, len);
     }
 }
 
@@ -1823,6 +2474,8 @@ JobDoneMsg::JobDoneMsg(int id, int exit, unsigned int _flags)
     in_uncompressed = 0;
     out_compressed = 0;
     out_uncompressed = 0;
+    transfer_msec = 0;
+    rtt_usec = 0;
 }
 
 void JobDoneMsg::fill_from_channel(MsgChannel *c)
@@ -1841,6 +2494,11 @@ void JobDoneMsg::fill_from_channel(MsgChannel *c)
     *c >> out_uncompressed;
     *c >> flags;
     exitcode = (int) _exitcode;
+
+    if (IS_PROTOCOL_40(c)) {
+        *c >> transfer_msec;
+        *c >> rtt_usec;
+    }
 }
 
 void JobDoneMsg::send_to_channel(MsgChannel *c) const
@@ -1857,6 +2515,11 @@ void JobDoneMsg::send_to_channel(MsgChannel *c) const
     *c << out_compressed;
     *c << out_uncompressed;
     *c << flags;
+
+    if (IS_PROTOCOL_40(c)) {
+        *c << transfer_msec;
+        *c << rtt_usec;
+    }
 }
 
 LoginMsg::LoginMsg(unsigned int myport, const std::string &_nodename, const std::string _host_platform)
@@ -1937,6 +2600,18 @@ void StatsMsg::fill_from_channel(MsgChannel *c)
     *c >> loadAvg5;
     *c >> loadAvg10;
     *c >> freeMem;
+
+    object_filter = string();
+
+    if (IS_PROTOCOL_42(c)) {
+        *c >> object_filter;
+    }
+
+    env_space = 0;
+
+    if (IS_PROTOCOL_47(c)) {
+        *c >> env_space;
+    }
 }
 
 void StatsMsg::send_to_channel(MsgChannel *c) const
@@ -1947,6 +2622,14 @@ void StatsMsg::send_to_channel(MsgChannel *c) const
     *c << loadAvg5;
     *c << loadAvg10;
     *c << freeMem;
+
+    if (IS_PROTOCOL_42(c)) {
+        *c << object_filter;
+    }
+
+    if (IS_PROTOCOL_47(c)) {
+        *c << env_space;
+    }
 }
 
 void GetNativeEnvMsg::fill_from_channel(MsgChannel *c)
@@ -2139,6 +2822,212 @@ void BlacklistHostEnvMsg::send_to_channel(MsgChannel *c) const
     *c << hostname;
 }
 
+void MuxStartMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> window;
+}
+
+void MuxStartMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << window;
+}
+
+void CSLeaseMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> job_id;
+    *c >> hostname;
+    *c >> port;
+    *c >> host_platform;
+    *c >> version;
+    *c >> got_env;
+    *c >> host_version;
+    *c >> lifetime;
+}
+
+void CSLeaseMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << job_id;
+    *c << hostname;
+    *c << port;
+    *c << host_platform;
+    *c << version;
+    *c << got_env;
+    *c << host_version;
+    *c << lifetime;
+}
+
+void UseLeaseMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> job_id;
+    *c >> client_id;
+    *c >> filename;
+}
+
+void UseLeaseMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << job_id;
+    *c << client_id;
+    *c << filename;
+}
+
+void ReturnLeaseMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> job_id;
+}
+
+void ReturnLeaseMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << job_id;
+}
+
+void CacheAnswerMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> hit;
+
+    if (IS_PROTOCOL_49(c)) {
+        uint32_t dictionary_id = 0;
+        *c >> dictionary_id;
+        c->set_remote_dictionary_id(dictionary_id);
+    }
+}
+
+void CacheAnswerMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << hit;
+
+    if (IS_PROTOCOL_49(c)) {
+        *c << c->compression_dictionary_id();
+    }
+}
+
+void PumpFilesMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> files;
+    *c >> quote_dirs;
+    *c >> user_dirs;
+    *c >> system_dirs;
+    *c >> cpp_flags;
+}
+
+void PumpFilesMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << files;
+    *c << quote_dirs;
+    *c << user_dirs;
+    *c << system_dirs;
+    *c << cpp_flags;
+}
+
+void PumpNeedMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> hashes;
+}
+
+void PumpNeedMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << hashes;
+}
+
+void EnvFilesMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> files;
+    *c >> dirs;
+    *c >> links;
+    *c >> link_targets;
+}
+
+void EnvFilesMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << files;
+    *c << dirs;
+    *c << links;
+    *c << link_targets;
+}
+
+void EnvNeedMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> hashes;
+}
+
+void EnvNeedMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << hashes;
+}
+
+void EnvFetchMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> name;
+    *c >> target;
+    *c >> peers;
+}
+
+void EnvFetchMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << name;
+    *c << target;
+    *c << peers;
+}
+
+void EnvFetchDoneMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    uint32_t read_ok;
+    *c >> read_ok;
+    ok = read_ok != 0;
+}
+
+void EnvFetchDoneMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << uint32_t(ok);
+}
+
+void GetEnvMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> name;
+    *c >> target;
+}
+
+void GetEnvMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << name;
+    *c << target;
+}
+
+void InputSizeMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> size;
+}
+
+void InputSizeMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << size;
+}
+
 /*
 vim:cinoptions={.5s,g0,p5,t0,(0,^-0.5s,n-0.5s:tw=78:cindent:sw=4:
 */
@@ -36,7 +36,7 @@
 #include "job.h"
 
 // if you increase the PROTOCOL_VERSION, add a macro below and use that
-#define PROTOCOL_VERSION 35
+#define PROTOCOL_VERSION 51
 // if you increase the MIN_PROTOCOL_VERSION, comment out macros below and clean up the code
 #define MIN_PROTOCOL_VERSION 21
 
@@ -60,6 +60,22 @@
 #define IS_PROTOCOL_33(c) ((c)->protocol >= 33)
 #define IS_PROTOCOL_34(c) ((c)->protocol >= 34)
 #define IS_PROTOCOL_35(c) ((c)->protocol >= 35)
+#define IS_PROTOCOL_36(c) ((c)->protocol >= 36)
+#define IS_PROTOCOL_37(c) ((c)->protocol >= 37)
+#define IS_PROTOCOL_38(c) ((c)->protocol >= 38)
+#define IS_PROTOCOL_39(c) ((c)->protocol >= 39)
+#define IS_PROTOCOL_40(c) ((c)->protocol >= 40)
+#define IS_PROTOCOL_41(c) ((c)->protocol >= 41)
+#define IS_PROTOCOL_42(c) ((c)->protocol >= 42)
+#define IS_PROTOCOL_43(c) ((c)->protocol >= 43)
+#define IS_PROTOCOL_44(c) ((c)->protocol >= 44)
+#define IS_PROTOCOL_45(c) ((c)->protocol >= 45)
+#define IS_PROTOCOL_46(c) ((c)->protocol >= 46)
+#define IS_PROTOCOL_47(c) ((c)->protocol >= 47)
+#define IS_PROTOCOL_48(c) ((c)->protocol >= 48)
+#define IS_PROTOCOL_49(c) ((c)->protocol >= 49)
+#define IS_PROTOCOL_50(c) ((c)->protocol >= 50)
+#define IS_PROTOCOL_51(c) ((c)->protocol >= 51)
 
 enum MsgType {
     // so far unknown
@@ -126,10 +142,47 @@ enum MsgType {
     M_VERIFY_ENV,
     M_VERIFY_ENV_RESULT,
     // C --> CS, CS --> S (forwarded from C), to not use given host for given environment
-    M_BLACKLIST_HOST_ENV
+    M_BLACKLIST_HOST_ENV,
+
+    // CS --> CS, answered with the same, the connection carries multiplexed
+    // job streams afterwards (IS_PROTOCOL_39)
+    M_MUX_START,
+
+    // S --> CS, a slot for a future job of a busy submitter (IS_PROTOCOL_41)
+    M_CS_LEASE,
+    // CS --> S, a lease was given to a client, or is not needed anymore
+    M_USE_LEASE,
+    M_RETURN_LEASE,
+
+    // CS --> C, after M_COMPILE_FILE with a cache key (IS_PROTOCOL_42)
+    M_CACHE_ANSWER,
+
+    // C --> CS, the files of a job the server preprocesses itself, answered
+    // with the contents it doesn't have yet (IS_PROTOCOL_43)
+    M_PUMP_FILES,
+    M_PUMP_NEED,
+
+    // C --> CS, instead of the tarball after M_TRANFER_ENV, answered with
+    // the contents the server's environment store lacks (IS_PROTOCOL_45)
+    M_ENV_FILES,
+    M_ENV_NEED,
+
+    // C --> CS, instead of M_TRANFER_ENV, the server gets the environment
+    // from other daemons, answered with M_ENV_FETCH_DONE (IS_PROTOCOL_46).
+    // S --> CS the same, to install it ahead of demand (IS_PROTOCOL_47)
+    M_ENV_FETCH,
+    M_ENV_FETCH_DONE,
+    // CS --> CS, answered with M_ENV_FILES or M_END
+    M_GET_ENV,
+
+    // C --> CS, the preprocessed size of the job of M_GET_CS, once the
+    // client knows it (IS_PROTOCOL_50)
+    M_INPUT_SIZE
 };
 
 class MsgChannel;
+class CompressionModel;
+class CompressionDictionary;
 
 // a list of pairs of host platform, filename
 typedef std::list<std::pair<std::string, std::string> > Environments;
@@ -166,6 +219,9 @@ public:
 
     // false <--> error (msg not send)
     bool send_msg(const Msg &, int SendFlags = SendBlocking);
+    // sends the message blocking, with a duplicate of PASS_FD attached;
+    // only works if can_pass_fds()
+    bool send_msg_with_fd(const Msg &, int pass_fd);
 
     bool has_msg(void) const
     {
@@ -174,6 +230,13 @@ public:
 
     bool read_a_bit(void);
 
+    // true if the last read_a_bit() left nothing in the socket (it would
+    // have blocked, or saw EOF or an error), needed for edge triggered polling
+    bool input_drained(void) const
+    {
+        return drained;
+    }
+
     bool at_eof(void) const
     {
         return instate != HAS_MSG && eof;
@@ -184,9 +247,39 @@ public:
         return text_based;
     }
 
+    // unix domain sockets can carry file descriptors along with the data
+    bool can_pass_fds(void) const
+    {
+        return addr && addr->sa_family == AF_UNIX;
+    }
+
+    // the oldest descriptor that came with the read data and is not taken
+    // yet, or -1; the caller owns it afterwards
+    int take_received_fd(void);
+
     void readcompressed(unsigned char **buf, size_t &_uclen, size_t &_clen);
     void writecompressed(const unsigned char *in_buf,
                          size_t _in_len, size_t &_out_len);
+    // a chunk compressed already with what pick_codec() said, see ChunkSender
+    void writeprecompressed(int codec, int level, size_t in_len,
+                            const unsigned char *out_buf, size_t out_len);
+    // the codec (a CompressionCodec) and level the next chunk of IN_LEN bytes should use
+    void pick_codec(size_t in_len, int &codec, int &level) const;
+    const CompressionDictionary *compression_dictionary() const;
+    // lets the cost model know how a chunk compressed elsewhere went
+    void record_compression(int codec, int level, size_t in_len, size_t out_len,
+                            unsigned long usecs);
+    // per codec summary of the compressed data that went through this channel
+    std::string compression_stats() const;
+    // load the zstd dictionary in FILE (IS_PROTOCOL_37); returns false if it
+    // can't be used.  Chunks are only compressed with it once the other side
+    // said it has the same one (IS_PROTOCOL_49), see set_remote_dictionary_id()
+    bool set_compression_dictionary(const std::string &file);
+    // the ZDICT id of the loaded dictionary, 0 without one
+    uint32_t compression_dictionary_id() const;
+    // what the other side said about its dictionary, 0 for none
+    void set_remote_dictionary_id(uint32_t id);
+    uint32_t remote_dictionary_id() const;
     void write_environments(const Environments &envs);
     void read_environments(Environments &envs);
     void read_line(std::string &line);
@@ -208,16 +301,24 @@ public:
     // the minimum protocol version between me and him
     int protocol;
 
+    // the codecs the other side can decompress (IS_PROTOCOL_36)
+    uint32_t remote_codecs;
+
     std::string name;
     time_t last_talk;
 
 protected:
-    MsgChannel(int _fd, struct sockaddr *, socklen_t, bool text = false);
+    /* A NEGOTIATED_PROTOCOL other than 0 means someone else did the protocol
+       setup on _FD already, see Service::adoptChannel().  */
+    MsgChannel(int _fd, struct sockaddr *, socklen_t, bool text = false,
+               int negotiated_protocol = 0);
 
     bool wait_for_protocol();
     // returns false if there was an error sending something
     bool flush_writebuf(bool blocking);
     void writefull(const void *_buf, size_t count);
+    // moves the payload into msgbuf, for when it can't be sent right away
+    void copy_payload(void);
     // returns false if there was an error in the protocol setup
     bool update_state(void);
     void chop_input(void);
@@ -235,6 +336,7 @@ protected:
 
     enum {
         NEED_PROTO,
+        NEED_CODECS,
         NEED_LEN,
         FILL_BUF,
         HAS_MSG
@@ -242,7 +344,26 @@ protected:
 
     uint32_t inmsglen;
     bool eof;
+    bool drained;
     bool text_based;
+    // a TCP connection, not a socketpair, so flushing it tells about the link
+    bool tcp_link;
+
+    // sent along with the next write, see send_msg_with_fd()
+    int pass_fd;
+    std::list<int> received_fds;
+    /* The data of a chunk, gathered behind what's in msgbuf when writing
+       instead of being copied there (see writecompressed()).  Points into
+       the caller's buffer or zbuf, so it is gone after send_msg().  */
+    const unsigned char *payload;
+    size_t payload_len;
+    // what compressed chunks are written into
+    unsigned char *zbuf;
+    size_t zbuflen;
+
+    CompressionModel *compression;
+    CompressionDictionary *dictionary;
+    uint32_t remote_dictionary;
 
 private:
     friend class Service;
@@ -258,7 +379,16 @@ class Service
 public:
     static MsgChannel *createChannel(const std::string &host, unsigned short p, int timeout);
     static MsgChannel *createChannel(const std::string &domain_socket);
-    static MsgChannel *createChannel(int remote_fd, struct sockaddr *, socklen_t);
+    /* Without WAIT_FOR_SETUP the protocol setup finishes while reading
+       the first message, for descriptors the caller itself feeds.  */
+    static MsgChannel *createChannel(int remote_fd, struct sockaddr *, socklen_t,
+                                     bool wait_for_setup = true);
+    // REMOTE_FD is a stream to HOST:PORT, relayed by the local daemon
+    static MsgChannel *createChannel(int remote_fd, const std::string &host, unsigned short p);
+    /* Takes over REMOTE_FD, a connection on which the protocol setup
+       was already done (by the local daemon, which then passed it on),
+       ending with PROTOCOL and the REMOTE_CODECS of the other side.  */
+    static MsgChannel *adoptChannel(int remote_fd, int protocol, uint32_t remote_codecs);
 };
 
 // --------------------------------------------------------------------------
@@ -357,7 +487,9 @@ public:
         : Msg(M_GET_CS)
         , count(1)
         , arg_flags(0)
-        , client_id(0) {}
+        , client_id(0)
+        , input_size(0)
+        , preprocessed_size(0) {}
 
     GetCSMsg(const Environments &envs, const std::string &f,
              CompileJob::Language _lang, unsigned int _count,
@@ -372,7 +504,9 @@ public:
         , arg_flags(_arg_flags)
         , client_id(0)
         , preferred_host(host)
-        , minimal_host_version(_minimal_host_version) {}
+        , minimal_host_version(_minimal_host_version)
+        , input_size(0)
+        , preprocessed_size(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -386,13 +520,23 @@ public:
     uint32_t client_id;
     std::string preferred_host;
     int minimal_host_version;
+    // of the result, to find a host that has it cached (IS_PROTOCOL_42)
+    std::string cache_key;
+    // of the source file, the local daemon estimates the job's cost (IS_PROTOCOL_44)
+    uint32_t input_size;
+    // of the preprocessed source, 0 if it isn't known yet (IS_PROTOCOL_50)
+    uint32_t preprocessed_size;
 };
 
 class UseCSMsg : public Msg
 {
 public:
     UseCSMsg()
-        : Msg(M_USE_CS) {}
+        : Msg(M_USE_CS),
+          pooled_protocol(0),
+          pooled_codecs(0),
+          pooled_stream(0),
+          pooled_fd(-1) {}
     UseCSMsg(std::string platform, std::string host, unsigned int p, unsigned int id, bool gotit,
              unsigned int _client_id, unsigned int matched_host_jobs)
         : Msg(M_USE_CS),
@@ -402,7 +546,12 @@ public:
           host_platform(platform),
           got_env(gotit),
           client_id(_client_id),
-          matched_job_id(matched_host_jobs) {}
+          matched_job_id(matched_host_jobs),
+          pooled_protocol(0),
+          pooled_codecs(0),
+          pooled_stream(0),
+          pooled_fd(-1) {}
+    virtual ~UseCSMsg();
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -414,6 +563,19 @@ public:
     uint32_t got_env;
     uint32_t client_id;
     uint32_t matched_job_id;
+    /* If the local daemon passes a ready connection to the compile server
+       along with this message (IS_PROTOCOL_38), the protocol and codecs
+       negotiated on it, otherwise 0.  */
+    uint32_t pooled_protocol;
+    uint32_t pooled_codecs;
+    /* Or the passed descriptor is a job stream of a connection shared
+       with other jobs, the protocol setup is still to do (IS_PROTOCOL_39).  */
+    uint32_t pooled_stream;
+    // not sent: that connection on the receiving side, closed with the message
+    int pooled_fd;
+    /* If the server lacks the environment, other daemons that have it
+       ("host:port", the least busy first), see EnvFetchMsg (IS_PROTOCOL_46).  */
+    std::list<std::string> env_peers;
 };
 
 class GetNativeEnvMsg : public Msg
@@ -476,6 +638,14 @@ private:
     CompileJob *job;
 };
 
+/* Buffers of received FileChunkMsgs come from a small pool and go back
+   there, so a stream of chunks doesn't allocate for every chunk.  Big
+   buffers are allocated and freed directly.  */
+unsigned char *alloc_chunk_buffer(size_t len);
+void free_chunk_buffer(unsigned char *buffer, size_t len);
+// how many buffers had to be allocated so far (as opposed to being reused)
+size_t chunk_buffers_allocated();
+
 class FileChunkMsg : public Msg
 {
 public:
@@ -483,13 +653,30 @@ public:
         : Msg(M_FILE_CHUNK)
         , buffer(_buffer)
         , len(_len)
-        , del_buf(false) {}
+        , del_buf(false)
+        , codec(-1)
+        , level(0)
+        , raw_len(0) {}
+
+    /* A chunk that is compressed already: BUFFER holds the LEN bytes CODEC
+       made out of RAW_LEN bytes.  */
+    FileChunkMsg(unsigned char *_buffer, size_t _len, size_t _raw_len, int _codec, int _level)
+        : Msg(M_FILE_CHUNK)
+        , buffer(_buffer)
+        , len(_len)
+        , del_buf(false)
+        , codec(_codec)
+        , level(_level)
+        , raw_len(_raw_len) {}
 
     FileChunkMsg()
         : Msg(M_FILE_CHUNK)
         , buffer(0)
         , len(0)
-        , del_buf(true) {}
+        , del_buf(true)
+        , codec(-1)
+        , level(0)
+        , raw_len(0) {}
 
     ~FileChunkMsg();
 
@@ -500,6 +687,10 @@ public:
     size_t len;
     mutable size_t compressed;
     bool del_buf;
+    // only for sending chunks compressed already, -1 otherwise
+    int codec;
+    int level;
+    size_t raw_len;
 
 private:
     FileChunkMsg(const FileChunkMsg &);
@@ -571,6 +762,16 @@ public:
         return (flags & FROM_SUBMITTER) == 0;
     }
 
+    // the server had the result in its object cache and compiled nothing
+    enum {
+        FROM_CACHE = 2
+    };
+
+    bool is_from_cache()
+    {
+        return (flags & FROM_CACHE) != 0;
+    }
+
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
 
@@ -588,6 +789,11 @@ public:
     uint32_t out_compressed;
     uint32_t out_uncompressed;
 
+    /* How long receiving the input took and the round trip time to the
+       submitter, as the server saw it; 0 if unknown (IS_PROTOCOL_40).  */
+    uint32_t transfer_msec;
+    uint32_t rtt_usec;
+
     uint32_t job_id;
 };
 
@@ -663,6 +869,7 @@ public:
         : Msg(M_STATS)
     {
         load = 0;
+        env_space = 0;
     }
 
     virtual void fill_from_channel(MsgChannel *c);
@@ -683,6 +890,14 @@ public:
     uint32_t loadAvg5;
     uint32_t loadAvg10;
     uint32_t freeMem;
+
+    /* BloomFilter::encode() of the object cache of the daemon, empty if
+       it didn't change since the last time (IS_PROTOCOL_42).  */
+    std::string object_filter;
+
+    /* How many MB of environments the daemon can still take without
+       removing others, for installing them ahead (IS_PROTOCOL_47).  */
+    uint32_t env_space;
 };
 
 class EnvTransferMsg : public Msg
@@ -914,4 +1129,280 @@ public:
     std::string hostname;
 };
 
+class MuxStartMsg : public Msg
+{
+public:
+    MuxStartMsg()
+        : Msg(M_MUX_START)
+        , window(0) {}
+
+    MuxStartMsg(unsigned int _window)
+        : Msg(M_MUX_START)
+        , window(_window) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // how much unacknowledged data per stream the sender accepts
+    uint32_t window;
+};
+
+/* A job the scheduler already placed, before the submitter asked for it.
+   The daemon answers the next fitting M_GET_CS of a local client with it
+   and tells with M_USE_LEASE, or gives it back with M_RETURN_LEASE.  */
+class CSLeaseMsg : public Msg
+{
+public:
+    CSLeaseMsg()
+        : Msg(M_CS_LEASE)
+        , job_id(0)
+        , port(0)
+        , got_env(0)
+        , host_version(0)
+        , lifetime(0) {}
+
+    CSLeaseMsg(unsigned int _job_id, const std::string &_hostname, unsigned int _port,
+               const std::string &_host_platform, const std::string &_version,
+               bool _got_env, int _host_version, unsigned int _lifetime)
+        : Msg(M_CS_LEASE)
+        , job_id(_job_id)
+        , hostname(_hostname)
+        , port(_port)
+        , host_platform(_host_platform)
+        , version(_version)
+        , got_env(_got_env)
+        , host_version(_host_version)
+        , lifetime(_lifetime) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t job_id;
+    std::string hostname;
+    uint32_t port;
+    std::string host_platform;
+    std::string version;             // the environment for HOST_PLATFORM
+    uint32_t got_env;
+    uint32_t host_version;           // the protocol of the host
+    uint32_t lifetime;               // seconds the daemon may hold it
+};
+
+class UseLeaseMsg : public Msg
+{
+public:
+    UseLeaseMsg()
+        : Msg(M_USE_LEASE)
+        , job_id(0)
+        , client_id(0) {}
+
+    UseLeaseMsg(unsigned int _job_id, unsigned int _client_id, const std::string &_filename)
+        : Msg(M_USE_LEASE)
+        , job_id(_job_id)
+        , client_id(_client_id)
+        , filename(_filename) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t job_id;
+    uint32_t client_id;
+    std::string filename;
+};
+
+class ReturnLeaseMsg : public Msg
+{
+public:
+    ReturnLeaseMsg()
+        : Msg(M_RETURN_LEASE)
+        , job_id(0) {}
+
+    ReturnLeaseMsg(unsigned int _job_id)
+        : Msg(M_RETURN_LEASE)
+        , job_id(_job_id) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t job_id;
+};
+
+/* Whether the compile server has the result of the job in its object
+   cache.  It then sends M_COMPILE_RESULT and the object right away and
+   the client skips sending the source.  */
+class CacheAnswerMsg : public Msg
+{
+public:
+    CacheAnswerMsg()
+        : Msg(M_CACHE_ANSWER)
+        , hit(0) {}
+
+    CacheAnswerMsg(bool _hit)
+        : Msg(M_CACHE_ANSWER)
+        , hit(_hit) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t hit;
+};
+
+/* What a job that is preprocessed on the compile server needs
+   (CompileJob::preprocessRemotely()).  The server lays the files out
+   under a directory of its own and searches the same directories
+   there.  It answers with M_PUMP_NEED, and the client sends the
+   contents asked for back to back as M_FILE_CHUNKs and an M_END.  */
+class PumpFilesMsg : public Msg
+{
+public:
+    PumpFilesMsg()
+        : Msg(M_PUMP_FILES) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // "<md5> <size> <path>", with the source and all it may include
+    std::list<std::string> files;
+    // the search path of the compiler: -iquote, -I, then system directories
+    std::list<std::string> quote_dirs;
+    std::list<std::string> user_dirs;
+    std::list<std::string> system_dirs;
+    // the other preprocessor flags, -D, -include, -MD and the like
+    std::list<std::string> cpp_flags;
+};
+
+class PumpNeedMsg : public Msg
+{
+public:
+    PumpNeedMsg()
+        : Msg(M_PUMP_NEED) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // the md5 sums of the files to send, in this order
+    std::list<std::string> hashes;
+};
+
+/* The contents of an environment tarball, for a server that keeps the
+   files of its environments in a store by their md5 sum.  It answers
+   with M_ENV_NEED, and the client sends the contents asked for back to
+   back as M_FILE_CHUNKs and an M_END, like for M_PUMP_FILES.  Paths are
+   relative to the top of the environment.  */
+class EnvFilesMsg : public Msg
+{
+public:
+    EnvFilesMsg()
+        : Msg(M_ENV_FILES) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // "<md5> <size> <octal mode> <path>", in the order of the tarball
+    std::list<std::string> files;
+    // "<octal mode> <path>"
+    std::list<std::string> dirs;
+    // the paths of the symlinks, and where each of them points to
+    std::list<std::string> links;
+    std::list<std::string> link_targets;
+};
+
+class EnvNeedMsg : public Msg
+{
+public:
+    EnvNeedMsg()
+        : Msg(M_ENV_NEED) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // the md5 sums of the files to send, in this order
+    std::list<std::string> hashes;
+};
+
+/* Asks the server to get an environment it lacks from PEERS, so it
+   doesn't come over the link of the client.  The server asks them with
+   M_GET_ENV in turn, and answers with M_ENV_FETCH_DONE once it has the
+   environment, or none of them had it.  The client still sends the
+   tarball in that case.  The scheduler sends it to idle servers to
+   install environments that are in demand before the jobs come.  */
+class EnvFetchMsg : public Msg
+{
+public:
+    EnvFetchMsg()
+        : Msg(M_ENV_FETCH) {}
+
+    EnvFetchMsg(const std::string &_target, const std::string &_name,
+                const std::list<std::string> &_peers)
+        : Msg(M_ENV_FETCH)
+        , name(_name)
+        , target(_target)
+        , peers(_peers) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string name;
+    std::string target;
+    // "host:port"
+    std::list<std::string> peers;
+};
+
+class EnvFetchDoneMsg : public Msg
+{
+public:
+    EnvFetchDoneMsg()
+        : Msg(M_ENV_FETCH_DONE)
+        , ok(false) {}
+
+    EnvFetchDoneMsg(bool _ok)
+        : Msg(M_ENV_FETCH_DONE)
+        , ok(_ok) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    bool ok;
+};
+
+/* Asks another daemon for an environment it has installed.  It answers
+   with its files like a client (EnvFilesMsg), or M_END if it doesn't
+   have it.  */
+class GetEnvMsg : public Msg
+{
+public:
+    GetEnvMsg()
+        : Msg(M_GET_ENV) {}
+
+    GetEnvMsg(const std::string &_target, const std::string &_name)
+        : Msg(M_GET_ENV)
+        , name(_name)
+        , target(_target) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string name;
+    std::string target;
+};
+
+/* The size of the preprocessed source of the job the client asked for,
+   when it wasn't known yet in M_GET_CS.  It is what the daemon estimates
+   the cost of that file with the next time.  */
+class InputSizeMsg : public Msg
+{
+public:
+    InputSizeMsg()
+        : Msg(M_INPUT_SIZE)
+        , size(0) {}
+
+    InputSizeMsg(unsigned int _size)
+        : Msg(M_INPUT_SIZE)
+        , size(_size) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t size;
+};
+
 #endif
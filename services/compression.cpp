@@ -0,0 +1,587 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <map>
+#include <vector>
+#include <lzo/lzo1x.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include "logging.h"
+#include "compression.h"
+#include "fileio.h"
+
+using namespace std;
+
+uint32_t supported_codecs()
+{
+    uint32_t mask = (1 << C_NONE) | (1 << C_LZO);
+#ifdef HAVE_LZ4
+    mask |= 1 << C_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+    mask |= 1 << C_ZSTD;
+#endif
+    return mask;
+}
+
+const char *codec_name(int codec)
+{
+    switch (codec) {
+    case C_NONE:
+        return "none";
+    case C_LZO:
+        return "lzo";
+    case C_LZ4:
+        return "lz4";
+    case C_ZSTD:
+        return "zstd";
+    case C_ZSTD_DICT:
+        return "zstd+dict";
+    }
+
+    return "unknown";
+}
+
+size_t compress_bound(CompressionCodec codec, size_t in_len)
+{
+    switch (codec) {
+    case C_NONE:
+        return in_len;
+#ifdef HAVE_LZ4
+    case C_LZ4:
+        return LZ4_compressBound(in_len);
+#endif
+#ifdef HAVE_ZSTD
+    case C_ZSTD:
+    case C_ZSTD_DICT:
+        return ZSTD_compressBound(in_len);
+#endif
+    default:
+        break;
+    }
+
+    // LZO, and what LZO has always been given
+    return in_len + in_len / 64 + 16 + 3;
+}
+
+#ifdef HAVE_ZSTD
+/* The contexts are only needed for dictionaries, and are kept around
+   for the whole process as setting them up is not cheap.  Chunks may be
+   compressed on several threads (see ChunkSender), so every one takes a
+   compression context of its own from this pool.  */
+static pthread_mutex_t zstd_cctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<ZSTD_CCtx *> zstd_cctx_pool;
+
+static ZSTD_CCtx *zstd_cctx_take()
+{
+    ZSTD_CCtx *cctx = 0;
+    pthread_mutex_lock(&zstd_cctx_lock);
+
+    if (!zstd_cctx_pool.empty()) {
+        cctx = zstd_cctx_pool.back();
+        zstd_cctx_pool.pop_back();
+    }
+
+    pthread_mutex_unlock(&zstd_cctx_lock);
+    return cctx ? cctx : ZSTD_createCCtx();
+}
+
+static void zstd_cctx_give_back(ZSTD_CCtx *cctx)
+{
+    pthread_mutex_lock(&zstd_cctx_lock);
+    zstd_cctx_pool.push_back(cctx);
+    pthread_mutex_unlock(&zstd_cctx_lock);
+}
+
+static ZSTD_DCtx *zstd_dctx()
+{
+    static ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    return dctx;
+}
+#endif
+
+bool compress_chunk(CompressionCodec codec, int level,
+                    const unsigned char *in, size_t in_len,
+                    unsigned char *out, size_t &out_len,
+                    const CompressionDictionary *dict)
+{
+    switch (codec) {
+    case C_NONE:
+        if (out_len < in_len) {
+            return false;
+        }
+
+        memcpy(out, in, in_len);
+        out_len = in_len;
+        return true;
+    case C_LZO: {
+        lzo_uint lzo_out_len = out_len;
+        lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
+        int ret = lzo1x_1_compress(in, in_len, out, &lzo_out_len, wrkmem);
+        free(wrkmem);
+
+        if (ret != LZO_E_OK) {
+            log_error() << "lzo compression failed: " << ret << endl;
+            return false;
+        }
+
+        out_len = lzo_out_len;
+        return true;
+    }
+#ifdef HAVE_LZ4
+    case C_LZ4: {
+        int ret = LZ4_compress_default((const char *)in, (char *)out, in_len, out_len);
+
+        if (ret <= 0) {
+            log_error() << "lz4 compression failed" << endl;
+            return false;
+        }
+
+        out_len = ret;
+        return true;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case C_ZSTD: {
+        size_t ret = ZSTD_compress(out, out_len, in, in_len, level);
+
+        if (ZSTD_isError(ret)) {
+            log_error() << "zstd compression failed: " << ZSTD_getErrorName(ret) << endl;
+            return false;
+        }
+
+        out_len = ret;
+        return true;
+    }
+    case C_ZSTD_DICT: {
+        if (!dict) {
+            break;
+        }
+
+        // the level is the one the dictionary was digested with
+        ZSTD_CCtx *cctx = zstd_cctx_take();
+        size_t ret = ZSTD_compress_usingCDict(cctx, out, out_len, in, in_len,
+                                              (const ZSTD_CDict *) dict->cdict());
+        zstd_cctx_give_back(cctx);
+
+        if (ZSTD_isError(ret)) {
+            log_error() << "zstd compression with dictionary failed: "
+                        << ZSTD_getErrorName(ret) << endl;
+            return false;
+        }
+
+        out_len = ret;
+        return true;
+    }
+#endif
+    default:
+        break;
+    }
+
+    (void) level;
+    (void) dict;
+    log_error() << "compression with unsupported codec " << codec_name(codec) << endl;
+    return false;
+}
+
+bool decompress_chunk(CompressionCodec codec,
+                      const unsigned char *in, size_t in_len,
+                      unsigned char *out, size_t &out_len,
+                      const CompressionDictionary *dict)
+{
+    switch (codec) {
+    case C_NONE:
+        if (out_len < in_len) {
+            return false;
+        }
+
+        memcpy(out, in, in_len);
+        out_len = in_len;
+        return true;
+    case C_LZO: {
+        lzo_uint lzo_out_len = out_len;
+        int ret = lzo1x_decompress_safe(in, in_len, out, &lzo_out_len, NULL);
+
+        if (ret != LZO_E_OK) {
+            log_error() << "lzo decompression failed: " << ret << endl;
+            return false;
+        }
+
+        out_len = lzo_out_len;
+        return true;
+    }
+#ifdef HAVE_LZ4
+    case C_LZ4: {
+        int ret = LZ4_decompress_safe((const char *)in, (char *)out, in_len, out_len);
+
+        if (ret < 0) {
+            log_error() << "lz4 decompression failed" << endl;
+            return false;
+        }
+
+        out_len = ret;
+        return true;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case C_ZSTD: {
+        size_t ret = ZSTD_decompress(out, out_len, in, in_len);
+
+        if (ZSTD_isError(ret)) {
+            log_error() << "zstd decompression failed: " << ZSTD_getErrorName(ret) << endl;
+            return false;
+        }
+
+        out_len = ret;
+        return true;
+    }
+    case C_ZSTD_DICT: {
+        if (!dict) {
+            log_error() << "got a chunk compressed with a dictionary, but have none" << endl;
+            return false;
+        }
+
+        size_t ret = ZSTD_decompress_usingDDict(zstd_dctx(), out, out_len, in, in_len,
+                                                (const ZSTD_DDict *) dict->ddict());
+
+        if (ZSTD_isError(ret)) {
+            log_error() << "zstd decompression with dictionary " << dict->id() << " failed: "
+                        << ZSTD_getErrorName(ret) << endl;
+            return false;
+        }
+
+        out_len = ret;
+        return true;
+    }
+#endif
+    default:
+        break;
+    }
+
+    (void) dict;
+    log_error() << "decompression with unsupported codec " << codec_name(codec) << endl;
+    return false;
+}
+
+CompressionDictionary *CompressionDictionary::load(const string &file)
+{
+#ifdef HAVE_ZSTD
+    static map<string, CompressionDictionary *> loaded;
+
+    map<string, CompressionDictionary *>::const_iterator it = loaded.find(file);
+
+    if (it != loaded.end()) {
+        return it->second;
+    }
+
+    string data;
+    CompressionDictionary *dict = 0;
+
+    if (read_text(AT_FDCWD, file, data) && !data.empty()
+            && ZDICT_getDictID(data.data(), data.size()) == 0) {
+        // the sides tell each other the id to make sure they have the same one
+        log_warning() << "compression dictionary " << file << " has no id, not using it" << endl;
+    } else if (!data.empty()) {
+        // the level dictionaries get digested with, fast enough for any link
+        // where a dictionary matters
+        static const int dictionary_level = 3;
+        dict = new CompressionDictionary;
+        dict->m_id = ZDICT_getDictID(data.data(), data.size());
+        dict->m_cdict = ZSTD_createCDict(data.data(), data.size(), dictionary_level);
+        dict->m_ddict = ZSTD_createDDict(data.data(), data.size());
+
+        if (!dict->m_cdict || !dict->m_ddict) {
+            log_error() << "failed to load compression dictionary " << file << endl;
+            ZSTD_freeCDict((ZSTD_CDict *) dict->m_cdict);
+            ZSTD_freeDDict((ZSTD_DDict *) dict->m_ddict);
+            delete dict;
+            dict = 0;
+        } else {
+            trace() << "loaded compression dictionary " << file << " id " << dict->m_id << endl;
+        }
+    }
+
+    loaded[file] = dict;
+    return dict;
+#else
+    (void) file;
+    return 0;
+#endif
+}
+
+bool train_dictionary(const list<string> &files, const string &output)
+{
+#ifdef HAVE_ZSTD
+    /* zstd wants many small samples rather than a few big ones, so cut
+       the files into pieces.  Preprocessed sources start with the same
+       system headers, which is what the dictionary should capture.  */
+    static const size_t sample_size = 16 * 1024;
+    static const size_t max_samples_size = 100 * 1024 * 1024;
+    static const size_t dictionary_size = 110 * 1024;
+
+    vector<char> samples;
+    vector<size_t> sample_sizes;
+
+    for (list<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        string data;
+
+        if (!read_text(AT_FDCWD, *it, data)) {
+            log_error() << "cannot read " << *it << endl;
+            return false;
+        }
+
+        for (size_t offset = 0; offset < data.size() && samples.size() < max_samples_size;
+                offset += sample_size) {
+            size_t len = min(sample_size, data.size() - offset);
+            samples.insert(samples.end(), data.begin() + offset, data.begin() + offset + len);
+            sample_sizes.push_back(len);
+        }
+    }
+
+    if (sample_sizes.empty()) {
+        log_error() << "no samples to train a dictionary from" << endl;
+        return false;
+    }
+
+    vector<char> dictionary(dictionary_size);
+    size_t ret = ZDICT_trainFromBuffer(&dictionary[0], dictionary.size(), &samples[0],
+                                       &sample_sizes[0], sample_sizes.size());
+
+    if (ZDICT_isError(ret)) {
+        log_error() << "training the dictionary failed: " << ZDICT_getErrorName(ret) << endl;
+        return false;
+    }
+
+    FILE *f = fopen(output.c_str(), "wb");
+
+    if (!f) {
+        log_perror("cannot create") << "\t" << output << endl;
+        return false;
+    }
+
+    bool ok = fwrite(&dictionary[0], 1, ret, f) == ret;
+
+    if (fclose(f) != 0) {
+        ok = false;
+    }
+
+    if (!ok) {
+        log_perror("cannot write") << "\t" << output << endl;
+        unlink(output.c_str());
+    }
+
+    return ok;
+#else
+    (void) files;
+    (void) output;
+    log_error() << "built without zstd, cannot train dictionaries" << endl;
+    return false;
+#endif
+}
+
+/* Weight of a new measurement in the running averages.  */
+static const double new_sample_weight = 0.25;
+
+static void update_average(double &avg, double sample)
+{
+    if (avg <= 0) {
+        avg = sample;
+    } else {
+        avg = avg * (1 - new_sample_weight) + sample * new_sample_weight;
+    }
+}
+
+CompressionModel::CompressionModel()
+    : link_speed(0)
+{
+    /* Starting points, roughly what the codecs do on preprocessed C++
+       on a current machine.  They get replaced by measured values as soon
+       as a codec is actually used on this channel.  A speed of 0 means
+       the step costs nothing.  */
+    static const Choice defaults[NUM_CHOICES] = {
+        { C_NONE, 0,             0,           0, 1.00 },
+        { C_LZ4,  0, 500000000.0, 2000000000.0, 0.42 },
+        { C_LZO,  0, 400000000.0,  800000000.0, 0.40 },
+        { C_ZSTD, 1, 300000000.0,  800000000.0, 0.25 },
+        { C_ZSTD, 3, 150000000.0,  800000000.0, 0.22 },
+        { C_ZSTD, 9,  40000000.0,  800000000.0, 0.18 },
+        { C_ZSTD_DICT, 3, 150000000.0, 800000000.0, 0.10 }
+    };
+
+    for (int i = 0; i < NUM_CHOICES; ++i) {
+        choices[i] = defaults[i];
+    }
+
+    memset(sent, 0, sizeof(sent));
+    memset(received, 0, sizeof(received));
+}
+
+CompressionModel::Choice *CompressionModel::find_choice(CompressionCodec codec, int level)
+{
+    for (int i = 0; i < NUM_CHOICES; ++i) {
+        if (choices[i].codec == codec && choices[i].level == level) {
+            return &choices[i];
+        }
+    }
+
+    return 0;
+}
+
+void CompressionModel::pick(size_t in_len, uint32_t usable,
+                            CompressionCodec &codec, int &level) const
+{
+    codec = C_LZO;
+    level = 0;
+
+    // until we know something about the link, stay with what always worked,
+    // unless there's a dictionary - that one wins on about any link
+    if (link_speed <= 0) {
+        if (usable & (1 << C_ZSTD_DICT)) {
+            codec = C_ZSTD_DICT;
+            level = 3;
+        }
+
+        return;
+    }
+
+    double best = -1;
+
+    for (int i = 0; i < NUM_CHOICES; ++i) {
+        const Choice &c = choices[i];
+
+        if (!(usable & (1 << c.codec))) {
+            continue;
+        }
+
+        double cost = in_len * c.ratio / link_speed;
+
+        if (c.speed > 0) {
+            cost += in_len / c.speed;
+        }
+
+        if (c.decomp_speed > 0) {
+            cost += in_len / c.decomp_speed;
+        }
+
+        if (best < 0 || cost < best) {
+            best = cost;
+            codec = c.codec;
+            level = c.level;
+        }
+    }
+}
+
+void CompressionModel::record_compression(CompressionCodec codec, int level,
+                                          size_t in_len, size_t out_len, unsigned long usecs)
+{
+    // tiny chunks say more about the timer than about the codec
+    if (codec == C_NONE || in_len < 4096) {
+        return;
+    }
+
+    Choice *c = find_choice(codec, level);
+
+    if (!c) {
+        return;
+    }
+
+    if (usecs == 0) {
+        usecs = 1;
+    }
+
+    update_average(c->speed, in_len * 1000000.0 / usecs);
+    update_average(c->ratio, double(out_len) / in_len);
+}
+
+void CompressionModel::record_link(size_t bytes, unsigned long usecs)
+{
+    if (bytes < 16384) {
+        return;
+    }
+
+    if (usecs == 0) {
+        usecs = 1;
+    }
+
+    update_average(link_speed, bytes * 1000000.0 / usecs);
+}
+
+void CompressionModel::set_link_estimate(double bytes_per_sec)
+{
+    if (link_speed <= 0) {
+        link_speed = bytes_per_sec;
+    }
+}
+
+void CompressionModel::count_sent(CompressionCodec codec, size_t uncompressed, size_t compressed)
+{
+    sent[codec].chunks++;
+    sent[codec].uncompressed += uncompressed;
+    sent[codec].compressed += compressed;
+}
+
+void CompressionModel::count_received(CompressionCodec codec, size_t uncompressed, size_t compressed)
+{
+    received[codec].chunks++;
+    received[codec].uncompressed += uncompressed;
+    received[codec].compressed += compressed;
+}
+
+string CompressionModel::dump_stats() const
+{
+    string result;
+    char buffer[200];
+
+    for (int i = 0; i <= C_LAST; ++i) {
+        if (sent[i].chunks) {
+            snprintf(buffer, sizeof(buffer), "%s%s: sent %lu chunks, %llu -> %llu bytes",
+                     result.empty() ? "" : "; ", codec_name(i), sent[i].chunks,
+                     sent[i].uncompressed, sent[i].compressed);
+            result += buffer;
+        }
+
+        if (received[i].chunks) {
+            snprintf(buffer, sizeof(buffer), "%s%s: received %lu chunks, %llu -> %llu bytes",
+                     result.empty() ? "" : "; ", codec_name(i), received[i].chunks,
+                     received[i].compressed, received[i].uncompressed);
+            result += buffer;
+        }
+    }
+
+    return result;
+}
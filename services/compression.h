@@ -0,0 +1,157 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_COMPRESSION_H
+#define ICECREAM_COMPRESSION_H
+
+#include <list>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Codecs usable for the payload of FileChunkMsg.  The numbers go over the
+   wire (IS_PROTOCOL_36), so never renumber them, only append.  */
+enum CompressionCodec {
+    C_NONE = 0,
+    C_LZO = 1,
+    C_LZ4 = 2,
+    C_ZSTD = 3,
+    C_ZSTD_DICT = 4,   // zstd with the dictionary of the environment (IS_PROTOCOL_37)
+    C_LAST = C_ZSTD_DICT
+};
+
+/* Name of the zstd dictionary inside an environment tarball, and the suffix
+   of the copy next to the tarball the client uses (see icecc-create-env
+   --compression-dictionary).  */
+#define COMPRESSION_DICTIONARY_NAME "icecc-compression.dict"
+#define COMPRESSION_DICTIONARY_SUFFIX ".dict"
+
+/* A pre-trained zstd dictionary.  Loading is cached, every file is read and
+   digested only once per process and the object is never freed.  */
+class CompressionDictionary
+{
+public:
+    // returns 0 if the file doesn't exist or dictionaries are not supported
+    static CompressionDictionary *load(const std::string &file);
+
+    unsigned int id() const
+    {
+        return m_id;
+    }
+
+    // the digested ZSTD_CDict and ZSTD_DDict
+    void *cdict() const
+    {
+        return m_cdict;
+    }
+
+    void *ddict() const
+    {
+        return m_ddict;
+    }
+
+private:
+    CompressionDictionary()
+        : m_id(0)
+        , m_cdict(0)
+        , m_ddict(0) {}
+
+    unsigned int m_id;
+    void *m_cdict;
+    void *m_ddict;
+};
+
+/* Trains a dictionary from samples of the given (preprocessed) files and
+   writes it to OUTPUT.  */
+extern bool train_dictionary(const std::list<std::string> &files, const std::string &output);
+
+/* Bitmask (1 << codec) of the codecs this build can both compress and
+   decompress.  C_NONE and C_LZO are always available.  */
+extern uint32_t supported_codecs();
+
+extern const char *codec_name(int codec);
+
+/* Upper bound for the output of compress_chunk().  */
+extern size_t compress_bound(CompressionCodec codec, size_t in_len);
+
+/* Both return false on failure.  On entry out_len is the size of OUT,
+   on success it is set to the number of bytes produced.  DICT is only
+   used (and needed) for C_ZSTD_DICT.  */
+extern bool compress_chunk(CompressionCodec codec, int level,
+                           const unsigned char *in, size_t in_len,
+                           unsigned char *out, size_t &out_len,
+                           const CompressionDictionary *dict = 0);
+extern bool decompress_chunk(CompressionCodec codec,
+                             const unsigned char *in, size_t in_len,
+                             unsigned char *out, size_t &out_len,
+                             const CompressionDictionary *dict = 0);
+
+/* Per channel cost model deciding which codec (and level) to use for the
+   next chunk.  It estimates the time to push a chunk through the channel as
+   compression time + decompression time + transfer time of the compressed
+   data, using the link throughput measured while flushing the channel and the
+   compression speed and ratio measured on previous chunks.  */
+class CompressionModel
+{
+public:
+    CompressionModel();
+
+    /* USABLE is the mask of codecs both sides can handle.  */
+    void pick(size_t in_len, uint32_t usable, CompressionCodec &codec, int &level) const;
+
+    void record_compression(CompressionCodec codec, int level, size_t in_len, size_t out_len,
+                            unsigned long usecs);
+    void record_link(size_t bytes, unsigned long usecs);
+
+    /* Byte counters, per codec, of what went in and out of the channel.  */
+    void count_sent(CompressionCodec codec, size_t uncompressed, size_t compressed);
+    void count_received(CompressionCodec codec, size_t uncompressed, size_t compressed);
+    std::string dump_stats() const;
+
+    /* Assume a link of BYTES_PER_SEC until something got measured.  */
+    void set_link_estimate(double bytes_per_sec);
+
+private:
+    struct Choice {
+        CompressionCodec codec;
+        int level;
+        double speed;          // bytes per second compressing
+        double decomp_speed;   // bytes per second decompressing, only a guess
+        double ratio;          // compressed / uncompressed
+    };
+
+    struct Counter {
+        unsigned long chunks;
+        unsigned long long uncompressed;
+        unsigned long long compressed;
+    };
+
+    Choice *find_choice(CompressionCodec codec, int level);
+
+    enum { NUM_CHOICES = 7 };
+    Choice choices[NUM_CHOICES];
+    double link_speed;         // bytes per second, 0 if unknown
+    Counter sent[C_LAST + 1];
+    Counter received[C_LAST + 1];
+};
+
+#endif
@@ -0,0 +1,237 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "fileio.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "logging.h"
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+using namespace std;
+
+void close_fd(int fd)
+{
+    if ((-1 == close(fd)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+}
+
+bool write_full(int fd, const void *data, size_t len)
+{
+    const char *p = static_cast<const char *>(data);
+
+    while (len) {
+        ssize_t bytes = write(fd, p, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        p += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+bool read_full(int fd, void *data, size_t len)
+{
+    char *p = static_cast<char *>(data);
+
+    while (len) {
+        ssize_t bytes = read(fd, p, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        p += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+bool read_text(int dir_fd, const string &name, string &text)
+{
+    text.clear();
+    int fd = openat(dir_fd, name.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    char buf[4096];
+    ssize_t len;
+
+    while ((len = read(fd, buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            close_fd(fd);
+            return false;
+        }
+
+        text.append(buf, len);
+    }
+
+    close_fd(fd);
+    return true;
+}
+
+bool write_text(int dir_fd, const string &name, const string &text, int flags, mode_t mode)
+{
+    int fd = openat(dir_fd, name.c_str(), O_WRONLY | flags, mode);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = write_full(fd, text.data(), text.size());
+    close_fd(fd);
+    return ok;
+}
+
+off_t remove_entry(int dir_fd, const string &name)
+{
+    struct stat st;
+
+    if (fstatat(dir_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW)) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlinkat(dir_fd, name.c_str(), 0)) {
+            return -1;
+        }
+
+        return S_ISREG(st.st_mode) ? st.st_size : 0;
+    }
+
+    int fd = openat(dir_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR *dir = fd < 0 ? 0 : fdopendir(fd);
+
+    if (!dir) {
+        if (fd >= 0) {
+            close_fd(fd);
+        }
+
+        return -1;
+    }
+
+    off_t size = 0;
+    bool ok = true;
+
+    while (struct dirent *ent = readdir(dir)) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+
+        off_t removed = remove_entry(fd, ent->d_name);
+
+        if (removed < 0) {
+            ok = false;
+        } else {
+            size += removed;
+        }
+    }
+
+    closedir(dir);
+
+    if (unlinkat(dir_fd, name.c_str(), AT_REMOVEDIR)) {
+        ok = false;
+    }
+
+    return ok ? size : -1;
+}
+
+string md5_hex(md5_state_t &state)
+{
+    md5_byte_t digest[16];
+    md5_finish(&state, digest);
+    char hex[33];
+
+    for (int i = 0; i < 16; ++i) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+
+    return string(hex, 32);
+}
+
+string md5_hex(const string &text)
+{
+    md5_state_t state;
+    md5_init(&state);
+    md5_append(&state, (const md5_byte_t *) text.data(), text.size());
+    return md5_hex(state);
+}
+
+string md5_file(const string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_LARGEFILE);
+
+    if (fd < 0) {
+        return string();
+    }
+
+    md5_state_t state;
+    md5_init(&state);
+    md5_byte_t buf[65536];
+    ssize_t len;
+
+    while ((len = read(fd, buf, sizeof(buf))) != 0) {
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (len < 0) {
+            close_fd(fd);
+            return string();
+        }
+
+        md5_append(&state, buf, len);
+    }
+
+    close_fd(fd);
+    return md5_hex(state);
+}
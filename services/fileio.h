@@ -0,0 +1,57 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_FILEIO_H
+#define ICECREAM_FILEIO_H
+
+#include <string>
+#include <sys/types.h>
+
+#include "md5.h"
+
+// closes FD, complaining if that fails for another reason than it not being open
+extern void close_fd(int fd);
+// writes all of DATA to FD, false if that failed
+extern bool write_full(int fd, const void *data, size_t len);
+// reads exactly LEN bytes from FD into DATA, false on an error or an early end
+extern bool read_full(int fd, void *data, size_t len);
+
+/* The contents of the file NAME in the directory DIR_FD (AT_FDCWD for
+   the current one), false if it couldn't be read.  */
+extern bool read_text(int dir_fd, const std::string &name, std::string &text);
+// makes NAME contain TEXT, opened with FLAGS and created with MODE
+extern bool write_text(int dir_fd, const std::string &name, const std::string &text,
+                       int flags, mode_t mode);
+
+/* Removes NAME in DIR_FD, with everything below it if it is a directory.
+   Returns the size of the files that went, -1 if not all of it did.
+   It is not an error if NAME doesn't exist.  */
+extern off_t remove_entry(int dir_fd, const std::string &name);
+
+// the md5 sum in hex of what STATE got, which is finished then
+extern std::string md5_hex(md5_state_t &state);
+extern std::string md5_hex(const std::string &text);
+// the same of the contents of PATH, empty if they couldn't be read
+extern std::string md5_file(const std::string &path);
+
+#endif
@@ -65,6 +65,8 @@ public:
     CompileJob()
         : m_id(0)
         , m_dwarf_fission(false)
+        , m_preprocess_remotely(false)
+        , m_input_from_cpp(false)
     {
         setTargetPlatform();
     }
@@ -150,6 +152,51 @@ public:
         return m_dwarf_fission;
     }
 
+    // what the result is known as in the object caches of the daemons
+    void setCacheKey(const std::string &key)
+    {
+        m_cache_key = key;
+    }
+
+    std::string cacheKey() const
+    {
+        return m_cache_key;
+    }
+
+    // the md5 sum of the preprocessed source, for the compile server to derive the key from
+    void setSourceHash(const std::string &hash)
+    {
+        m_source_hash = hash;
+    }
+
+    std::string sourceHash() const
+    {
+        return m_source_hash;
+    }
+
+    // the server gets the source and the headers instead of the preprocessed source
+    void setPreprocessRemotely(bool flag)
+    {
+        m_preprocess_remotely = flag;
+    }
+
+    bool preprocessRemotely() const
+    {
+        return m_preprocess_remotely;
+    }
+
+    /* The preprocessed source is sent while cpp still produces it, so it
+       comes as fast as cpp is and not as the link would allow.  */
+    void setInputFromCpp(bool flag)
+    {
+        m_input_from_cpp = flag;
+    }
+
+    bool inputFromCpp() const
+    {
+        return m_input_from_cpp;
+    }
+
     void setWorkingDirectory(const std::string& dir)
     {
         m_working_directory = dir;
@@ -198,7 +245,11 @@ private:
     std::string m_input_file, m_output_file;
     std::string m_working_directory;
     std::string m_target_platform;
+    std::string m_cache_key;
+    std::string m_source_hash;
     bool m_dwarf_fission;
+    bool m_preprocess_remotely;
+    bool m_input_from_cpp;
 };
 
 inline void appendList(std::list<std::string> &list, const std::list<std::string> &toadd)
@@ -0,0 +1,55 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "objectkey.h"
+
+#include "fileio.h"
+#include "job.h"
+
+using namespace std;
+
+string object_key(const CompileJob &job, const string &environment, const string &source_hash)
+{
+    // the compile server knows the compiler only by what the environment calls it
+    string compiler = job.compilerName().find("clang") != string::npos ? "clang"
+                      : job.language() == CompileJob::Lang_CXX ? "g++" : "gcc";
+    string text = "icecc object 2\n" + compiler + "\n" + job.targetPlatform() + "\n"
+                  + environment + "\n";
+    text += char('0' + job.language());
+    text += "\n";
+
+    list<string> flags = job.remoteFlags();
+    list<string> rest = job.restFlags();
+    flags.splice(flags.end(), rest);
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        text += *it + "\n";
+    }
+
+    // the object file refers to the split DWARF file by its name
+    if (job.dwarfFissionEnabled()) {
+        text += job.outputFile() + "\n";
+    }
+
+    return md5_hex(text + source_hash);
+}
@@ -0,0 +1,40 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_OBJECTKEY_H
+#define ICECREAM_OBJECTKEY_H
+
+#include <string>
+
+class CompileJob;
+
+/* What the result of JOB is known as in the object caches: the md5 sum of
+   all the compile server gets for it, with ENVIRONMENT the one it compiles
+   in and SOURCE_HASH the md5 sum of the preprocessed source.  The client
+   derives it to look the result up, and the compile server again from
+   what it got (IS_PROTOCOL_48), so an object can only be stored under the
+   key of the source it was compiled from.  */
+extern std::string object_key(const CompileJob &job, const std::string &environment,
+                              const std::string &source_hash);
+
+#endif
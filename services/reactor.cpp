@@ -0,0 +1,250 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "reactor.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/select.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "logging.h"
+
+using namespace std;
+
+Reactor::Reactor()
+{
+#ifdef HAVE_SYS_EPOLL_H
+#ifdef EPOLL_CLOEXEC
+    // don't leak it into forked compilers
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    m_epfd = epoll_create(64);
+#endif
+
+    if (m_epfd < 0) {
+        log_perror("epoll_create()");
+    }
+#endif
+}
+
+Reactor::~Reactor()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if ((-1 == close(m_epfd)) && (errno != EBADF)){
+        log_perror("close failed");
+    }
+#endif
+}
+
+bool Reactor::ok() const
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return m_epfd >= 0;
+#else
+    return true;
+#endif
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static uint32_t epoll_events(bool edge_triggered, bool interested, bool writable)
+{
+    uint32_t events = interested ? (uint32_t) EPOLLIN : 0;
+
+    if (writable) {
+        events |= EPOLLOUT;
+    }
+
+    if (edge_triggered) {
+        events |= EPOLLET;
+    }
+
+    return events;
+}
+#endif
+
+bool Reactor::add(int fd, bool edge_triggered)
+{
+    Interest interest;
+    interest.edge_triggered = edge_triggered;
+    interest.interested = true;
+    interest.writable = false;
+
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    ev.events = epoll_events(edge_triggered, true, false);
+    ev.data.fd = fd;
+
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_perror("epoll_ctl(ADD)");
+        return false;
+    }
+#endif
+
+    m_fds[fd] = interest;
+    return true;
+}
+
+void Reactor::remove(int fd)
+{
+    map<int, Interest>::iterator it = m_fds.find(fd);
+
+    if (it == m_fds.end()) {
+        return;
+    }
+
+    m_fds.erase(it);
+
+#ifdef HAVE_SYS_EPOLL_H
+    // the kernel wants a non-NULL event for DEL before 2.6.9
+    struct epoll_event ev;
+    ev.events = 0;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, &ev) < 0 && errno != EBADF) {
+        log_perror("epoll_ctl(DEL)");
+    }
+#endif
+}
+
+void Reactor::set_interest(int fd, bool interested)
+{
+    map<int, Interest>::iterator it = m_fds.find(fd);
+
+    if (it == m_fds.end() || it->second.interested == interested) {
+        return;
+    }
+
+    it->second.interested = interested;
+    update(fd, it->second);
+}
+
+void Reactor::set_write_interest(int fd, bool interested)
+{
+    map<int, Interest>::iterator it = m_fds.find(fd);
+
+    if (it == m_fds.end() || it->second.writable == interested) {
+        return;
+    }
+
+    it->second.writable = interested;
+    update(fd, it->second);
+}
+
+void Reactor::update(int fd, const Interest &interest)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    /* Re-arming an edge triggered descriptor reports it again if it
+       is readable already, so no input gets lost while disabled.  */
+    struct epoll_event ev;
+    ev.events = epoll_events(interest.edge_triggered, interest.interested, interest.writable);
+    ev.data.fd = fd;
+
+    if (epoll_ctl(m_epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        log_perror("epoll_ctl(MOD)");
+    }
+#else
+    (void) fd;
+    (void) interest;
+#endif
+}
+
+bool Reactor::interested(int fd) const
+{
+    map<int, Interest>::const_iterator it = m_fds.find(fd);
+    return it != m_fds.end() && it->second.interested;
+}
+
+int Reactor::wait(int timeout, vector<int> &ready)
+{
+    vector<int> writable;
+    return wait(timeout, ready, writable);
+}
+
+int Reactor::wait(int timeout, vector<int> &ready, vector<int> &writable)
+{
+    ready.clear();
+    writable.clear();
+
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event events[64];
+    int count = epoll_wait(m_epfd, events, sizeof(events) / sizeof(events[0]), timeout);
+
+    for (int i = 0; i < count; ++i) {
+        if (events[i].events & EPOLLOUT) {
+            writable.push_back(events[i].data.fd);
+        }
+
+        /* Errors and hangups are reported as readable, reading tells
+           the channel what happened.  */
+        if (events[i].events & ~(uint32_t) EPOLLOUT) {
+            ready.push_back(events[i].data.fd);
+        }
+    }
+
+    return count;
+#else
+    fd_set read_set;
+    fd_set write_set;
+    int max_fd = -1;
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+
+    for (map<int, Interest>::const_iterator it = m_fds.begin(); it != m_fds.end(); ++it) {
+        if (it->second.interested) {
+            FD_SET(it->first, &read_set);
+            max_fd = max(max_fd, it->first);
+        }
+
+        if (it->second.writable) {
+            FD_SET(it->first, &write_set);
+            max_fd = max(max_fd, it->first);
+        }
+    }
+
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    int count = select(max_fd + 1, &read_set, &write_set, NULL, timeout < 0 ? NULL : &tv);
+
+    if (count <= 0) {
+        return count;
+    }
+
+    for (map<int, Interest>::const_iterator it = m_fds.begin(); it != m_fds.end(); ++it) {
+        if (FD_ISSET(it->first, &read_set)) {
+            ready.push_back(it->first);
+        }
+
+        if (FD_ISSET(it->first, &write_set)) {
+            writable.push_back(it->first);
+        }
+    }
+
+    return ready.size() + writable.size();
+#endif
+}
@@ -0,0 +1,79 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    Copyright (c) 2019 by the Icecream Authors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <map>
+#include <vector>
+
+#include "config.h"
+
+/* Waits for input on a set of file descriptors.  With epoll the cost of
+   wait() depends only on the number of ready descriptors, elsewhere it
+   falls back to select().
+
+   Edge triggered descriptors are reported only when new input arrives,
+   so the caller has to read them until they would block (see
+   MsgChannel::input_drained()).  Level triggered ones are reported as
+   long as they are readable.  Descriptors can also ask to be reported
+   when they are writable, for callers that buffer their output.  */
+class Reactor
+{
+public:
+    Reactor();
+    ~Reactor();
+
+    // false if the reactor could not be set up
+    bool ok() const;
+
+    bool add(int fd, bool edge_triggered);
+    void remove(int fd);
+
+    // a descriptor without interest stays registered, but is not reported
+    void set_interest(int fd, bool interested);
+    bool interested(int fd) const;
+    void set_write_interest(int fd, bool interested);
+
+    /* Waits at most TIMEOUT milliseconds (-1 forever) and fills READY
+       with the readable descriptors.  Returns the number of them, or -1
+       on error (errno is set, EINTR included).  */
+    int wait(int timeout, std::vector<int> &ready);
+    // the same, also filling WRITABLE for the descriptors asking for it
+    int wait(int timeout, std::vector<int> &ready, std::vector<int> &writable);
+
+private:
+    struct Interest {
+        bool edge_triggered;
+        bool interested;
+        bool writable;
+    };
+
+    void update(int fd, const Interest &interest);
+
+    std::map<int, Interest> m_fds;
+#ifdef HAVE_SYS_EPOLL_H
+    int m_epfd;
+#endif
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "bloomfilter.h"
+#include "fileio.h"
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+
+using namespace std;
+
+static string key(int i) {
+  ostringstream text;
+  text << "object " << i;
+  return md5_hex(text.str());
+}
+
+// nothing added is ever missed, and few others are taken for being there
+void test_1() {
+  BloomFilter filter(1000);
+  if (filter.empty() || filter.may_contain(key(0))) {
+    cerr << "bloomfilter 1a failed\n";
+    exit(1);
+  }
+  for (int i = 0; i < 1000; ++i)
+    filter.add(key(i));
+  for (int i = 0; i < 1000; ++i) {
+    if (!filter.may_contain(key(i))) {
+      cerr << "bloomfilter 1b failed: " << key(i) << " is missing\n";
+      exit(1);
+    }
+  }
+  int false_positives = 0;
+  for (int i = 1000; i < 11000; ++i)
+    false_positives += filter.may_contain(key(i));
+  if (false_positives > 500) {
+    cerr << "bloomfilter 1c failed: " << false_positives << " false positives\n";
+    exit(1);
+  }
+}
+
+// what isn't an md5 sum is neither added nor found
+void test_2() {
+  BloomFilter filter(10);
+  filter.add("not a key");
+  filter.add("zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz");
+  if (filter.may_contain("not a key") || filter.may_contain("zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz")
+      || filter != BloomFilter(10)) {
+    cerr << "bloomfilter 2 failed\n";
+    exit(1);
+  }
+}
+
+// the filter survives the trip through M_STATS, broken ones don't
+void test_3() {
+  BloomFilter filter(5000);
+  for (int i = 0; i < 5000; i += 3)
+    filter.add(key(i));
+  BloomFilter copy;
+  if (!copy.decode(filter.encode()) || copy != filter || !copy.may_contain(key(3))) {
+    cerr << "bloomfilter 3a failed\n";
+    exit(1);
+  }
+  string hex = filter.encode();
+  if (copy.decode(hex.substr(1)) || !copy.empty()) {
+    cerr << "bloomfilter 3b failed\n";
+    exit(1);
+  }
+  if (copy.decode(hex.substr(0, hex.size() / 2 + 2)) || !copy.empty()) {
+    cerr << "bloomfilter 3c failed\n";
+    exit(1);
+  }
+  hex[7] = 'x';
+  if (copy.decode(hex) || !copy.empty()) {
+    cerr << "bloomfilter 3d failed\n";
+    exit(1);
+  }
+  if (copy.decode("") || !copy.empty()) {
+    cerr << "bloomfilter 3e failed\n";
+    exit(1);
+  }
+}
+
+int main() {
+  test_1();
+  test_2();
+  test_3();
+  exit(0);
+}
@@ -0,0 +1,145 @@
+#include "compression.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// something like preprocessed source, repetitive but not entirely
+static string source(int seed, size_t size) {
+  ostringstream text;
+  srand(seed);
+  for (int line = 0; text.tellp() < (streampos) size; ++line) {
+    text << "# " << line << " \"/usr/include/c++/bits/stl_vector.h\" 3\n"
+         << "static inline int function_" << rand() % 1000 << "(const struct item *p, int n)\n"
+         << "{\n    return p->value[" << rand() % 64 << "] * n + " << rand() << ";\n}\n";
+  }
+  return text.str().substr(0, size);
+}
+
+static void round_trip(const string &prefix, CompressionCodec codec, int level,
+                       const string &in, const CompressionDictionary *dict = 0) {
+  vector<unsigned char> out(compress_bound(codec, in.size()));
+  size_t out_len = out.size();
+  if (!compress_chunk(codec, level, (const unsigned char *) in.data(), in.size(), &out[0],
+                      out_len, dict)) {
+    cerr << prefix << " failed: " << codec_name(codec) << " could not compress "
+         << in.size() << " bytes\n";
+    exit(1);
+  }
+  vector<unsigned char> back(in.size() + 1);
+  size_t back_len = back.size();
+  if (!decompress_chunk(codec, &out[0], out_len, &back[0], back_len, dict)
+      || string((const char *) &back[0], back_len) != in) {
+    cerr << prefix << " failed: " << codec_name(codec) << " did not give back "
+         << in.size() << " bytes\n";
+    exit(1);
+  }
+  // damaged input must not decompress into something
+  if (codec != C_NONE && out_len > 16) {
+    out.resize(out_len / 2);
+    back_len = back.size();
+    if (decompress_chunk(codec, &out[0], out.size(), &back[0], back_len, dict)
+        && back_len == in.size()) {
+      cerr << prefix << " failed: " << codec_name(codec) << " took truncated input\n";
+      exit(1);
+    }
+  }
+}
+
+// every codec this build has gives back what went in
+void test_1() {
+  uint32_t codecs = supported_codecs();
+  if (!(codecs & (1 << C_NONE)) || !(codecs & (1 << C_LZO))) {
+    cerr << "compression 1a failed\n";
+    exit(1);
+  }
+  static const size_t sizes[] = { 1, 100, 4095, 100000, 1000000 };
+  for (int codec = C_NONE; codec <= C_LAST; ++codec) {
+    if (!(codecs & (1 << codec)))
+      continue;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+      round_trip("compression 1b", (CompressionCodec) codec, 0, source(i, sizes[i]));
+      if (codec == C_ZSTD)
+        round_trip("compression 1c", C_ZSTD, 9, source(i, sizes[i]));
+    }
+  }
+}
+
+static void check_pick(const string &prefix, const CompressionModel &model, uint32_t usable,
+                       CompressionCodec expected_codec, int expected_level) {
+  CompressionCodec codec;
+  int level;
+  model.pick(100000, usable, codec, level);
+  if (codec != expected_codec || level != expected_level) {
+    cerr << prefix << " failed: " << codec_name(codec) << " level " << level << ", expected "
+         << codec_name(expected_codec) << " level " << expected_level << "\n";
+    exit(1);
+  }
+}
+
+// the codec depends on the link, and never is one the other side can't do
+void test_2() {
+  uint32_t all = (1 << C_NONE) | (1 << C_LZO) | (1 << C_LZ4) | (1 << C_ZSTD);
+  CompressionModel model;
+  check_pick("compression 2a", model, all, C_LZO, 0);
+  check_pick("compression 2b", model, all | (1 << C_ZSTD_DICT), C_ZSTD_DICT, 3);
+  model.set_link_estimate(1000000);
+  check_pick("compression 2c", model, all, C_ZSTD, 9);
+  check_pick("compression 2d", model, (1 << C_NONE) | (1 << C_LZO), C_LZO, 0);
+  // the estimate is only until the link got measured
+  model.set_link_estimate(10e9);
+  check_pick("compression 2e", model, all, C_ZSTD, 9);
+  for (int i = 0; i < 50; ++i)
+    model.record_link(1000000000, 100000);
+  check_pick("compression 2f", model, all, C_NONE, 0);
+
+  // a codec that turns out slow isn't used anymore, even on a slow link
+  CompressionModel measured;
+  measured.set_link_estimate(1000000);
+  for (int i = 0; i < 20; ++i)
+    measured.record_compression(C_ZSTD, 9, 1000000, 180000, 10000000);
+  CompressionCodec codec;
+  int level;
+  measured.pick(100000, all, codec, level);
+  if (codec == C_ZSTD && level == 9) {
+    cerr << "compression 2g failed\n";
+    exit(1);
+  }
+}
+
+// the dictionary of an environment, trained and then used on both sides
+void test_3() {
+  if (!(supported_codecs() & (1 << C_ZSTD)))
+    return;
+  char dir[] = "/tmp/icecc-test-XXXXXX";
+  if (!mkdtemp(dir)) {
+    cerr << "compression 3a failed\n";
+    exit(1);
+  }
+  string samples = string(dir) + "/samples.i";
+  string output = string(dir) + "/env.dict";
+  ofstream(samples.c_str()) << source(4711, 4 * 1024 * 1024);
+  list<string> files(1, samples);
+  CompressionDictionary *dict = 0;
+  if (!train_dictionary(files, output) || !(dict = CompressionDictionary::load(output))
+      || !dict->id() || CompressionDictionary::load(output) != dict) {
+    cerr << "compression 3b failed\n";
+    exit(1);
+  }
+  round_trip("compression 3c", C_ZSTD_DICT, 3, source(1, 100000), dict);
+  round_trip("compression 3d", C_ZSTD_DICT, 3, source(2, 100), dict);
+  unlink(samples.c_str());
+  unlink(output.c_str());
+  rmdir(dir);
+}
+
+int main() {
+  test_1();
+  test_2();
+  test_3();
+  exit(0);
+}
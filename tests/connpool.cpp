@@ -0,0 +1,86 @@
+#include "comm.h"
+#include "compression.h"
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+static void fail(const string &prefix, const string &why) {
+  cerr << prefix << " failed: " << why << "\n";
+  exit(1);
+}
+
+static UseCSMsg *receive(const string &prefix, MsgChannel *c) {
+  Msg *msg = c->get_msg(10);
+  if (!msg || msg->type != M_USE_CS)
+    fail(prefix, "no M_USE_CS");
+  return static_cast<UseCSMsg *>(msg);
+}
+
+// what is written to one end of the passed connection comes out of the other
+static void check_connected(const string &prefix, int fd, int other) {
+  char buf[6] = { 0 };
+  if (write(fd, "hello", 5) != 5 || read(other, buf, 5) != 5 || strcmp(buf, "hello"))
+    fail(prefix, "passed descriptor not connected");
+}
+
+// a warm connection goes to the client along with M_USE_CS
+void test_1() {
+  int sv[2], conn[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) || socketpair(AF_UNIX, SOCK_STREAM, 0, conn))
+    fail("connpool 1a", "no socketpair");
+  MsgChannel *daemon_side = Service::adoptChannel(sv[0], PROTOCOL_VERSION, 1 << C_LZO);
+  MsgChannel *client_side = Service::adoptChannel(sv[1], PROTOCOL_VERSION, 1 << C_LZO);
+  if (!daemon_side || !client_side || !daemon_side->can_pass_fds())
+    fail("connpool 1a", "no channels");
+
+  UseCSMsg msg("x86_64", "server", 10245, 7, true, 1, 0);
+  msg.pooled_protocol = PROTOCOL_VERSION;
+  msg.pooled_codecs = 1 << C_LZO;
+  if (!daemon_side->send_msg_with_fd(msg, conn[0]))
+    fail("connpool 1b", "cannot send");
+  close(conn[0]);
+  UseCSMsg *got = receive("connpool 1b", client_side);
+  if (got->pooled_fd < 0 || got->pooled_protocol != PROTOCOL_VERSION
+      || got->pooled_codecs != (1 << C_LZO) || got->pooled_stream || got->job_id != 7)
+    fail("connpool 1c", "pooled connection not passed");
+  check_connected("connpool 1d", got->pooled_fd, conn[1]);
+  delete got;
+
+  // without a connection to pass, the client connects itself
+  msg.pooled_protocol = 0;
+  msg.pooled_codecs = 0;
+  if (!daemon_side->send_msg(msg))
+    fail("connpool 1e", "cannot send");
+  got = receive("connpool 1e", client_side);
+  if (got->pooled_fd >= 0 || got->pooled_protocol)
+    fail("connpool 1e", "descriptor out of nowhere");
+  delete got;
+
+  // a stream of a multiplexed connection needs the protocol setup still
+  int stream[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, stream))
+    fail("connpool 1f", "no socketpair");
+  msg.pooled_stream = 1;
+  if (!daemon_side->send_msg_with_fd(msg, stream[0]))
+    fail("connpool 1f", "cannot send");
+  close(stream[0]);
+  got = receive("connpool 1f", client_side);
+  if (got->pooled_fd < 0 || !got->pooled_stream || got->pooled_protocol)
+    fail("connpool 1f", "stream not passed");
+  check_connected("connpool 1g", got->pooled_fd, stream[1]);
+  delete got;
+
+  close(conn[1]);
+  close(stream[1]);
+  delete client_side;
+  delete daemon_side;
+}
+
+int main() {
+  test_1();
+  exit(0);
+}
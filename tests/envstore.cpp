@@ -0,0 +1,327 @@
+#include "client.h"
+#include "compression.h"
+#include "environment.h"
+#include "fileio.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <netinet/in.h>
+#include <set>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+static string dir;
+
+static void fail(const string &prefix, const string &why) {
+  cerr << prefix << " failed: " << why << "\n";
+  exit(1);
+}
+
+static void make_file(const string &path, const string &text, mode_t mode) {
+  if (!write_text(AT_FDCWD, path, text, O_WRONLY | O_CREAT | O_TRUNC, mode)
+      || chmod(path.c_str(), mode))
+    fail("envstore", "cannot write " + path);
+}
+
+static void run(const string &command) {
+  if (system(command.c_str()) != 0)
+    fail("envstore", "cannot run " + command);
+}
+
+/* A compiler environment in SRC, made into TARBALL with the tar of the
+   system: a program, two files with the same contents, a hard link, a
+   symlink and an empty directory.  */
+static void make_env(const string &src, const string &tarball, const string &extra) {
+  run("mkdir -p " + src + "/bin " + src + "/lib " + src + "/empty");
+  make_file(src + "/bin/tool", "#!/bin/sh\necho tool\n", 0755);
+  make_file(src + "/lib/a.txt", "shared\n", 0644);
+  make_file(src + "/lib/b.txt", "shared\n", 0644);
+  make_file(src + "/lib/" + extra + ".txt", extra + "\n", 0644);
+  run("ln -f " + src + "/lib/a.txt " + src + "/lib/c.txt");
+  run("ln -sf a.txt " + src + "/lib/link");
+  run("tar -C " + src + " -czf " + tarball + " .");
+}
+
+// the files of the tarball as the client lists them for the server
+void test_1() {
+  string tarball = dir + "/env1.tar.gz";
+  make_env(dir + "/src1", tarball, "one");
+  EnvFilesMsg msg;
+  vector<string> contents;
+  if (!env_list_files(tarball, msg, contents))
+    fail("envstore 1a", "cannot list " + tarball);
+
+  map<string, string> files;
+  for (list<string>::const_iterator it = msg.files.begin(); it != msg.files.end(); ++it)
+    files[it->substr(it->rfind(' ') + 1)] = it->substr(0, it->rfind(' '));
+  string shared = md5_hex("shared\n") + " 7 644";
+  if (files.size() != 5 || files["bin/tool"] != md5_hex("#!/bin/sh\necho tool\n") + " 20 755"
+      || files["lib/a.txt"] != shared || files["lib/b.txt"] != shared
+      || files["lib/c.txt"] != shared || files["lib/one.txt"] != md5_hex("one\n") + " 4 644")
+    fail("envstore 1b", "wrong list of files");
+  // the hard link has no contents of its own
+  if (contents.size() != 4 || msg.dirs.size() != 3)
+    fail("envstore 1c", "wrong contents or directories");
+  if (msg.links.size() != 1 || msg.links.front() != "lib/link"
+      || msg.link_targets.front() != "a.txt")
+    fail("envstore 1d", "wrong symlinks");
+}
+
+static size_t count_store() {
+  DIR *d = opendir((dir + "/envs/store").c_str());
+  size_t count = 0;
+  if (!d)
+    return 0;
+  while (struct dirent *ent = readdir(d))
+    count += ent->d_name[0] != '.';
+  closedir(d);
+  return count;
+}
+
+/* Installs TARBALL as NAME like the daemon does with M_ENV_FILES, sending
+   the contents it asks for, and returns how many it asked for.  */
+static size_t install(const string &prefix, const string &tarball, const string &name,
+                      const map<string, string> &data, bool damaged = false) {
+  EnvFilesMsg msg;
+  vector<string> contents;
+  if (!env_list_files(tarball, msg, contents))
+    fail(prefix, "cannot list " + tarball);
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    fail(prefix, "no socketpair");
+  MsgChannel *server = Service::adoptChannel(sv[0], PROTOCOL_VERSION, 1 << C_LZO);
+  MsgChannel *client = Service::adoptChannel(sv[1], PROTOCOL_VERSION, 1 << C_LZO);
+  int pipe_to_child = -1;
+  pid_t pid = start_install_environment(dir + "/envs", "x86_64", name, server, &msg,
+                                        pipe_to_child, getuid(), getgid(), 0);
+  Msg *need = client->get_msg(10);
+  if (!pid || !need || need->type != M_ENV_NEED)
+    fail(prefix, "no M_ENV_NEED");
+  const list<string> &hashes = static_cast<EnvNeedMsg *>(need)->hashes;
+  for (list<string>::const_iterator it = hashes.begin(); it != hashes.end(); ++it) {
+    map<string, string>::const_iterator text = data.find(*it);
+    if (text == data.end())
+      fail(prefix, "asked for unknown contents " + *it);
+    string sent = text->second;
+    if (damaged)
+      sent[0] ^= 1;
+    if (!write_full(pipe_to_child, sent.data(), sent.size()))
+      fail(prefix, "cannot send " + *it);
+  }
+  size_t asked = hashes.size();
+  delete need;
+  close_fd(pipe_to_child);
+  size_t size = finalize_install_environment(dir + "/envs", "x86_64/" + name, pid, getuid(),
+                                             getgid());
+  delete client;
+  delete server;
+  if (!damaged && !size)
+    fail(prefix, "installation failed");
+  if (damaged && size)
+    fail(prefix, "damaged contents were taken");
+  return asked;
+}
+
+static void check_file(const string &prefix, const string &path, const string &expected,
+                       bool executable) {
+  string text;
+  struct stat st;
+  if (!read_text(AT_FDCWD, path, text) || text != expected || stat(path.c_str(), &st)
+      || !(st.st_mode & 0100) != !executable)
+    fail(prefix, "wrong " + path);
+}
+
+// the daemon only gets contents once, and links the trees to them
+void test_2() {
+  map<string, string> data;
+  data[md5_hex("#!/bin/sh\necho tool\n")] = "#!/bin/sh\necho tool\n";
+  data[md5_hex("shared\n")] = "shared\n";
+  data[md5_hex("one\n")] = "one\n";
+  data[md5_hex("two\n")] = "two\n";
+  run("mkdir -p " + dir + "/envs");
+
+  if (install("envstore 2a", dir + "/env1.tar.gz", "env1", data) != 3)
+    fail("envstore 2a", "not asked for each contents once");
+  string root = dir + "/envs/target=x86_64/env1";
+  check_file("envstore 2b", root + "/bin/tool", "#!/bin/sh\necho tool\n", true);
+  check_file("envstore 2b", root + "/lib/a.txt", "shared\n", false);
+  check_file("envstore 2b", root + "/lib/b.txt", "shared\n", false);
+  check_file("envstore 2b", root + "/lib/c.txt", "shared\n", false);
+  check_file("envstore 2b", root + "/lib/one.txt", "one\n", false);
+  check_file("envstore 2b", root + "/lib/link", "shared\n", false);
+  struct stat a, b, blob, empty;
+  if (stat((root + "/lib/a.txt").c_str(), &a) || stat((root + "/lib/b.txt").c_str(), &b)
+      || stat((dir + "/envs/store/" + md5_hex("shared\n") + "-444").c_str(), &blob)
+      || a.st_ino != b.st_ino || a.st_ino != blob.st_ino)
+    fail("envstore 2c", "same contents are not the same file");
+  if (stat((root + "/empty").c_str(), &empty) || !S_ISDIR(empty.st_mode))
+    fail("envstore 2d", "no empty directory");
+
+  // only what is new comes over, what the other one had stays in the store
+  make_env(dir + "/src2", dir + "/env2.tar.gz", "two");
+  if (install("envstore 2e", dir + "/env2.tar.gz", "env2", data) != 1 || count_store() != 4)
+    fail("envstore 2e", "contents in the store sent again");
+  check_file("envstore 2f", dir + "/envs/target=x86_64/env2/lib/two.txt", "two\n", false);
+
+  // contents that don't match their md5 sum never get into an environment
+  make_env(dir + "/src3", dir + "/env3.tar.gz", "three");
+  data[md5_hex("three\n")] = "three\n";
+  install("envstore 2g", dir + "/env3.tar.gz", "env3", data, true);
+  if (count_store() != 4)
+    fail("envstore 2g", "damaged contents in the store");
+
+  // what no environment uses anymore goes from the store
+  run("rm -rf " + root);
+  gc_env_store(dir + "/envs");
+  if (count_store() != 3 || access((dir + "/envs/store/" + md5_hex("one\n") + "-444").c_str(), F_OK) == 0)
+    fail("envstore 2h", "unused contents kept");
+  gc_env_store(dir + "/envs");
+  if (count_store() != 3)
+    fail("envstore 2i", "used contents removed");
+}
+
+// the environments of the manifest survive a restart, if they are intact
+void test_3() {
+  map<string, string> data;
+  string as = "#!/bin/sh\necho as\n";
+  data[md5_hex("#!/bin/sh\necho tool\n")] = "#!/bin/sh\necho tool\n";
+  data[md5_hex("shared\n")] = "shared\n";
+  data[md5_hex(as)] = as;
+  InstalledEnvs envs;
+  static const char *const names[] = { "four", "five" };
+  for (int i = 0; i < 2; ++i) {
+    string src = dir + "/src-" + names[i];
+    run("mkdir -p " + src + "/usr/bin");
+    make_file(src + "/usr/bin/as", as, 0755);
+    make_env(src, dir + "/" + names[i] + ".tar.gz", names[i]);
+    data[md5_hex(string(names[i]) + "\n")] = string(names[i]) + "\n";
+    install("envstore 3a", dir + "/" + names[i] + ".tar.gz", names[i], data);
+    InstalledEnv &env = envs[string("x86_64/") + names[i]];
+    env.size = 1;
+    env.last_use = time(0);
+    env.checksum = environment_checksum(dir + "/envs", string("x86_64/") + names[i]);
+    if (env.checksum.empty())
+      fail("envstore 3a", "no checksum");
+  }
+  if (!write_env_manifest(dir + "/envs", envs))
+    fail("envstore 3b", "cannot write the manifest");
+
+  // a file more is damage as well, what isn't in the manifest goes anyway
+  make_file(dir + "/envs/target=x86_64/five/lib/more.txt", "more\n", 0644);
+  InstalledEnvs kept;
+  if (!cleanup_cache(dir + "/envs", getuid(), getgid(), kept))
+    fail("envstore 3c", "cleanup failed");
+  if (kept.size() != 1 || kept.begin()->first != "x86_64/four"
+      || kept.begin()->second.checksum != envs["x86_64/four"].checksum)
+    fail("envstore 3c", "wrong environments kept");
+  check_file("envstore 3d", dir + "/envs/target=x86_64/four/lib/four.txt", "four\n", false);
+  if (access((dir + "/envs/target=x86_64/five").c_str(), F_OK) == 0
+      || access((dir + "/envs/target=x86_64/env2").c_str(), F_OK) == 0)
+    fail("envstore 3e", "damaged or unknown environment kept");
+}
+
+// removing an environment only renames it, a child removes the files
+void test_4() {
+  string root = dir + "/envs/target=x86_64/four";
+  pid_t pid = remove_environment(dir + "/envs", "x86_64/four");
+  if (pid <= 0 || access(root.c_str(), F_OK) == 0)
+    fail("envstore 4a", "environment not moved away");
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+    fail("envstore 4b", "removal failed");
+  DIR *d = opendir((dir + "/envs").c_str());
+  while (struct dirent *ent = readdir(d)) {
+    if (string(ent->d_name).compare(0, 8, "removed.") == 0)
+      fail("envstore 4c", "files left in " + string(ent->d_name));
+  }
+  closedir(d);
+  if (remove_environment(dir + "/envs", "x86_64/four") != 0)
+    fail("envstore 4d", "removed twice");
+}
+
+/* A peer on a port of localhost that answers one M_GET_ENV from what is
+   installed in DIR/envs, returns its pid.  */
+static pid_t start_peer(const string &prefix, unsigned short &port) {
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr))
+      || listen(listen_fd, 1) || getsockname(listen_fd, (struct sockaddr *) &addr, &len))
+    fail(prefix, "cannot listen");
+  port = ntohs(addr.sin_port);
+  pid_t pid = fork();
+  if (pid) {
+    close(listen_fd);
+    return pid;
+  }
+  int fd = accept(listen_fd, (struct sockaddr *) &addr, &len);
+  MsgChannel *c = fd < 0 ? 0 : Service::createChannel(fd, (struct sockaddr *) &addr, len);
+  Msg *msg = c ? c->get_msg(10) : 0;
+  if (!msg || msg->type != M_GET_ENV)
+    _exit(1);
+  GetEnvMsg *get = static_cast<GetEnvMsg *>(msg);
+  bool sent = send_environment(c, dir + "/envs", get->target + "/" + get->name);
+  delete msg;
+  delete c;
+  _exit(sent ? 0 : 1);
+}
+
+static size_t fetch(const string &prefix, const string &name, bool peer_has_it) {
+  unsigned short port;
+  pid_t peer = start_peer(prefix, port);
+  list<string> peers;
+  peers.push_back("127.0.0.1:" + toString(port));
+  int pipe = start_fetch_environment(dir + "/fetched", "x86_64", name, peers, getuid(), getgid(),
+                                     0, 0);
+  if (!pipe)
+    fail(prefix, "cannot start fetching");
+  size_t size = finish_fetch_environment(pipe);
+  int status;
+  if (waitpid(peer, &status, 0) != peer || !WIFEXITED(status) || !WEXITSTATUS(status) != peer_has_it)
+    fail(prefix, "the peer failed");
+  while (waitpid(-1, 0, 0) > 0) {}
+  return size;
+}
+
+// a daemon gets an environment from another that has it installed
+void test_5() {
+  map<string, string> data;
+  data[md5_hex("#!/bin/sh\necho tool\n")] = "#!/bin/sh\necho tool\n";
+  data[md5_hex("shared\n")] = "shared\n";
+  data[md5_hex("six\n")] = "six\n";
+  make_env(dir + "/src6", dir + "/env6.tar.gz", "six");
+  install("envstore 5a", dir + "/env6.tar.gz", "six", data);
+  run("mkdir -p " + dir + "/fetched");
+  if (!fetch("envstore 5b", "six", true))
+    fail("envstore 5b", "not fetched");
+  string root = dir + "/fetched/target=x86_64/six";
+  check_file("envstore 5c", root + "/bin/tool", "#!/bin/sh\necho tool\n", true);
+  check_file("envstore 5c", root + "/lib/six.txt", "six\n", false);
+  check_file("envstore 5c", root + "/lib/link", "shared\n", false);
+  if (fetch("envstore 5d", "seven", false))
+    fail("envstore 5d", "fetched what the peer doesn't have");
+}
+
+int main() {
+  char tmp[] = "/tmp/icecc-test-XXXXXX";
+  if (!mkdtemp(tmp))
+    fail("envstore", "no temporary directory");
+  dir = tmp;
+  test_1();
+  test_2();
+  test_3();
+  test_4();
+  test_5();
+  run("rm -rf " + dir);
+  exit(0);
+}
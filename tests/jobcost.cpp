@@ -0,0 +1,62 @@
+#include "jobcost.h"
+#include "job.h"
+#include "logging.h"
+#include <iostream>
+#include <stdlib.h>
+
+using namespace std;
+
+static void fail(const string &prefix, const string &why) {
+  cerr << prefix << " failed: " << why << "\n";
+  exit(1);
+}
+
+static string name(int i) {
+  return "/job/" + toString(i) + ".c";
+}
+
+// the round trip makes small jobs cheaper here, big ones elsewhere
+void test_1() {
+  JobCosts costs;
+  string reason;
+  if (costs.prefer_local(name(0), 0, 1000, reason))
+    fail("jobcost 1a", "local without any times: " + reason);
+  for (int i = 1; i <= 8; ++i) {
+    costs.record(name(i), 0, i * 1000, true, false, 500 + i * 10, i);
+    costs.record(name(100 + i), 0, i * 1000, true, true, 10 + i * 100, i);
+  }
+  if (!costs.prefer_local(name(200), 0, 1000, reason))
+    fail("jobcost 1b", "small job sent away: " + reason);
+  if (costs.prefer_local(name(201), 0, 100000, reason))
+    fail("jobcost 1c", "big job kept: " + reason);
+  // other kinds of jobs have their own times
+  if (costs.prefer_local(name(202), CompileJob::Flag_O2, 1000, reason))
+    fail("jobcost 1d", "-O job kept without times: " + reason);
+  // a file's own times beat the fit
+  costs.record(name(203), 0, 1000, true, false, 50, 10);
+  costs.record(name(203), 0, 1000, true, true, 5000, 10);
+  if (costs.prefer_local(name(203), 0, 1000, reason))
+    fail("jobcost 1e", "the file's own times ignored: " + reason);
+}
+
+// the preprocessed size is kept for the next time, the source size isn't
+void test_2() {
+  JobCosts costs;
+  costs.record("a", 0, 50000, true, false, 100, 1);
+  costs.record("b", 0, 700, false, false, 100, 1);
+  if (costs.preprocessed_size("a") != 50000 || costs.preprocessed_size("b") != 0
+      || costs.preprocessed_size("c") != 0)
+    fail("jobcost 2a", "wrong sizes");
+  costs.record("a", 0, 900, false, true, 100, 2);
+  if (costs.preprocessed_size("a") != 50000)
+    fail("jobcost 2b", "source size taken as the preprocessed one");
+  costs.record("a", 0, 60000, true, true, 100, 3);
+  if (costs.preprocessed_size("a") != 60000)
+    fail("jobcost 2c", "size not updated");
+}
+
+int main() {
+  test_1();
+  test_2();
+  exit(0);
+}
@@ -0,0 +1,120 @@
+#include "compileserver.h"
+#include "job.h"
+#include "lease.h"
+#include <algorithm>
+#include <iostream>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+static void fail(const string &prefix, const string &why) {
+  cerr << prefix << " failed: " << why << "\n";
+  exit(1);
+}
+
+static CompileServer *new_daemon(int max_jobs) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    fail("lease", "no socketpair");
+  // sv[1] stays open, nobody reads what the channel sends
+  CompileServer *cs = new CompileServer(sv[0], 0, 0, false);
+  cs->protocol = PROTOCOL_VERSION;
+  cs->setMaxJobs(max_jobs);
+  return cs;
+}
+
+static bool has(const list<Job *> &l, Job *job) {
+  return find(l.begin(), l.end(), job) != l.end();
+}
+
+// only busy submitters get leases, and never on their own slots
+void test_1() {
+  CompileServer *submitter = new_daemon(4);
+  CompileServer *server = new_daemon(1);
+  Job *first = new Job(1, submitter);
+  if (leases_wanted(submitter) != 0)
+    fail("lease 1a", "leases for one job");
+  Job *second = new Job(2, submitter);
+  if (leases_wanted(submitter) != MAX_LEASES)
+    fail("lease 1b", "no leases for a busy submitter");
+  submitter->protocol = 40;
+  if (leases_wanted(submitter) != 0)
+    fail("lease 1c", "leases for an old daemon");
+  submitter->protocol = PROTOCOL_VERSION;
+
+  Job *lease = new Job(3, submitter);
+  if (can_lease(submitter, lease))
+    fail("lease 1d", "the submitter's own slot leased");
+  if (!can_lease(server, lease))
+    fail("lease 1e", "free slot not leased");
+  server->appendJob(first);
+  if (can_lease(server, lease))
+    fail("lease 1f", "full server leased");
+  server->removeJob(first);
+  delete first;
+  delete second;
+  delete lease;
+  delete server;
+  delete submitter;
+}
+
+// a lease takes a slot until it is used, returned or expires
+void test_2() {
+  CompileServer *submitter = new_daemon(4);
+  CompileServer *server = new_daemon(4);
+  time_t now = time(0);
+  Job *running[2] = { new Job(1, submitter), new Job(2, submitter) };
+  Job *a = new Job(3, submitter);
+  Job *b = new Job(4, submitter);
+  Job *c = new Job(5, submitter);
+  grant_lease(a, server, now);
+  grant_lease(b, server, now + 3);
+  grant_lease(c, server, now + 3);
+  if (a->state() != Job::WAITINGFORCS || a->server() != server
+      || a->leaseExpiry() != now + LEASE_TIME + LEASE_GRACE || !has(server->jobList(), a)
+      || submitter->leases().size() != 3 || !has(submitter->leases(), a))
+    fail("lease 2a", "lease not placed");
+  if (leases_wanted(submitter) != MAX_LEASES - 3)
+    fail("lease 2b", "leases counted as busy");
+
+  // used, it is a job like any other
+  use_lease(b);
+  use_lease(b);
+  if (b->leaseExpiry() || has(submitter->leases(), b) || !has(server->jobList(), b))
+    fail("lease 2c", "used lease");
+
+  time_t next;
+  list<Job *> expired = expire_leases(submitter, now + LEASE_TIME + LEASE_GRACE - 1, next);
+  if (!expired.empty() || next != now + LEASE_TIME + LEASE_GRACE)
+    fail("lease 2d", "expired early");
+  expired = expire_leases(submitter, now + LEASE_TIME + LEASE_GRACE, next);
+  if (expired.size() != 1 || expired.front() != a || has(server->jobList(), a)
+      || has(submitter->leases(), a) || next != now + 3 + LEASE_TIME + LEASE_GRACE)
+    fail("lease 2e", "not expired");
+  delete a;
+
+  // given back before
+  revoke_lease(c);
+  if (has(server->jobList(), c) || !submitter->leases().empty())
+    fail("lease 2f", "returned lease kept");
+  expired = expire_leases(submitter, now + 100, next);
+  if (!expired.empty() || next)
+    fail("lease 2g", "nothing left to expire");
+  delete c;
+
+  server->removeJob(b);
+  delete b;
+  delete running[0];
+  delete running[1];
+  if (submitter->submittedJobsCount() != 0 || !server->jobList().empty())
+    fail("lease 2h", "jobs left");
+  delete server;
+  delete submitter;
+}
+
+int main() {
+  test_1();
+  test_2();
+  exit(0);
+}
@@ -0,0 +1,151 @@
+#include "client.h"
+#include "fileio.h"
+#include <fcntl.h>
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static ManifestResult result(const string &key, const string &files, const string &depend) {
+  ManifestResult r;
+  r.key = key;
+  r.files = files;
+  r.depend = depend;
+  return r;
+}
+
+static bool same(const vector<ManifestResult> &a, const vector<ManifestResult> &b) {
+  if (a.size() != b.size())
+    return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].key != b[i].key || a[i].files != b[i].files || a[i].depend != b[i].depend)
+      return false;
+  }
+  return true;
+}
+
+static vector<ManifestResult> sample() {
+  vector<ManifestResult> results;
+  results.push_back(result("0123456789abcdef0123456789abcdef",
+                           "d41d8cd98f00b204e9800998ecf8427e 0 1500000000 1500000000 /usr/include/empty.h\n"
+                           "900150983cd24fb0d6963f7d28e17f72 3 1500000001 1500000002 /home/u/dir with space/a.h\n",
+                           "main.o: main.c /usr/include/empty.h \\\n \"/home/u/dir with space/a.h\"\n"));
+  // no dependency file, and a file list that looks like a result line
+  results.push_back(result("fedcba9876543210fedcba9876543210",
+                           "0cc175b9c0f1b6a831c399e269772661 1 1 1 result x 1 1\n", ""));
+  results.push_back(result("00000000000000000000000000000000", "", "\n\n"));
+  return results;
+}
+
+void test_run(const string &prefix, const string &text, const vector<ManifestResult> &expected) {
+  vector<ManifestResult> results;
+  parse_manifest(text, results);
+  if (!same(results, expected)) {
+    cerr << prefix << " failed: " << results.size() << " results, expected "
+         << expected.size() << "\n";
+    exit(1);
+  }
+}
+
+// what goes in comes out
+void test_1() {
+  vector<ManifestResult> results = sample();
+  test_run("manifest 1a", format_manifest(results), results);
+  test_run("manifest 1b", format_manifest(vector<ManifestResult>()), vector<ManifestResult>());
+}
+
+// a damaged manifest keeps the results before the damage
+void test_2() {
+  vector<ManifestResult> results = sample();
+  string text = format_manifest(results);
+  string first = format_manifest(vector<ManifestResult>(results.begin(), results.begin() + 1));
+  string two = format_manifest(vector<ManifestResult>(results.begin(), results.begin() + 2));
+  test_run("manifest 2a", "", vector<ManifestResult>());
+  test_run("manifest 2b", "icecc manifest 2\n" + text.substr(17), vector<ManifestResult>());
+  test_run("manifest 2c", first + "garbage\n",
+           vector<ManifestResult>(results.begin(), results.begin() + 1));
+  test_run("manifest 2d", two.substr(0, two.size() - 1),
+           vector<ManifestResult>(results.begin(), results.begin() + 1));
+  // cut off anywhere
+  for (size_t len = 0; len < text.size(); ++len) {
+    vector<ManifestResult> parsed;
+    parse_manifest(text.substr(0, len), parsed);
+    size_t whole = 0;
+    while (whole < results.size()
+           && format_manifest(vector<ManifestResult>(results.begin(), results.begin() + whole + 1)).size() <= len)
+      ++whole;
+    if (!same(parsed, vector<ManifestResult>(results.begin(), results.begin() + whole))) {
+      cerr << "manifest 2e failed at " << len << "\n";
+      exit(1);
+    }
+  }
+}
+
+static void write_file(const string &prefix, const string &name, const string &text) {
+  if (!write_text(AT_FDCWD, name, text, O_WRONLY | O_CREAT | O_TRUNC, 0644)) {
+    cerr << prefix << " failed: cannot write " << name << "\n";
+    exit(1);
+  }
+}
+
+static void next_second() {
+  time_t now = time(0);
+  while (time(0) == now)
+    usleep(10000);
+}
+
+// a header changed while the preprocessor ran gives no manifest
+void test_3() {
+  char dir[] = "/tmp/icecc-test-XXXXXX";
+  if (!mkdtemp(dir) || chdir(dir) || mkdir("cache", 0755)) {
+    cerr << "manifest 3a failed\n";
+    exit(1);
+  }
+  setenv("ICECC_CACHE_DIR", (string(dir) + "/cache").c_str(), 1);
+  setenv("ICECC_CC", "/bin/sh", 1);
+  write_file("manifest 3a", "a.h", "int x;\n");
+  write_file("manifest 3a", "a.c", "#include \"a.h\"\n");
+  write_file("manifest 3a", "a.o", "object\n");
+  // what the preprocessor gave for it
+  string preprocessed = "a.i";
+  write_file("manifest 3a", preprocessed, "# 1 \"a.c\"\n# 1 \"a.h\" 1\nint x;\n# 2 \"a.c\" 2\n");
+  const char *argv[] = { "gcc", "-c", "a.c", "-o", "a.o", 0 };
+  CompileJob job;
+  analyse_argv(argv, job, false, 0);
+  string key = "0123456789abcdef0123456789abcdef";
+  cache_store(key, job, "", "");
+
+  string out, err;
+  next_second();
+  time_t cpp_start = time(0);
+  write_file("manifest 3b", "a.h", "int y;\n");
+  cache_record_manifest(job, preprocessed, key, cpp_start);
+  if (cache_direct_fetch(job, out, err)) {
+    cerr << "manifest 3b failed: the new header got the old result\n";
+    exit(1);
+  }
+
+  // once it is older than the preprocessor the manifest is written
+  next_second();
+  cache_record_manifest(job, preprocessed, key, time(0));
+  if (!cache_direct_fetch(job, out, err)) {
+    cerr << "manifest 3c failed: no direct hit\n";
+    exit(1);
+  }
+  if (system(("rm -rf " + string(dir)).c_str()) != 0) {
+    cerr << "manifest 3d failed\n";
+    exit(1);
+  }
+}
+
+int main() {
+  test_1();
+  test_2();
+  test_3();
+  exit(0);
+}
@@ -0,0 +1,128 @@
+#include "mincostflow.h"
+#include <iostream>
+#include <stdlib.h>
+#include <vector>
+
+using namespace std;
+
+/* Random placements like the scheduler does them: KINDS kinds of jobs with
+   a count each, HOSTS hosts with free slots, and a cost (maybe negative)
+   for every kind on every host.  The network only has edges from the
+   source to the kinds, from the kinds to the hosts and from the hosts to
+   the sink, so the brute force just tries every matrix of how many jobs
+   of a kind go to a host.  */
+struct Placement {
+  int kinds;
+  int hosts;
+  vector<int> jobs;
+  vector<int> slots;
+  vector<vector<int> > cost;
+};
+
+static void brute_force(const Placement &p, vector<int> &x, size_t cell,
+                        long long &best_flow, long long &best_cost) {
+  if (cell == x.size()) {
+    long long flow = 0;
+    long long cost = 0;
+    for (int k = 0; k < p.kinds; ++k) {
+      int sum = 0;
+      for (int h = 0; h < p.hosts; ++h) {
+        sum += x[k * p.hosts + h];
+        cost += (long long) x[k * p.hosts + h] * p.cost[k][h];
+      }
+      if (sum > p.jobs[k])
+        return;
+      flow += sum;
+    }
+    for (int h = 0; h < p.hosts; ++h) {
+      int sum = 0;
+      for (int k = 0; k < p.kinds; ++k)
+        sum += x[k * p.hosts + h];
+      if (sum > p.slots[h])
+        return;
+    }
+    if (flow > best_flow || (flow == best_flow && cost < best_cost)) {
+      best_flow = flow;
+      best_cost = cost;
+    }
+    return;
+  }
+  int k = cell / p.hosts;
+  int h = cell % p.hosts;
+  for (int n = 0; n <= min(p.jobs[k], p.slots[h]); ++n) {
+    x[cell] = n;
+    brute_force(p, x, cell + 1, best_flow, best_cost);
+  }
+  x[cell] = 0;
+}
+
+static void test_run(int round, const Placement &p) {
+  // nodes: source, the kinds, the hosts, sink
+  int source = 0;
+  int sink = 1 + p.kinds + p.hosts;
+  MinCostFlow net(sink + 1);
+  vector<int> edges;
+  for (int k = 0; k < p.kinds; ++k)
+    net.add_edge(source, 1 + k, p.jobs[k], 0);
+  for (int k = 0; k < p.kinds; ++k)
+    for (int h = 0; h < p.hosts; ++h)
+      edges.push_back(net.add_edge(1 + k, 1 + p.kinds + h, p.jobs[k], p.cost[k][h]));
+  for (int h = 0; h < p.hosts; ++h)
+    net.add_edge(1 + p.kinds + h, sink, p.slots[h], 0);
+
+  long long flow = net.solve(source, sink);
+  long long cost = 0;
+  for (int k = 0; k < p.kinds; ++k)
+    for (int h = 0; h < p.hosts; ++h)
+      cost += net.flow(edges[k * p.hosts + h]) * p.cost[k][h];
+
+  vector<int> x(p.kinds * p.hosts, 0);
+  long long best_flow = -1;
+  long long best_cost = 0;
+  brute_force(p, x, 0, best_flow, best_cost);
+
+  if (flow != best_flow || cost != best_cost) {
+    cerr << "mincostflow " << round << " failed: flow " << flow << " cost " << cost
+         << ", expected flow " << best_flow << " cost " << best_cost << "\n";
+    exit(1);
+  }
+}
+
+// the cheap host is full, the rest has to go to the expensive one
+void test_1() {
+  Placement p;
+  p.kinds = 1;
+  p.hosts = 2;
+  p.jobs.push_back(3);
+  p.slots.push_back(2);
+  p.slots.push_back(4);
+  p.cost.push_back(vector<int>());
+  p.cost[0].push_back(1);
+  p.cost[0].push_back(5);
+  test_run(0, p);
+}
+
+// random networks, with negative costs like for cached results
+void test_2() {
+  srand(4711);
+  for (int round = 1; round <= 500; ++round) {
+    Placement p;
+    p.kinds = 1 + rand() % 3;
+    p.hosts = 1 + rand() % 3;
+    for (int k = 0; k < p.kinds; ++k) {
+      p.jobs.push_back(rand() % 4);
+      p.cost.push_back(vector<int>());
+      for (int h = 0; h < p.hosts; ++h)
+        p.cost[k].push_back(rand() % 16 - 5);
+    }
+    for (int h = 0; h < p.hosts; ++h)
+      p.slots.push_back(rand() % 4);
+    test_run(round, p);
+  }
+}
+
+int main() {
+  test_1();
+  test_2();
+  exit(0);
+}
@@ -0,0 +1,286 @@
+#include "fileio.h"
+#include "logging.h"
+#include "mux.h"
+#include "reactor.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+// the frame types of mux.h
+enum { DATA = 1, WINDOW = 2, CLOSE = 3 };
+
+struct Frame {
+  uint32_t id;
+  uint32_t type;
+  uint32_t len;
+  string data;
+};
+
+static Reactor reactor;
+static MuxDescriptors descriptors;
+static vector<int> accepted;
+
+static void fail(const string &prefix, const string &why) {
+  cerr << prefix << " failed: " << why << "\n";
+  exit(1);
+}
+
+// lets the connections work until nothing happens for a while
+static void pump() {
+  for (int idle = 0; idle < 3;) {
+    vector<int> ready, writable;
+    if (reactor.wait(20, ready, writable) <= 0 && writable.empty()) {
+      ++idle;
+      continue;
+    }
+    idle = 0;
+    for (size_t i = 0; i < ready.size(); ++i) {
+      MuxDescriptors::iterator it = descriptors.find(ready[i]);
+      if (it != descriptors.end())
+        it->second->handle_readable(ready[i], accepted);
+    }
+    for (size_t i = 0; i < writable.size(); ++i) {
+      MuxDescriptors::iterator it = descriptors.find(writable[i]);
+      if (it != descriptors.end())
+        it->second->handle_writable(writable[i]);
+    }
+  }
+}
+
+static void send_frame(int fd, uint32_t id, uint32_t type, const string &data, uint32_t len) {
+  uint32_t header[3] = { htonl(id), htonl(type), htonl(len) };
+  if (!write_full(fd, header, sizeof(header)) || !write_full(fd, data.data(), data.size()))
+    fail("mux", "cannot send a frame");
+}
+
+// what is there to read on FD without waiting, EOF included
+static string take(int fd, bool *eof = 0) {
+  string text;
+  char buf[65536];
+  if (eof)
+    *eof = false;
+  for (;;) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) <= 0)
+      break;
+    ssize_t ret = read(fd, buf, sizeof(buf));
+    if (ret <= 0) {
+      if (eof)
+        *eof = ret == 0;
+      break;
+    }
+    text.append(buf, ret);
+  }
+  return text;
+}
+
+// the frames in what the connection sent, the rest stays in BUF
+static vector<Frame> frames(string &buf) {
+  vector<Frame> result;
+  size_t ofs = 0;
+  while (buf.size() - ofs >= 12) {
+    uint32_t header[3];
+    memcpy(header, buf.data() + ofs, sizeof(header));
+    Frame f = { ntohl(header[0]), ntohl(header[1]), ntohl(header[2]), string() };
+    size_t payload = f.type == DATA ? f.len : 0;
+    if (buf.size() - ofs < 12 + payload)
+      break;
+    f.data = buf.substr(ofs + 12, payload);
+    result.push_back(f);
+    ofs += 12 + payload;
+  }
+  buf.erase(0, ofs);
+  return result;
+}
+
+static string pattern(size_t size, int seed) {
+  string text(size, 0);
+  for (size_t i = 0; i < size; ++i)
+    text[i] = char(i * 7 + seed + i / 251);
+  return text;
+}
+
+// the frames of a stream the other side opened, and how they reach the job
+void test_1() {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    fail("mux 1a", "no socketpair");
+  MuxConnection *mux = new MuxConnection(reactor, descriptors, sv[0], false, 1000);
+  string wire;
+
+  send_frame(sv[1], 1, DATA, "hello", 5);
+  pump();
+  if (accepted.size() != 1 || mux->stream_count() != 1)
+    fail("mux 1a", "stream not accepted");
+  int job = accepted[0];
+  accepted.clear();
+  fcntl(job, F_SETFL, O_NONBLOCK);
+  if (take(job) != "hello")
+    fail("mux 1b", "data not passed on");
+
+  // never more than the window the other side offered
+  string out = pattern(3000, 1);
+  if (!write_full(job, out.data(), out.size()))
+    fail("mux 1c", "cannot write");
+  pump();
+  wire += take(sv[1]);
+  vector<Frame> got = frames(wire);
+  string sent;
+  for (size_t i = 0; i < got.size(); ++i) {
+    if (got[i].id != 1 || got[i].type != DATA)
+      fail("mux 1c", "unexpected frame");
+    sent += got[i].data;
+  }
+  if (sent != out.substr(0, 1000))
+    fail("mux 1c", "sent " + toString(sent.size()) + " bytes, the window is 1000");
+
+  // credit given back lets the rest come
+  send_frame(sv[1], 1, WINDOW, "", 5000);
+  pump();
+  wire += take(sv[1]);
+  got = frames(wire);
+  for (size_t i = 0; i < got.size(); ++i)
+    sent += got[i].data;
+  if (sent != out)
+    fail("mux 1d", "not all data after the credit");
+
+  // what the job took, the hello included, is acknowledged in quarters of the window
+  string in = pattern(MUX_WINDOW / 4 + 100, 2);
+  for (size_t ofs = 0; ofs < in.size(); ofs += 60000)
+    send_frame(sv[1], 1, DATA, in.substr(ofs, 60000), in.substr(ofs, 60000).size());
+  pump();
+  string received;
+  while (received.size() < in.size()) {
+    string part = take(job);
+    if (part.empty())
+      fail("mux 1e", "data lost");
+    received += part;
+    pump();
+  }
+  if (received != in)
+    fail("mux 1e", "data changed");
+  wire += take(sv[1]);
+  got = frames(wire);
+  if (got.size() != 1 || got[0].type != WINDOW || got[0].len != in.size() + 5)
+    fail("mux 1f", "no acknowledgement");
+
+  // a close each way ends the stream
+  send_frame(sv[1], 1, CLOSE, "", 0);
+  pump();
+  bool eof;
+  take(job, &eof);
+  if (!eof || mux->stream_count() != 1)
+    fail("mux 1g", "close not passed on");
+  close(job);
+  pump();
+  wire += take(sv[1]);
+  got = frames(wire);
+  if (got.empty() || got.back().type != CLOSE || mux->stream_count() != 0)
+    fail("mux 1h", "stream not finished");
+
+  // finished streams don't come back, new ones get a new id
+  send_frame(sv[1], 1, DATA, "late", 4);
+  pump();
+  if (!accepted.empty() || mux->stream_count() != 0)
+    fail("mux 1i", "finished stream reopened");
+
+  // a frame that can't be valid breaks the connection
+  send_frame(sv[1], 2, DATA, "", 1024 * 1024);
+  pump();
+  if (mux->alive())
+    fail("mux 1j", "oversized frame taken");
+  for (size_t i = 0; i < accepted.size(); ++i)
+    close(accepted[i]);
+  accepted.clear();
+  delete mux;
+  close(sv[1]);
+}
+
+// two daemons, many streams both ways, more than the windows at once
+void test_2() {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    fail("mux 2a", "no socketpair");
+  MuxConnection *out = new MuxConnection(reactor, descriptors, sv[0], true, MUX_WINDOW);
+  MuxConnection *in = new MuxConnection(reactor, descriptors, sv[1], false, MUX_WINDOW);
+  const int count = 3;
+  int ours[count], theirs[count];
+  for (int i = 0; i < count; ++i) {
+    ours[i] = out->open_stream();
+    if (ours[i] < 0)
+      fail("mux 2a", "cannot open a stream");
+    fcntl(ours[i], F_SETFL, O_NONBLOCK);
+  }
+  pump();
+  if (accepted.size() != count)
+    fail("mux 2a", "streams not accepted");
+  for (int i = 0; i < count; ++i) {
+    theirs[i] = accepted[i];
+    fcntl(theirs[i], F_SETFL, O_NONBLOCK);
+  }
+  accepted.clear();
+
+  string data[count], back[count], request[count], reply[count];
+  size_t written[count] = { 0 }, answered[count] = { 0 };
+  for (int i = 0; i < count; ++i) {
+    request[i] = pattern(3 * MUX_WINDOW + 1000 * i, i);
+    reply[i] = pattern(MUX_WINDOW / 2 + i, 10 + i);
+  }
+  for (int round = 0; round < 1000; ++round) {
+    bool done = true;
+    for (int i = 0; i < count; ++i) {
+      if (written[i] < request[i].size()) {
+        ssize_t ret = write(ours[i], request[i].data() + written[i],
+                            min<size_t>(request[i].size() - written[i], 100000));
+        if (ret > 0)
+          written[i] += ret;
+        else if (errno != EAGAIN)
+          fail("mux 2b", "cannot write");
+      }
+      if (answered[i] < reply[i].size()) {
+        ssize_t ret = write(theirs[i], reply[i].data() + answered[i], reply[i].size() - answered[i]);
+        if (ret > 0)
+          answered[i] += ret;
+      }
+      data[i] += take(theirs[i]);
+      back[i] += take(ours[i]);
+      done = done && data[i].size() == request[i].size() && back[i].size() == reply[i].size();
+    }
+    if (done)
+      break;
+    pump();
+  }
+  for (int i = 0; i < count; ++i) {
+    if (data[i] != request[i] || back[i] != reply[i])
+      fail("mux 2b", "stream " + toString(i) + " got other data");
+  }
+
+  // closing the connection ends the streams of the jobs
+  delete out;
+  pump();
+  bool eof;
+  take(theirs[0], &eof);
+  if (!eof || in->alive())
+    fail("mux 2c", "jobs not told");
+  for (int i = 0; i < count; ++i) {
+    close(ours[i]);
+    close(theirs[i]);
+  }
+  delete in;
+}
+
+int main() {
+  if (!reactor.ok())
+    fail("mux", "no reactor");
+  test_1();
+  test_2();
+  exit(0);
+}
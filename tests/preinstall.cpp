@@ -0,0 +1,114 @@
+#include "compileserver.h"
+#include "preinstall.h"
+#include <iostream>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+static void fail(const string &prefix, const string &why) {
+  cerr << prefix << " failed: " << why << "\n";
+  exit(1);
+}
+
+// an idle x86_64 host with room for environments
+static CompileServer *new_daemon() {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    fail("preinstall", "no socketpair");
+  CompileServer *cs = new CompileServer(sv[0], 0, 0, false);
+  cs->protocol = PROTOCOL_VERSION;
+  cs->setNodeName("idle");
+  cs->setMaxJobs(4);
+  cs->setRemotePort(10245);
+  cs->setChrootPossible(true);
+  cs->setEnvSpace(1000);
+  cs->setHostPlatform("x86_64");
+  cs->setLoad(0);
+  return cs;
+}
+
+static EnvRequest request(const string &name) {
+  Environments versions;
+  versions.push_back(make_pair(string("x86_64"), name));
+  return make_pair(string("x86_64"), versions);
+}
+
+// environments many jobs asked for lately come first, old demand fades
+void test_1() {
+  EnvDemands demands;
+  time_t now = time(0);
+  note_env_demand(demands, request("a"), 10, now);
+  note_env_demand(demands, request("b"), PREINSTALL_MIN_DEMAND - 1, now);
+  note_env_demand(demands, request("c"), 30, now);
+  list<pair<unsigned int, const EnvRequest *> > hot = hot_env_requests(demands, now);
+  if (hot.size() != 2 || hot.front().first != 30 || *hot.front().second != request("c")
+      || hot.back().first != 10 || *hot.back().second != request("a"))
+    fail("preinstall 1a", "wrong environments in demand");
+
+  // halved every period, and forgotten once nothing is left
+  hot = hot_env_requests(demands, now + DEMAND_PERIOD);
+  if (hot.size() != 1 || hot.front().first != 15 || demands.size() != 3)
+    fail("preinstall 1b", "demand not halved");
+  hot = hot_env_requests(demands, now + 10 * DEMAND_PERIOD);
+  if (!hot.empty() || !demands.empty())
+    fail("preinstall 1c", "old demand kept");
+}
+
+// only idle hosts with room get environments, ones they lack
+void test_2() {
+  CompileServer *cs = new_daemon();
+  if (!can_preinstall(cs))
+    fail("preinstall 2a", "idle host left out");
+  cs->setLoad(PREINSTALL_MAX_LOAD);
+  if (can_preinstall(cs))
+    fail("preinstall 2b", "busy host taken");
+  cs->setLoad(0);
+  cs->setEnvSpace(0);
+  if (can_preinstall(cs))
+    fail("preinstall 2c", "full host taken");
+  cs->setEnvSpace(1000);
+  cs->setNoRemote(true);
+  if (can_preinstall(cs))
+    fail("preinstall 2d", "host without remote jobs taken");
+  cs->setNoRemote(false);
+  cs->protocol = 46;
+  if (can_preinstall(cs))
+    fail("preinstall 2e", "old daemon taken");
+  cs->protocol = PROTOCOL_VERSION;
+
+  EnvRequest wanted = request("a");
+  wanted.second.push_front(make_pair(string("aarch64"), string("arm")));
+  if (missing_env(cs, "x86_64", wanted.second) != "a")
+    fail("preinstall 2f", "wrong environment");
+  Environments installed;
+  installed.push_back(make_pair(string("x86_64"), string("a")));
+  cs->setCompilerVersions(installed);
+  if (!missing_env(cs, "x86_64", wanted.second).empty())
+    fail("preinstall 2g", "installed environment installed again");
+  delete cs;
+}
+
+// a preinstall that takes too long fails, and isn't tried again soon
+void test_3() {
+  CompileServer *cs = new_daemon();
+  time_t now = time(0);
+  cs->setPreinstalling("x86_64/a", now);
+  if (!preinstall_running(cs, now + PREINSTALL_TIMEOUT - 1))
+    fail("preinstall 3a", "given up too early");
+  if (preinstall_running(cs, now + PREINSTALL_TIMEOUT) || !cs->preinstalling().empty())
+    fail("preinstall 3b", "not given up on");
+  now += PREINSTALL_TIMEOUT;
+  if (!preinstall_failed_recently(cs, "x86_64/a", now + PREINSTALL_RETRY - 1)
+      || preinstall_failed_recently(cs, "x86_64/a", now + PREINSTALL_RETRY)
+      || preinstall_failed_recently(cs, "x86_64/b", now))
+    fail("preinstall 3c", "wrong retry");
+  delete cs;
+}
+
+int main() {
+  test_1();
+  test_2();
+  test_3();
+  exit(0);
+}
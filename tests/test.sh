@@ -854,6 +854,118 @@ zero_local_jobs_test()
     echo
 }
 
+# Check that ICECC_CACHE_DIR keeps the result of a remote job, so the same job
+# again doesn't go to the remote host.
+cache_test()
+{
+    echo Running cache test.
+    local cachedir="$testdir"/cache
+    rm -rf "$cachedir"
+
+    reset_logs remote "cache miss"
+    ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice1 ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log ICECC_CACHE_DIR="$cachedir" $valgrind "${icecc}" \
+        $GXX -Wall -Werror -c plain.cpp -o "$testdir"/plain.o.cachemiss 2>>"$testdir"/stderr.log
+    if test $? -ne 0; then
+        echo Cache test failed.
+        stop_ice 0
+        abort_tests
+    fi
+    flush_logs
+    check_logs_for_generic_errors
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_message icecc "cache.* miss"
+
+    reset_logs remote "cache hit"
+    ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice1 ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log ICECC_CACHE_DIR="$cachedir" $valgrind "${icecc}" \
+        $GXX -Wall -Werror -c plain.cpp -o "$testdir"/plain.o.cachehit 2>>"$testdir"/stderr.log
+    if test $? -ne 0; then
+        echo Cache test failed.
+        stop_ice 0
+        abort_tests
+    fi
+    flush_logs
+    check_logs_for_generic_errors
+    check_log_message icecc "cache.* hit"
+    check_log_error icecc "Have to use host 127.0.0.1:10246"
+    check_log_error icecc "Have to use host 127.0.0.1:10247"
+    if ! cmp -s "$testdir"/plain.o.cachemiss "$testdir"/plain.o.cachehit; then
+        echo "Cache test failed, the cached result differs ($testdir/plain.o.cachehit)."
+        stop_ice 0
+        abort_tests
+    fi
+    echo Cache test successful.
+    echo
+    rm -rf "$cachedir" "$testdir"/plain.o.cachemiss "$testdir"/plain.o.cachehit
+}
+
+# Check that the remote host can preprocess with the files the include scan
+# sent it (ICECC_PUMP), and that the result works like the one of a local build.
+pump_test()
+{
+    echo Running pump test.
+    reset_logs remote "pump"
+
+    ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice1 ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log ICECC_PUMP=1 $valgrind "${icecc}" \
+        $GXX -Wall -Werror -c includes.cpp -o "$testdir"/includes.o.pump 2>>"$testdir"/stderr.log
+    if test $? -ne 0; then
+        echo Pump test failed.
+        stop_ice 0
+        abort_tests
+    fi
+    flush_logs
+    check_logs_for_generic_errors
+    check_log_message icecc "include scan: "
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_error icecc "<building_local>"
+    $GXX -Wall -Werror -c includes.cpp -o "$testdir"/includes.o.local
+    if ! diff -q <(nm "$testdir"/includes.o.local) <(nm "$testdir"/includes.o.pump); then
+        echo "Pump test failed, the result differs ($testdir/includes.o.pump)."
+        stop_ice 0
+        abort_tests
+    fi
+    echo Pump test successful.
+    echo
+    rm -f "$testdir"/includes.o.pump "$testdir"/includes.o.local
+}
+
+# Check that icecc --serve runs the jobs passed to it with ICECC_SUBMIT_SOCKET.
+serve_test()
+{
+    echo Running submission server test.
+    reset_logs remote "icecc --serve"
+    local socket="$testdir"/socket-submit
+    rm -f "$socket"
+
+    ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log \
+        "${icecc}" --serve "$socket" 2>>"$testdir"/stderr.log &
+    local serve_pid=$!
+    local wait=0
+    while test ! -S "$socket" -a $wait -lt 50; do
+        sleep 0.1
+        wait=$((wait + 1))
+    done
+
+    ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice1 ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log ICECC_SUBMIT_SOCKET="$socket" "${icecc}" \
+        $GXX -Wall -Werror -c plain.cpp -o "$testdir"/plain.o.served 2>>"$testdir"/stderr.log
+    local exit_code=$?
+    kill $serve_pid 2>/dev/null
+    wait $serve_pid 2>/dev/null
+    if test $exit_code -ne 0 -o ! -f "$testdir"/plain.o.served; then
+        echo Submission server test failed.
+        stop_ice 0
+        abort_tests
+    fi
+    flush_logs
+    check_logs_for_generic_errors
+    check_log_message icecc "accepting jobs at"
+    check_log_message icecc "job .*plain.o.served exited with 0"
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_error icecc "failed, building here"
+    echo Submission server test successful.
+    echo
+    rm -f "$testdir"/plain.o.served "$socket"
+}
+
 reset_logs()
 {
     type="$1"
@@ -1037,6 +1149,14 @@ else
     skipped_tests="$skipped_tests zero_local_jobs_test"
 fi
 
+if test -z "$chroot_disabled"; then
+    cache_test
+    pump_test
+    serve_test
+else
+    skipped_tests="$skipped_tests cache_test pump_test serve_test"
+fi
+
 if test -x $CLANGXX; then
     # There's probably not much point in repeating all tests with Clang, but at least
     # try it works (there's a different icecc-create-env run needed, and -frewrite-includes
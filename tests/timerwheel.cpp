@@ -0,0 +1,108 @@
+#include "timerwheel.h"
+#include <iostream>
+#include <list>
+#include <stdlib.h>
+
+using namespace std;
+
+static void check_expired(const string &prefix, TimerWheel &wheel, time_t now,
+                          const list<int> &expected) {
+  list<int> expired;
+  wheel.expire(now, expired);
+  expired.sort();
+  if (expired != expected) {
+    cerr << prefix << " failed: expired";
+    for (list<int>::const_iterator it = expired.begin(); it != expired.end(); ++it)
+      cerr << " " << *it;
+    cerr << ", expected";
+    for (list<int>::const_iterator it = expected.begin(); it != expected.end(); ++it)
+      cerr << " " << *it;
+    cerr << "\n";
+    exit(1);
+  }
+}
+
+static void check_timeout(const string &prefix, const TimerWheel &wheel, time_t now,
+                          time_t limit, time_t expected) {
+  time_t timeout = wheel.next_timeout(now, limit);
+  if (timeout != expected) {
+    cerr << prefix << " failed: " << timeout << ", expected " << expected << "\n";
+    exit(1);
+  }
+}
+
+// timers fire at their deadline, not before, and only once
+void test_1() {
+  TimerWheel wheel;
+  time_t now = time(0);
+  wheel.schedule(3, now + 5);
+  wheel.schedule(4, now + 7);
+  check_timeout("timerwheel 1a", wheel, now, 100, 5);
+  check_timeout("timerwheel 1b", wheel, now, 2, 2);
+  check_expired("timerwheel 1c", wheel, now + 4, list<int>());
+  list<int> expected(1, 3);
+  check_expired("timerwheel 1d", wheel, now + 5, expected);
+  check_timeout("timerwheel 1e", wheel, now + 6, 100, 1);
+  expected.assign(1, 4);
+  check_expired("timerwheel 1f", wheel, now + 10, expected);
+  check_expired("timerwheel 1g", wheel, now + 20, list<int>());
+  check_timeout("timerwheel 1h", wheel, now + 21, 100, 100);
+}
+
+// cancelled timers don't fire, an earlier deadline wins over a later one
+void test_2() {
+  TimerWheel wheel;
+  time_t now = time(0);
+  wheel.schedule(5, now + 10);
+  wheel.cancel(5);
+  wheel.cancel(6);
+  wheel.schedule(7, now + 20);
+  wheel.schedule(7, now + 30);
+  wheel.schedule(8, now + 20);
+  wheel.schedule(8, now + 15);
+  list<int> expected(1, 8);
+  check_expired("timerwheel 2a", wheel, now + 15, expected);
+  expected.assign(1, 7);
+  check_expired("timerwheel 2b", wheel, now + 25, expected);
+  check_expired("timerwheel 2c", wheel, now + 40, list<int>());
+}
+
+// deadlines further away than the wheel wait for their round
+void test_3() {
+  TimerWheel wheel;
+  time_t now = time(0);
+  wheel.schedule(9, now + 300);
+  wheel.schedule(10, now + 44);
+  list<int> expected(1, 10);
+  check_expired("timerwheel 3a", wheel, now + 44, expected);
+  check_expired("timerwheel 3b", wheel, now + 299, list<int>());
+  expected.assign(1, 9);
+  check_expired("timerwheel 3c", wheel, now + 300, expected);
+}
+
+// overdue timers fire with the next expire, as do all after a long sleep
+void test_4() {
+  TimerWheel wheel;
+  time_t now = time(0);
+  check_expired("timerwheel 4a", wheel, now + 10, list<int>());
+  wheel.schedule(11, now);
+  check_timeout("timerwheel 4b", wheel, now + 11, 100, 0);
+  list<int> expected(1, 11);
+  check_expired("timerwheel 4c", wheel, now + 11, expected);
+  wheel.schedule(12, now + 20);
+  wheel.schedule(13, now + 500);
+  wheel.schedule(14, now + 5000);
+  expected.assign(1, 12);
+  expected.push_back(13);
+  check_expired("timerwheel 4d", wheel, now + 1000, expected);
+  expected.assign(1, 14);
+  check_expired("timerwheel 4e", wheel, now + 6000, expected);
+}
+
+int main() {
+  test_1();
+  test_2();
+  test_3();
+  test_4();
+  exit(0);
+}